@@ -119,6 +119,7 @@ __FBSDID("$FreeBSD: head/sys/amd64/amd64/pmap.c 293836 2016-01-13 19:19:50Z jkim
 #include <sys/vmmeter.h>
 #include <sys/sched.h>
 #include <sys/sysctl.h>
+#include <sys/turnstile.h>
 #include <sys/_unrhdr.h>
 #include <sys/smp.h>
 
@@ -375,6 +376,11 @@ static int pg_ps_enabled = 1;
 SYSCTL_INT(_vm_pmap, OID_AUTO, pg_ps_enabled, CTLFLAG_RDTUN | CTLFLAG_NOFETCH,
     &pg_ps_enabled, 0, "Are large page mappings enabled?");
 
+static int pg_ps1g_enabled = 1;
+SYSCTL_INT(_vm_pmap, OID_AUTO, pg_ps1g_enabled, CTLFLAG_RDTUN |
+    CTLFLAG_NOFETCH, &pg_ps1g_enabled, 0,
+    "Are 1GB page mappings of user memory enabled?");
+
 #define	PAT_INDEX_SIZE	8
 static int pat_index[PAT_INDEX_SIZE];	/* cache mode to PAT index conversion */
 
@@ -399,16 +405,309 @@ static struct pmap_preinit_mapping {
 } pmap_preinit_mapping[PMAP_PREINIT_MAPPING_COUNT];
 static int pmap_initialized;
 
-static struct rwlock_padalign pvh_global_lock;
-
 /*
- * Data for the pv entry allocation mechanism
+ * Data for the pv entry allocation mechanism.  The LRU list of pv
+ * chunks is split by the memory domain of the chunk page, so that
+ * chunk allocation, free and reclaim on different domains do not
+ * serialize on a single mutex.
  */
-static TAILQ_HEAD(pch, pv_chunk) pv_chunks = TAILQ_HEAD_INITIALIZER(pv_chunks);
-static struct mtx pv_chunks_mutex;
+struct pv_chunks_list {
+	struct mtx		pvc_lock;
+	TAILQ_HEAD(pch, pv_chunk) pvc_list;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct pv_chunks_list pv_chunks[MAXMEMDOM];
 static struct rwlock pv_list_locks[NPV_LIST_LOCKS];
 static struct md_page *pv_table;
 
+/*
+ * Delayed invalidation.
+ *
+ * There is no global pv lock.  A thread may remove the pv entries
+ * for a range of mappings and drop the pv list locks before the TLB
+ * shootdown for those mappings is performed.  pmap_remove_all() or
+ * pmap_remove_write() could then find the pv list empty and return
+ * while stale TLB entries still allow access to the page.
+ *
+ * Such removals are bracketed by pmap_delayed_invl_started() and
+ * pmap_delayed_invl_finished().  Each bracket is assigned a
+ * generation number, which pmap_delayed_invl_page() records in
+ * pv_invl_gen[] for every page losing a pv entry.  pmap_invl_gen is
+ * advanced only when all brackets with smaller generation numbers
+ * have finished, and pmap_delayed_invl_wait() blocks until it
+ * covers the generation recorded for the page.
+ *
+ * Updates to pv_invl_gen[] are protected by the corresponding
+ * pv_list_locks[] element, reads are not.
+ */
+static LIST_HEAD(, pmap_invl_gen) pmap_invl_gen_tracker =
+    LIST_HEAD_INITIALIZER(&pmap_invl_gen_tracker);
+static struct mtx invl_gen_mtx;
+static u_long pmap_invl_gen = 0;
+/* Fake lock object to satisfy the turnstile interface. */
+static struct lock_object invl_gen_ts = {
+	.lo_name = "invlts",
+};
+static u_long pv_invl_gen[NPV_LIST_LOCKS];
+
+static __inline bool
+pmap_not_in_di(void)
+{
+
+	return (curthread->td_md.md_invl_gen.gen == 0);
+}
+
+#define	PMAP_ASSERT_NOT_IN_DI() \
+    KASSERT(pmap_not_in_di(), ("DI already started"))
+
+/*
+ * Start a new delayed invalidation block.  The block is tracked on
+ * pmap_invl_gen_tracker, newest first, and takes the next
+ * generation number.
+ */
+static void
+pmap_delayed_invl_started(void)
+{
+	struct pmap_invl_gen *invl_gen;
+	u_long currgen;
+
+	invl_gen = &curthread->td_md.md_invl_gen;
+	PMAP_ASSERT_NOT_IN_DI();
+	mtx_lock(&invl_gen_mtx);
+	if (LIST_EMPTY(&pmap_invl_gen_tracker))
+		currgen = pmap_invl_gen;
+	else
+		currgen = LIST_FIRST(&pmap_invl_gen_tracker)->gen;
+	invl_gen->gen = currgen + 1;
+	LIST_INSERT_HEAD(&pmap_invl_gen_tracker, invl_gen, link);
+	mtx_unlock(&invl_gen_mtx);
+}
+
+/*
+ * Finish the delayed invalidation block, after the TLB shootdown
+ * for every mapping removed within it.  If this was the oldest
+ * block, publish its generation and wake up the threads waiting in
+ * pmap_delayed_invl_wait().  Otherwise, hand the generation to the
+ * next older block, which publishes it when it finishes.
+ */
+static void
+pmap_delayed_invl_finished(void)
+{
+	struct pmap_invl_gen *invl_gen, *next;
+	struct turnstile *ts;
+
+	invl_gen = &curthread->td_md.md_invl_gen;
+	KASSERT(invl_gen->gen != 0, ("missed invl_started"));
+	mtx_lock(&invl_gen_mtx);
+	next = LIST_NEXT(invl_gen, link);
+	if (next == NULL) {
+		turnstile_chain_lock(&invl_gen_ts);
+		ts = turnstile_lookup(&invl_gen_ts);
+		pmap_invl_gen = invl_gen->gen;
+		if (ts != NULL) {
+			turnstile_broadcast(ts, TS_SHARED_QUEUE);
+			turnstile_unpend(ts, TS_SHARED_LOCK);
+		}
+		turnstile_chain_unlock(&invl_gen_ts);
+	} else {
+		next->gen = invl_gen->gen;
+	}
+	LIST_REMOVE(invl_gen, link);
+	mtx_unlock(&invl_gen_mtx);
+	invl_gen->gen = 0;
+}
+
+static u_long *
+pmap_delayed_invl_genp(vm_page_t m)
+{
+
+	return (&pv_invl_gen[pa_index(VM_PAGE_TO_PHYS(m)) % NPV_LIST_LOCKS]);
+}
+
+/*
+ * Wait until every delayed invalidation block that removed a
+ * mapping of the page has finished.  A turnstile is used rather
+ * than a sleep queue, since the callers may hold the object lock.
+ */
+static void
+pmap_delayed_invl_wait(vm_page_t m)
+{
+	struct turnstile *ts;
+	u_long *m_gen;
+
+	m_gen = pmap_delayed_invl_genp(m);
+	while (*m_gen > pmap_invl_gen) {
+		ts = turnstile_trywait(&invl_gen_ts);
+		if (*m_gen > pmap_invl_gen)
+			turnstile_wait(ts, NULL, TS_SHARED_QUEUE);
+		else
+			turnstile_cancel(ts);
+	}
+}
+
+/*
+ * Mark the page as having had a mapping removed inside the current
+ * delayed invalidation block, if any.  The pv list lock of the page
+ * must be held.
+ */
+static void
+pmap_delayed_invl_page(vm_page_t m)
+{
+	u_long gen, *m_gen;
+
+	rw_assert(VM_PAGE_TO_PV_LIST_LOCK(m), RA_WLOCKED);
+	gen = curthread->td_md.md_invl_gen.gen;
+	if (gen == 0)
+		return;
+	m_gen = pmap_delayed_invl_genp(m);
+	if (*m_gen < gen)
+		*m_gen = gen;
+}
+
+/*
+ * Batched TLB invalidation.
+ *
+ * Between pmap_invl_batch_begin() and pmap_invl_batch_end(), the
+ * shootdowns that pmap_remove() and pmap_protect() would issue for
+ * the batched pmap are accumulated into a single range, and page
+ * table pages freed by pmap_remove() are held.  The end of the batch
+ * performs one shootdown for the whole range, or a full flush if the
+ * range exceeds pmap_invl_batch_max pages, and then frees the held
+ * pages.  The batch is a delayed invalidation block, so that
+ * pmap_remove_all() and pmap_remove_write() wait for the shootdown.
+ * Pages whose writeable mappings were downgraded by pmap_protect()
+ * are recorded for the same reason.
+ *
+ * The batch state is per-thread.  The caller must not sleep while a
+ * batch is open.
+ */
+static void pmap_free_zero_pages(struct spglist *free);
+
+static int pmap_invl_batch_enable = 1;
+SYSCTL_INT(_vm_pmap, OID_AUTO, invl_batch, CTLFLAG_RWTUN,
+    &pmap_invl_batch_enable, 0,
+    "Batch TLB shootdowns across vm_map_delete() and vm_map_protect()");
+
+static int pmap_invl_batch_max = 64;
+SYSCTL_INT(_vm_pmap, OID_AUTO, invl_batch_max, CTLFLAG_RWTUN,
+    &pmap_invl_batch_max, 0,
+    "Largest batched range, in pages, invalidated page by page");
+
+static __inline bool
+pmap_invl_batched(pmap_t pmap)
+{
+
+	return (curthread->td_md.md_invl_batch.pmap == pmap);
+}
+
+/*
+ * Invalidate the range, or the whole pmap if "all" is set.  If the
+ * current thread batches invalidations for the pmap, only record the
+ * range.
+ */
+static void
+pmap_invl_batch_add(pmap_t pmap, vm_offset_t sva, vm_offset_t eva, bool all)
+{
+	struct pmap_invl_batch *b;
+
+	b = &curthread->td_md.md_invl_batch;
+	if (b->pmap != pmap) {
+		if (all)
+			pmap_invalidate_all(pmap);
+		else
+			pmap_invalidate_range(pmap, sva, eva);
+		return;
+	}
+	if (b->sva >= b->eva) {
+		b->sva = sva;
+		b->eva = eva;
+	} else {
+		if (sva < b->sva)
+			b->sva = sva;
+		if (eva > b->eva)
+			b->eva = eva;
+	}
+}
+
+/*
+ * Free the page table pages, or hold them until the end of the batch
+ * if the current thread batches invalidations for the pmap.
+ */
+static void
+pmap_invl_batch_free(pmap_t pmap, struct spglist *free)
+{
+	struct pmap_invl_batch *b;
+	vm_page_t m;
+
+	b = &curthread->td_md.md_invl_batch;
+	if (b->pmap != pmap) {
+		pmap_free_zero_pages(free);
+		return;
+	}
+	while ((m = SLIST_FIRST(free)) != NULL) {
+		SLIST_REMOVE_HEAD(free, plinks.s.ss);
+		SLIST_INSERT_HEAD(&b->free, m, plinks.s.ss);
+	}
+}
+
+/*
+ * Record a managed page that lost a writeable mapping inside the
+ * batch.  Changes the held pv list lock to the page's.
+ */
+static void
+pmap_invl_batch_page(pmap_t pmap, vm_page_t m, struct rwlock **lockp)
+{
+
+	if (!pmap_invl_batched(pmap))
+		return;
+	CHANGE_PV_LIST_LOCK_TO_VM_PAGE(lockp, m);
+	pmap_delayed_invl_page(m);
+}
+
+void
+pmap_invl_batch_begin(pmap_t pmap)
+{
+	struct pmap_invl_batch *b;
+
+	b = &curthread->td_md.md_invl_batch;
+	KASSERT(b->pmap == NULL, ("nested invalidation batch for %p", pmap));
+	if (pmap == kernel_pmap || !pmap_invl_batch_enable ||
+	    !pmap_not_in_di())
+		return;
+	pmap_delayed_invl_started();
+	b->pmap = pmap;
+	b->sva = b->eva = 0;
+	SLIST_INIT(&b->free);
+}
+
+void
+pmap_invl_batch_end(pmap_t pmap)
+{
+	struct pmap_invl_batch *b;
+	struct spglist free;
+	vm_page_t m;
+
+	b = &curthread->td_md.md_invl_batch;
+	if (b->pmap == NULL)
+		return;
+	KASSERT(b->pmap == pmap, ("invalidation batch for %p, not %p",
+	    b->pmap, pmap));
+	b->pmap = NULL;
+	if (b->sva < b->eva) {
+		if (b->eva - b->sva > ptoa(pmap_invl_batch_max))
+			pmap_invalidate_all(pmap);
+		else
+			pmap_invalidate_range(pmap, b->sva, b->eva);
+	}
+	pmap_delayed_invl_finished();
+	SLIST_INIT(&free);
+	while ((m = SLIST_FIRST(&b->free)) != NULL) {
+		SLIST_REMOVE_HEAD(&b->free, plinks.s.ss);
+		SLIST_INSERT_HEAD(&free, m, plinks.s.ss);
+	}
+	pmap_free_zero_pages(&free);
+}
+
 /*
  * All those kernel PT submaps that BSD is so fond of
  */
@@ -472,6 +771,8 @@ static boolean_t pmap_demote_pdpe(pmap_t pmap, pdp_entry_t *pdpe,
     vm_offset_t va);
 static boolean_t pmap_enter_pde(pmap_t pmap, vm_offset_t va, vm_page_t m,
     vm_prot_t prot, struct rwlock **lockp);
+static boolean_t pmap_enter_pdpe(pmap_t pmap, vm_offset_t va, vm_page_t m,
+    vm_prot_t prot, struct rwlock **lockp);
 static vm_page_t pmap_enter_quick_locked(pmap_t pmap, vm_offset_t va,
     vm_page_t m, vm_prot_t prot, vm_page_t mpte, struct rwlock **lockp);
 static void pmap_fill_ptp(pt_entry_t *firstpte, pt_entry_t newpte);
@@ -481,8 +782,10 @@ static vm_page_t pmap_lookup_pt_page(pmap_t pmap, vm_offset_t va);
 static void pmap_pde_attr(pd_entry_t *pde, int cache_bits, int mask);
 static void pmap_promote_pde(pmap_t pmap, pd_entry_t *pde, vm_offset_t va,
     struct rwlock **lockp);
+static void pmap_promote_pdpe(pmap_t pmap, vm_offset_t va);
 static boolean_t pmap_protect_pde(pmap_t pmap, pd_entry_t *pde, vm_offset_t sva,
     vm_prot_t prot);
+static boolean_t pmap_protect_pdpe(pmap_t pmap, pdp_entry_t *pdpe);
 static void pmap_pte_attr(pt_entry_t *pte, int cache_bits, int mask);
 static int pmap_remove_pde(pmap_t pmap, pd_entry_t *pdq, vm_offset_t sva,
     struct spglist *free, struct rwlock **lockp);
@@ -535,6 +838,13 @@ pmap_pde_pindex(vm_offset_t va)
 	return (va >> PDRSHIFT);
 }
 
+/* Return the pindex of the PD page for a given VA */
+static __inline vm_pindex_t
+pmap_pdpe_pindex(vm_offset_t va)
+{
+	return (NUPDE + (va >> PDPSHIFT));
+}
+
 
 /* Return various clipped indexes for a given VA */
 static __inline vm_pindex_t
@@ -704,6 +1014,13 @@ pmap_pde(pmap_t pmap, vm_offset_t va)
 	if (pdpe == NULL || (*pdpe & PG_V) == 0)
 		return (NULL);
 
+	/*
+	 * A 1GB user page mapping has no PD entries of its own.  The caller
+	 * must either handle it or demote it first.
+	 */
+	KASSERT((*pdpe & PG_PS) == 0 || va >= VM_MAXUSER_ADDRESS,
+	    ("pmap_pde: va %#lx is mapped by a 1GB page", va));
+
 	/* Calculates the PD entry corresponding to va and returns it */
 	return (pmap_pdpe_to_pde(pdpe, va));
 }
@@ -997,9 +1314,9 @@ pmap_bootstrap(vm_paddr_t *firstaddr)
 	kernel_pmap->pm_flags = pmap_flags;
 
  	/*
-	 * Initialize the global pv list lock.
+	 * Initialize the delayed invalidation generation mutex.
 	 */
-	rw_init(&pvh_global_lock, "pmap pv global");
+	mtx_init(&invl_gen_mtx, "invlgn", NULL, MTX_DEF);
 
 	/*
 	 * Reserve some special page table entries/VA space for temporary
@@ -1191,9 +1508,27 @@ pmap_init(void)
 	}
 
 	/*
-	 * Initialize the pv chunk list mutex.
+	 * Are 1GB page mappings of user memory enabled?  They depend on 2MB
+	 * page mappings, and they are not supported on processors needing
+	 * the erratum 383 workaround.
+	 */
+	TUNABLE_INT_FETCH("vm.pmap.pg_ps1g_enabled", &pg_ps1g_enabled);
+	if (pg_ps_enabled && pg_ps1g_enabled &&
+	    (amd_feature & AMDID_PAGE1GB) != 0 && !workaround_erratum383) {
+		KASSERT(MAXPAGESIZES > 2 && pagesizes[2] == 0,
+		    ("pmap_init: can't assign to pagesizes[2]"));
+		pagesizes[2] = NBPDP;
+	} else
+		pg_ps1g_enabled = 0;
+
+	/*
+	 * Initialize the per-domain pv chunk lists.
 	 */
-	mtx_init(&pv_chunks_mutex, "pmap pv chunk list", NULL, MTX_DEF);
+	for (i = 0; i < MAXMEMDOM; i++) {
+		mtx_init(&pv_chunks[i].pvc_lock, "pmap pv chunk list", NULL,
+		    MTX_DEF);
+		TAILQ_INIT(&pv_chunks[i].pvc_list);
+	}
 
 	/*
 	 * Initialize the pool of pv list locks.
@@ -1265,6 +1600,18 @@ static u_long pmap_pdpe_demotions;
 SYSCTL_ULONG(_vm_pmap_pdpe, OID_AUTO, demotions, CTLFLAG_RD,
     &pmap_pdpe_demotions, 0, "1GB page demotions");
 
+static u_long pmap_pdpe_mappings;
+SYSCTL_ULONG(_vm_pmap_pdpe, OID_AUTO, mappings, CTLFLAG_RD,
+    &pmap_pdpe_mappings, 0, "1GB page mappings");
+
+static u_long pmap_pdpe_p_failures;
+SYSCTL_ULONG(_vm_pmap_pdpe, OID_AUTO, p_failures, CTLFLAG_RD,
+    &pmap_pdpe_p_failures, 0, "1GB page promotion failures");
+
+static u_long pmap_pdpe_promotions;
+SYSCTL_ULONG(_vm_pmap_pdpe, OID_AUTO, promotions, CTLFLAG_RD,
+    &pmap_pdpe_promotions, 0, "1GB page promotions");
+
 /***************************************************
  * Low level helper routines.....
  ***************************************************/
@@ -1367,6 +1714,62 @@ pmap_ps_enabled(pmap_t pmap)
 	return (pg_ps_enabled && (pmap->pm_flags & PMAP_PDE_SUPERPAGE) != 0);
 }
 
+static __inline boolean_t
+pmap_ps1g_enabled(pmap_t pmap)
+{
+
+	return (pg_ps1g_enabled && pmap->pm_type == PT_X86 &&
+	    pmap_ps_enabled(pmap));
+}
+
+/*
+ * Returns TRUE if the given user virtual address is mapped by a 1GB page.
+ */
+static __inline boolean_t
+pmap_pdpe_is_ps(pmap_t pmap, vm_offset_t va)
+{
+	pdp_entry_t *pdpe;
+	pt_entry_t PG_V;
+
+	PG_V = pmap_valid_bit(pmap);
+	pdpe = pmap_pdpe(pmap, va);
+	return (pdpe != NULL && (*pdpe & (PG_PS | PG_V)) == (PG_PS | PG_V));
+}
+
+/*
+ * Demotes the 1GB page mapping of the given user virtual address, if there
+ * is one, so that the caller may change the PD entry for the address.  The
+ * demotion of a user 1GB page mapping never fails.
+ */
+static __inline void
+pmap_demote_user_pdpe(pmap_t pmap, vm_offset_t va)
+{
+	pdp_entry_t *pdpe;
+	pt_entry_t PG_V;
+
+	PG_V = pmap_valid_bit(pmap);
+	pdpe = pmap_pdpe(pmap, va);
+	if (va < VM_MAXUSER_ADDRESS && pdpe != NULL &&
+	    (*pdpe & (PG_PS | PG_V)) == (PG_PS | PG_V))
+		(void)pmap_demote_pdpe(pmap, pdpe, va);
+}
+
+/*
+ * Returns the entry that maps the given 2MB pv entry's virtual address: the
+ * PDP entry if the address is mapped by a 1GB page and the PD entry
+ * otherwise.  Only the entry's attribute bits may be examined.
+ */
+static __inline pd_entry_t *
+pmap_pv_pde(pmap_t pmap, vm_offset_t va)
+{
+	pdp_entry_t *pdpe;
+
+	pdpe = pmap_pdpe(pmap, va);
+	if ((*pdpe & PG_PS) != 0)
+		return ((pd_entry_t *)pdpe);
+	return (pmap_pdpe_to_pde(pdpe, va));
+}
+
 static void
 pmap_update_pde_store(pmap_t pmap, pd_entry_t *pde, pd_entry_t newpde)
 {
@@ -1960,6 +2363,7 @@ pmap_extract(pmap_t pmap, vm_offset_t va)
 vm_page_t
 pmap_extract_and_hold(pmap_t pmap, vm_offset_t va, vm_prot_t prot)
 {
+	pdp_entry_t *pdpe;
 	pd_entry_t pde, *pdep;
 	pt_entry_t pte, PG_RW, PG_V;
 	vm_paddr_t pa;
@@ -1971,8 +2375,17 @@ pmap_extract_and_hold(pmap_t pmap, vm_offset_t va, vm_prot_t prot)
 	PG_V = pmap_valid_bit(pmap);
 	PMAP_LOCK(pmap);
 retry:
-	pdep = pmap_pde(pmap, va);
-	if (pdep != NULL && (pde = *pdep)) {
+	pdpe = pmap_pdpe(pmap, va);
+	if (pdpe != NULL && (*pdpe & (PG_PS | PG_V)) == (PG_PS | PG_V)) {
+		if ((*pdpe & PG_RW) || (prot & VM_PROT_WRITE) == 0) {
+			if (vm_page_pa_tryrelock(pmap, (*pdpe & PG_PS_FRAME) |
+			    (va & PDPMASK), &pa))
+				goto retry;
+			m = PHYS_TO_VM_PAGE((*pdpe & PG_PS_FRAME) |
+			    (va & PDPMASK));
+			vm_page_hold(m);
+		}
+	} else if ((pdep = pmap_pde(pmap, va)) != NULL && (pde = *pdep)) {
 		if (pde & PG_PS) {
 			if ((pde & PG_RW) || (prot & VM_PROT_WRITE) == 0) {
 				if (vm_page_pa_tryrelock(pmap, (pde &
@@ -2424,9 +2837,8 @@ _pmap_allocpte(pmap_t pmap, vm_pindex_t ptepindex, struct rwlock **lockp)
 		if (lockp != NULL) {
 			RELEASE_PV_LIST_LOCK(lockp);
 			PMAP_UNLOCK(pmap);
-			rw_runlock(&pvh_global_lock);
+			PMAP_ASSERT_NOT_IN_DI();
 			VM_WAIT;
-			rw_rlock(&pvh_global_lock);
 			PMAP_LOCK(pmap);
 		}
 
@@ -2534,6 +2946,8 @@ _pmap_allocpte(pmap_t pmap, vm_pindex_t ptepindex, struct rwlock **lockp)
 					return (NULL);
 				}
 			} else {
+				KASSERT((*pdp & PG_PS) == 0,
+				    ("_pmap_allocpte: va is mapped by a 1GB page"));
 				/* Add reference to the pd page */
 				pdpg = PHYS_TO_VM_PAGE(*pdp & PG_FRAME);
 				pdpg->wire_count++;
@@ -2562,7 +2976,10 @@ pmap_allocpde(pmap_t pmap, vm_offset_t va, struct rwlock **lockp)
 
 retry:
 	pdpe = pmap_pdpe(pmap, va);
-	if (pdpe != NULL && (*pdpe & PG_V) != 0) {
+	if (pdpe != NULL && (*pdpe & (PG_PS | PG_V)) == (PG_PS | PG_V)) {
+		/* The va is already mapped by a 1GB page. */
+		pdpg = NULL;
+	} else if (pdpe != NULL && (*pdpe & PG_V) != 0) {
 		/* Add a reference to the pd page. */
 		pdpg = PHYS_TO_VM_PAGE(*pdpe & PG_FRAME);
 		pdpg->wire_count++;
@@ -2594,6 +3011,7 @@ retry:
 	/*
 	 * Get the page directory entry
 	 */
+	pmap_demote_user_pdpe(pmap, va);
 	pd = pmap_pde(pmap, va);
 
 	/*
@@ -2814,6 +3232,13 @@ SYSCTL_INT(_vm_pmap, OID_AUTO, pv_entry_spare, CTLFLAG_RD, &pv_entry_spare, 0,
 	"Current number of spare pv entries");
 #endif
 
+static __inline int
+pc_to_domain(struct pv_chunk *pc)
+{
+
+	return (vm_phys_domidx(PHYS_TO_VM_PAGE(DMAP_TO_PHYS((vm_offset_t)pc))));
+}
+
 /*
  * We are in a serious low memory condition.  Resort to
  * drastic measures to free some pages so we can allocate
@@ -2826,8 +3251,9 @@ SYSCTL_INT(_vm_pmap, OID_AUTO, pv_entry_spare, CTLFLAG_RD, &pv_entry_spare, 0,
  * exacerbating the shortage of free pv entries.
  */
 static vm_page_t
-reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
+reclaim_pv_chunk_domain(pmap_t locked_pmap, struct rwlock **lockp, int domain)
 {
+	struct pv_chunks_list *pvc;
 	struct pch new_tail;
 	struct pv_chunk *pc;
 	struct md_page *pvh;
@@ -2841,25 +3267,39 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 	struct spglist free;
 	uint64_t inuse;
 	int bit, field, freed;
+	bool start_di;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(locked_pmap, MA_OWNED);
 	KASSERT(lockp != NULL, ("reclaim_pv_chunk: lockp is NULL"));
+	pvc = &pv_chunks[domain];
 	pmap = NULL;
 	m_pc = NULL;
 	PG_G = PG_A = PG_M = PG_RW = 0;
 	SLIST_INIT(&free);
 	TAILQ_INIT(&new_tail);
-	mtx_lock(&pv_chunks_mutex);
-	while ((pc = TAILQ_FIRST(&pv_chunks)) != NULL && SLIST_EMPTY(&free)) {
-		TAILQ_REMOVE(&pv_chunks, pc, pc_lru);
-		mtx_unlock(&pv_chunks_mutex);
+
+	/*
+	 * A delayed invalidation block is already active if pmap_remove()
+	 * or pmap_advise() got here through pmap_demote_pde_locked().
+	 */
+	start_di = pmap_not_in_di();
+	if (start_di)
+		pmap_delayed_invl_started();
+	mtx_lock(&pvc->pvc_lock);
+	while ((pc = TAILQ_FIRST(&pvc->pvc_list)) != NULL &&
+	    SLIST_EMPTY(&free)) {
+		TAILQ_REMOVE(&pvc->pvc_list, pc, pc_lru);
+		mtx_unlock(&pvc->pvc_lock);
 		if (pmap != pc->pc_pmap) {
 			if (pmap != NULL) {
 				pmap_invalidate_all(pmap);
 				if (pmap != locked_pmap)
 					PMAP_UNLOCK(pmap);
 			}
+			if (start_di) {
+				pmap_delayed_invl_finished();
+				pmap_delayed_invl_started();
+			}
 			pmap = pc->pc_pmap;
 			/* Avoid deadlock and lock recursion. */
 			if (pmap > locked_pmap) {
@@ -2869,7 +3309,7 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 			    !PMAP_TRYLOCK(pmap)) {
 				pmap = NULL;
 				TAILQ_INSERT_TAIL(&new_tail, pc, pc_lru);
-				mtx_lock(&pv_chunks_mutex);
+				mtx_lock(&pvc->pvc_lock);
 				continue;
 			}
 			PG_G = pmap_global_bit(pmap);
@@ -2888,6 +3328,8 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 				bit = bsfq(inuse);
 				pv = &pc->pc_pventry[field * 64 + bit];
 				va = pv->pv_va;
+				if (pmap_pdpe_is_ps(pmap, va))
+					continue;
 				pde = pmap_pde(pmap, va);
 				if ((*pde & PG_PS) != 0)
 					continue;
@@ -2913,6 +3355,7 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 						    PGA_WRITEABLE);
 					}
 				}
+				pmap_delayed_invl_page(m);
 				pc->pc_map[field] |= 1UL << bit;
 				pmap_unuse_pt(pmap, va, *pde, &free);
 				freed++;
@@ -2920,7 +3363,7 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 		}
 		if (freed == 0) {
 			TAILQ_INSERT_TAIL(&new_tail, pc, pc_lru);
-			mtx_lock(&pv_chunks_mutex);
+			mtx_lock(&pvc->pvc_lock);
 			continue;
 		}
 		/* Every freed mapping is for a 4 KB page. */
@@ -2937,23 +3380,25 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 			/* Entire chunk is free; return it. */
 			m_pc = PHYS_TO_VM_PAGE(DMAP_TO_PHYS((vm_offset_t)pc));
 			dump_drop_page(m_pc->phys_addr);
-			mtx_lock(&pv_chunks_mutex);
+			mtx_lock(&pvc->pvc_lock);
 			break;
 		}
 		TAILQ_INSERT_HEAD(&pmap->pm_pvchunk, pc, pc_list);
 		TAILQ_INSERT_TAIL(&new_tail, pc, pc_lru);
-		mtx_lock(&pv_chunks_mutex);
+		mtx_lock(&pvc->pvc_lock);
 		/* One freed pv entry in locked_pmap is sufficient. */
 		if (pmap == locked_pmap)
 			break;
 	}
-	TAILQ_CONCAT(&pv_chunks, &new_tail, pc_lru);
-	mtx_unlock(&pv_chunks_mutex);
+	TAILQ_CONCAT(&pvc->pvc_list, &new_tail, pc_lru);
+	mtx_unlock(&pvc->pvc_lock);
 	if (pmap != NULL) {
 		pmap_invalidate_all(pmap);
 		if (pmap != locked_pmap)
 			PMAP_UNLOCK(pmap);
 	}
+	if (start_di)
+		pmap_delayed_invl_finished();
 	if (m_pc == NULL && !SLIST_EMPTY(&free)) {
 		m_pc = SLIST_FIRST(&free);
 		SLIST_REMOVE_HEAD(&free, plinks.s.ss);
@@ -2965,6 +3410,25 @@ reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
 	return (m_pc);
 }
 
+/*
+ * Reclaim a pv chunk, trying the local memory domain first.
+ */
+static vm_page_t
+reclaim_pv_chunk(pmap_t locked_pmap, struct rwlock **lockp)
+{
+	vm_page_t m_pc;
+	int domain, i;
+
+	domain = PCPU_GET(domain);
+	for (i = 0; i < vm_ndomains; i++) {
+		m_pc = reclaim_pv_chunk_domain(locked_pmap, lockp, domain);
+		if (m_pc != NULL)
+			break;
+		domain = (domain + 1) % vm_ndomains;
+	}
+	return (m_pc);
+}
+
 /*
  * free the pv_entry back to the free list
  */
@@ -2974,7 +3438,6 @@ free_pv_entry(pmap_t pmap, pv_entry_t pv)
 	struct pv_chunk *pc;
 	int idx, field, bit;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	PV_STAT(atomic_add_long(&pv_entry_frees, 1));
 	PV_STAT(atomic_add_int(&pv_entry_spare, 1));
@@ -3000,11 +3463,13 @@ free_pv_entry(pmap_t pmap, pv_entry_t pv)
 static void
 free_pv_chunk(struct pv_chunk *pc)
 {
+	struct pv_chunks_list *pvc;
 	vm_page_t m;
 
-	mtx_lock(&pv_chunks_mutex);
- 	TAILQ_REMOVE(&pv_chunks, pc, pc_lru);
-	mtx_unlock(&pv_chunks_mutex);
+	pvc = &pv_chunks[pc_to_domain(pc)];
+	mtx_lock(&pvc->pvc_lock);
+	TAILQ_REMOVE(&pvc->pvc_list, pc, pc_lru);
+	mtx_unlock(&pvc->pvc_lock);
 	PV_STAT(atomic_subtract_int(&pv_entry_spare, _NPCPV));
 	PV_STAT(atomic_subtract_int(&pc_chunk_count, 1));
 	PV_STAT(atomic_add_int(&pc_chunk_frees, 1));
@@ -3026,12 +3491,12 @@ free_pv_chunk(struct pv_chunk *pc)
 static pv_entry_t
 get_pv_entry(pmap_t pmap, struct rwlock **lockp)
 {
+	struct pv_chunks_list *pvc;
 	int bit, field;
 	pv_entry_t pv;
 	struct pv_chunk *pc;
 	vm_page_t m;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	PV_STAT(atomic_add_long(&pv_entry_allocs, 1));
 retry:
@@ -3078,9 +3543,10 @@ retry:
 	pc->pc_map[0] = PC_FREE0 & ~1ul;	/* preallocated bit 0 */
 	pc->pc_map[1] = PC_FREE1;
 	pc->pc_map[2] = PC_FREE2;
-	mtx_lock(&pv_chunks_mutex);
-	TAILQ_INSERT_TAIL(&pv_chunks, pc, pc_lru);
-	mtx_unlock(&pv_chunks_mutex);
+	pvc = &pv_chunks[vm_phys_domidx(m)];
+	mtx_lock(&pvc->pvc_lock);
+	TAILQ_INSERT_TAIL(&pvc->pvc_list, pc, pc_lru);
+	mtx_unlock(&pvc->pvc_lock);
 	pv = &pc->pc_pventry[0];
 	TAILQ_INSERT_HEAD(&pmap->pm_pvchunk, pc, pc_list);
 	PV_STAT(atomic_add_long(&pv_entry_count, 1));
@@ -3122,12 +3588,12 @@ popcnt_pc_map_elem_pq(uint64_t elem)
 static void
 reserve_pv_entries(pmap_t pmap, int needed, struct rwlock **lockp)
 {
-	struct pch new_tail;
+	struct pv_chunks_list *pvc;
+	struct pch new_tail[MAXMEMDOM];
 	struct pv_chunk *pc;
-	int avail, free;
+	int avail, free, i;
 	vm_page_t m;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	KASSERT(lockp != NULL, ("reserve_pv_entries: lockp is NULL"));
 
@@ -3137,7 +3603,8 @@ reserve_pv_entries(pmap_t pmap, int needed, struct rwlock **lockp)
 	 * reclaim_pv_chunk() could recycle one of these chunks.  In
 	 * contrast, these chunks must be added to the pmap upon allocation.
 	 */
-	TAILQ_INIT(&new_tail);
+	for (i = 0; i < vm_ndomains; i++)
+		TAILQ_INIT(&new_tail[i]);
 retry:
 	avail = 0;
 	TAILQ_FOREACH(pc, &pmap->pm_pvchunk, pc_list) {
@@ -3176,13 +3643,16 @@ retry:
 		pc->pc_map[1] = PC_FREE1;
 		pc->pc_map[2] = PC_FREE2;
 		TAILQ_INSERT_HEAD(&pmap->pm_pvchunk, pc, pc_list);
-		TAILQ_INSERT_TAIL(&new_tail, pc, pc_lru);
+		TAILQ_INSERT_TAIL(&new_tail[vm_phys_domidx(m)], pc, pc_lru);
 		PV_STAT(atomic_add_int(&pv_entry_spare, _NPCPV));
 	}
-	if (!TAILQ_EMPTY(&new_tail)) {
-		mtx_lock(&pv_chunks_mutex);
-		TAILQ_CONCAT(&pv_chunks, &new_tail, pc_lru);
-		mtx_unlock(&pv_chunks_mutex);
+	for (i = 0; i < vm_ndomains; i++) {
+		if (TAILQ_EMPTY(&new_tail[i]))
+			continue;
+		pvc = &pv_chunks[i];
+		mtx_lock(&pvc->pvc_lock);
+		TAILQ_CONCAT(&pvc->pvc_list, &new_tail[i], pc_lru);
+		mtx_unlock(&pvc->pvc_lock);
 	}
 }
 
@@ -3197,7 +3667,6 @@ pmap_pvh_remove(struct md_page *pvh, pmap_t pmap, vm_offset_t va)
 {
 	pv_entry_t pv;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	TAILQ_FOREACH(pv, &pvh->pv_list, pv_next) {
 		if (pmap == PV_PMAP(pv) && va == pv->pv_va) {
 			TAILQ_REMOVE(&pvh->pv_list, pv, pv_next);
@@ -3224,7 +3693,6 @@ pmap_pv_demote_pde(pmap_t pmap, vm_offset_t va, vm_paddr_t pa,
 	vm_page_t m;
 	int bit, field;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	KASSERT((pa & PDRMASK) == 0,
 	    ("pmap_pv_demote_pde: pa is not 2mpage aligned"));
@@ -3291,7 +3759,6 @@ pmap_pv_promote_pde(pmap_t pmap, vm_offset_t va, vm_paddr_t pa,
 	vm_offset_t va_last;
 	vm_page_t m;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	KASSERT((pa & PDRMASK) == 0,
 	    ("pmap_pv_promote_pde: pa is not 2mpage aligned"));
 	CHANGE_PV_LIST_LOCK_TO_PHYS(lockp, pa);
@@ -3344,7 +3811,6 @@ pmap_try_insert_pv_entry(pmap_t pmap, vm_offset_t va, vm_page_t m,
 {
 	pv_entry_t pv;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	/* Pass NULL instead of the lock pointer to disable reclamation. */
 	if ((pv = get_pv_entry(pmap, NULL)) != NULL) {
@@ -3368,7 +3834,6 @@ pmap_pv_insert_pde(pmap_t pmap, vm_offset_t va, vm_paddr_t pa,
 	struct md_page *pvh;
 	pv_entry_t pv;
 
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 	/* Pass NULL instead of the lock pointer to disable reclamation. */
 	if ((pv = get_pv_entry(pmap, NULL)) != NULL) {
@@ -3626,6 +4091,7 @@ pmap_remove_pde(pmap_t pmap, pd_entry_t *pdq, vm_offset_t sva,
 			if (TAILQ_EMPTY(&m->md.pv_list) &&
 			    TAILQ_EMPTY(&pvh->pv_list))
 				vm_page_aflag_clear(m, PGA_WRITEABLE);
+			pmap_delayed_invl_page(m);
 		}
 	}
 	if (pmap == kernel_pmap) {
@@ -3679,6 +4145,7 @@ pmap_remove_pte(pmap_t pmap, pt_entry_t *ptq, vm_offset_t va,
 			if (TAILQ_EMPTY(&pvh->pv_list))
 				vm_page_aflag_clear(m, PGA_WRITEABLE);
 		}
+		pmap_delayed_invl_page(m);
 	}
 	return (pmap_unuse_pt(pmap, va, ptepde, free));
 }
@@ -3704,7 +4171,7 @@ pmap_remove_page(pmap_t pmap, vm_offset_t va, pd_entry_t *pde,
 	pmap_remove_pte(pmap, pte, va, *pde, free, &lock);
 	if (lock != NULL)
 		rw_wunlock(lock);
-	pmap_invalidate_page(pmap, va);
+	pmap_invl_batch_add(pmap, va, va + PAGE_SIZE, false);
 }
 
 /*
@@ -3723,7 +4190,9 @@ pmap_remove(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 	pd_entry_t ptpaddr, *pde;
 	pt_entry_t *pte, PG_G, PG_V;
 	struct spglist free;
+	vm_offset_t osva;
 	int anyvalid;
+	bool start_di;
 
 	PG_G = pmap_global_bit(pmap);
 	PG_V = pmap_valid_bit(pmap);
@@ -3735,9 +4204,13 @@ pmap_remove(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 		return;
 
 	anyvalid = 0;
+	osva = sva;
 	SLIST_INIT(&free);
 
-	rw_rlock(&pvh_global_lock);
+	/* A batch is already a delayed invalidation block. */
+	start_di = pmap_not_in_di();
+	if (start_di)
+		pmap_delayed_invl_started();
 	PMAP_LOCK(pmap);
 
 	/*
@@ -3745,7 +4218,7 @@ pmap_remove(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 	 * common operation and easy to short circuit some
 	 * code.
 	 */
-	if (sva + PAGE_SIZE == eva) {
+	if (sva + PAGE_SIZE == eva && !pmap_pdpe_is_ps(pmap, sva)) {
 		pde = pmap_pde(pmap, sva);
 		if (pde && (*pde & PG_PS) == 0) {
 			pmap_remove_page(pmap, sva, pde, &free);
@@ -3782,6 +4255,9 @@ pmap_remove(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 		if (va_next < sva)
 			va_next = eva;
 
+		if ((*pdpe & PG_PS) != 0 &&
+		    !pmap_demote_pdpe(pmap, pdpe, sva))
+			continue;
 		pde = pmap_pdpe_to_pde(pdpe, sva);
 		ptpaddr = *pde;
 
@@ -3851,10 +4327,11 @@ pmap_remove(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 		rw_wunlock(lock);
 out:
 	if (anyvalid)
-		pmap_invalidate_all(pmap);
-	rw_runlock(&pvh_global_lock);	
+		pmap_invl_batch_add(pmap, osva, eva, true);
 	PMAP_UNLOCK(pmap);
-	pmap_free_zero_pages(&free);
+	if (start_di)
+		pmap_delayed_invl_finished();
+	pmap_invl_batch_free(pmap, &free);
 }
 
 /*
@@ -3874,32 +4351,63 @@ void
 pmap_remove_all(vm_page_t m)
 {
 	struct md_page *pvh;
+	struct rwlock *lock;
 	pv_entry_t pv;
 	pmap_t pmap;
 	pt_entry_t *pte, tpte, PG_A, PG_M, PG_RW;
 	pd_entry_t *pde;
 	vm_offset_t va;
 	struct spglist free;
+	int pvh_gen, md_gen;
 
 	KASSERT((m->oflags & VPO_UNMANAGED) == 0,
 	    ("pmap_remove_all: page %p is not managed", m));
 	SLIST_INIT(&free);
-	rw_wlock(&pvh_global_lock);
-	if ((m->flags & PG_FICTITIOUS) != 0)
+	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
+	pvh = (m->flags & PG_FICTITIOUS) != 0 ? NULL :
+	    pa_to_pvh(VM_PAGE_TO_PHYS(m));
+retry:
+	rw_wlock(lock);
+	if (pvh == NULL)
 		goto small_mappings;
-	pvh = pa_to_pvh(VM_PAGE_TO_PHYS(m));
 	while ((pv = TAILQ_FIRST(&pvh->pv_list)) != NULL) {
 		pmap = PV_PMAP(pv);
-		PMAP_LOCK(pmap);
+		if (!PMAP_TRYLOCK(pmap)) {
+			pvh_gen = pvh->pv_gen;
+			rw_wunlock(lock);
+			PMAP_LOCK(pmap);
+			rw_wlock(lock);
+			if (pvh_gen != pvh->pv_gen) {
+				rw_wunlock(lock);
+				PMAP_UNLOCK(pmap);
+				goto retry;
+			}
+		}
 		va = pv->pv_va;
+		pmap_demote_user_pdpe(pmap, va);
 		pde = pmap_pde(pmap, va);
-		(void)pmap_demote_pde(pmap, pde, va);
+		(void)pmap_demote_pde_locked(pmap, pde, va, &lock);
+		KASSERT(lock == VM_PAGE_TO_PV_LIST_LOCK(m),
+		    ("inconsistent pv lock %p %p for page %p",
+		    lock, VM_PAGE_TO_PV_LIST_LOCK(m), m));
 		PMAP_UNLOCK(pmap);
 	}
 small_mappings:
 	while ((pv = TAILQ_FIRST(&m->md.pv_list)) != NULL) {
 		pmap = PV_PMAP(pv);
-		PMAP_LOCK(pmap);
+		if (!PMAP_TRYLOCK(pmap)) {
+			pvh_gen = pvh != NULL ? pvh->pv_gen : 0;
+			md_gen = m->md.pv_gen;
+			rw_wunlock(lock);
+			PMAP_LOCK(pmap);
+			rw_wlock(lock);
+			if ((pvh != NULL && pvh_gen != pvh->pv_gen) ||
+			    md_gen != m->md.pv_gen) {
+				rw_wunlock(lock);
+				PMAP_UNLOCK(pmap);
+				goto retry;
+			}
+		}
 		PG_A = pmap_accessed_bit(pmap);
 		PG_M = pmap_modified_bit(pmap);
 		PG_RW = pmap_rw_bit(pmap);
@@ -3927,7 +4435,8 @@ small_mappings:
 		PMAP_UNLOCK(pmap);
 	}
 	vm_page_aflag_clear(m, PGA_WRITEABLE);
-	rw_wunlock(&pvh_global_lock);
+	rw_wunlock(lock);
+	pmap_delayed_invl_wait(m);
 	pmap_free_zero_pages(&free);
 }
 
@@ -3975,6 +4484,37 @@ retry:
 	return (anychanged);
 }
 
+/*
+ * Write protects a 1GB user page mapping without demoting it.  If the
+ * mapping was modified, all of its pages are dirtied, because the single
+ * modified bit does not tell which of them were written.  Returns TRUE if
+ * the mapping was changed and must be invalidated by the caller.
+ */
+static boolean_t
+pmap_protect_pdpe(pmap_t pmap, pdp_entry_t *pdpe)
+{
+	pdp_entry_t oldpdpe;
+	vm_page_t m, mt;
+	pt_entry_t PG_M, PG_RW;
+
+	PG_M = pmap_modified_bit(pmap);
+	PG_RW = pmap_rw_bit(pmap);
+
+	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
+retry:
+	oldpdpe = *pdpe;
+	if ((oldpdpe & PG_RW) == 0)
+		return (FALSE);
+	if (!atomic_cmpset_long(pdpe, oldpdpe, oldpdpe & ~(PG_RW | PG_M)))
+		goto retry;
+	if ((oldpdpe & (PG_MANAGED | PG_M)) == (PG_MANAGED | PG_M)) {
+		m = PHYS_TO_VM_PAGE(oldpdpe & PG_PS_FRAME);
+		for (mt = m; mt < &m[NBPDP / PAGE_SIZE]; mt++)
+			vm_page_dirty(mt);
+	}
+	return (TRUE);
+}
+
 /*
  *	Set the physical protection on the
  *	specified range of this map as requested.
@@ -3987,7 +4527,9 @@ pmap_protect(pmap_t pmap, vm_offset_t sva, vm_offset_t eva, vm_prot_t prot)
 	pdp_entry_t *pdpe;
 	pd_entry_t ptpaddr, *pde;
 	pt_entry_t *pte, PG_G, PG_M, PG_RW, PG_V;
-	boolean_t anychanged, pv_lists_locked;
+	struct rwlock *lock;
+	vm_offset_t osva;
+	boolean_t anychanged;
 
 	KASSERT((prot & ~VM_PROT_ALL) == 0, ("invalid prot %x", prot));
 	if (prot == VM_PROT_NONE) {
@@ -4003,9 +4545,9 @@ pmap_protect(pmap_t pmap, vm_offset_t sva, vm_offset_t eva, vm_prot_t prot)
 	PG_M = pmap_modified_bit(pmap);
 	PG_V = pmap_valid_bit(pmap);
 	PG_RW = pmap_rw_bit(pmap);
-	pv_lists_locked = FALSE;
-resume:
 	anychanged = FALSE;
+	lock = NULL;
+	osva = sva;
 
 	PMAP_LOCK(pmap);
 	for (; sva < eva; sva = va_next) {
@@ -4030,6 +4572,9 @@ resume:
 		if (va_next < sva)
 			va_next = eva;
 
+		if ((*pdpe & PG_PS) != 0 &&
+		    !pmap_demote_pdpe(pmap, pdpe, sva))
+			continue;
 		pde = pmap_pdpe_to_pde(pdpe, sva);
 		ptpaddr = *pde;
 
@@ -4052,22 +4597,26 @@ resume:
 				 * The TLB entry for a PG_G mapping is
 				 * invalidated by pmap_protect_pde().
 				 */
-				if (pmap_protect_pde(pmap, pde, sva, prot))
+				if (pmap_protect_pde(pmap, pde, sva, prot)) {
 					anychanged = TRUE;
+					if ((ptpaddr & (PG_MANAGED | PG_RW)) ==
+					    (PG_MANAGED | PG_RW) &&
+					    (prot & VM_PROT_WRITE) == 0)
+						pmap_invl_batch_page(pmap,
+						    PHYS_TO_VM_PAGE(ptpaddr &
+						    PG_PS_FRAME), &lock);
+				}
 				continue;
 			} else {
-				if (!pv_lists_locked) {
-					pv_lists_locked = TRUE;
-					if (!rw_try_rlock(&pvh_global_lock)) {
-						if (anychanged)
-							pmap_invalidate_all(
-							    pmap);
-						PMAP_UNLOCK(pmap);
-						rw_rlock(&pvh_global_lock);
-						goto resume;
-					}
-				}
-				if (!pmap_demote_pde(pmap, pde, sva)) {
+				/*
+				 * The pv list lock held for the batch may
+				 * be switched to the lock of the demoted
+				 * page.  The batch does not depend on it:
+				 * pages recorded so far carry the batch's
+				 * generation, stored under their own lock.
+				 */
+				if (!pmap_demote_pde_locked(pmap, pde, sva,
+				    &lock)) {
 					/*
 					 * The large page mapping was
 					 * destroyed.
@@ -4106,15 +4655,22 @@ retry:
 					goto retry;
 				if (obits & PG_G)
 					pmap_invalidate_page(pmap, sva);
-				else
+				else {
 					anychanged = TRUE;
+					if ((obits & (PG_MANAGED | PG_RW)) ==
+					    (PG_MANAGED | PG_RW) &&
+					    (pbits & PG_RW) == 0)
+						pmap_invl_batch_page(pmap,
+						    PHYS_TO_VM_PAGE(obits &
+						    PG_FRAME), &lock);
+				}
 			}
 		}
 	}
+	if (lock != NULL)
+		rw_wunlock(lock);
 	if (anychanged)
-		pmap_invalidate_all(pmap);
-	if (pv_lists_locked)
-		rw_runlock(&pvh_global_lock);
+		pmap_invl_batch_add(pmap, osva, eva, true);
 	PMAP_UNLOCK(pmap);
 }
 
@@ -4247,6 +4803,127 @@ setpte:
 	    " in pmap %p", va, pmap);
 }
 
+/*
+ * Tries to promote the 512, contiguous 2MB page mappings that are within a
+ * single page directory page (PD) to a single 1GB page mapping.  The
+ * conditions are those of pmap_promote_pde(), applied to 2MB page mappings.
+ * The pv entries are not promoted: they remain at 2MB granularity.  A 1GB
+ * page mapping is demoted explicitly before any of its 2MB pieces is changed
+ * individually, while the pv list walkers that only test or age it operate
+ * on the PDP entry directly.
+ */
+static void
+pmap_promote_pdpe(pmap_t pmap, vm_offset_t va)
+{
+	pdp_entry_t newpdpe, *pdpe;
+	pd_entry_t *firstpde, oldpde, pa, *pde;
+	pt_entry_t PG_G, PG_A, PG_M, PG_RW, PG_V;
+	vm_page_t mpde;
+	int PG_PDE_CACHE;
+
+	PG_A = pmap_accessed_bit(pmap);
+	PG_G = pmap_global_bit(pmap);
+	PG_M = pmap_modified_bit(pmap);
+	PG_V = pmap_valid_bit(pmap);
+	PG_RW = pmap_rw_bit(pmap);
+	PG_PDE_CACHE = pmap_cache_mask(pmap, 1);
+
+	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
+	KASSERT(va < VM_MAXUSER_ADDRESS,
+	    ("pmap_promote_pdpe: va %#lx is not a user address", va));
+
+	/*
+	 * Every PDE in the PD page must be valid.
+	 */
+	pdpe = pmap_pdpe(pmap, va);
+	mpde = PHYS_TO_VM_PAGE(*pdpe & PG_FRAME);
+	if (mpde->wire_count != NPDEPG)
+		return;
+
+	/*
+	 * Examine the first PDE in the specified PD page.  Abort if this PDE
+	 * is not a 2MB page mapping or does not map the first 2MB physical
+	 * page within a 1GB page.
+	 */
+	firstpde = (pd_entry_t *)PHYS_TO_DMAP(*pdpe & PG_FRAME);
+setpdpe:
+	newpdpe = *firstpde;
+	if ((newpdpe & ((PG_PS_FRAME & PDPMASK) | PG_PS | PG_A | PG_V)) !=
+	    (PG_PS | PG_A | PG_V)) {
+		atomic_add_long(&pmap_pdpe_p_failures, 1);
+		CTR2(KTR_PMAP, "pmap_promote_pdpe: failure for va %#lx"
+		    " in pmap %p", va, pmap);
+		return;
+	}
+	if ((newpdpe & (PG_M | PG_RW)) == PG_RW) {
+		/*
+		 * When PG_M is already clear, PG_RW can be cleared without
+		 * a TLB invalidation.
+		 */
+		if (!atomic_cmpset_long(firstpde, newpdpe, newpdpe & ~PG_RW))
+			goto setpdpe;
+		newpdpe &= ~PG_RW;
+	}
+
+	/*
+	 * Examine each of the other PDEs in the specified PD page.  Abort if
+	 * this PDE maps an unexpected 2MB physical page or does not have
+	 * identical characteristics to the first PDE.
+	 */
+	pa = (newpdpe & (PG_PS_FRAME | PG_PS | PG_A | PG_V)) + NBPDP - NBPDR;
+	for (pde = firstpde + NPDEPG - 1; pde > firstpde; pde--) {
+setpde:
+		oldpde = *pde;
+		if ((oldpde & (PG_PS_FRAME | PG_PS | PG_A | PG_V)) != pa) {
+			atomic_add_long(&pmap_pdpe_p_failures, 1);
+			CTR2(KTR_PMAP, "pmap_promote_pdpe: failure for va %#lx"
+			    " in pmap %p", va, pmap);
+			return;
+		}
+		if ((oldpde & (PG_M | PG_RW)) == PG_RW) {
+			/*
+			 * When PG_M is already clear, PG_RW can be cleared
+			 * without a TLB invalidation.
+			 */
+			if (!atomic_cmpset_long(pde, oldpde, oldpde & ~PG_RW))
+				goto setpde;
+			oldpde &= ~PG_RW;
+		}
+		if ((oldpde & PG_PDE_PROMOTE) != (newpdpe & PG_PDE_PROMOTE)) {
+			atomic_add_long(&pmap_pdpe_p_failures, 1);
+			CTR2(KTR_PMAP, "pmap_promote_pdpe: failure for va %#lx"
+			    " in pmap %p", va, pmap);
+			return;
+		}
+		pa -= NBPDR;
+	}
+
+	/*
+	 * Save the page directory page in its current state until the PDPE
+	 * mapping the superpage is demoted by pmap_demote_pdpe().  The page
+	 * table pages saved by the 2MB promotions remain in place.
+	 */
+	KASSERT(mpde->pindex == pmap_pdpe_pindex(va),
+	    ("pmap_promote_pdpe: page directory page's pindex is wrong"));
+	if (pmap_insert_pt_page(pmap, mpde)) {
+		atomic_add_long(&pmap_pdpe_p_failures, 1);
+		CTR2(KTR_PMAP,
+		    "pmap_promote_pdpe: failure for va %#lx in pmap %p", va,
+		    pmap);
+		return;
+	}
+
+	/*
+	 * Map the superpage.  The PAT bit is in the same position in a 1GB
+	 * page mapping as in a 2MB page mapping.
+	 */
+	pde_store(pdpe, newpdpe);
+
+	atomic_add_long(&pmap_pdpe_promotions, 1);
+	CTR2(KTR_PMAP, "pmap_promote_pdpe: success for va %#lx"
+	    " in pmap %p", va, pmap);
+}
+
 /*
  *	Insert the given physical page (p) at
  *	the specified virtual address (v) in the
@@ -4271,6 +4948,7 @@ pmap_enter(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
 	vm_paddr_t opa, pa;
 	vm_page_t mpte, om;
 	boolean_t nosleep;
+	int level;
 
 	PG_A = pmap_accessed_bit(pmap);
 	PG_G = pmap_global_bit(pmap);
@@ -4319,7 +4997,6 @@ pmap_enter(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
 	mpte = NULL;
 
 	lock = NULL;
-	rw_rlock(&pvh_global_lock);
 	PMAP_LOCK(pmap);
 
 	/*
@@ -4327,6 +5004,7 @@ pmap_enter(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
 	 * resident, we are creating it here.
 	 */
 retry:
+	pmap_demote_user_pdpe(pmap, va);
 	pde = pmap_pde(pmap, va);
 	if (pde != NULL && (*pde & PG_V) != 0 && ((*pde & PG_PS) == 0 ||
 	    pmap_demote_pde_locked(pmap, pde, va, &lock))) {
@@ -4346,7 +5024,6 @@ retry:
 		if (mpte == NULL && nosleep) {
 			if (lock != NULL)
 				rw_wunlock(lock);
-			rw_runlock(&pvh_global_lock);
 			PMAP_UNLOCK(pmap);
 			return (KERN_RESOURCE_SHORTAGE);
 		}
@@ -4474,12 +5151,20 @@ unchanged:
 	if ((mpte == NULL || mpte->wire_count == NPTEPG) &&
 	    pmap_ps_enabled(pmap) &&
 	    (m->flags & PG_FICTITIOUS) == 0 &&
-	    vm_reserv_level_iffullpop(m) == 0)
+	    (level = vm_reserv_level_iffullpop(m)) >= 0) {
 		pmap_promote_pde(pmap, pde, va, &lock);
 
+		/*
+		 * If the 1GB reservation is also fully populated, then
+		 * attempt promotion of the 2MB page mappings.
+		 */
+		if (level == 1 && (*pde & PG_PS) != 0 &&
+		    pmap_ps1g_enabled(pmap))
+			pmap_promote_pdpe(pmap, va);
+	}
+
 	if (lock != NULL)
 		rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 	return (KERN_SUCCESS);
 }
@@ -4500,7 +5185,6 @@ pmap_enter_pde(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
 	struct spglist free;
 
 	PG_V = pmap_valid_bit(pmap);
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 
 	if ((mpde = pmap_allocpde(pmap, va, NULL)) == NULL) {
@@ -4559,6 +5243,114 @@ pmap_enter_pde(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
 	return (TRUE);
 }
 
+/*
+ * Tries to create a read-only 1GB page mapping of user memory.  Returns TRUE
+ * if successful and FALSE otherwise.  Fails if (1) a page directory page
+ * cannot be allocated without blocking, (2) a mapping already exists within
+ * the 1GB virtual range, or (3) a pv entry cannot be allocated without
+ * reclaiming another pv entry.  As with promotion, the pv entries are
+ * created at 2MB granularity, and the page directory page is saved for
+ * pmap_demote_pdpe().
+ */
+static boolean_t
+pmap_enter_pdpe(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot,
+    struct rwlock **lockp)
+{
+	pdp_entry_t *pdpe, newpdpe;
+	pt_entry_t PG_A, PG_V;
+	vm_offset_t sva;
+	vm_paddr_t pa;
+	vm_page_t mpde;
+	struct spglist free;
+
+	PG_A = pmap_accessed_bit(pmap);
+	PG_V = pmap_valid_bit(pmap);
+	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
+	KASSERT(va < VM_MAXUSER_ADDRESS && (va & PDPMASK) == 0,
+	    ("pmap_enter_pdpe: invalid va %#lx", va));
+
+	pdpe = pmap_pdpe(pmap, va);
+	if (pdpe != NULL && (*pdpe & PG_V) != 0) {
+		CTR2(KTR_PMAP, "pmap_enter_pdpe: failure for va %#lx"
+		    " in pmap %p", va, pmap);
+		return (FALSE);
+	}
+	if ((mpde = _pmap_allocpte(pmap, pmap_pdpe_pindex(va), NULL)) ==
+	    NULL) {
+		CTR2(KTR_PMAP, "pmap_enter_pdpe: failure for va %#lx"
+		    " in pmap %p", va, pmap);
+		return (FALSE);
+	}
+	pdpe = pmap_pdpe(pmap, va);
+	newpdpe = VM_PAGE_TO_PHYS(m) | pmap_cache_bits(pmap, m->md.pat_mode,
+	    1) | PG_PS | PG_A | PG_U | PG_V;
+	if ((m->oflags & VPO_UNMANAGED) == 0) {
+		newpdpe |= PG_MANAGED;
+
+		/*
+		 * Abort this mapping if any of its PV entries could not be
+		 * created.
+		 */
+		for (sva = va; sva < va + NBPDP; sva += NBPDR) {
+			pa = VM_PAGE_TO_PHYS(m) + (sva - va);
+			if (!pmap_pv_insert_pde(pmap, sva, pa, lockp))
+				break;
+		}
+		if (sva < va + NBPDP) {
+			while (sva > va) {
+				sva -= NBPDR;
+				pa = VM_PAGE_TO_PHYS(m) + (sva - va);
+				CHANGE_PV_LIST_LOCK_TO_PHYS(lockp, pa);
+				pmap_pvh_free(pa_to_pvh(pa), pmap, sva);
+			}
+			goto fail;
+		}
+	}
+
+	/*
+	 * Save the page directory page for pmap_demote_pdpe().  It stands
+	 * for NPDEPG valid PDEs.
+	 */
+	if (pmap_insert_pt_page(pmap, mpde)) {
+		if ((newpdpe & PG_MANAGED) != 0) {
+			for (sva = va; sva < va + NBPDP; sva += NBPDR) {
+				pa = VM_PAGE_TO_PHYS(m) + (sva - va);
+				CHANGE_PV_LIST_LOCK_TO_PHYS(lockp, pa);
+				pmap_pvh_free(pa_to_pvh(pa), pmap, sva);
+			}
+		}
+		goto fail;
+	}
+	mpde->wire_count = NPDEPG;
+	if ((prot & VM_PROT_EXECUTE) == 0)
+		newpdpe |= pg_nx;
+
+	/*
+	 * Increment counters.
+	 */
+	pmap_resident_count_inc(pmap, NBPDP / PAGE_SIZE);
+
+	/*
+	 * Map the superpage.
+	 */
+	pde_store(pdpe, newpdpe);
+
+	atomic_add_long(&pmap_pdpe_mappings, 1);
+	CTR2(KTR_PMAP, "pmap_enter_pdpe: success for va %#lx"
+	    " in pmap %p", va, pmap);
+	return (TRUE);
+
+fail:
+	SLIST_INIT(&free);
+	if (pmap_unwire_ptp(pmap, va, mpde, &free)) {
+		pmap_invalidate_page(pmap, va);
+		pmap_free_zero_pages(&free);
+	}
+	CTR2(KTR_PMAP, "pmap_enter_pdpe: failure for va %#lx"
+	    " in pmap %p", va, pmap);
+	return (FALSE);
+}
+
 /*
  * Maps a sequence of resident pages belonging to the same object.
  * The sequence begins with the given page m_start.  This page is
@@ -4589,7 +5381,6 @@ pmap_enter_object(pmap_t pmap, vm_offset_t start, vm_offset_t end,
 	/* m refers to memory as in page of memory */
 	m = m_start;
 	lock = NULL;
-	rw_rlock(&pvh_global_lock);
 	PMAP_LOCK(pmap);
 					/*  (diff = curr_idx - start_idx) < psize */
 	while (m != NULL && (diff = m->pindex - m_start->pindex) < psize) {
@@ -4605,8 +5396,12 @@ pmap_enter_object(pmap_t pmap, vm_offset_t start, vm_offset_t end,
 		 *  psind  := pagesizes[0] = 4 KiB
 		 *            pagesizes[1] = 2 MiB
 		 */
-		if ((va & PDRMASK) == 0 && va + NBPDR <= end &&
-		    m->psind == 1 && pmap_ps_enabled(pmap) &&
+		if ((va & PDPMASK) == 0 && va + NBPDP <= end &&
+		    m->psind == 2 && pmap_ps1g_enabled(pmap) &&
+		    pmap_enter_pdpe(pmap, va, m, prot, &lock))
+			m = &m[NBPDP / PAGE_SIZE - 1];
+		else if ((va & PDRMASK) == 0 && va + NBPDR <= end &&
+		    m->psind >= 1 && pmap_ps_enabled(pmap) &&
 		    pmap_enter_pde(pmap, va, m, prot, &lock))
 			m = &m[NBPDR / PAGE_SIZE - 1];
 		else
@@ -4618,7 +5413,6 @@ pmap_enter_object(pmap_t pmap, vm_offset_t start, vm_offset_t end,
 	}
 	if (lock != NULL)
 		rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 }
 
@@ -4637,12 +5431,10 @@ pmap_enter_quick(pmap_t pmap, vm_offset_t va, vm_page_t m, vm_prot_t prot)
 	struct rwlock *lock;
 
 	lock = NULL;
-	rw_rlock(&pvh_global_lock);
 	PMAP_LOCK(pmap);
 	(void)pmap_enter_quick_locked(pmap, va, m, prot, NULL, &lock);
 	if (lock != NULL)
 		rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 }
 
@@ -4660,7 +5452,6 @@ pmap_enter_quick_locked(pmap_t pmap, vm_offset_t va, vm_page_t m,
 
 	/* Acquire valid bit */
 	PG_V = pmap_valid_bit(pmap);
-	rw_assert(&pvh_global_lock, RA_LOCKED);
 	PMAP_LOCK_ASSERT(pmap, MA_OWNED);
 
 	/*
@@ -4686,6 +5477,9 @@ pmap_enter_quick_locked(pmap_t pmap, vm_offset_t va, vm_page_t m,
 		/* Increment wire count if indexes match */
 		if (mpte && (mpte->pindex == ptepindex)) {
 			mpte->wire_count++;
+		} else if (pmap_pdpe_is_ps(pmap, va)) {
+			/* The va is already mapped by a 1GB page. */
+			return (NULL);
 		} else {
 			/*
 			 * Get the page directory entry.
@@ -4901,11 +5695,8 @@ pmap_unwire(pmap_t pmap, vm_offset_t sva, vm_offset_t eva)
 	pdp_entry_t *pdpe;
 	pd_entry_t *pde;
 	pt_entry_t *pte, PG_V;
-	boolean_t pv_lists_locked;
 
 	PG_V = pmap_valid_bit(pmap);
-	pv_lists_locked = FALSE;
-resume:
 	PMAP_LOCK(pmap);
 	for (; sva < eva; sva = va_next) {
 		pml4e = pmap_pml4e(pmap, sva);
@@ -4925,6 +5716,9 @@ resume:
 		va_next = (sva + NBPDR) & ~PDRMASK;
 		if (va_next < sva)
 			va_next = eva;
+		if ((*pdpe & PG_PS) != 0 &&
+		    !pmap_demote_pdpe(pmap, pdpe, sva))
+			continue;
 		pde = pmap_pdpe_to_pde(pdpe, sva);
 		if ((*pde & PG_V) == 0)
 			continue;
@@ -4943,15 +5737,6 @@ resume:
 				    PAGE_SIZE;
 				continue;
 			} else {
-				if (!pv_lists_locked) {
-					pv_lists_locked = TRUE;
-					if (!rw_try_rlock(&pvh_global_lock)) {
-						PMAP_UNLOCK(pmap);
-						rw_rlock(&pvh_global_lock);
-						/* Repeat sva. */
-						goto resume;
-					}
-				}
 				if (!pmap_demote_pde(pmap, pde, sva))
 					panic("pmap_unwire: demotion failed");
 			}
@@ -4975,8 +5760,6 @@ resume:
 			pmap->pm_stats.wired_count--;
 		}
 	}
-	if (pv_lists_locked)
-		rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 }
 
@@ -5017,7 +5800,6 @@ pmap_copy(pmap_t dst_pmap, pmap_t src_pmap, vm_offset_t dst_addr, vm_size_t len,
 		return;
 
 	lock = NULL;
-	rw_rlock(&pvh_global_lock);
 	if (dst_pmap < src_pmap) {
 		PMAP_LOCK(dst_pmap);
 		PMAP_LOCK(src_pmap);
@@ -5049,7 +5831,7 @@ pmap_copy(pmap_t dst_pmap, pmap_t src_pmap, vm_offset_t dst_addr, vm_size_t len,
 		}
 
 		pdpe = pmap_pml4e_to_pdpe(pml4e, addr);
-		if ((*pdpe & PG_V) == 0) {
+		if ((*pdpe & PG_V) == 0 || (*pdpe & PG_PS) != 0) {
 			va_next = (addr + NBPDP) & ~PDPMASK;
 			if (va_next < addr)
 				va_next = end_addr;
@@ -5144,7 +5926,6 @@ pmap_copy(pmap_t dst_pmap, pmap_t src_pmap, vm_offset_t dst_addr, vm_size_t len,
 out:
 	if (lock != NULL)
 		rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(src_pmap);
 	PMAP_UNLOCK(dst_pmap);
 }
@@ -5257,7 +6038,6 @@ pmap_page_exists_quick(pmap_t pmap, vm_page_t m)
 	KASSERT((m->oflags & VPO_UNMANAGED) == 0,
 	    ("pmap_page_exists_quick: page %p is not managed", m));
 	rv = FALSE;
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	rw_rlock(lock);
 	TAILQ_FOREACH(pv, &m->md.pv_list, pv_next) {
@@ -5282,7 +6062,6 @@ pmap_page_exists_quick(pmap_t pmap, vm_page_t m)
 		}
 	}
 	rw_runlock(lock);
-	rw_runlock(&pvh_global_lock);
 	return (rv);
 }
 
@@ -5304,7 +6083,6 @@ pmap_page_wired_mappings(vm_page_t m)
 
 	if ((m->oflags & VPO_UNMANAGED) != 0)
 		return (0);
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	rw_rlock(lock);
 restart:
@@ -5342,14 +6120,13 @@ restart:
 					goto restart;
 				}
 			}
-			pte = pmap_pde(pmap, pv->pv_va);
+			pte = pmap_pv_pde(pmap, pv->pv_va);
 			if ((*pte & PG_W) != 0)
 				count++;
 			PMAP_UNLOCK(pmap);
 		}
 	}
 	rw_runlock(lock);
-	rw_runlock(&pvh_global_lock);
 	return (count);
 }
 
@@ -5365,14 +6142,12 @@ pmap_page_is_mapped(vm_page_t m)
 
 	if ((m->oflags & VPO_UNMANAGED) != 0)
 		return (FALSE);
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	rw_rlock(lock);
 	rv = !TAILQ_EMPTY(&m->md.pv_list) ||
 	    ((m->flags & PG_FICTITIOUS) == 0 &&
 	    !TAILQ_EMPTY(&pa_to_pvh(VM_PAGE_TO_PHYS(m))->pv_list));
 	rw_runlock(lock);
-	rw_runlock(&pvh_global_lock);
 	return (rv);
 }
 
@@ -5435,7 +6210,6 @@ pmap_remove_pages(pmap_t pmap)
 	PG_RW = pmap_rw_bit(pmap);
 
 	SLIST_INIT(&free);
-	rw_rlock(&pvh_global_lock);
 	PMAP_LOCK(pmap);
 	TAILQ_FOREACH_SAFE(pc, &pmap->pm_pvchunk, pc_list, npc) {
 		allfree = 1;
@@ -5450,6 +6224,9 @@ pmap_remove_pages(pmap_t pmap)
 				inuse &= ~bitmask;
 
 				pte = pmap_pdpe(pmap, pv->pv_va);
+				if ((*pte & PG_PS) != 0)
+					(void)pmap_demote_pdpe(pmap, pte,
+					    pv->pv_va);
 				ptepde = *pte;
 				pte = pmap_pdpe_to_pde(pte, pv->pv_va);
 				tpte = *pte;
@@ -5568,7 +6345,6 @@ pmap_remove_pages(pmap_t pmap)
 	if (lock != NULL)
 		rw_wunlock(lock);
 	pmap_invalidate_all(pmap);
-	rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 	pmap_free_zero_pages(&free);
 }
@@ -5586,7 +6362,6 @@ pmap_page_test_mappings(vm_page_t m, boolean_t accessed, boolean_t modified)
 	boolean_t rv;
 
 	rv = FALSE;
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	rw_rlock(lock);
 restart:
@@ -5635,7 +6410,7 @@ restart:
 					goto restart;
 				}
 			}
-			pte = pmap_pde(pmap, pv->pv_va);
+			pte = pmap_pv_pde(pmap, pv->pv_va);
 			mask = 0;
 			if (modified) {
 				PG_M = pmap_modified_bit(pmap);
@@ -5655,7 +6430,6 @@ restart:
 	}
 out:
 	rw_runlock(lock);
-	rw_runlock(&pvh_global_lock);
 	return (rv);
 }
 
@@ -5699,6 +6473,10 @@ pmap_is_prefaultable(pmap_t pmap, vm_offset_t addr)
 	PG_V = pmap_valid_bit(pmap);
 	rv = FALSE;
 	PMAP_LOCK(pmap);
+	if (pmap_pdpe_is_ps(pmap, addr)) {
+		PMAP_UNLOCK(pmap);
+		return (rv);
+	}
 	pde = pmap_pde(pmap, addr);
 	if (pde != NULL && (*pde & (PG_PS | PG_V)) == PG_V) {
 		pte = pmap_pde_to_pte(pde, addr);
@@ -5733,6 +6511,7 @@ pmap_remove_write(vm_page_t m)
 	pmap_t pmap;
 	struct rwlock *lock;
 	pv_entry_t next_pv, pv;
+	pdp_entry_t *pdpe;
 	pd_entry_t *pde;
 	pt_entry_t oldpte, *pte, PG_M, PG_RW;
 	vm_offset_t va;
@@ -5749,7 +6528,6 @@ pmap_remove_write(vm_page_t m)
 	VM_OBJECT_ASSERT_WLOCKED(m->object);
 	if (!vm_page_xbusied(m) && (m->aflags & PGA_WRITEABLE) == 0)
 		return;
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	pvh = pa_to_pvh(VM_PAGE_TO_PHYS(m));
 retry_pv_loop:
@@ -5771,8 +6549,15 @@ retry_pv_loop:
 		}
 		PG_RW = pmap_rw_bit(pmap);
 		va = pv->pv_va;
-		pde = pmap_pde(pmap, va);
-		if ((*pde & PG_RW) != 0)
+		pdpe = pmap_pdpe(pmap, va);
+		if ((*pdpe & PG_PS) != 0) {
+			/*
+			 * Write protect the 1GB page mapping as a whole
+			 * rather than shattering it.
+			 */
+			if (pmap_protect_pdpe(pmap, pdpe))
+				pmap_invalidate_page(pmap, va);
+		} else if ((*(pde = pmap_pdpe_to_pde(pdpe, va)) & PG_RW) != 0)
 			(void)pmap_demote_pde_locked(pmap, pde, va, &lock);
 		KASSERT(lock == VM_PAGE_TO_PV_LIST_LOCK(m),
 		    ("inconsistent pv lock %p %p for page %p",
@@ -5816,7 +6601,7 @@ retry:
 	}
 	rw_wunlock(lock);
 	vm_page_aflag_clear(m, PGA_WRITEABLE);
-	rw_runlock(&pvh_global_lock);
+	pmap_delayed_invl_wait(m);
 }
 
 static __inline boolean_t
@@ -5867,6 +6652,7 @@ pmap_ts_referenced(vm_page_t m)
 	pv_entry_t pv, pvf;
 	pmap_t pmap;
 	struct rwlock *lock;
+	pdp_entry_t *pdpe;
 	pd_entry_t oldpde, *pde;
 	pt_entry_t *pte, PG_A;
 	vm_offset_t va;
@@ -5882,7 +6668,6 @@ pmap_ts_referenced(vm_page_t m)
 	pa = VM_PAGE_TO_PHYS(m);
 	lock = PHYS_TO_PV_LIST_LOCK(pa);
 	pvh = pa_to_pvh(pa);
-	rw_rlock(&pvh_global_lock);
 	rw_wlock(lock);
 retry:
 	not_cleared = 0;
@@ -5906,7 +6691,29 @@ retry:
 		}
 		PG_A = pmap_accessed_bit(pmap);
 		va = pv->pv_va;
-		pde = pmap_pde(pmap, pv->pv_va);
+		pdpe = pmap_pdpe(pmap, va);
+		if ((*pdpe & PG_PS) != 0) {
+			/*
+			 * The reference bit of a 1GB page mapping is shared
+			 * by NBPDP / PAGE_SIZE 4KB pages.  Select the one on
+			 * which testing it clears it as below, and leave a
+			 * wired mapping's bit set.  Only pmaps without
+			 * accessed bit emulation have 1GB page mappings, so
+			 * the bit can simply be cleared without demotion.
+			 */
+			if ((*pdpe & PG_A) != 0) {
+				if ((((pa >> PAGE_SHIFT) ^ (va >> PDPSHIFT) ^
+				    (uintptr_t)pmap) & (NBPDP / PAGE_SIZE -
+				    1)) == 0 && (*pdpe & PG_W) == 0) {
+					atomic_clear_long(pdpe, PG_A);
+					pmap_invalidate_page(pmap, va);
+					cleared++;
+				} else
+					not_cleared++;
+			}
+			goto next_superpage;
+		}
+		pde = pmap_pdpe_to_pde(pdpe, va);
 		oldpde = *pde;
 		if ((*pde & PG_A) != 0) {
 			/*
@@ -5971,6 +6778,7 @@ retry:
 			} else
 				not_cleared++;
 		}
+next_superpage:
 		PMAP_UNLOCK(pmap);
 		/* Rotate the PV list if it has more than one entry. */
 		if (pv != NULL && TAILQ_NEXT(pv, pv_next) != NULL) {
@@ -6042,7 +6850,6 @@ small_mappings:
 	    not_cleared < PMAP_TS_REFERENCED_MAX);
 out:
 	rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 	pmap_free_zero_pages(&free);
 	return (cleared + not_cleared);
 }
@@ -6062,7 +6869,7 @@ pmap_advise(pmap_t pmap, vm_offset_t sva, vm_offset_t eva, int advice)
 	pt_entry_t *pte, PG_A, PG_G, PG_M, PG_RW, PG_V;
 	vm_offset_t va_next;
 	vm_page_t m;
-	boolean_t anychanged, pv_lists_locked;
+	boolean_t anychanged;
 
 	if (advice != MADV_DONTNEED && advice != MADV_FREE)
 		return;
@@ -6082,9 +6889,8 @@ pmap_advise(pmap_t pmap, vm_offset_t sva, vm_offset_t eva, int advice)
 	PG_V = pmap_valid_bit(pmap);
 	PG_RW = pmap_rw_bit(pmap);
 
-	pv_lists_locked = FALSE;
-resume:
 	anychanged = FALSE;
+	pmap_delayed_invl_started();
 	PMAP_LOCK(pmap);
 	for (; sva < eva; sva = va_next) {
 		pml4e = pmap_pml4e(pmap, sva);
@@ -6104,6 +6910,9 @@ resume:
 		va_next = (sva + NBPDR) & ~PDRMASK;
 		if (va_next < sva)
 			va_next = eva;
+		if ((*pdpe & PG_PS) != 0 &&
+		    !pmap_demote_pdpe(pmap, pdpe, sva))
+			continue;
 		pde = pmap_pdpe_to_pde(pdpe, sva);
 		oldpde = *pde;
 		if ((oldpde & PG_V) == 0)
@@ -6111,16 +6920,6 @@ resume:
 		else if ((oldpde & PG_PS) != 0) {
 			if ((oldpde & PG_MANAGED) == 0)
 				continue;
-			if (!pv_lists_locked) {
-				pv_lists_locked = TRUE;
-				if (!rw_try_rlock(&pvh_global_lock)) {
-					if (anychanged)
-						pmap_invalidate_all(pmap);
-					PMAP_UNLOCK(pmap);
-					rw_rlock(&pvh_global_lock);
-					goto resume;
-				}
-			}
 			lock = NULL;
 			if (!pmap_demote_pde_locked(pmap, pde, sva, &lock)) {
 				if (lock != NULL)
@@ -6180,9 +6979,8 @@ resume:
 	}
 	if (anychanged)
 		pmap_invalidate_all(pmap);
-	if (pv_lists_locked)
-		rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
+	pmap_delayed_invl_finished();
 }
 
 /*
@@ -6194,6 +6992,7 @@ pmap_clear_modify(vm_page_t m)
 	struct md_page *pvh;
 	pmap_t pmap;
 	pv_entry_t next_pv, pv;
+	pdp_entry_t *pdpe;
 	pd_entry_t oldpde, *pde;
 	pt_entry_t oldpte, *pte, PG_M, PG_RW, PG_V;
 	struct rwlock *lock;
@@ -6214,7 +7013,6 @@ pmap_clear_modify(vm_page_t m)
 	if ((m->aflags & PGA_WRITEABLE) == 0)
 		return;
 	pvh = pa_to_pvh(VM_PAGE_TO_PHYS(m));
-	rw_rlock(&pvh_global_lock);
 	lock = VM_PAGE_TO_PV_LIST_LOCK(m);
 	rw_wlock(lock);
 restart:
@@ -6236,7 +7034,21 @@ restart:
 		PG_V = pmap_valid_bit(pmap);
 		PG_RW = pmap_rw_bit(pmap);
 		va = pv->pv_va;
-		pde = pmap_pde(pmap, va);
+		pdpe = pmap_pdpe(pmap, va);
+		if ((*pdpe & PG_PS) != 0) {
+			/*
+			 * Write protect an unwired 1GB page mapping as a
+			 * whole, dirtying its pages if it was modified, so
+			 * that a subsequent write access faults.  The caller
+			 * then cleans this page.
+			 */
+			if ((*pdpe & PG_W) == 0 &&
+			    pmap_protect_pdpe(pmap, pdpe))
+				pmap_invalidate_page(pmap, va);
+			PMAP_UNLOCK(pmap);
+			continue;
+		}
+		pde = pmap_pdpe_to_pde(pdpe, va);
 		oldpde = *pde;
 		if ((oldpde & PG_RW) != 0) {
 			if (pmap_demote_pde_locked(pmap, pde, va, &lock)) {
@@ -6290,7 +7102,6 @@ small_mappings:
 		PMAP_UNLOCK(pmap);
 	}
 	rw_wunlock(lock);
-	rw_runlock(&pvh_global_lock);
 }
 
 /*
@@ -6461,8 +7272,17 @@ pmap_demote_pdpe(pmap_t pmap, pdp_entry_t *pdpe, vm_offset_t va)
 	oldpdpe = *pdpe;
 	KASSERT((oldpdpe & (PG_PS | PG_V)) == (PG_PS | PG_V),
 	    ("pmap_demote_pdpe: oldpdpe is missing PG_PS and/or PG_V"));
-	if ((mpde = vm_page_alloc(NULL, va >> PDPSHIFT, VM_ALLOC_INTERRUPT |
-	    VM_ALLOC_NOOBJ | VM_ALLOC_WIRED)) == NULL) {
+	if (va < VM_MAXUSER_ADDRESS) {
+		/*
+		 * A 1GB user page mapping always has a saved page directory
+		 * page, so its demotion cannot fail.
+		 */
+		mpde = vm_radix_lookup(&pmap->pm_root, pmap_pdpe_pindex(va));
+		KASSERT(mpde != NULL,
+		    ("pmap_demote_pdpe: missing page directory page"));
+		pmap_remove_pt_page(pmap, mpde);
+	} else if ((mpde = vm_page_alloc(NULL, va >> PDPSHIFT,
+	    VM_ALLOC_INTERRUPT | VM_ALLOC_NOOBJ | VM_ALLOC_WIRED)) == NULL) {
 		CTR2(KTR_PMAP, "pmap_demote_pdpe: failure for va %#lx"
 		    " in pmap %p", va, pmap);
 		return (FALSE);
@@ -6490,9 +7310,13 @@ pmap_demote_pdpe(pmap_t pmap, pdp_entry_t *pdpe, vm_offset_t va)
 	*pdpe = newpdpe;
 
 	/*
-	 * Invalidate a stale recursive mapping of the page directory page.
+	 * Invalidate the 1GB page mapping or, for the kernel, a stale
+	 * recursive mapping of the page directory page.
 	 */
-	pmap_invalidate_page(pmap, (vm_offset_t)vtopde(va));
+	if (va < VM_MAXUSER_ADDRESS)
+		pmap_invalidate_page(pmap, va & ~PDPMASK);
+	else
+		pmap_invalidate_page(pmap, (vm_offset_t)vtopde(va));
 
 	pmap_pdpe_demotions++;
 	CTR2(KTR_PMAP, "pmap_demote_pdpe: success for va %#lx"
@@ -6806,6 +7630,7 @@ pmap_demote_DMAP(vm_paddr_t base, vm_size_t len, boolean_t invalidate)
 int
 pmap_mincore(pmap_t pmap, vm_offset_t addr, vm_paddr_t *locked_pa)
 {
+	pdp_entry_t *pdpe;
 	pd_entry_t *pdep;
 	pt_entry_t pte, PG_A, PG_M, PG_RW, PG_V;
 	vm_paddr_t pa;
@@ -6818,8 +7643,13 @@ pmap_mincore(pmap_t pmap, vm_offset_t addr, vm_paddr_t *locked_pa)
 
 	PMAP_LOCK(pmap);
 retry:
-	pdep = pmap_pde(pmap, addr);
-	if (pdep != NULL && (*pdep & PG_V)) {
+	pdpe = pmap_pdpe(pmap, addr);
+	if (pdpe != NULL && (*pdpe & (PG_PS | PG_V)) == (PG_PS | PG_V)) {
+		pte = *pdpe;
+		/* Compute the physical address of the 4KB page. */
+		pa = ((*pdpe & PG_PS_FRAME) | (addr & PDPMASK)) & PG_FRAME;
+		val = MINCORE_SUPER;
+	} else if ((pdep = pmap_pde(pmap, addr)) != NULL && (*pdep & PG_V)) {
 		if (*pdep & PG_PS) {
 			pte = *pdep;
 			/* Compute the physical address of the 4KB page. */
@@ -6956,6 +7786,22 @@ pmap_align_superpage(vm_object_t object, vm_ooffset_t offset,
 		return;
 	if (object != NULL && (object->flags & OBJ_COLORED) != 0)
 		offset += ptoa(object->pg_color);
+
+	/*
+	 * Prefer the alignment of a 1GB page if the mapping could contain
+	 * one.
+	 */
+	if (pagesizes[2] != 0 && size >= NBPDP) {
+		superpage_offset = offset & PDPMASK;
+		if (size - ((NBPDP - superpage_offset) & PDPMASK) >= NBPDP) {
+			if ((*addr & PDPMASK) < superpage_offset)
+				*addr = (*addr & ~PDPMASK) + superpage_offset;
+			else if ((*addr & PDPMASK) > superpage_offset)
+				*addr = ((*addr + PDPMASK) & ~PDPMASK) +
+				    superpage_offset;
+			return;
+		}
+	}
 	superpage_offset = offset & PDRMASK;
 	if (size - ((NBPDR - superpage_offset) & PDRMASK) < NBPDR ||
 	    (*addr & PDRMASK) == superpage_offset)
@@ -6992,7 +7838,6 @@ pmap_emulate_accessed_dirty(pmap_t pmap, vm_offset_t va, int ftype)
 	vm_page_t m, mpte;
 	pd_entry_t *pde;
 	pt_entry_t *pte, PG_A, PG_M, PG_RW, PG_V;
-	boolean_t pv_lists_locked;
 
 	KASSERT(ftype == VM_PROT_READ || ftype == VM_PROT_WRITE,
 	    ("pmap_emulate_accessed_dirty: invalid fault type %d", ftype));
@@ -7007,8 +7852,6 @@ pmap_emulate_accessed_dirty(pmap_t pmap, vm_offset_t va, int ftype)
 
 	rv = -1;
 	lock = NULL;
-	pv_lists_locked = FALSE;
-retry:
 	PMAP_LOCK(pmap);
 
 	pde = pmap_pde(pmap, va);
@@ -7058,15 +7901,7 @@ retry:
 	if ((mpte == NULL || mpte->wire_count == NPTEPG) &&
 	    pmap_ps_enabled(pmap) &&
 	    (m->flags & PG_FICTITIOUS) == 0 &&
-	    vm_reserv_level_iffullpop(m) == 0) {
-		if (!pv_lists_locked) {
-			pv_lists_locked = TRUE;
-			if (!rw_try_rlock(&pvh_global_lock)) {
-				PMAP_UNLOCK(pmap);
-				rw_rlock(&pvh_global_lock);
-				goto retry;
-			}
-		}
+	    vm_reserv_level_iffullpop(m) >= 0) {
 		pmap_promote_pde(pmap, pde, va, &lock);
 #ifdef INVARIANTS
 		atomic_add_long(&ad_emulation_superpage_promotions, 1);
@@ -7082,8 +7917,6 @@ retry:
 done:
 	if (lock != NULL)
 		rw_wunlock(lock);
-	if (pv_lists_locked)
-		rw_runlock(&pvh_global_lock);
 	PMAP_UNLOCK(pmap);
 	return (rv);
 }
@@ -41,7 +41,8 @@ __FBSDID("$FreeBSD: head/sys/amd64/amd64/uma_machdep.c 280957 2015-04-01 12:42:2
 #include <machine/vmparam.h>
 
 void *
-uma_small_alloc(uma_zone_t zone, vm_size_t bytes, u_int8_t *flags, int wait)
+uma_small_alloc(uma_zone_t zone, vm_size_t bytes, int domain, u_int8_t *flags,
+    int wait)
 {
 	vm_page_t m;
 	vm_paddr_t pa;
@@ -51,7 +52,7 @@ uma_small_alloc(uma_zone_t zone, vm_size_t bytes, u_int8_t *flags, int wait)
 	*flags = UMA_SLAB_PRIV;
 	pflags = malloc2vm_flags(wait) | VM_ALLOC_NOOBJ | VM_ALLOC_WIRED;
 	for (;;) {
-		m = vm_page_alloc(NULL, 0, pflags);
+		m = vm_page_alloc_domain(NULL, 0, domain, pflags);
 		if (m == NULL) {
 			if (wait & M_NOWAIT)
 				return (NULL);
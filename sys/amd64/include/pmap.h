@@ -119,6 +119,13 @@
 #define	PG_PTE_PROMOTE	(PG_NX | PG_MANAGED | PG_W | PG_G | PG_PTE_CACHE | \
 	    PG_M | PG_A | PG_U | PG_RW | PG_V)
 
+/*
+ * Promotion to a 1GB (PDPE) page mapping requires that the corresponding 2MB
+ * (PDE) page mappings have identical settings for the following fields:
+ */
+#define	PG_PDE_PROMOTE	(PG_NX | PG_MANAGED | PG_W | PG_G | PG_PDE_CACHE | \
+	    PG_M | PG_A | PG_U | PG_RW | PG_V)
+
 /*
  * Page Protection Exception bits
  */
@@ -403,6 +410,9 @@ void	pmap_unmapdev(vm_offset_t, vm_size_t);
 void	pmap_invalidate_page(pmap_t, vm_offset_t);
 void	pmap_invalidate_range(pmap_t, vm_offset_t, vm_offset_t);
 void	pmap_invalidate_all(pmap_t);
+#define	PMAP_HAS_INVL_BATCH
+void	pmap_invl_batch_begin(pmap_t);
+void	pmap_invl_batch_end(pmap_t);
 void	pmap_invalidate_cache(void);
 void	pmap_invalidate_cache_pages(vm_page_t *pages, int count);
 void	pmap_invalidate_cache_range(vm_offset_t sva, vm_offset_t eva,
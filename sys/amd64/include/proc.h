@@ -40,6 +40,27 @@ struct proc_ldt {
 	int     ldt_refcnt;
 };
 
+/*
+ * List of locks
+ *	k - only accessed by curthread
+ *	pp - pmap.c:invl_gen_mtx
+ */
+
+struct pmap_invl_gen {
+	u_long gen;			/* (k) */
+	LIST_ENTRY(pmap_invl_gen) link;	/* (pp) */
+};
+
+/*
+ * TLB shootdowns deferred by pmap_invl_batch_begin().
+ */
+struct pmap_invl_batch {
+	struct pmap	*pmap;		/* (k) batched pmap or NULL */
+	vm_offset_t	sva;		/* (k) accumulated range */
+	vm_offset_t	eva;		/* (k) */
+	SLIST_HEAD(, vm_page) free;	/* (k) page table pages to free */
+};
+
 /*
  * Machine-dependent part of the proc structure for AMD64.
  */
@@ -47,6 +68,8 @@ struct mdthread {
 	int	md_spinlock_count;	/* (k) */
 	register_t md_saved_flags;	/* (k) */
 	register_t md_spurflt_addr;	/* (k) Spurious page fault address. */
+	struct pmap_invl_gen md_invl_gen;
+	struct pmap_invl_batch md_invl_batch;
 };
 
 struct mdproc {
@@ -128,10 +128,10 @@
 #define	VM_NFREEORDER		13
 
 /*
- * Enable superpage reservations: 1 level.
+ * Enable superpage reservations: 2 levels.
  */
 #ifndef	VM_NRESERVLEVEL
-#define	VM_NRESERVLEVEL		1
+#define	VM_NRESERVLEVEL		2
 #endif
 
 /*
@@ -141,6 +141,13 @@
 #define	VM_LEVEL_0_ORDER	9
 #endif
 
+/*
+ * Level 1 reservations consist of 512 level 0 reservations, i.e., 1GB.
+ */
+#ifndef	VM_LEVEL_1_ORDER
+#define	VM_LEVEL_1_ORDER	9
+#endif
+
 #ifdef	SMP
 #define	PA_LOCK_COUNT	256
 #endif
@@ -70,6 +70,12 @@ __FBSDID("$FreeBSD: head/sys/kern/kern_event.c 288145 2015-09-23 12:45:08Z mjg $
 #include <sys/ktrace.h>
 #endif
 
+#include <vm/vm.h>
+#include <vm/vm_param.h>
+#include <vm/vm_extern.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_page.h>
 #include <vm/uma.h>
 
 static MALLOC_DEFINE(M_KQUEUE, "kqueue", "memory for kqueue system");
@@ -96,7 +102,7 @@ TASKQUEUE_DEFINE_THREAD(kqueue);
 static int	kevent_copyout(void *arg, struct kevent *kevp, int count);
 static int	kevent_copyin(void *arg, struct kevent *kevp, int count);
 static int	kqueue_register(struct kqueue *kq, struct kevent *kev,
-		    struct thread *td, int waitok);
+		    struct thread *td, int waitok, struct knote **tknp);
 static int	kqueue_acquire(struct file *fp, struct kqueue **kqp);
 static void	kqueue_release(struct kqueue *kq, int locked);
 static void	kqueue_destroy(struct kqueue *kq);
@@ -111,6 +117,14 @@ static int	kqueue_scan(struct kqueue *kq, int maxevents,
 static void 	kqueue_wakeup(struct kqueue *kq);
 static struct filterops *kqueue_fo_find(int filt);
 static void	kqueue_fo_release(int filt);
+static struct knote *kqueue_knote_find(struct kqueue *kq,
+		    struct filterops *fops, struct kevent *kev);
+static int	kqueue_ring_post(struct kqueue *kq, struct knote *kn);
+static int	kqueue_ring_pending(struct kqueue *kq);
+static int	kqueue_ring_setup(struct kqueue *kq,
+		    struct kevent_ring_args *kra, struct thread *td);
+static void	kqueue_ring_unmap(struct kevent_ring *kr, vm_page_t *ma,
+		    int npages);
 
 static fo_ioctl_t	kqueue_ioctl;
 static fo_poll_t	kqueue_poll;
@@ -192,6 +206,9 @@ static atomic_uint	kq_ncallouts = ATOMIC_VAR_INIT(0);
 static unsigned int 	kq_calloutmax = 4 * 1024;
 SYSCTL_UINT(_kern, OID_AUTO, kq_calloutmax, CTLFLAG_RW,
     &kq_calloutmax, 0, "Maximum number of callouts allocated for kqueue");
+static u_int	kq_ringmaxpages = 64;
+SYSCTL_UINT(_kern, OID_AUTO, kq_ringmaxpages, CTLFLAG_RW,
+    &kq_ringmaxpages, 0, "Maximum size in pages of a kqueue completion ring");
 
 /* XXX - ensure not KN_INFLUX?? */
 #define KNOTE_ACTIVATE(kn, islock) do { 				\
@@ -276,7 +293,10 @@ extern struct filterops sig_filtops;
 extern struct filterops fs_filtops;
 
 /*
- * Table for for all system-defined filters.
+ * Table for for all system-defined filters.  Lookups are lock-free: the
+ * built-in filters are never unregistered (for_nolock), and the others
+ * are pinned by an atomic reference count.  filterops_lock only
+ * serializes kqueue_add_filteropts() and kqueue_del_filteropts().
  */
 static struct mtx	filterops_lock;
 MTX_SYSINIT(kqueue_filterops, &filterops_lock, "protect sysfilt_ops",
@@ -513,7 +533,7 @@ knote_fork(struct knlist *list, int pid)
 		kev.fflags = kn->kn_sfflags;
 		kev.data = kn->kn_id;		/* parent */
 		kev.udata = kn->kn_kevent.udata;/* preserve udata */
-		error = kqueue_register(kq, &kev, NULL, 0);
+		error = kqueue_register(kq, &kev, NULL, 0, NULL);
 		if (error)
 			kn->kn_fflags |= NOTE_TRACKERR;
 		if (kn->kn_fop->f_event(kn, NOTE_FORK))
@@ -911,45 +931,365 @@ kern_kevent(struct thread *td, int fd, int nchanges, int nevents,
 	return (error);
 }
 
+/*
+ * Returns true if the change only modifies an existing knote, so that it
+ * may be applied by kqueue_modify_batch().
+ */
+static __inline int
+kqueue_batchable(struct kevent *kev)
+{
+
+	return (kev->filter != 0 && (kev->flags & (EV_ADD | EV_DELETE |
+	    EV_FORCEONESHOT | EV_RECEIPT)) == 0);
+}
+
+/*
+ * Apply a run of changes to existing knotes.  The knotes of the whole run
+ * are looked up and put in flux under a single acquisition of the kq lock.
+ * Each is then updated and polled under its knlist lock, and the run is
+ * published under a second acquisition.  KN_SCAN stays set in between, so
+ * that knote() activates a knote which fires once its knlist lock has
+ * been dropped.  This keeps the re-arming of EV_DISPATCH knotes to two
+ * trips through the kq lock per run.  Returns a mask of the changes which
+ * could not be applied here, because their knote is missing or already in
+ * flux or the descriptor is a kqueue.  Those must be passed to
+ * kqueue_register().
+ */
+static int
+kqueue_modify_batch(struct kqueue *kq, struct kevent *changes, int n,
+    struct thread *td)
+{
+	struct filterops *fops[KQ_NEVENTS];
+	struct knote *kns[KQ_NEVENTS];
+	struct kevent *kev;
+	struct knote *kn;
+	struct file *fp;
+	cap_rights_t rights;
+	int events, fallback, i;
+
+	KASSERT(n <= KQ_NEVENTS, ("count (%d) > KQ_NEVENTS", n));
+	fallback = 0;
+	for (i = 0; i < n; i++) {
+		kev = &changes[i];
+		kns[i] = NULL;
+		fops[i] = kqueue_fo_find(kev->filter);
+		if (fops[i] == NULL) {
+			fallback |= 1 << i;
+			continue;
+		}
+		if (!fops[i]->f_isfd)
+			continue;
+		if (fget(td, kev->ident, cap_rights_init(&rights, CAP_EVENT),
+		    &fp) != 0) {
+			fallback |= 1 << i;
+			continue;
+		}
+		if (fp->f_type == DTYPE_KQUEUE)
+			fallback |= 1 << i;
+		fdrop(fp, td);
+	}
+
+	KQ_LOCK(kq);
+	for (i = 0; i < n; i++) {
+		if ((fallback & (1 << i)) != 0)
+			continue;
+		kn = kqueue_knote_find(kq, fops[i], &changes[i]);
+		if (kn == NULL || (kn->kn_status & KN_INFLUX) != 0) {
+			fallback |= 1 << i;
+			continue;
+		}
+		kn->kn_status |= KN_INFLUX | KN_SCAN;
+		kns[i] = kn;
+	}
+	KQ_UNLOCK(kq);
+
+	events = 0;
+	for (i = 0; i < n; i++) {
+		if ((kn = kns[i]) == NULL)
+			continue;
+		kev = &changes[i];
+		KN_LIST_LOCK(kn);
+		kn->kn_kevent.udata = kev->udata;
+		if (!fops[i]->f_isfd && fops[i]->f_touch != NULL) {
+			fops[i]->f_touch(kn, kev, EVENT_REGISTER);
+		} else {
+			kn->kn_sfflags = kev->fflags;
+			kn->kn_sdata = kev->data;
+		}
+		if ((kev->flags & EV_DISABLE) &&
+		    ((kn->kn_status & KN_DISABLED) == 0))
+			kn->kn_status |= KN_DISABLED;
+		if ((kn->kn_status & KN_DISABLED) == 0 &&
+		    kn->kn_fop->f_event(kn, 0))
+			events |= 1 << i;
+		KN_LIST_UNLOCK(kn);
+	}
+
+	KQ_LOCK(kq);
+	for (i = 0; i < n; i++) {
+		if ((kn = kns[i]) == NULL)
+			continue;
+		if ((events & (1 << i)) != 0)
+			KNOTE_ACTIVATE(kn, 1);
+		kn->kn_status &= ~(KN_INFLUX | KN_SCAN);
+		if ((changes[i].flags & EV_ENABLE) &&
+		    (kn->kn_status & KN_DISABLED)) {
+			kn->kn_status &= ~KN_DISABLED;
+			if ((kn->kn_status & KN_ACTIVE) &&
+			    ((kn->kn_status & KN_QUEUED) == 0))
+				knote_enqueue(kn);
+		}
+	}
+	KQ_UNLOCK_FLUX(kq);
+
+	for (i = 0; i < n; i++)
+		if (fops[i] != NULL)
+			kqueue_fo_release(changes[i].filter);
+	return (fallback);
+}
+
+/*
+ * Preallocate knotes for the EV_ADD changes among the n changes.
+ */
+static int
+kqueue_spare_alloc(struct knote **spare, struct kevent *changes, int n)
+{
+	int i, nadd;
+
+	nadd = 0;
+	for (i = 0; i < n; i++)
+		if (changes[i].filter != 0 && (changes[i].flags & EV_ADD) != 0)
+			nadd++;
+	return (uma_zalloc_bulk(knote_zone, (void **)spare, nadd, NULL,
+	    M_WAITOK | M_ZERO));
+}
+
 static int
 kqueue_kevent(struct kqueue *kq, struct thread *td, int nchanges, int nevents,
     struct kevent_copyops *k_ops, const struct timespec *timeout)
 {
 	struct kevent keva[KQ_NEVENTS];
+	struct knote *spare[KQ_NEVENTS];
 	struct kevent *kevp, *changes;
-	int i, n, nerrors, error;
+	struct knote *tkn;
+	int fallback, i, j, k, n, nerrors, nspare, error;
 
 	nerrors = 0;
+	nspare = 0;
 	while (nchanges > 0) {
 		n = nchanges > KQ_NEVENTS ? KQ_NEVENTS : nchanges;
 		error = k_ops->k_copyin(k_ops->arg, keva, n);
 		if (error)
-			return (error);
+			goto out;
 		changes = keva;
-		for (i = 0; i < n; i++) {
-			kevp = &changes[i];
-			if (!kevp->filter)
-				continue;
-			kevp->flags &= ~EV_SYSFLAGS;
-			error = kqueue_register(kq, kevp, td, 1);
-			if (error || (kevp->flags & EV_RECEIPT)) {
-				if (nevents == 0)
-					return (error);
-				kevp->flags = EV_ERROR;
-				kevp->data = error;
-				(void)k_ops->k_copyout(k_ops->arg, kevp, 1);
-				nevents--;
-				nerrors++;
+		for (i = 0; i < n; i++)
+			changes[i].flags &= ~EV_SYSFLAGS;
+		for (i = 0; i < n; i = j) {
+			/*
+			 * Runs of changes to existing knotes are applied
+			 * in a batch.  Anything else, and whatever the
+			 * batch could not handle, goes through
+			 * kqueue_register() one at a time, in order.
+			 */
+			for (j = i; j < n && kqueue_batchable(&changes[j]); j++)
+				;
+			if (j > i)
+				fallback = kqueue_modify_batch(kq, &changes[i],
+				    j - i, td);
+			else {
+				fallback = 1;
+				j = i + 1;
+			}
+			for (k = i; fallback != 0; k++, fallback >>= 1) {
+				if ((fallback & 1) == 0)
+					continue;
+				kevp = &changes[k];
+				if (!kevp->filter)
+					continue;
+				/*
+				 * Allocate the knotes for the additions in
+				 * the rest of the chunk at once.
+				 */
+				if ((kevp->flags & EV_ADD) != 0 && nspare == 0)
+					nspare = kqueue_spare_alloc(spare,
+					    &changes[k], n - k);
+				tkn = nspare > 0 ? spare[--nspare] : NULL;
+				error = kqueue_register(kq, kevp, td, 1, &tkn);
+				if (tkn != NULL)
+					spare[nspare++] = tkn;
+				if (error || (kevp->flags & EV_RECEIPT)) {
+					if (nevents == 0)
+						goto out;
+					kevp->flags = EV_ERROR;
+					kevp->data = error;
+					(void)k_ops->k_copyout(k_ops->arg,
+					    kevp, 1);
+					nevents--;
+					nerrors++;
+				}
 			}
 		}
 		nchanges -= n;
 	}
 	if (nerrors) {
 		td->td_retval[0] = nerrors;
+		error = 0;
+		goto out;
+	}
+
+	error = kqueue_scan(kq, nevents, k_ops, timeout, keva, td);
+out:
+	if (nspare > 0)
+		uma_zfree_bulk(knote_zone, (void **)spare, nspare, NULL);
+	return (error);
+}
+
+/*
+ * Store an activated knote in the completion ring, as kqueue_scan()
+ * would have returned it, instead of queueing it for kevent(2).  Only
+ * knotes that a scan leaves unqueued after delivery are posted: EV_CLEAR
+ * or EV_DISPATCH ones that need neither dropping nor f_touch.  A knote
+ * in flux is being registered or scanned and is queued as usual, as is
+ * everything when the ring is full.  Returns 1 if the knote was posted.
+ */
+static int
+kqueue_ring_post(struct kqueue *kq, struct knote *kn)
+{
+	struct kevent_ring *kr;
+	u_int used;
+
+	KQ_OWNED(kq);
+	kr = kq->kq_ring;
+	if (kr == NULL || (kn->kn_flags & (EV_CLEAR | EV_DISPATCH)) == 0 ||
+	    (kn->kn_flags & (EV_ONESHOT | EV_DROP)) != 0 ||
+	    (kn->kn_status & KN_INFLUX) != 0 ||
+	    (!kn->kn_fop->f_isfd && kn->kn_fop->f_touch != NULL))
+		return (0);
+
+	/* The head belongs to the process and is not trusted. */
+	used = kq->kq_ringtail - atomic_load_acq_int(&kr->kr_head);
+	if (used > kq->kq_ringmask)
 		return (0);
+	KEVENT_RING_EVENTS(kr)[kq->kq_ringtail & kq->kq_ringmask] =
+	    kn->kn_kevent;
+	kq->kq_ringtail++;
+	atomic_store_rel_int(&kr->kr_tail, kq->kq_ringtail);
+
+	if (kn->kn_flags & EV_CLEAR) {
+		kn->kn_data = 0;
+		kn->kn_fflags = 0;
 	}
+	if (kn->kn_flags & EV_DISPATCH)
+		kn->kn_status |= KN_DISABLED;
+	kn->kn_status &= ~KN_ACTIVE;
+	return (1);
+}
 
-	return (kqueue_scan(kq, nevents, k_ops, timeout, keva, td));
+/*
+ * Return non-zero if the process has not consumed all of the ring.
+ */
+static int
+kqueue_ring_pending(struct kqueue *kq)
+{
+
+	KQ_OWNED(kq);
+	return (kq->kq_ring != NULL &&
+	    kq->kq_ringtail != atomic_load_acq_int(&kq->kq_ring->kr_head));
+}
+
+/*
+ * Wire the pages of the completion ring described by kra and map them
+ * into the kernel, so that events can be posted from knote activation,
+ * in whatever context that happens, without copyout().
+ */
+static int
+kqueue_ring_setup(struct kqueue *kq, struct kevent_ring_args *kra,
+    struct thread *td)
+{
+	struct kevent_ring *kr;
+	vm_map_t map;
+	vm_page_t *ma;
+	vm_offset_t addr, kva;
+	size_t len;
+	u_int nentries;
+	int i, npages;
+
+	addr = (vm_offset_t)kra->kra_ring;
+	if ((addr & PAGE_MASK) != 0 ||
+	    kra->kra_len < sizeof(*kr) + sizeof(struct kevent) ||
+	    kra->kra_len > ptoa(kq_ringmaxpages))
+		return (EINVAL);
+	if (kq->kq_ring != NULL)
+		return (EBUSY);
+	nentries = (kra->kra_len - sizeof(*kr)) / sizeof(struct kevent);
+	nentries = 1 << (fls(nentries) - 1);
+	len = sizeof(*kr) + nentries * sizeof(struct kevent);
+	npages = atop(round_page(len));
+
+	/*
+	 * Faulting for write gives the map its own copy of each page, and
+	 * sharing the range on fork(2) keeps it from being copied on write
+	 * later, so the process always sees the pages the kernel stores to.
+	 */
+	map = &td->td_proc->p_vmspace->vm_map;
+	ma = malloc(npages * sizeof(*ma), M_KQUEUE, M_WAITOK);
+	if (vm_fault_quick_hold_pages(map, addr, len,
+	    VM_PROT_READ | VM_PROT_WRITE, ma, npages) < 0) {
+		free(ma, M_KQUEUE);
+		return (EFAULT);
+	}
+	kva = kva_alloc(ptoa(npages));
+	if (kva == 0) {
+		vm_page_unhold_pages(ma, npages);
+		free(ma, M_KQUEUE);
+		return (ENOMEM);
+	}
+	for (i = 0; i < npages; i++) {
+		vm_page_lock(ma[i]);
+		vm_page_wire(ma[i]);
+		vm_page_unhold(ma[i]);
+		vm_page_unlock(ma[i]);
+	}
+	pmap_qenter(kva, ma, npages);
+	kr = (struct kevent_ring *)kva;
+	(void)vm_map_inherit(map, addr, addr + ptoa(npages),
+	    VM_INHERIT_SHARE);
+
+	KQ_LOCK(kq);
+	if (kq->kq_ring != NULL) {
+		KQ_UNLOCK(kq);
+		kqueue_ring_unmap(kr, ma, npages);
+		return (EBUSY);
+	}
+	kr->kr_head = 0;
+	kr->kr_tail = 0;
+	kr->kr_nentries = nentries;
+	kq->kq_ring = kr;
+	kq->kq_ringma = ma;
+	kq->kq_ringnpages = npages;
+	kq->kq_ringmask = nentries - 1;
+	kq->kq_ringtail = 0;
+	KQ_UNLOCK(kq);
+	return (0);
+}
+
+static void
+kqueue_ring_unmap(struct kevent_ring *kr, vm_page_t *ma, int npages)
+{
+	vm_page_t m;
+	int i;
+
+	pmap_qremove((vm_offset_t)kr, npages);
+	kva_free((vm_offset_t)kr, ptoa(npages));
+	for (i = 0; i < npages; i++) {
+		m = ma[i];
+		vm_page_lock(m);
+		/* The process may have unmapped the ring meanwhile. */
+		if (vm_page_unwire(m, PQ_ACTIVE) && m->object == NULL)
+			vm_page_free(m);
+		vm_page_unlock(m);
+	}
+	free(ma, M_KQUEUE);
 }
 
 int
@@ -1002,10 +1342,8 @@ kqueue_add_filteropts(int filt, struct filterops *filtops)
 	if (sysfilt_ops[~filt].for_fop != &null_filtops &&
 	    sysfilt_ops[~filt].for_fop != NULL)
 		error = EEXIST;
-	else {
+	else
 		sysfilt_ops[~filt].for_fop = filtops;
-		sysfilt_ops[~filt].for_refcnt = 0;
-	}
 	mtx_unlock(&filterops_lock);
 
 	return (error);
@@ -1014,6 +1352,7 @@ kqueue_add_filteropts(int filt, struct filterops *filtops)
 int
 kqueue_del_filteropts(int filt)
 {
+	struct filterops *fop;
 	int error;
 
 	error = 0;
@@ -1021,14 +1360,21 @@ kqueue_del_filteropts(int filt)
 		return EINVAL;
 
 	mtx_lock(&filterops_lock);
-	if (sysfilt_ops[~filt].for_fop == &null_filtops ||
-	    sysfilt_ops[~filt].for_fop == NULL)
+	fop = sysfilt_ops[~filt].for_fop;
+	if (fop == &null_filtops || fop == NULL)
 		error = EINVAL;
-	else if (sysfilt_ops[~filt].for_refcnt != 0)
-		error = EBUSY;
 	else {
+		/*
+		 * Unpublish the filter before checking for references;
+		 * kqueue_fo_find() takes its reference before loading
+		 * the filter, so one of the two sides sees the other.
+		 */
 		sysfilt_ops[~filt].for_fop = &null_filtops;
-		sysfilt_ops[~filt].for_refcnt = 0;
+		atomic_thread_fence_seq_cst();
+		if (sysfilt_ops[~filt].for_refcnt != 0) {
+			sysfilt_ops[~filt].for_fop = fop;
+			error = EBUSY;
+		}
 	}
 	mtx_unlock(&filterops_lock);
 
@@ -1038,6 +1384,7 @@ kqueue_del_filteropts(int filt)
 static struct filterops *
 kqueue_fo_find(int filt)
 {
+	struct filterops *fop;
 
 	if (filt > 0 || filt + EVFILT_SYSCOUNT < 0)
 		return NULL;
@@ -1045,13 +1392,13 @@ kqueue_fo_find(int filt)
 	if (sysfilt_ops[~filt].for_nolock)
 		return sysfilt_ops[~filt].for_fop;
 
-	mtx_lock(&filterops_lock);
-	sysfilt_ops[~filt].for_refcnt++;
-	if (sysfilt_ops[~filt].for_fop == NULL)
-		sysfilt_ops[~filt].for_fop = &null_filtops;
-	mtx_unlock(&filterops_lock);
+	atomic_add_int(&sysfilt_ops[~filt].for_refcnt, 1);
+	atomic_thread_fence_seq_cst();
+	fop = sysfilt_ops[~filt].for_fop;
+	if (fop == NULL)
+		fop = &null_filtops;
 
-	return sysfilt_ops[~filt].for_fop;
+	return fop;
 }
 
 static void
@@ -1064,20 +1411,50 @@ kqueue_fo_release(int filt)
 	if (sysfilt_ops[~filt].for_nolock)
 		return;
 
-	mtx_lock(&filterops_lock);
 	KASSERT(sysfilt_ops[~filt].for_refcnt > 0,
 	    ("filter object refcount not valid on release"));
-	sysfilt_ops[~filt].for_refcnt--;
-	mtx_unlock(&filterops_lock);
+	atomic_subtract_int(&sysfilt_ops[~filt].for_refcnt, 1);
+}
+
+/*
+ * Find the knote on kq matching the ident and filter of kev.
+ */
+static struct knote *
+kqueue_knote_find(struct kqueue *kq, struct filterops *fops,
+    struct kevent *kev)
+{
+	struct klist *list;
+	struct knote *kn;
+
+	KQ_OWNED(kq);
+	kn = NULL;
+	if (fops->f_isfd) {
+		if (kev->ident < kq->kq_knlistsize) {
+			SLIST_FOREACH(kn, &kq->kq_knlist[kev->ident], kn_link)
+				if (kev->filter == kn->kn_filter)
+					break;
+		}
+	} else if (kq->kq_knhashmask != 0) {
+		list = &kq->kq_knhash[
+		    KN_HASH((u_long)kev->ident, kq->kq_knhashmask)];
+		SLIST_FOREACH(kn, list, kn_link)
+			if (kev->ident == kn->kn_id &&
+			    kev->filter == kn->kn_filter)
+				break;
+	}
+	return (kn);
 }
 
 /*
  * A ref to kq (obtained via kqueue_acquire) must be held.  waitok will
  * influence if memory allocation should wait.  Make sure it is 0 if you
- * hold any mutexes.
+ * hold any mutexes.  If tknp is not NULL and points to a preallocated,
+ * zeroed knote, that knote is used for EV_ADD instead of allocating one;
+ * a spare knote which ends up unused is passed back through tknp.
  */
 static int
-kqueue_register(struct kqueue *kq, struct kevent *kev, struct thread *td, int waitok)
+kqueue_register(struct kqueue *kq, struct kevent *kev, struct thread *td,
+    int waitok, struct knote **tknp)
 {
 	struct filterops *fops;
 	struct file *fp;
@@ -1103,7 +1480,11 @@ kqueue_register(struct kqueue *kq, struct kevent *kev, struct thread *td, int wa
 		 * allocation failures are handled in the loop, only
 		 * if the spare knote appears to be actually required.
 		 */
-		tkn = knote_alloc(waitok);
+		if (tknp != NULL && *tknp != NULL) {
+			tkn = *tknp;
+			*tknp = NULL;
+		} else
+			tkn = knote_alloc(waitok);
 	} else {
 		tkn = NULL;
 	}
@@ -1151,26 +1532,13 @@ findkn:
 		}
 
 		KQ_LOCK(kq);
-		if (kev->ident < kq->kq_knlistsize) {
-			SLIST_FOREACH(kn, &kq->kq_knlist[kev->ident], kn_link)
-				if (kev->filter == kn->kn_filter)
-					break;
-		}
+		kn = kqueue_knote_find(kq, fops, kev);
 	} else {
 		if ((kev->flags & EV_ADD) == EV_ADD)
 			kqueue_expand(kq, fops, kev->ident, waitok);
 
 		KQ_LOCK(kq);
-		if (kq->kq_knhashmask != 0) {
-			struct klist *list;
-
-			list = &kq->kq_knhash[
-			    KN_HASH((u_long)kev->ident, kq->kq_knhashmask)];
-			SLIST_FOREACH(kn, list, kn_link)
-				if (kev->ident == kn->kn_id &&
-				    kev->filter == kn->kn_filter)
-					break;
-		}
+		kn = kqueue_knote_find(kq, fops, kev);
 	}
 
 	/* knote is in the process of changing, wait for it to stablize. */
@@ -1308,7 +1676,11 @@ done:
 		FILEDESC_XUNLOCK(td->td_proc->p_fd);
 	if (fp != NULL)
 		fdrop(fp, td);
-	knote_free(tkn);
+	if (tkn != NULL && tknp != NULL && *tknp == NULL) {
+		bzero(tkn, sizeof(*tkn));
+		*tknp = tkn;
+	} else
+		knote_free(tkn);
 	if (fops != NULL)
 		kqueue_fo_release(filt);
 	return (error);
@@ -1510,8 +1882,16 @@ kqueue_scan(struct kqueue *kq, int maxevents, struct kevent_copyops *k_ops,
 retry:
 	kevp = keva;
 	if (kq->kq_count == 0) {
-		if (asbt == -1) {
+		if (kqueue_ring_pending(kq)) {
+			/* The caller has events to consume in the ring. */
+			goto done;
+		} else if (asbt == -1) {
 			error = EWOULDBLOCK;
+		} else if ((kq->kq_state & KQ_EXCL) == KQ_EXCL) {
+			kq->kq_sleepers++;
+			error = msleep_sbt(&kq->kq_sleepers, &kq->kq_lock,
+			    PSOCK | PCATCH, "kqexcl", asbt, rsbt, C_ABSOLUTE);
+			kq->kq_sleepers--;
 		} else {
 			kq->kq_state |= KQ_SLEEP;
 			error = msleep_sbt(kq, &kq->kq_lock, PSOCK | PCATCH,
@@ -1669,6 +2049,33 @@ static int
 kqueue_ioctl(struct file *fp, u_long cmd, void *data,
 	struct ucred *active_cred, struct thread *td)
 {
+	struct kqueue *kq;
+	int error;
+
+	switch (cmd) {
+	case KQIOCEXCL:
+		if ((error = kqueue_acquire(fp, &kq)))
+			return (error);
+		KQ_LOCK(kq);
+		if (*(int *)data)
+			kq->kq_state |= KQ_EXCL;
+		else {
+			kq->kq_state &= ~KQ_EXCL;
+			if (kq->kq_sleepers > 0)
+				wakeup(&kq->kq_sleepers);
+		}
+		kqueue_release(kq, 1);
+		KQ_UNLOCK(kq);
+		return (0);
+
+	case KQIOCSETRING:
+		if ((error = kqueue_acquire(fp, &kq)))
+			return (error);
+		error = kqueue_ring_setup(kq, data, td);
+		kqueue_release(kq, 0);
+		return (error);
+	}
+
 	/*
 	 * Enabling sigio causes two major problems:
 	 * 1) infinite recursion:
@@ -1726,7 +2133,7 @@ kqueue_poll(struct file *fp, int events, struct ucred *active_cred,
 
 	KQ_LOCK(kq);
 	if (events & (POLLIN | POLLRDNORM)) {
-		if (kq->kq_count) {
+		if (kq->kq_count || kqueue_ring_pending(kq)) {
 			revents |= events & (POLLIN | POLLRDNORM);
 		} else {
 			selrecord(td, &kq->kq_sel);
@@ -1838,6 +2245,9 @@ kqueue_destroy(struct kqueue *kq)
 		free(kq->kq_knhash, M_KQUEUE);
 	if (kq->kq_knlist != NULL)
 		free(kq->kq_knlist, M_KQUEUE);
+	if (kq->kq_ring != NULL)
+		kqueue_ring_unmap(kq->kq_ring, kq->kq_ringma,
+		    kq->kq_ringnpages);
 
 	funsetown(&kq->kq_sigio);
 }
@@ -1898,6 +2308,14 @@ kqueue_wakeup(struct kqueue *kq)
 		kq->kq_state &= ~KQ_SLEEP;
 		wakeup(kq);
 	}
+	/*
+	 * Exclusive scanners sleep on their own channel, so that a
+	 * wakeup_one() is not consumed by a thread waiting for a knote
+	 * in flux.  One is woken for every event queued; the longest
+	 * sleeper is picked, so events are handed out round-robin.
+	 */
+	if (kq->kq_sleepers > 0)
+		wakeup_one(&kq->kq_sleepers);
 	if ((kq->kq_state & KQ_SEL) == KQ_SEL) {
 		selwakeuppri(&kq->kq_sel, PSOCK);
 		if (!SEL_WAITING(&kq->kq_sel))
@@ -1923,7 +2341,7 @@ knote(struct knlist *list, long hint, int lockflags)
 {
 	struct kqueue *kq;
 	struct knote *kn, *tkn;
-	int error;
+	int error, influx;
 
 	if (list == NULL)
 		return;
@@ -1954,11 +2372,17 @@ knote(struct knlist *list, long hint, int lockflags)
 			 */
 			KQ_UNLOCK(kq);
 		} else if ((lockflags & KNF_NOKQLOCK) != 0) {
+			/*
+			 * A knote under scan is already in flux and must
+			 * stay so for its owner.
+			 */
+			influx = kn->kn_status & KN_INFLUX;
 			kn->kn_status |= KN_INFLUX;
 			KQ_UNLOCK(kq);
 			error = kn->kn_fop->f_event(kn, hint);
 			KQ_LOCK(kq);
-			kn->kn_status &= ~KN_INFLUX;
+			if (influx == 0)
+				kn->kn_status &= ~KN_INFLUX;
 			if (error)
 				KNOTE_ACTIVATE(kn, 1);
 			KQ_UNLOCK_FLUX(kq);
@@ -2346,6 +2770,10 @@ knote_enqueue(struct knote *kn)
 	KQ_OWNED(kn->kn_kq);
 	KASSERT((kn->kn_status & KN_QUEUED) == 0, ("knote already queued"));
 
+	if (kqueue_ring_post(kq, kn)) {
+		kqueue_wakeup(kq);
+		return;
+	}
 	TAILQ_INSERT_TAIL(&kq->kq_head, kn, kn_tqe);
 	kn->kn_status |= KN_QUEUED;
 	kq->kq_count++;
@@ -2406,7 +2834,7 @@ kqfd_register(int fd, struct kevent *kev, struct thread *td, int waitok)
 	if ((error = kqueue_acquire(fp, &kq)) != 0)
 		goto noacquire;
 
-	error = kqueue_register(kq, kev, td, waitok);
+	error = kqueue_register(kq, kev, td, waitok, NULL);
 
 	kqueue_release(kq, 0);
 
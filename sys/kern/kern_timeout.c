@@ -51,10 +51,12 @@ __FBSDID("$FreeBSD: head/sys/kern/kern_timeout.c 292384 2015-12-16 23:39:27Z mar
 #include <sys/interrupt.h>
 #include <sys/kernel.h>
 #include <sys/ktr.h>
+#include <sys/linker.h>
 #include <sys/lock.h>
 #include <sys/malloc.h>
 #include <sys/mutex.h>
 #include <sys/proc.h>
+#include <sys/sbuf.h>
 #include <sys/sdt.h>
 #include <sys/sleepqueue.h>
 #include <sys/sysctl.h>
@@ -71,6 +73,12 @@ DPCPU_DECLARE(sbintime_t, hardclocktime);
 SDT_PROVIDER_DEFINE(callout_execute);
 SDT_PROBE_DEFINE1(callout_execute, , , callout__start, "struct callout *");
 SDT_PROBE_DEFINE1(callout_execute, , , callout__end, "struct callout *");
+SDT_PROBE_DEFINE2(callout_execute, , , callout__runtime, "struct callout *",
+    "sbintime_t");
+SDT_PROBE_DEFINE3(callout_execute, , , callout__migrate, "struct callout *",
+    "int", "int");
+SDT_PROBE_DEFINE3(callout_execute, , , callout__scan, "int", "int",
+    "sbintime_t");
 
 #ifdef CALLOUT_PROFILING
 static int avg_depth;
@@ -116,6 +124,14 @@ SYSCTL_INT(_kern, OID_AUTO, pin_default_swi, CTLFLAG_RDTUN | CTLFLAG_NOFETCH, &p
 SYSCTL_INT(_kern, OID_AUTO, pin_pcpu_swi, CTLFLAG_RDTUN | CTLFLAG_NOFETCH, &pin_pcpu_swi,
     0, "Pin the per-CPU swis (except PCPU 0, which is also default");
 
+static SYSCTL_NODE(_kern, OID_AUTO, callout, CTLFLAG_RW, 0,
+    "Callout statistics");
+
+static int callout_handler_stats;
+SYSCTL_INT(_kern_callout, OID_AUTO, handler_stats, CTLFLAG_RW,
+    &callout_handler_stats, 0,
+    "Time callout handlers and keep per-function runtime histograms");
+
 /*
  * TODO:
  *	allocate more timeout table slots when table overflows.
@@ -146,6 +162,38 @@ struct cc_exec {
 	bool			cc_waiting;
 };
 
+/*
+ * Per-cpu callout statistics, all protected by cc_lock.  The wheel
+ * occupancy is not tracked here; the sysctl walks the wheel instead.
+ *
+ * The handler table is a small open-addressed hash of callout functions
+ * with a log2 histogram of their runtime in microseconds.  It is only
+ * fed while kern.callout.handler_stats is set, since timing every
+ * handler costs two sbinuptime() calls.
+ */
+#define	CC_STAT_NFUNC		64
+#define	CC_STAT_NBUCKET		16
+
+struct cc_func_stat {
+	void			(*cfs_func)(void *);
+	uint64_t		cfs_calls;
+	sbintime_t		cfs_total;
+	sbintime_t		cfs_max;
+	uint32_t		cfs_hist[CC_STAT_NBUCKET];
+};
+
+struct cc_stat {
+	uint64_t		cs_scans;	/* callout_process() calls */
+	uint64_t		cs_idle;	/* scans expiring nothing */
+	uint64_t		cs_expired;	/* callouts expired by scans */
+	uint64_t		cs_maxbatch;	/* most expired by one scan */
+	sbintime_t		cs_lateness;	/* sum of (now - c_time) */
+	uint64_t		cs_direct;	/* run from the interrupt */
+	uint64_t		cs_softclock;	/* run by softclock() */
+	uint64_t		cs_migrations;	/* moved to another cpu */
+	uint64_t		cs_nofunc;	/* handler table was full */
+};
+
 /*
  * There is one struct callout_cpu per cpu, holding all relevant
  * state for the callout processing thread on the individual CPU.
@@ -164,6 +212,8 @@ struct callout_cpu {
 	u_int			cc_bucket;
 	u_int			cc_inited;
 	char			cc_ktr_event_name[20];
+	struct cc_stat		cc_stat;
+	struct cc_func_stat	*cc_funcstat;
 };
 
 #define	callout_migrating(c)	((c)->c_iflags & CALLOUT_DFRMIGRATION)
@@ -317,6 +367,8 @@ callout_cpu_init(struct callout_cpu *cc, int cpu)
 	for (i = 0; i < callwheelsize; i++)
 		LIST_INIT(&cc->cc_callwheel[i]);
 	TAILQ_INIT(&cc->cc_expireq);
+	cc->cc_funcstat = malloc(sizeof(struct cc_func_stat) * CC_STAT_NFUNC,
+	    M_CALLOUT, M_WAITOK | M_ZERO);
 	cc->cc_firstevent = SBT_MAX;
 	for (i = 0; i < 2; i++)
 		cc_cce_cleanup(cc, i);
@@ -346,6 +398,10 @@ callout_cpu_switch(struct callout *c, struct callout_cpu *cc, int new_cpu)
 	MPASS(c != NULL && cc != NULL);
 	CC_LOCK_ASSERT(cc);
 
+	cc->cc_stat.cs_migrations++;
+	SDT_PROBE3(callout_execute, , , callout__migrate, c, c->c_cpu,
+	    new_cpu);
+
 	/*
 	 * Avoid interrupts and preemption firing after the callout cpu
 	 * is blocked in order to avoid deadlocks as the new thread
@@ -432,9 +488,9 @@ callout_process(sbintime_t now)
 	struct callout *tmp, *tmpn;
 	struct callout_cpu *cc;
 	struct callout_list *sc;
-	sbintime_t first, last, max, tmp_max;
+	sbintime_t first, last, max, tmp_max, lateness;
 	uint32_t lookahead;
-	u_int firstb, lastb, nowb;
+	u_int firstb, lastb, nowb, expired;
 #ifdef CALLOUT_PROFILING
 	int depth_dir = 0, mpcalls_dir = 0, lockcalls_dir = 0;
 #endif
@@ -460,6 +516,8 @@ callout_process(sbintime_t now)
 	last &= (0xffffffffffffffffLLU << (32 - CC_HASH_SHIFT));
 	lastb = callout_hash(last) - 1;
 	max = last;
+	expired = 0;
+	lateness = 0;
 
 	/*
 	 * Check if we wrapped around the entire wheel from the last scan.
@@ -478,6 +536,8 @@ callout_process(sbintime_t now)
 		while (tmp != NULL) {
 			/* Run the callout if present time within allowed. */
 			if (tmp->c_time <= now) {
+				expired++;
+				lateness += now - tmp->c_time;
 				/*
 				 * Consumer told us the callout may be run
 				 * directly from hardware interrupt context.
@@ -490,6 +550,7 @@ callout_process(sbintime_t now)
 					    LIST_NEXT(tmp, c_links.le);
 					cc->cc_bucket = firstb & callwheelmask;
 					LIST_REMOVE(tmp, c_links.le);
+					cc->cc_stat.cs_direct++;
 					softclock_call_cc(tmp, cc,
 #ifdef CALLOUT_PROFILING
 					    &mpcalls_dir, &lockcalls_dir, NULL,
@@ -536,6 +597,15 @@ next:
 		 */
 	} while (((int)(firstb - lastb)) <= 0);
 	cc->cc_firstevent = last;
+	cc->cc_stat.cs_scans++;
+	if (expired == 0)
+		cc->cc_stat.cs_idle++;
+	cc->cc_stat.cs_expired += expired;
+	if (expired > cc->cc_stat.cs_maxbatch)
+		cc->cc_stat.cs_maxbatch = expired;
+	cc->cc_stat.cs_lateness += lateness;
+	SDT_PROBE3(callout_execute, , , callout__scan, curcpu, expired,
+	    lateness);
 #ifndef NO_EVENTTIMERS
 	cpu_new_callout(curcpu, last, first);
 #endif
@@ -618,6 +688,44 @@ callout_cc_add(struct callout *c, struct callout_cpu *cc,
 #endif
 }
 
+/*
+ * Account one run of a callout handler in the per-cpu function table.
+ */
+static void
+callout_stat_handler(struct callout_cpu *cc, void (*func)(void *),
+    sbintime_t runtime)
+{
+	struct cc_func_stat *cfs;
+	uint64_t us;
+	u_int b, h, i;
+
+	CC_LOCK_ASSERT(cc);
+	h = ((uintptr_t)func >> 4) % CC_STAT_NFUNC;
+	for (i = 0; i < CC_STAT_NFUNC; i++) {
+		cfs = &cc->cc_funcstat[(h + i) % CC_STAT_NFUNC];
+		if (cfs->cfs_func == func)
+			break;
+		if (cfs->cfs_func == NULL) {
+			cfs->cfs_func = func;
+			break;
+		}
+	}
+	if (i == CC_STAT_NFUNC) {
+		cc->cc_stat.cs_nofunc++;
+		return;
+	}
+	cfs->cfs_calls++;
+	cfs->cfs_total += runtime;
+	if (runtime > cfs->cfs_max)
+		cfs->cfs_max = runtime;
+	us = runtime / SBT_1US;
+	if (us >= (1 << (CC_STAT_NBUCKET - 2)))
+		b = CC_STAT_NBUCKET - 1;
+	else
+		b = fls((int)us);
+	cfs->cfs_hist[b]++;
+}
+
 static void
 callout_cc_del(struct callout *c, struct callout_cpu *cc)
 {
@@ -641,7 +749,8 @@ softclock_call_cc(struct callout *c, struct callout_cpu *cc,
 	struct lock_class *class;
 	struct lock_object *c_lock;
 	uintptr_t lock_status;
-	int c_iflags;
+	sbintime_t hstart;
+	int c_iflags, hstat;
 #ifdef SMP
 	struct callout_cpu *new_cc;
 	void (*new_func)(void *);
@@ -680,6 +789,8 @@ softclock_call_cc(struct callout *c, struct callout_cpu *cc,
 	cc_exec_curr(cc, direct) = c;
 	cc_exec_cancel(cc, direct) = false;
 	cc_exec_drain(cc, direct) = NULL;
+	hstat = callout_handler_stats;
+	hstart = 0;
 	CC_UNLOCK(cc);
 	if (c_lock != NULL) {
 		class->lc_lock(c_lock, lock_status);
@@ -689,6 +800,7 @@ softclock_call_cc(struct callout *c, struct callout_cpu *cc,
 		 */
 		if (cc_exec_cancel(cc, direct)) {
 			class->lc_unlock(c_lock);
+			hstat = 0;
 			goto skip;
 		}
 		/* The callout cannot be stopped now. */
@@ -718,11 +830,17 @@ softclock_call_cc(struct callout *c, struct callout_cpu *cc,
 #if defined(DIAGNOSTIC) || defined(CALLOUT_PROFILING)
 	sbt1 = sbinuptime();
 #endif
+	if (hstat)
+		hstart = sbinuptime();
 	THREAD_NO_SLEEPING();
 	SDT_PROBE1(callout_execute, , , callout__start, c);
 	c_func(c_arg);
 	SDT_PROBE1(callout_execute, , , callout__end, c);
 	THREAD_SLEEPING_OK();
+	if (hstat) {
+		hstart = sbinuptime() - hstart;
+		SDT_PROBE2(callout_execute, , , callout__runtime, c, hstart);
+	}
 #if defined(DIAGNOSTIC) || defined(CALLOUT_PROFILING)
 	sbt2 = sbinuptime();
 	sbt2 -= sbt1;
@@ -743,6 +861,8 @@ softclock_call_cc(struct callout *c, struct callout_cpu *cc,
 		class->lc_unlock(c_lock);
 skip:
 	CC_LOCK(cc);
+	if (hstat)
+		callout_stat_handler(cc, c_func, hstart);
 	KASSERT(cc_exec_curr(cc, direct) == c, ("mishandled cc_curr"));
 	cc_exec_curr(cc, direct) = NULL;
 	if (cc_exec_drain(cc, direct)) {
@@ -858,6 +978,7 @@ softclock(void *arg)
 	CC_LOCK(cc);
 	while ((c = TAILQ_FIRST(&cc->cc_expireq)) != NULL) {
 		TAILQ_REMOVE(&cc->cc_expireq, c, c_links.tqe);
+		cc->cc_stat.cs_softclock++;
 		softclock_call_cc(c, cc,
 #ifdef CALLOUT_PROFILING
 		    &mpcalls, &lockcalls, &gcalls,
@@ -1615,3 +1736,174 @@ SYSCTL_PROC(_kern, OID_AUTO, callout_stat,
     CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE,
     0, 0, sysctl_kern_callout_stat, "I",
     "Dump immediate statistic snapshot of the scheduled callouts");
+
+/*
+ * Per-cpu callout statistics: wheel occupancy, how many callouts each
+ * callout_process() scan expired (the coalescing the precision window
+ * buys), how late they ran on average and how often callouts migrated.
+ */
+static int
+sysctl_kern_callout_cpustats(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf sb;
+	struct callout *tmp;
+	struct callout_cpu *cc;
+	struct cc_stat cs;
+	int c, cpu, error, maxc, pending, queued;
+	u_int i;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	sbuf_printf(&sb, "\ncpu  pending maxbk  queued        scans     idle"
+	    "  avgbatch maxbatch  avglate(us)   direct  softclock  migrate");
+	CPU_FOREACH(cpu) {
+		cc = CC_CPU(cpu);
+		if (cc->cc_inited == 0)
+			continue;
+		pending = maxc = queued = 0;
+		CC_LOCK(cc);
+		for (i = 0; i < callwheelsize; i++) {
+			c = 0;
+			LIST_FOREACH(tmp, &cc->cc_callwheel[i], c_links.le)
+				c++;
+			if (c > maxc)
+				maxc = c;
+			pending += c;
+		}
+		TAILQ_FOREACH(tmp, &cc->cc_expireq, c_links.tqe)
+			queued++;
+		cs = cc->cc_stat;
+		CC_UNLOCK(cc);
+		sbuf_printf(&sb, "\n%3d %8d %5d %7d %12ju %8ju %5ju.%03ju "
+		    "%8ju %12ju %8ju %10ju %8ju",
+		    cpu, pending, maxc, queued,
+		    (uintmax_t)cs.cs_scans, (uintmax_t)cs.cs_idle,
+		    (uintmax_t)(cs.cs_scans != cs.cs_idle ?
+		    cs.cs_expired / (cs.cs_scans - cs.cs_idle) : 0),
+		    (uintmax_t)(cs.cs_scans != cs.cs_idle ?
+		    cs.cs_expired * 1000 / (cs.cs_scans - cs.cs_idle) % 1000 :
+		    0),
+		    (uintmax_t)cs.cs_maxbatch,
+		    (uintmax_t)(cs.cs_expired != 0 ?
+		    cs.cs_lateness / SBT_1US / cs.cs_expired : 0),
+		    (uintmax_t)cs.cs_direct, (uintmax_t)cs.cs_softclock,
+		    (uintmax_t)cs.cs_migrations);
+	}
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+SYSCTL_PROC(_kern_callout, OID_AUTO, cpustats,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+    0, 0, sysctl_kern_callout_cpustats, "A",
+    "Per-cpu callout wheel and scan statistics");
+
+/*
+ * Runtime histograms of callout handlers, summed over all cpus.  Fed
+ * only while kern.callout.handler_stats is set.
+ */
+static int
+sysctl_kern_callout_handlers(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf sb;
+	struct cc_func_stat *all, *cfs, *pcpu;
+	struct callout_cpu *cc;
+	char name[64];
+	long offset;
+	uint64_t nofunc;
+	int b, cpu, error, i, j, n;
+
+	error = sysctl_wire_old_buffer(req, 0);
+	if (error != 0)
+		return (error);
+	n = mp_ncpus * CC_STAT_NFUNC;
+	all = malloc(sizeof(*all) * n, M_TEMP, M_WAITOK | M_ZERO);
+	pcpu = malloc(sizeof(*pcpu) * CC_STAT_NFUNC, M_TEMP, M_WAITOK);
+	nofunc = 0;
+	n = 0;
+	CPU_FOREACH(cpu) {
+		cc = CC_CPU(cpu);
+		if (cc->cc_inited == 0)
+			continue;
+		CC_LOCK(cc);
+		bcopy(cc->cc_funcstat, pcpu, sizeof(*pcpu) * CC_STAT_NFUNC);
+		nofunc += cc->cc_stat.cs_nofunc;
+		CC_UNLOCK(cc);
+		for (i = 0; i < CC_STAT_NFUNC; i++) {
+			if (pcpu[i].cfs_func == NULL)
+				continue;
+			for (j = 0; j < n; j++)
+				if (all[j].cfs_func == pcpu[i].cfs_func)
+					break;
+			cfs = &all[j];
+			if (j == n) {
+				cfs->cfs_func = pcpu[i].cfs_func;
+				n++;
+			}
+			cfs->cfs_calls += pcpu[i].cfs_calls;
+			cfs->cfs_total += pcpu[i].cfs_total;
+			if (pcpu[i].cfs_max > cfs->cfs_max)
+				cfs->cfs_max = pcpu[i].cfs_max;
+			for (b = 0; b < CC_STAT_NBUCKET; b++)
+				cfs->cfs_hist[b] += pcpu[i].cfs_hist[b];
+		}
+	}
+	free(pcpu, M_TEMP);
+
+	sbuf_new_for_sysctl(&sb, NULL, 256, req);
+	sbuf_printf(&sb, "\n%d handlers, %ju runs not recorded (table full)"
+	    "\nhistogram buckets are [2^(n-1), 2^n) us, the last is open",
+	    n, (uintmax_t)nofunc);
+	for (j = 0; j < n; j++) {
+		cfs = &all[j];
+		if (linker_search_symbol_name((caddr_t)cfs->cfs_func, name,
+		    sizeof(name), &offset) != 0)
+			snprintf(name, sizeof(name), "%p", cfs->cfs_func);
+		sbuf_printf(&sb, "\n%-32s calls %ju avg %ju us max %ju us\n ",
+		    name, (uintmax_t)cfs->cfs_calls,
+		    (uintmax_t)(cfs->cfs_total / SBT_1US / cfs->cfs_calls),
+		    (uintmax_t)(cfs->cfs_max / SBT_1US));
+		for (b = 0; b < CC_STAT_NBUCKET; b++)
+			sbuf_printf(&sb, " %u", cfs->cfs_hist[b]);
+	}
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	free(all, M_TEMP);
+	return (error);
+}
+SYSCTL_PROC(_kern_callout, OID_AUTO, handlers,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+    0, 0, sysctl_kern_callout_handlers, "A",
+    "Callout handler runtime histograms");
+
+/*
+ * Writing a non-zero value clears all of the above.
+ */
+static int
+sysctl_kern_callout_reset(SYSCTL_HANDLER_ARGS)
+{
+	struct callout_cpu *cc;
+	int cpu, error, val;
+
+	val = 0;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL || val == 0)
+		return (error);
+	CPU_FOREACH(cpu) {
+		cc = CC_CPU(cpu);
+		if (cc->cc_inited == 0)
+			continue;
+		CC_LOCK(cc);
+		bzero(&cc->cc_stat, sizeof(cc->cc_stat));
+		bzero(cc->cc_funcstat,
+		    sizeof(struct cc_func_stat) * CC_STAT_NFUNC);
+		CC_UNLOCK(cc);
+	}
+	return (0);
+}
+SYSCTL_PROC(_kern_callout, OID_AUTO, reset_stats,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE,
+    0, 0, sysctl_kern_callout_reset, "I",
+    "Reset callout statistics");
@@ -102,6 +102,8 @@ struct umtx_q {
 	/* Umtx flags. */
 	int			uq_flags;
 #define UQF_UMTXQ	0x0001
+#define UQF_CVMUTEX	0x0002
+#define UQF_REQUEUED	0x0004
 
 	/* The thread waits on. */
 	struct thread		*uq_thread;
@@ -127,6 +129,13 @@ struct umtx_q {
 
 	/* The queue we on */
 	struct umtxq_queue	*uq_cur_queue;
+
+	/*
+	 * Mutex released by a condition variable waiter, valid
+	 * with UQF_CVMUTEX.  Signal and broadcast may move the
+	 * waiter onto this key's queue instead of waking it.
+	 */
+	struct umtx_key		uq_mkey;
 };
 
 TAILQ_HEAD(umtxq_head, umtx_q);
@@ -203,9 +212,18 @@ static struct umtxq_chain	umtxq_chains[2][UMTX_CHAINS];
 static MALLOC_DEFINE(M_UMTX, "umtx", "UMTX queue memory");
 static int			umtx_pi_allocated;
 
+static int			umtx_cv_requeue = 1;
+static u_long			umtx_cv_requeued;
+
 static SYSCTL_NODE(_debug, OID_AUTO, umtx, CTLFLAG_RW, 0, "umtx debug");
 SYSCTL_INT(_debug_umtx, OID_AUTO, umtx_pi_allocated, CTLFLAG_RD,
     &umtx_pi_allocated, 0, "Allocated umtx_pi");
+SYSCTL_INT(_debug_umtx, OID_AUTO, cv_requeue, CTLFLAG_RW,
+    &umtx_cv_requeue, 0,
+    "Requeue condition variable waiters onto the mutex");
+SYSCTL_ULONG(_debug_umtx, OID_AUTO, cv_requeued, CTLFLAG_RD,
+    &umtx_cv_requeued, 0,
+    "Condition variable waiters requeued onto the mutex");
 
 #ifdef UMTX_PROFILING
 static long max_length;
@@ -461,6 +479,26 @@ umtxq_unlock(struct umtx_key *key)
 	mtx_unlock(&uc->uc_lock);
 }
 
+/*
+ * Lock the chain a waiter is queued on.  A condition variable
+ * waiter's key may be switched to the mutex by a requeue while
+ * it is not holding a chain lock, so recheck once locked; the
+ * requeue is done with both chains held.
+ */
+static inline void
+umtxq_lock_uq(struct umtx_q *uq)
+{
+	struct umtxq_chain *uc;
+
+	for (;;) {
+		uc = umtxq_getchain(&uq->uq_key);
+		mtx_lock(&uc->uc_lock);
+		if (uc == umtxq_getchain(&uq->uq_key))
+			break;
+		mtx_unlock(&uc->uc_lock);
+	}
+}
+
 /*
  * Set chain to busy state when following operation
  * may be blocked (kernel mutex can not be used).
@@ -766,9 +804,10 @@ umtxq_sleep(struct umtx_q *uq, const char *wmesg, struct abs_timeout *abstime)
 	struct umtxq_chain *uc;
 	int error, timo;
 
-	uc = umtxq_getchain(&uq->uq_key);
-	UMTXQ_LOCKED_ASSERT(uc);
 	for (;;) {
+		/* A requeue may have moved us to another chain. */
+		uc = umtxq_getchain(&uq->uq_key);
+		UMTXQ_LOCKED_ASSERT(uc);
 		if (!(uq->uq_flags & UQF_UMTXQ))
 			return (0);
 		if (abstime != NULL) {
@@ -779,12 +818,12 @@ umtxq_sleep(struct umtx_q *uq, const char *wmesg, struct abs_timeout *abstime)
 			timo = 0;
 		error = msleep(uq, &uc->uc_lock, PCATCH | PDROP, wmesg, timo);
 		if (error != EWOULDBLOCK) {
-			umtxq_lock(&uq->uq_key);
+			umtxq_lock_uq(uq);
 			break;
 		}
 		if (abstime != NULL)
 			abs_timeout_update(abstime);
-		umtxq_lock(&uq->uq_key);
+		umtxq_lock_uq(uq);
 	}
 	return (error);
 }
@@ -2309,9 +2348,10 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 	struct timespec *timeout, u_long wflags)
 {
 	struct abs_timeout timo;
+	struct umtx_key key;
 	struct umtx_q *uq;
-	uint32_t flags, clockid, hasw;
-	int error;
+	uint32_t flags, mflags, clockid, hasw;
+	int error, requeue;
 
 	uq = td->td_umtxq;
 	error = fueword32(&cv->c_flags, &flags);
@@ -2320,6 +2360,26 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 	error = umtx_key_get(cv, TYPE_CV, GET_SHARE(flags), &uq->uq_key);
 	if (error != 0)
 		return (error);
+	key = uq->uq_key;
+
+	/*
+	 * Record the mutex so that a signal or broadcast may move us
+	 * onto its queue; userland relocks it once we return.  Only
+	 * process-private PTHREAD_PRIO_NONE mutexes are requeued,
+	 * the signalling thread sets the contested bit through its
+	 * own address space.
+	 */
+	requeue = 0;
+	if (umtx_cv_requeue && !key.shared &&
+	    fueword32(&m->m_flags, &mflags) == 0 &&
+	    (mflags & (UMUTEX_PRIO_INHERIT | UMUTEX_PRIO_PROTECT)) == 0 &&
+	    umtx_key_get(m, TYPE_NORMAL_UMUTEX, GET_SHARE(mflags),
+	    &uq->uq_mkey) == 0) {
+		if (!uq->uq_mkey.shared)
+			requeue = 1;
+		else
+			umtx_key_release(&uq->uq_mkey);
+	}
 
 	if ((wflags & CVWAIT_CLOCKID) != 0) {
 		error = fueword32(&cv->c_clockid, &clockid);
@@ -2337,10 +2397,12 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 		clockid = CLOCK_REALTIME;
 	}
 
-	umtxq_lock(&uq->uq_key);
-	umtxq_busy(&uq->uq_key);
+	umtxq_lock(&key);
+	umtxq_busy(&key);
 	umtxq_insert(uq);
-	umtxq_unlock(&uq->uq_key);
+	if (requeue)
+		uq->uq_flags |= UQF_CVMUTEX;
+	umtxq_unlock(&key);
 
 	/*
 	 * Set c_has_waiters to 1 before releasing user mutex, also
@@ -2350,7 +2412,7 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 	if (error == 0 && hasw == 0)
 		suword32(&cv->c_has_waiters, 1);
 
-	umtxq_unbusy_unlocked(&uq->uq_key);
+	umtxq_unbusy_unlocked(&key);
 
 	error = do_unlock_umutex(td, m);
 
@@ -2358,7 +2420,7 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 		abs_timeout_init(&timo, clockid, ((wflags & CVWAIT_ABSTIME) != 0),
 			timeout);
 	
-	umtxq_lock(&uq->uq_key);
+	umtxq_lock_uq(uq);
 	if (error == 0) {
 		error = umtxq_sleep(uq, "ucond", timeout == NULL ?
 		    NULL : &timo);
@@ -2366,32 +2428,157 @@ do_cv_wait(struct thread *td, struct ucond *cv, struct umutex *m,
 
 	if ((uq->uq_flags & UQF_UMTXQ) == 0)
 		error = 0;
-	else {
+	else if ((uq->uq_flags & UQF_REQUEUED) != 0) {
+		/*
+		 * Timed out or interrupted after being moved to the
+		 * mutex queue.  The signal was consumed by us, so
+		 * report the wakeup and let userland take the mutex.
+		 */
+		umtxq_remove(uq);
+		error = 0;
+	} else {
 		/*
 		 * This must be timeout,interrupted by signal or
 		 * surprious wakeup, clear c_has_waiter flag when
 		 * necessary.
 		 */
-		umtxq_busy(&uq->uq_key);
-		if ((uq->uq_flags & UQF_UMTXQ) != 0) {
-			int oldlen = uq->uq_cur_queue->length;
+		umtxq_busy(&key);
+		if ((uq->uq_flags & UQF_REQUEUED) != 0) {
+			/* Requeued while we waited for the chain. */
+			umtxq_unbusy(&key);
+			umtxq_unlock(&key);
+			umtxq_lock_uq(uq);
 			umtxq_remove(uq);
-			if (oldlen == 1) {
-				umtxq_unlock(&uq->uq_key);
-				suword32(&cv->c_has_waiters, 0);
-				umtxq_lock(&uq->uq_key);
+			error = 0;
+		} else {
+			if ((uq->uq_flags & UQF_UMTXQ) != 0) {
+				int oldlen = uq->uq_cur_queue->length;
+				umtxq_remove(uq);
+				if (oldlen == 1) {
+					umtxq_unlock(&key);
+					suword32(&cv->c_has_waiters, 0);
+					umtxq_lock(&key);
+				}
 			}
+			umtxq_unbusy(&key);
+			if (error == ERESTART)
+				error = EINTR;
 		}
-		umtxq_unbusy(&uq->uq_key);
-		if (error == ERESTART)
-			error = EINTR;
 	}
 
+	uq->uq_flags &= ~(UQF_CVMUTEX | UQF_REQUEUED);
 	umtxq_unlock(&uq->uq_key);
-	umtx_key_release(&uq->uq_key);
+	uq->uq_key = key;
+	umtx_key_release(&key);
 	return (error);
 }
 
+/*
+ * Set the contested bit of a process-private normal mutex so
+ * that its owner enters the kernel on unlock and wakes the
+ * waiters requeued onto it.  Returns non-zero in *owned if a
+ * thread holds the mutex.
+ */
+static int
+umtx_cv_contest(struct thread *td, struct umtx_key *mkey, int *owned)
+{
+	struct umutex *m;
+	uint32_t owner, old;
+	int error;
+
+	if (mkey->info.private.vs != td->td_proc->p_vmspace)
+		return (EINVAL);
+	m = (struct umutex *)mkey->info.private.addr;
+	error = fueword32(&m->m_owner, &owner);
+	if (error == -1)
+		return (EFAULT);
+	while ((owner & UMUTEX_CONTESTED) == 0) {
+		error = casueword32(&m->m_owner, owner, &old,
+		    owner | UMUTEX_CONTESTED);
+		if (error == -1)
+			return (EFAULT);
+		if (old == owner)
+			break;
+		owner = old;
+		error = umtxq_check_susp(td);
+		if (error != 0)
+			return (error);
+	}
+	*owned = (owner & ~UMUTEX_CONTESTED) != 0;
+	return (0);
+}
+
+/*
+ * Remove up to n_wake waiters from a condition variable queue.
+ * Waiters blocked on the same mutex as the first one are moved
+ * onto the mutex queue instead of being woken, and are released
+ * one at a time by do_unlock_normal().  If the mutex is not
+ * held, the first waiter is woken to take it.  The cv chain is
+ * locked and busied by the caller; the lock is dropped to touch
+ * the mutex word.  Returns the number of waiters removed.
+ */
+static int
+umtxq_cv_requeue(struct thread *td, struct umtx_key *key, int n_wake)
+{
+	struct umtx_key mkey;
+	struct umtxq_queue *uh;
+	struct umtx_q *uq;
+	int error, owned, ret;
+
+	UMTXQ_LOCKED_ASSERT(umtxq_getchain(key));
+	if (!umtx_cv_requeue)
+		return (umtxq_signal(key, n_wake));
+	uh = umtxq_queue_lookup(key, UMTX_SHARED_QUEUE);
+	if (uh == NULL)
+		return (0);
+	uq = TAILQ_FIRST(&uh->head);
+	if ((uq->uq_flags & UQF_CVMUTEX) == 0)
+		return (umtxq_signal(key, n_wake));
+	mkey = uq->uq_mkey;
+
+	/*
+	 * Busy the mutex chain so that an unlock can not observe an
+	 * empty queue after we set the contested bit.  The cv chain
+	 * is always busied first.
+	 */
+	umtxq_unlock(key);
+	umtxq_lock(&mkey);
+	umtxq_busy(&mkey);
+	umtxq_unlock(&mkey);
+	error = umtx_cv_contest(td, &mkey, &owned);
+	umtxq_lock(key);
+	if (error != 0) {
+		ret = umtxq_signal(key, n_wake);
+		goto out;
+	}
+
+	ret = 0;
+	umtxq_lock(&mkey);
+	while (ret < n_wake &&
+	    (uh = umtxq_queue_lookup(key, UMTX_SHARED_QUEUE)) != NULL) {
+		uq = TAILQ_FIRST(&uh->head);
+		if ((ret == 0 && !owned) ||
+		    (uq->uq_flags & UQF_CVMUTEX) == 0 ||
+		    !umtx_key_match(&uq->uq_mkey, &mkey)) {
+			umtxq_remove(uq);
+			wakeup(uq);
+		} else {
+			umtxq_remove(uq);
+			uq->uq_key = mkey;
+			umtxq_insert(uq);
+			uq->uq_flags |= UQF_REQUEUED;
+			atomic_add_long(&umtx_cv_requeued, 1);
+		}
+		ret++;
+	}
+	umtxq_unlock(&mkey);
+out:
+	umtxq_lock(&mkey);
+	umtxq_unbusy(&mkey);
+	umtxq_unlock(&mkey);
+	return (ret);
+}
+
 /*
  * Signal a userland condition variable.
  */
@@ -2410,7 +2597,7 @@ do_cv_signal(struct thread *td, struct ucond *cv)
 	umtxq_lock(&key);
 	umtxq_busy(&key);
 	cnt = umtxq_count(&key);
-	nwake = umtxq_signal(&key, 1);
+	nwake = umtxq_cv_requeue(td, &key, 1);
 	if (cnt <= nwake) {
 		umtxq_unlock(&key);
 		error = suword32(&cv->c_has_waiters, 0);
@@ -2439,7 +2626,7 @@ do_cv_broadcast(struct thread *td, struct ucond *cv)
 
 	umtxq_lock(&key);
 	umtxq_busy(&key);
-	umtxq_signal(&key, INT_MAX);
+	umtxq_cv_requeue(td, &key, INT_MAX);
 	umtxq_unlock(&key);
 
 	error = suword32(&cv->c_has_waiters, 0);
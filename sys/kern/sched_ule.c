@@ -98,6 +98,7 @@ struct td_sched {
 	int		ts_ltick;	/* Last tick that we were running on */
 	int		ts_ftick;	/* First tick that we were running on */
 	int		ts_ticks;	/* Tick count */
+	uint64_t	ts_qtime;	/* cpu_ticks() when queued, for stats. */
 #ifdef KTR
 	char		ts_name[TS_NAME_LEN];
 #endif
@@ -219,6 +220,25 @@ static int preempt_thresh = 0;
 static int static_boost = PRI_MIN_BATCH;
 static int sched_idlespins = 10000;
 static int sched_idlespinthresh = -1;
+static int sched_stats_enable = 0;
+
+/*
+ * Run-queue statistics, only collected while kern.sched.stats.enable is
+ * set.  Run-queue latency is the time from a thread being placed on a
+ * run queue until it is switched to, kept as a log2 histogram of
+ * microseconds: bucket 0 counts waits below 1us and bucket n waits in
+ * [2^(n-1), 2^n)us.  The last bucket also takes everything longer.
+ */
+#define	SCHED_LAT_BUCKETS	32
+
+struct tdq_stats {
+	uint64_t	tds_lat[SCHED_LAT_BUCKETS]; /* Run-queue latency. */
+	uint64_t	tds_steals;		/* Threads stolen when idle. */
+	uint64_t	tds_migrate_in;		/* Threads moved to this queue. */
+	uint64_t	tds_migrate_out;	/* Threads moved off this queue. */
+	uint64_t	tds_balanced;		/* Moves by the long-term balancer. */
+	uint64_t	tds_preempts;		/* Preemptive switches. */
+};
 
 /*
  * tdq - per processor runqs and statistics.  All fields are protected by the
@@ -233,6 +253,7 @@ struct tdq {
 	 */
 	struct mtx_padalign tdq_lock;		/* run queue lock. */
 	struct cpu_group *tdq_cg;		/* Pointer to cpu topology. */
+	struct cpu_group *tdq_llc;		/* Last level cache group. */
 	volatile int	tdq_load;		/* Aggregate load. */
 	volatile int	tdq_cpu_idle;		/* cpu_idle() is active. */
 	int		tdq_sysload;		/* For loadavg, !ITHD load. */
@@ -250,6 +271,7 @@ struct tdq {
 #ifdef KTR
 	char		tdq_loadname[TDQ_LOADNAME_LEN];
 #endif
+	struct tdq_stats tdq_stats;		/* Statistics, see above. */
 } __aligned(64);
 
 /* Idle thread states and config. */
@@ -270,6 +292,7 @@ static int balance_interval = 128;	/* Default set in sched_initticks(). */
 static int affinity;
 static int steal_idle = 1;
 static int steal_thresh = 2;
+static int wakee_affinity = 0;
 
 /*
  * One thread queue per processor.
@@ -384,6 +407,25 @@ runq_print(struct runq *rq)
 	}
 }
 
+/*
+ * Account the run-queue latency of a thread that is being switched to.
+ */
+static void
+tdq_stats_latency(struct tdq *tdq, struct thread *td)
+{
+	struct td_sched *ts;
+	uint64_t usec;
+
+	TDQ_LOCK_ASSERT(tdq, MA_OWNED);
+	ts = td->td_sched;
+	if (ts->ts_qtime == 0)
+		return;
+	usec = cputick2usec(cpu_ticks() - ts->ts_qtime);
+	ts->ts_qtime = 0;
+	tdq->tdq_stats.tds_lat[usec == 0 ? 0 :
+	    imin(flsll(usec), SCHED_LAT_BUCKETS - 1)]++;
+}
+
 /*
  * Print the status of a per-cpu thread queue.  Should be a ddb show cmd.
  */
@@ -461,6 +503,7 @@ tdq_runq_add(struct tdq *tdq, struct thread *td, int flags)
 
 	pri = td->td_priority;
 	ts = td->td_sched;
+	ts->ts_qtime = __predict_false(sched_stats_enable) ? cpu_ticks() : 0;
 	TD_SET_RUNQ(td);
 	if (THREAD_CAN_MIGRATE(td)) {
 		tdq->tdq_transferable++;
@@ -931,6 +974,8 @@ sched_balance_pair(struct tdq *high, struct tdq *low)
 	 */
 	if (high->tdq_transferable != 0 && high->tdq_load > low->tdq_load &&
 	    (moved = tdq_move(high, low)) > 0) {
+		if (__predict_false(sched_stats_enable))
+			high->tdq_stats.tds_balanced++;
 		/*
 		 * In case the target isn't the current cpu IPI it to force a
 		 * reschedule with the new workload.
@@ -974,6 +1019,10 @@ tdq_move(struct tdq *from, struct tdq *to)
 	ts->ts_cpu = cpu;
 	td->td_lock = TDQ_LOCKPTR(to);
 	tdq_add(to, td, SRQ_YIELDING);
+	if (__predict_false(sched_stats_enable)) {
+		from->tdq_stats.tds_migrate_out++;
+		to->tdq_stats.tds_migrate_in++;
+	}
 	return (1);
 }
 
@@ -1023,6 +1072,8 @@ tdq_idled(struct tdq *tdq)
 			tdq_unlock_pair(tdq, steal);
 			continue;
 		}
+		if (__predict_false(sched_stats_enable))
+			tdq->tdq_stats.tds_steals++;
 		spinlock_exit();
 		TDQ_UNLOCK(steal);
 		mi_switch(SW_VOL | SWT_IDLE, NULL);
@@ -1210,6 +1261,8 @@ SCHED_STAT_DEFINE(pickcpu_affinity, "Picked cpu based on affinity");
 SCHED_STAT_DEFINE(pickcpu_lowest, "Selected lowest load");
 SCHED_STAT_DEFINE(pickcpu_local, "Migrated to current cpu");
 SCHED_STAT_DEFINE(pickcpu_migration, "Selection may have caused migration");
+SCHED_STAT_DEFINE(pickcpu_wakee_affinity,
+    "Picked idle cpu sharing the waker's last level cache");
 
 static int
 sched_pickcpu(struct thread *td, int flags)
@@ -1243,6 +1296,25 @@ sched_pickcpu(struct thread *td, int flags)
 			return (ts->ts_cpu);
 		}
 	}
+	/*
+	 * A thread woken by another thread is likely to consume what the
+	 * waker just produced (pipes, sockets, umtx handoffs).  If its last
+	 * cpu is outside of the waker's last level cache, prefer an idle cpu
+	 * within that cache.  Otherwise fall back to the regular search.
+	 */
+	cg = TDQ_CPU(self)->tdq_llc;
+	if (wakee_affinity && cg != NULL &&
+	    curthread->td_intr_nesting_level == 0 &&
+	    !TD_IS_IDLETHREAD(curthread) &&
+	    !CPU_ISSET(ts->ts_cpu, &cg->cg_mask)) {
+		cpu = sched_lowest(cg, td->td_cpuset->cs_mask,
+		    max(pri, PRI_MAX_TIMESHARE), INT_MAX, self);
+		if (cpu != -1) {
+			SCHED_STAT_INC(pickcpu_wakee_affinity);
+			SCHED_STAT_INC(pickcpu_migration);
+			return (cpu);
+		}
+	}
 	/*
 	 * If the thread can run on the last cpu and the affinity has not
 	 * expired or it is idle run it there.
@@ -1364,6 +1436,7 @@ tdq_setup(struct tdq *tdq)
 static void
 sched_setup_smp(void)
 {
+	struct cpu_group *cg;
 	struct tdq *tdq;
 	int i;
 
@@ -1374,6 +1447,9 @@ sched_setup_smp(void)
 		tdq->tdq_cg = smp_topo_find(cpu_top, i);
 		if (tdq->tdq_cg == NULL)
 			panic("Can't find cpu group for %d\n", i);
+		for (cg = tdq->tdq_cg; cg != NULL; cg = cg->cg_parent)
+			if (cg->cg_level != CG_SHARE_NONE)
+				tdq->tdq_llc = cg;
 	}
 	balance_tdq = TDQ_SELF();
 	sched_balance();
@@ -1900,6 +1976,8 @@ sched_switch(struct thread *td, struct thread *newtd, int flags)
 	td->td_owepreempt = 0;
 	if (!TD_IS_IDLETHREAD(td))
 		tdq->tdq_switchcnt++;
+	if (__predict_false(sched_stats_enable) && (flags & SW_PREEMPT) != 0)
+		tdq->tdq_stats.tds_preempts++;
 	/*
 	 * The lock pointer in an idle thread should never change.  Reset it
 	 * to CAN_RUN as well.
@@ -1937,6 +2015,8 @@ sched_switch(struct thread *td, struct thread *newtd, int flags)
 	 */
 	TDQ_LOCK_ASSERT(tdq, MA_OWNED | MA_NOTRECURSED);
 	newtd = choosethread();
+	if (__predict_false(sched_stats_enable))
+		tdq_stats_latency(tdq, newtd);
 	/*
 	 * Call the MD code to switch contexts if necessary.
 	 */
@@ -2883,7 +2963,158 @@ sysctl_kern_quantum(SYSCTL_HANDLER_ARGS)
 	return (0);
 }
 
+/*
+ * Sum the statistics of one cpu, or of all cpus if tdq is NULL.
+ */
+static void
+sched_stats_fetch(struct tdq *tdq, struct tdq_stats *tds)
+{
+	struct tdq_stats *src;
+	int cpu, i;
+
+	bzero(tds, sizeof(*tds));
+	CPU_FOREACH(cpu) {
+		if (tdq != NULL && tdq != TDQ_CPU(cpu))
+			continue;
+		src = &TDQ_CPU(cpu)->tdq_stats;
+		for (i = 0; i < SCHED_LAT_BUCKETS; i++)
+			tds->tds_lat[i] += src->tds_lat[i];
+		tds->tds_steals += src->tds_steals;
+		tds->tds_migrate_in += src->tds_migrate_in;
+		tds->tds_migrate_out += src->tds_migrate_out;
+		tds->tds_balanced += src->tds_balanced;
+		tds->tds_preempts += src->tds_preempts;
+	}
+}
+
+static int
+sysctl_kern_sched_stats_latency(SYSCTL_HANDLER_ARGS)
+{
+	struct tdq_stats tds;
+	struct sbuf sbuf;
+	uint64_t lo, hi;
+	int error, i;
+
+	sched_stats_fetch(arg1, &tds);
+	sbuf_new_for_sysctl(&sbuf, NULL, 64 * SCHED_LAT_BUCKETS, req);
+	sbuf_printf(&sbuf, "\n%10s %10s %16s\n", "usec >=", "usec <",
+	    "count");
+	for (i = 0; i < SCHED_LAT_BUCKETS; i++) {
+		if (tds.tds_lat[i] == 0)
+			continue;
+		lo = i == 0 ? 0 : (uint64_t)1 << (i - 1);
+		hi = (uint64_t)1 << i;
+		if (i == SCHED_LAT_BUCKETS - 1)
+			sbuf_printf(&sbuf, "%10ju %10s %16ju\n", (uintmax_t)lo,
+			    "-", (uintmax_t)tds.tds_lat[i]);
+		else
+			sbuf_printf(&sbuf, "%10ju %10ju %16ju\n",
+			    (uintmax_t)lo, (uintmax_t)hi,
+			    (uintmax_t)tds.tds_lat[i]);
+	}
+	error = sbuf_finish(&sbuf);
+	sbuf_delete(&sbuf);
+	return (error);
+}
+
+static int
+sysctl_kern_sched_stats_counter(SYSCTL_HANDLER_ARGS)
+{
+	struct tdq_stats tds;
+	uint64_t val;
+
+	sched_stats_fetch(arg1, &tds);
+	val = *(uint64_t *)((char *)&tds + arg2);
+	return (sysctl_handle_64(oidp, &val, 0, req));
+}
+
+static int
+sysctl_kern_sched_stats_reset(SYSCTL_HANDLER_ARGS)
+{
+	struct tdq *tdq;
+	int cpu, error, val;
+
+	val = 0;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL || val == 0)
+		return (error);
+	CPU_FOREACH(cpu) {
+		tdq = TDQ_CPU(cpu);
+		TDQ_LOCK(tdq);
+		bzero(&tdq->tdq_stats, sizeof(tdq->tdq_stats));
+		TDQ_UNLOCK(tdq);
+	}
+	return (0);
+}
+
 SYSCTL_NODE(_kern, OID_AUTO, sched, CTLFLAG_RW, 0, "Scheduler");
+SYSCTL_NODE(_kern_sched, OID_AUTO, stats, CTLFLAG_RW, 0,
+    "Run-queue statistics");
+SYSCTL_INT(_kern_sched_stats, OID_AUTO, enable, CTLFLAG_RW,
+    &sched_stats_enable, 0, "Collect run-queue statistics");
+SYSCTL_PROC(_kern_sched_stats, OID_AUTO, reset, CTLTYPE_INT | CTLFLAG_WR,
+    NULL, 0, sysctl_kern_sched_stats_reset, "I",
+    "Clear run-queue statistics");
+
+/*
+ * Export the statistics of all cpus as kern.sched.stats and of each cpu
+ * as kern.sched.stats.cpuN.
+ */
+static void
+sched_stats_sysctl_add(struct sysctl_oid_list *children, struct tdq *tdq)
+{
+
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "latency",
+	    CTLTYPE_STRING | CTLFLAG_RD, tdq, 0,
+	    sysctl_kern_sched_stats_latency, "A",
+	    "Run-queue latency histogram (log2 usec)");
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "steals",
+	    CTLTYPE_U64 | CTLFLAG_RD, tdq,
+	    offsetof(struct tdq_stats, tds_steals),
+	    sysctl_kern_sched_stats_counter, "QU",
+	    "Threads stolen by idle cpus");
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "migrate_in",
+	    CTLTYPE_U64 | CTLFLAG_RD, tdq,
+	    offsetof(struct tdq_stats, tds_migrate_in),
+	    sysctl_kern_sched_stats_counter, "QU",
+	    "Threads moved to the queue from another cpu");
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "migrate_out",
+	    CTLTYPE_U64 | CTLFLAG_RD, tdq,
+	    offsetof(struct tdq_stats, tds_migrate_out),
+	    sysctl_kern_sched_stats_counter, "QU",
+	    "Threads moved from the queue to another cpu");
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "balanced",
+	    CTLTYPE_U64 | CTLFLAG_RD, tdq,
+	    offsetof(struct tdq_stats, tds_balanced),
+	    sysctl_kern_sched_stats_counter, "QU",
+	    "Threads moved off the queue by the long-term balancer");
+	SYSCTL_ADD_PROC(NULL, children, OID_AUTO, "preemptions",
+	    CTLTYPE_U64 | CTLFLAG_RD, tdq,
+	    offsetof(struct tdq_stats, tds_preempts),
+	    sysctl_kern_sched_stats_counter, "QU",
+	    "Preemptive context switches");
+}
+
+static void
+sched_stats_sysctl_init(void *dummy __unused)
+{
+	struct sysctl_oid *oid;
+	char name[sizeof("cpu") + sizeof(__XSTRING(MAXCPU))];
+	int cpu;
+
+	sched_stats_sysctl_add(SYSCTL_CHILDREN(&sysctl___kern_sched_stats),
+	    NULL);
+	CPU_FOREACH(cpu) {
+		snprintf(name, sizeof(name), "cpu%d", cpu);
+		oid = SYSCTL_ADD_NODE(NULL,
+		    SYSCTL_CHILDREN(&sysctl___kern_sched_stats), OID_AUTO,
+		    name, CTLFLAG_RD, NULL, "Per-cpu run-queue statistics");
+		sched_stats_sysctl_add(SYSCTL_CHILDREN(oid), TDQ_CPU(cpu));
+	}
+}
+SYSINIT(sched_stats_sysctl, SI_SUB_SMP, SI_ORDER_ANY,
+    sched_stats_sysctl_init, NULL);
+
 SYSCTL_STRING(_kern_sched, OID_AUTO, name, CTLFLAG_RD, "ULE", 0,
     "Scheduler name");
 SYSCTL_PROC(_kern_sched, OID_AUTO, quantum, CTLTYPE_INT | CTLFLAG_RW,
@@ -2915,6 +3146,9 @@ SYSCTL_INT(_kern_sched, OID_AUTO, steal_idle, CTLFLAG_RW, &steal_idle, 0,
     "Attempts to steal work from other cores before idling");
 SYSCTL_INT(_kern_sched, OID_AUTO, steal_thresh, CTLFLAG_RW, &steal_thresh, 0,
     "Minimum load on remote CPU before we'll steal");
+SYSCTL_INT(_kern_sched, OID_AUTO, wakee_affinity, CTLFLAG_RW,
+    &wakee_affinity, 0,
+    "Place woken threads on idle CPUs sharing the waker's last level cache");
 SYSCTL_PROC(_kern_sched, OID_AUTO, topology_spec, CTLTYPE_STRING |
     CTLFLAG_RD, NULL, 0, sysctl_kern_sched_topology_spec, "A",
     "XML dump of detected CPU topology");
@@ -38,8 +38,10 @@ __FBSDID("$FreeBSD: head/sys/kern/subr_taskqueue.c 290805 2015-11-13 22:51:35Z r
 #include <sys/lock.h>
 #include <sys/malloc.h>
 #include <sys/mutex.h>
+#include <sys/pcpu.h>
 #include <sys/proc.h>
 #include <sys/sched.h>
+#include <sys/smp.h>
 #include <sys/taskqueue.h>
 #include <sys/unistd.h>
 #include <machine/stdarg.h>
@@ -50,6 +52,10 @@ static void	*taskqueue_ih;
 static void	 taskqueue_fast_enqueue(void *);
 static void	 taskqueue_swi_enqueue(void *);
 static void	 taskqueue_swi_giant_enqueue(void *);
+static int	 taskqueue_pcpu_enqueue(struct taskqueue *, struct task *);
+static int	 taskqueue_pcpu_cancel(struct taskqueue *, struct task *,
+		    u_int *);
+static void	 taskqueue_pcpu_drain(struct taskqueue *, struct task *);
 
 struct taskqueue_busy {
 	struct task	*tb_running;
@@ -71,11 +77,15 @@ struct taskqueue {
 	int			tq_callouts;
 	taskqueue_callback_fn	tq_callbacks[TASKQUEUE_NUM_CALLBACKS];
 	void			*tq_cb_contexts[TASKQUEUE_NUM_CALLBACKS];
+	struct taskqueue	**tq_pcpu;	/* per-cpu queues, by cpu id */
+	struct taskqueue	*tq_parent;	/* of a per-cpu queue */
+	cpuset_t		tq_steal;	/* cpus a per-cpu worker robs */
 };
 
 #define	TQ_FLAGS_ACTIVE		(1 << 0)
 #define	TQ_FLAGS_BLOCKED	(1 << 1)
 #define	TQ_FLAGS_UNLOCKED_ENQUEUE	(1 << 2)
+#define	TQ_FLAGS_IDLE		(1 << 3)
 
 #define	DT_CALLOUT_ARMED	(1 << 0)
 
@@ -183,10 +193,14 @@ taskqueue_terminate(struct thread **pp, struct taskqueue *tq)
 	}
 }
 
+static void taskqueue_pcpu_free(struct taskqueue *queue);
+
 void
 taskqueue_free(struct taskqueue *queue)
 {
 
+	if (queue->tq_pcpu != NULL)
+		taskqueue_pcpu_free(queue);
 	TQ_LOCK(queue);
 	queue->tq_flags &= ~TQ_FLAGS_ACTIVE;
 	taskqueue_terminate(queue->tq_threads, queue);
@@ -203,6 +217,11 @@ taskqueue_enqueue_locked(struct taskqueue *queue, struct task *task)
 	struct task *ins;
 	struct task *prev;
 
+	if (queue->tq_pcpu != NULL) {
+		TQ_UNLOCK(queue);
+		return (taskqueue_pcpu_enqueue(queue, task));
+	}
+
 	/*
 	 * Count multiple enqueues.
 	 */
@@ -249,6 +268,8 @@ taskqueue_enqueue(struct taskqueue *queue, struct task *task)
 {
 	int res;
 
+	if (queue->tq_pcpu != NULL)
+		return (taskqueue_pcpu_enqueue(queue, task));
 	TQ_LOCK(queue);
 	res = taskqueue_enqueue_locked(queue, task);
 	/* The lock is released inside. */
@@ -385,7 +406,12 @@ taskqueue_drain_tq_active(struct taskqueue *queue)
 void
 taskqueue_block(struct taskqueue *queue)
 {
+	u_int cpu;
 
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu)
+			taskqueue_block(queue->tq_pcpu[cpu]);
+	}
 	TQ_LOCK(queue);
 	queue->tq_flags |= TQ_FLAGS_BLOCKED;
 	TQ_UNLOCK(queue);
@@ -394,7 +420,12 @@ taskqueue_block(struct taskqueue *queue)
 void
 taskqueue_unblock(struct taskqueue *queue)
 {
+	u_int cpu;
 
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu)
+			taskqueue_unblock(queue->tq_pcpu[cpu]);
+	}
 	TQ_LOCK(queue);
 	queue->tq_flags &= ~TQ_FLAGS_BLOCKED;
 	if (!STAILQ_EMPTY(&queue->tq_queue))
@@ -402,49 +433,65 @@ taskqueue_unblock(struct taskqueue *queue)
 	TQ_UNLOCK(queue);
 }
 
+/*
+ * Run the first task on the queue, using tb to mark it as active.
+ */
 static void
-taskqueue_run_locked(struct taskqueue *queue)
+taskqueue_run_one(struct taskqueue *queue, struct taskqueue_busy *tb)
 {
-	struct taskqueue_busy tb;
 	struct taskqueue_busy *tb_first;
 	struct task *task;
 	int pending;
 
 	TQ_ASSERT_LOCKED(queue);
-	tb.tb_running = NULL;
+	TAILQ_INSERT_TAIL(&queue->tq_active, tb, tb_link);
 
-	while (STAILQ_FIRST(&queue->tq_queue)) {
-		TAILQ_INSERT_TAIL(&queue->tq_active, &tb, tb_link);
+	/*
+	 * Carefully remove the first task from the queue and
+	 * zero its pending count.
+	 */
+	task = STAILQ_FIRST(&queue->tq_queue);
+	STAILQ_REMOVE_HEAD(&queue->tq_queue, ta_link);
+	pending = task->ta_pending;
+	task->ta_pending = 0;
+	tb->tb_running = task;
+	TQ_UNLOCK(queue);
 
-		/*
-		 * Carefully remove the first task from the queue and
-		 * zero its pending count.
-		 */
-		task = STAILQ_FIRST(&queue->tq_queue);
-		STAILQ_REMOVE_HEAD(&queue->tq_queue, ta_link);
-		pending = task->ta_pending;
-		task->ta_pending = 0;
-		tb.tb_running = task;
-		TQ_UNLOCK(queue);
+	task->ta_func(task->ta_context, pending);
 
-		task->ta_func(task->ta_context, pending);
+	TQ_LOCK(queue);
+	tb->tb_running = NULL;
+	wakeup(task);
 
-		TQ_LOCK(queue);
-		tb.tb_running = NULL;
-		wakeup(task);
+	TAILQ_REMOVE(&queue->tq_active, tb, tb_link);
+	tb_first = TAILQ_FIRST(&queue->tq_active);
+	if (tb_first != NULL &&
+	    tb_first->tb_running == TB_DRAIN_WAITER)
+		wakeup(tb_first);
+}
 
-		TAILQ_REMOVE(&queue->tq_active, &tb, tb_link);
-		tb_first = TAILQ_FIRST(&queue->tq_active);
-		if (tb_first != NULL &&
-		    tb_first->tb_running == TB_DRAIN_WAITER)
-			wakeup(tb_first);
-	}
+static void
+taskqueue_run_locked(struct taskqueue *queue)
+{
+	struct taskqueue_busy tb;
+
+	TQ_ASSERT_LOCKED(queue);
+	tb.tb_running = NULL;
+
+	while (STAILQ_FIRST(&queue->tq_queue))
+		taskqueue_run_one(queue, &tb);
 }
 
 void
 taskqueue_run(struct taskqueue *queue)
 {
+	u_int cpu;
 
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu)
+			taskqueue_run(queue->tq_pcpu[cpu]);
+		return;
+	}
 	TQ_LOCK(queue);
 	taskqueue_run_locked(queue);
 	TQ_UNLOCK(queue);
@@ -468,6 +515,8 @@ taskqueue_cancel_locked(struct taskqueue *queue, struct task *task,
     u_int *pendp)
 {
 
+	if (queue->tq_pcpu != NULL)
+		return (taskqueue_pcpu_cancel(queue, task, pendp));
 	if (task->ta_pending > 0)
 		STAILQ_REMOVE(&queue->tq_queue, task, task, ta_link);
 	if (pendp != NULL)
@@ -481,6 +530,8 @@ taskqueue_cancel(struct taskqueue *queue, struct task *task, u_int *pendp)
 {
 	int error;
 
+	if (queue->tq_pcpu != NULL)
+		return (taskqueue_pcpu_cancel(queue, task, pendp));
 	TQ_LOCK(queue);
 	error = taskqueue_cancel_locked(queue, task, pendp);
 	TQ_UNLOCK(queue);
@@ -516,6 +567,10 @@ taskqueue_drain(struct taskqueue *queue, struct task *task)
 	if (!queue->tq_spin)
 		WITNESS_WARN(WARN_GIANTOK | WARN_SLEEPOK, NULL, __func__);
 
+	if (queue->tq_pcpu != NULL) {
+		taskqueue_pcpu_drain(queue, task);
+		return;
+	}
 	TQ_LOCK(queue);
 	while (task->ta_pending != 0 || task_is_running(queue, task))
 		TQ_SLEEP(queue, task, &queue->tq_mutex, PWAIT, "-", 0);
@@ -525,10 +580,16 @@ taskqueue_drain(struct taskqueue *queue, struct task *task)
 void
 taskqueue_drain_all(struct taskqueue *queue)
 {
+	u_int cpu;
 
 	if (!queue->tq_spin)
 		WITNESS_WARN(WARN_GIANTOK | WARN_SLEEPOK, NULL, __func__);
 
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu)
+			taskqueue_drain_all(queue->tq_pcpu[cpu]);
+		return;
+	}
 	TQ_LOCK(queue);
 	taskqueue_drain_tq_queue(queue);
 	taskqueue_drain_tq_active(queue);
@@ -765,8 +826,16 @@ TASKQUEUE_FAST_DEFINE(fast, taskqueue_fast_enqueue, NULL,
 int
 taskqueue_member(struct taskqueue *queue, struct thread *td)
 {
+	u_int cpu;
 	int i, j, ret = 0;
 
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu) {
+			if (queue->tq_pcpu[cpu]->tq_threads[0] == td)
+				return (1);
+		}
+		return (0);
+	}
 	for (i = 0, j = 0; ; i++) {
 		if (queue->tq_threads[i] == NULL)
 			continue;
@@ -779,3 +848,336 @@ taskqueue_member(struct taskqueue *queue, struct thread *td)
 	}
 	return (ret);
 }
+
+/*
+ * Per-cpu taskqueues.
+ *
+ * The parent queue holds no tasks itself; it only carries the timeout
+ * callouts and the callbacks.  Each cpu has a child queue with its own
+ * mutex and a worker thread bound to that cpu.  A task is on at most
+ * one child, named by ta_cpu.  ta_cpu changes only while the task is
+ * not pending and with the locks of both children held, so holding
+ * the child lock that ta_cpu names keeps it stable, much like c_cpu
+ * for callouts.
+ *
+ * A worker whose queue is empty steals single tasks from the busy
+ * children of the cpus in its memory domain.  It runs them with its
+ * taskqueue_busy on the victim's active list, as if it were a second
+ * thread of that queue, so that the victim's drain and cancel see
+ * it.  A task that ran from one child may be queued on another by the
+ * time it finishes, so drain and cancel check every child for it
+ * running.
+ */
+static struct taskqueue *
+taskqueue_pcpu_lock(struct taskqueue *queue, struct task *task)
+{
+	struct taskqueue *tq;
+	u_int cpu;
+
+	for (;;) {
+		cpu = task->ta_cpu;
+		KASSERT(cpu <= mp_maxid && queue->tq_pcpu[cpu] != NULL,
+		    ("%s: task %p has bad cpu %u", __func__, task, cpu));
+		tq = queue->tq_pcpu[cpu];
+		TQ_LOCK(tq);
+		if (cpu == task->ta_cpu)
+			return (tq);
+		TQ_UNLOCK(tq);
+	}
+}
+
+static int
+taskqueue_pcpu_enqueue(struct taskqueue *queue, struct task *task)
+{
+	struct taskqueue *tq, *ntq;
+	u_int cpu;
+
+	tq = taskqueue_pcpu_lock(queue, task);
+	cpu = curcpu;
+	if (task->ta_pending == 0 && task->ta_cpu != cpu) {
+		/*
+		 * Move the task over to this cpu.  If our queue is
+		 * contended, leave it where it was rather than wait.
+		 */
+		ntq = queue->tq_pcpu[cpu];
+		if (mtx_trylock(&ntq->tq_mutex)) {
+			task->ta_cpu = cpu;
+			TQ_UNLOCK(tq);
+			tq = ntq;
+		}
+	}
+	/* The lock is released inside. */
+	return (taskqueue_enqueue_locked(tq, task));
+}
+
+/*
+ * Returns EBUSY if the task is running out of any per-cpu queue.
+ */
+static int
+taskqueue_pcpu_running(struct taskqueue *queue, struct task *task)
+{
+	struct taskqueue *tq;
+	u_int cpu;
+	int running;
+
+	running = 0;
+	CPU_FOREACH(cpu) {
+		tq = queue->tq_pcpu[cpu];
+		TQ_LOCK(tq);
+		running = task_is_running(tq, task);
+		TQ_UNLOCK(tq);
+		if (running)
+			break;
+	}
+	return (running ? EBUSY : 0);
+}
+
+static int
+taskqueue_pcpu_cancel(struct taskqueue *queue, struct task *task,
+    u_int *pendp)
+{
+	struct taskqueue *tq;
+	int error;
+
+	tq = taskqueue_pcpu_lock(queue, task);
+	error = taskqueue_cancel_locked(tq, task, pendp);
+	TQ_UNLOCK(tq);
+	if (error == 0)
+		error = taskqueue_pcpu_running(queue, task);
+	return (error);
+}
+
+static void
+taskqueue_pcpu_drain(struct taskqueue *queue, struct task *task)
+{
+	struct taskqueue *tq;
+	u_int cpu;
+
+	for (;;) {
+		tq = taskqueue_pcpu_lock(queue, task);
+		if (task->ta_pending == 0 && !task_is_running(tq, task))
+			break;
+		TQ_SLEEP(tq, task, &tq->tq_mutex, PWAIT, "-", 0);
+		TQ_UNLOCK(tq);
+	}
+	TQ_UNLOCK(tq);
+	CPU_FOREACH(cpu) {
+		tq = queue->tq_pcpu[cpu];
+		TQ_LOCK(tq);
+		while (task_is_running(tq, task))
+			TQ_SLEEP(tq, task, &tq->tq_mutex, PWAIT, "-", 0);
+		TQ_UNLOCK(tq);
+	}
+}
+
+/*
+ * Enqueue notification for a per-cpu queue.  Wake its worker and, if
+ * that is busy with another task, an idle sibling to steal the new one.
+ */
+static void
+taskqueue_pcpu_kick(void *context)
+{
+	struct taskqueue *sib, *tq;
+	u_int cpu;
+
+	tq = context;
+	wakeup_one(tq);
+	if (TAILQ_EMPTY(&tq->tq_active))
+		return;
+	CPU_FOREACH(cpu) {
+		if (!CPU_ISSET(cpu, &tq->tq_steal))
+			continue;
+		sib = tq->tq_parent->tq_pcpu[cpu];
+		if ((sib->tq_flags & TQ_FLAGS_IDLE) != 0) {
+			wakeup_one(sib);
+			break;
+		}
+	}
+}
+
+/*
+ * Run one task queued behind a busy sibling's running task.  Returns
+ * non-zero if a task was run.
+ */
+static int
+taskqueue_pcpu_steal(struct taskqueue *tq)
+{
+	struct taskqueue_busy tb;
+	struct taskqueue *victim;
+	u_int cpu, i;
+
+	TQ_ASSERT_UNLOCKED(tq);
+	tb.tb_running = NULL;
+	for (i = 1, cpu = PCPU_GET(cpuid); i <= mp_maxid; i++) {
+		cpu = (cpu + 1) % (mp_maxid + 1);
+		if (!CPU_ISSET(cpu, &tq->tq_steal))
+			continue;
+		victim = tq->tq_parent->tq_pcpu[cpu];
+		if (STAILQ_EMPTY(&victim->tq_queue) ||
+		    TAILQ_EMPTY(&victim->tq_active))
+			continue;
+		TQ_LOCK(victim);
+		if (!STAILQ_EMPTY(&victim->tq_queue) &&
+		    !TAILQ_EMPTY(&victim->tq_active)) {
+			taskqueue_run_one(victim, &tb);
+			TQ_UNLOCK(victim);
+			return (1);
+		}
+		TQ_UNLOCK(victim);
+	}
+	return (0);
+}
+
+static void
+taskqueue_pcpu_loop(void *arg)
+{
+	struct taskqueue *tq;
+
+	tq = arg;
+	taskqueue_run_callback(tq->tq_parent, TASKQUEUE_CALLBACK_TYPE_INIT);
+	TQ_LOCK(tq);
+	while ((tq->tq_flags & TQ_FLAGS_ACTIVE) != 0) {
+		taskqueue_run_locked(tq);
+		if ((tq->tq_flags & TQ_FLAGS_ACTIVE) == 0)
+			break;
+		TQ_UNLOCK(tq);
+		if (taskqueue_pcpu_steal(tq)) {
+			TQ_LOCK(tq);
+			continue;
+		}
+		TQ_LOCK(tq);
+		if ((tq->tq_flags & TQ_FLAGS_ACTIVE) == 0)
+			break;
+		if (!STAILQ_EMPTY(&tq->tq_queue))
+			continue;
+		tq->tq_flags |= TQ_FLAGS_IDLE;
+		TQ_SLEEP(tq, tq, &tq->tq_mutex, 0, "-", 0);
+		tq->tq_flags &= ~TQ_FLAGS_IDLE;
+	}
+	taskqueue_run_locked(tq);
+	TQ_UNLOCK(tq);
+	taskqueue_run_callback(tq->tq_parent,
+	    TASKQUEUE_CALLBACK_TYPE_SHUTDOWN);
+	TQ_LOCK(tq);
+	tq->tq_tcount--;
+	wakeup_one(tq->tq_threads);
+	TQ_UNLOCK(tq);
+	kthread_exit();
+}
+
+static void
+taskqueue_pcpu_free(struct taskqueue *queue)
+{
+	struct taskqueue *tq;
+	u_int cpu;
+
+	/*
+	 * Stop every worker before tearing down any queue, as a worker
+	 * may be running a task it stole from a sibling.
+	 */
+	CPU_FOREACH(cpu) {
+		tq = queue->tq_pcpu[cpu];
+		TQ_LOCK(tq);
+		tq->tq_flags &= ~TQ_FLAGS_ACTIVE;
+		wakeup(tq);
+		TQ_UNLOCK(tq);
+	}
+	CPU_FOREACH(cpu) {
+		tq = queue->tq_pcpu[cpu];
+		TQ_LOCK(tq);
+		taskqueue_terminate(tq->tq_threads, tq);
+		TQ_UNLOCK(tq);
+	}
+	CPU_FOREACH(cpu)
+		taskqueue_free(queue->tq_pcpu[cpu]);
+	free(queue->tq_pcpu, M_TASKQUEUE);
+	queue->tq_pcpu = NULL;
+}
+
+/*
+ * Create a per-cpu taskqueue and start its workers.  This must be
+ * called once all cpus have been started.
+ */
+struct taskqueue *
+taskqueue_create_pcpu(const char *name, int mflags, int pri)
+{
+	cpuset_t mask;
+	struct taskqueue *queue, *tq;
+	struct thread *td;
+	u_int cpu, i;
+	int error;
+
+	queue = _taskqueue_create(name, mflags, NULL, NULL,
+	    MTX_DEF | MTX_DUPOK, "taskqueue");
+	if (queue == NULL)
+		return (NULL);
+	queue->tq_pcpu = malloc(sizeof(struct taskqueue *) * (mp_maxid + 1),
+	    M_TASKQUEUE, mflags | M_ZERO);
+	if (queue->tq_pcpu == NULL)
+		goto fail;
+	CPU_FOREACH(cpu) {
+		tq = _taskqueue_create(name, mflags, taskqueue_pcpu_kick,
+		    NULL, MTX_DEF | MTX_DUPOK, "pcpu taskqueue");
+		if (tq == NULL)
+			goto fail;
+		tq->tq_context = tq;
+		tq->tq_flags |= TQ_FLAGS_UNLOCKED_ENQUEUE;
+		tq->tq_parent = queue;
+		CPU_FOREACH(i) {
+			if (i != cpu &&
+			    pcpu_find(i)->pc_domain == pcpu_find(cpu)->pc_domain)
+				CPU_SET(i, &tq->tq_steal);
+		}
+		tq->tq_threads = malloc(sizeof(struct thread *), M_TASKQUEUE,
+		    mflags | M_ZERO);
+		queue->tq_pcpu[cpu] = tq;
+		if (tq->tq_threads == NULL)
+			goto fail;
+	}
+
+	error = 0;
+	CPU_FOREACH(cpu) {
+		tq = queue->tq_pcpu[cpu];
+		error = kthread_add(taskqueue_pcpu_loop, tq, NULL,
+		    &tq->tq_threads[0], RFSTOPPED, 0, "%s_%u", name, cpu);
+		if (error != 0) {
+			printf("%s: kthread_add(%s_%u): error %d\n", __func__,
+			    name, cpu, error);
+			break;
+		}
+		tq->tq_tcount++;
+		td = tq->tq_threads[0];
+		CPU_SETOF(cpu, &mask);
+		error = cpuset_setthread(td->td_tid, &mask);
+		/*
+		 * Failing to pin is rarely an actual fatal error;
+		 * it'll just affect performance.
+		 */
+		if (error != 0)
+			printf("%s: curthread=%llu: can't pin; error=%d\n",
+			    __func__, (unsigned long long)td->td_tid, error);
+		error = 0;
+		thread_lock(td);
+		sched_prio(td, pri);
+		sched_add(td, SRQ_BORING);
+		thread_unlock(td);
+	}
+	if (error != 0) {
+		/* Workers already started exit through the usual path. */
+		taskqueue_free(queue);
+		return (NULL);
+	}
+	return (queue);
+
+fail:
+	if (queue->tq_pcpu != NULL) {
+		CPU_FOREACH(cpu) {
+			if (queue->tq_pcpu[cpu] != NULL)
+				taskqueue_free(queue->tq_pcpu[cpu]);
+		}
+		free(queue->tq_pcpu, M_TASKQUEUE);
+		queue->tq_pcpu = NULL;
+	}
+	taskqueue_free(queue);
+	return (NULL);
+}
@@ -247,7 +247,9 @@ vmem_t *memguard_arena = &memguard_arena_storage;
 static int
 bt_fill(vmem_t *vm, int flags)
 {
+	void *tags[BT_MAXALLOC];
 	bt_t *bt;
+	int i, n;
 
 	VMEM_ASSERT_LOCKED(vm);
 
@@ -262,9 +264,20 @@ bt_fill(vmem_t *vm, int flags)
 	/*
 	 * Loop until we meet the reserve.  To minimize the lock shuffle
 	 * and prevent simultaneous fills we first try a NOWAIT regardless
-	 * of the caller's flags.  Specify M_NOVM so we don't recurse while
-	 * holding a vmem lock.
+	 * of the caller's flags, fetching all of the missing tags in one
+	 * batch.  Specify M_NOVM so we don't recurse while holding a vmem
+	 * lock.
 	 */
+	if (vm->vm_nfreetags < BT_MAXALLOC) {
+		n = uma_zalloc_bulk(vmem_bt_zone, tags,
+		    BT_MAXALLOC - vm->vm_nfreetags, NULL,
+		    (flags & M_USE_RESERVE) | M_NOWAIT | M_NOVM);
+		for (i = 0; i < n; i++) {
+			bt = tags[i];
+			LIST_INSERT_HEAD(&vm->vm_freetags, bt, bt_freelist);
+		}
+		vm->vm_nfreetags += n;
+	}
 	while (vm->vm_nfreetags < BT_MAXALLOC) {
 		bt = uma_zalloc(vmem_bt_zone,
 		    (flags & M_USE_RESERVE) | M_NOWAIT | M_NOVM);
@@ -310,7 +323,9 @@ static void
 bt_freetrim(vmem_t *vm, int freelimit)
 {
 	LIST_HEAD(, vmem_btag) freetags;
+	void *tags[BT_MAXFREE];
 	bt_t *bt;
+	int n;
 
 	LIST_INIT(&freetags);
 	VMEM_ASSERT_LOCKED(vm);
@@ -321,9 +336,14 @@ bt_freetrim(vmem_t *vm, int freelimit)
 		LIST_INSERT_HEAD(&freetags, bt, bt_freelist);
 	}
 	VMEM_UNLOCK(vm);
+	n = 0;
 	while ((bt = LIST_FIRST(&freetags)) != NULL) {
 		LIST_REMOVE(bt, bt_freelist);
-		uma_zfree(vmem_bt_zone, bt);
+		tags[n++] = bt;
+		if (n == nitems(tags) || LIST_EMPTY(&freetags)) {
+			uma_zfree_bulk(vmem_bt_zone, tags, n, NULL);
+			n = 0;
+		}
 	}
 }
 
@@ -495,7 +515,7 @@ bt_insfree(vmem_t *vm, bt_t *bt)
  * Import from the arena into the quantum cache in UMA.
  */
 static int
-qc_import(void *arg, void **store, int cnt, int flags)
+qc_import(void *arg, void **store, int cnt, int domain, int flags)
 {
 	qcache_t *qc;
 	vmem_addr_t addr;
@@ -609,7 +629,8 @@ static struct mtx_padalign vmem_bt_lock;
  * we are really out of KVA.
  */
 static void *
-vmem_bt_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
+vmem_bt_alloc(uma_zone_t zone, vm_size_t bytes, int domain, uint8_t *pflag,
+    int wait)
 {
 	vmem_addr_t addr;
 
@@ -623,7 +644,7 @@ vmem_bt_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
 	if (vmem_xalloc(kmem_arena, bytes, 0, 0, 0, VMEM_ADDR_MIN,
 	    VMEM_ADDR_MAX, M_NOWAIT | M_NOVM | M_USE_RESERVE | M_BESTFIT,
 	    &addr) == 0) {
-		if (kmem_back(kmem_object, addr, bytes,
+		if (kmem_back_domain(kmem_object, addr, bytes, domain,
 		    M_NOWAIT | M_USE_RESERVE) == 0) {
 			mtx_unlock(&vmem_bt_lock);
 			return ((void *)addr);
@@ -42,6 +42,17 @@
  * pageable kernel buffer.  Since signals don't happen all that often,
  * the copy operation is normally eliminated.
  *
+ * When kern.ipc.pipeloan is set, a direct write of private anonymous
+ * memory does not wait for the reader at all.  The held pages are marked
+ * VPO_LOANED and write-protected, so a later store by the writer faults
+ * and gets a private copy (see vm_fault()), and the reader drains the
+ * original pages whenever it gets around to it.  Only the next write
+ * waits for the loan to be consumed.
+ *
+ * The FIOSPLICE ioctl hands pipe contents to another descriptor from
+ * the kernel side, sparing the read(2)/write(2) round trip through a
+ * user buffer.
+ *
  * The constant PIPE_MINDIRECT is chosen to make sure that buffering will
  * happen for small transfers so that the system will not spend all of
  * its time context switching.
@@ -60,7 +71,8 @@
  *
  * 0% - 50%:
  *     New pipes are given 16K of memory backing, pipes may dynamically
- *     grow to as large as 64K where needed.
+ *     grow to as large as kern.ipc.pipemaxsize (64K by default) where
+ *     needed.
  * 50% - 75%:
  *     New pipes are given 4K (or PAGE_SIZE) of memory backing,
  *     existing pipes may NOT grow.
@@ -94,6 +106,8 @@ __FBSDID("$FreeBSD: head/sys/kern/sys_pipe.c 286021 2015-07-29 17:18:27Z ed $");
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/buf.h>
+#include <sys/capsicum.h>
 #include <sys/conf.h>
 #include <sys/fcntl.h>
 #include <sys/file.h>
@@ -107,12 +121,14 @@ __FBSDID("$FreeBSD: head/sys/kern/sys_pipe.c 286021 2015-07-29 17:18:27Z ed $");
 #include <sys/malloc.h>
 #include <sys/poll.h>
 #include <sys/selinfo.h>
+#include <sys/sf_buf.h>
 #include <sys/signalvar.h>
 #include <sys/syscallsubr.h>
 #include <sys/sysctl.h>
 #include <sys/sysproto.h>
 #include <sys/pipe.h>
 #include <sys/proc.h>
+#include <sys/rwlock.h>
 #include <sys/vnode.h>
 #include <sys/uio.h>
 #include <sys/user.h>
@@ -207,6 +223,8 @@ static int pipefragretry;
 static int pipeallocfail;
 static int piperesizefail;
 static int piperesizeallowed = 1;
+static int pipemaxsize = BIG_PIPE_SIZE;
+static int pipeloan;
 
 SYSCTL_LONG(_kern_ipc, OID_AUTO, maxpipekva, CTLFLAG_RDTUN | CTLFLAG_NOFETCH,
 	   &maxpipekva, 0, "Pipe KVA limit");
@@ -220,6 +238,25 @@ SYSCTL_INT(_kern_ipc, OID_AUTO, piperesizefail, CTLFLAG_RD,
 	  &piperesizefail, 0, "Pipe resize failures");
 SYSCTL_INT(_kern_ipc, OID_AUTO, piperesizeallowed, CTLFLAG_RW,
 	  &piperesizeallowed, 0, "Pipe resizing allowed");
+SYSCTL_INT(_kern_ipc, OID_AUTO, pipeloan, CTLFLAG_RW,
+	  &pipeloan, 0, "Loan direct write pages copy-on-write to the reader");
+
+static int
+sysctl_pipemaxsize(SYSCTL_HANDLER_ARGS)
+{
+	int error, val;
+
+	val = pipemaxsize;
+	error = sysctl_handle_int(oidp, &val, 0, req);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (val < PIPE_SIZE || val > maxpipekva / 16)
+		return (EINVAL);
+	pipemaxsize = round_page(val);
+	return (0);
+}
+SYSCTL_PROC(_kern_ipc, OID_AUTO, pipemaxsize, CTLTYPE_INT | CTLFLAG_RW,
+	  NULL, 0, sysctl_pipemaxsize, "I", "Maximum size of a pipe buffer");
 
 static void pipeinit(void *dummy __unused);
 static void pipeclose(struct pipe *cpipe);
@@ -233,7 +270,12 @@ static int pipe_build_write_buffer(struct pipe *wpipe, struct uio *uio);
 static void pipe_destroy_write_buffer(struct pipe *wpipe);
 static int pipe_direct_write(struct pipe *wpipe, struct uio *uio);
 static void pipe_clone_write_buffer(struct pipe *wpipe);
+static void pipe_loan_done(struct pipe *cpipe);
 #endif
+static int pipe_splice(struct file *fp, struct fiosplice_arg *fsa,
+    struct ucred *active_cred, struct thread *td);
+static int pipe_splice_pipe(struct pipe *rpipe, struct pipe *wpipe,
+    const char *src, int len, int nonblock, int *done);
 static int pipespace(struct pipe *cpipe, int size);
 static int pipespace_new(struct pipe *cpipe, int size);
 
@@ -740,6 +782,8 @@ pipe_read(fp, uio, active_cred, flags, td)
 			rpipe->pipe_map.pos += size;
 			rpipe->pipe_map.cnt -= size;
 			if (rpipe->pipe_map.cnt == 0) {
+				if (rpipe->pipe_state & PIPE_LOANED)
+					pipe_loan_done(rpipe);
 				rpipe->pipe_state &= ~(PIPE_DIRECTW|PIPE_WANTW);
 				wakeup(rpipe);
 			}
@@ -841,9 +885,8 @@ pipe_build_write_buffer(wpipe, uio)
 	KASSERT(wpipe->pipe_state & PIPE_DIRECTW,
 		("Clone attempt on non-direct write pipe!"));
 
-	if (uio->uio_iov->iov_len > wpipe->pipe_buffer.size)
-                size = wpipe->pipe_buffer.size;
-	else
+	size = min(wpipe->pipe_buffer.size, BIG_PIPE_SIZE);
+	if (uio->uio_iov->iov_len < size)
                 size = uio->uio_iov->iov_len;
 
 	if ((i = vm_fault_quick_hold_pages(&curproc->p_vmspace->vm_map,
@@ -923,6 +966,23 @@ pipe_clone_write_buffer(wpipe)
 	pipe_destroy_write_buffer(wpipe);
 }
 
+/*
+ * The reader has consumed a loaned direct write, or is going away.
+ */
+static void
+pipe_loan_done(cpipe)
+	struct pipe *cpipe;
+{
+
+	PIPE_LOCK_ASSERT(cpipe, MA_OWNED);
+	KASSERT(cpipe->pipe_state & PIPE_LOANED,
+		("pipe_loan_done: no loan"));
+	vm_page_unloan(cpipe->pipe_map.ms, cpipe->pipe_map.npages);
+	pipe_destroy_write_buffer(cpipe);
+	cpipe->pipe_map.cnt = 0;
+	cpipe->pipe_state &= ~(PIPE_LOANED | PIPE_DIRECTW);
+}
+
 /*
  * This implements the pipe buffer write mechanism.  Note that only
  * a direct write OR a normal pipe write can be pending at any given time.
@@ -935,7 +995,7 @@ pipe_direct_write(wpipe, uio)
 	struct pipe *wpipe;
 	struct uio *uio;
 {
-	int error;
+	int error, loaned;
 
 retry:
 	PIPE_LOCK_ASSERT(wpipe, MA_OWNED);
@@ -982,13 +1042,31 @@ retry:
 	wpipe->pipe_state |= PIPE_DIRECTW;
 
 	PIPE_UNLOCK(wpipe);
+	loaned = 0;
 	error = pipe_build_write_buffer(wpipe, uio);
+	if (error == 0 && pipeloan != 0)
+		loaned = vm_page_loan(wpipe->pipe_map.ms,
+		    wpipe->pipe_map.npages);
 	PIPE_LOCK(wpipe);
 	if (error) {
 		wpipe->pipe_state &= ~PIPE_DIRECTW;
 		pipeunlock(wpipe);
 		goto error1;
 	}
+	if (loaned) {
+		/*
+		 * The reader owns the pages now; it releases them once
+		 * they are drained, and we are free to go.
+		 */
+		wpipe->pipe_state |= PIPE_LOANED;
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		pipeselwakeup(wpipe);
+		pipeunlock(wpipe);
+		return (0);
+	}
 
 	error = 0;
 	while (!error && (wpipe->pipe_state & PIPE_DIRECTW)) {
@@ -1078,9 +1156,9 @@ pipe_write(fp, uio, active_cred, flags, td)
 			break;
 		if (amountpipekva > maxpipekva / 2)
 			break;
-		if (desiredsize == BIG_PIPE_SIZE)
+		if (desiredsize >= pipemaxsize)
 			break;
-		desiredsize = desiredsize * 2;
+		desiredsize = min(desiredsize * 2, pipemaxsize);
 	}
 
 	/* Choose a smaller size if we're in a OOM situation */
@@ -1313,6 +1391,359 @@ pipe_write(fp, uio, active_cred, flags, td)
 	return (error);
 }
 
+/*
+ * Write a stretch of pipe data, already in the kernel, to the splice
+ * destination.  The number of bytes taken is returned in *done.
+ */
+static int
+pipe_splice_out(struct file *dfp, void *buf, int len, struct thread *td,
+    int *done)
+{
+	struct uio auio;
+	struct iovec aiov;
+	int error;
+
+	aiov.iov_base = buf;
+	aiov.iov_len = len;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = -1;
+	auio.uio_resid = len;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_WRITE;
+	auio.uio_td = td;
+	if (dfp->f_type == DTYPE_VNODE)
+		bwillwrite();
+	error = fo_write(dfp, &auio, td->td_ucred, 0, td);
+	*done = len - auio.uio_resid;
+	if (*done > 0 && (error == ERESTART || error == EINTR ||
+	    error == EWOULDBLOCK))
+		error = 0;
+	return (error);
+}
+
+/*
+ * Append up to len bytes at src, which belong to splice source rpipe, to
+ * the buffer of destination pipe wpipe.  This stands in for fo_write()
+ * when splicing into a pipe: pipe_write() would block on wpipe's I/O
+ * lock while we hold rpipe's, and two splices running in opposite
+ * directions between the same two pipes would deadlock.  Here we never
+ * sleep on wpipe with rpipe locked.  If wpipe is locked, or is full and
+ * nonblock is clear, rpipe's I/O lock is dropped for the wait and
+ * reacquired, and EBUSY tells the caller to re-read rpipe's state.  A
+ * full wpipe with nonblock set gives EAGAIN.
+ *
+ * Called and returns with rpipe's I/O lock and mutex held.
+ */
+static int
+pipe_splice_pipe(struct pipe *rpipe, struct pipe *wpipe, const char *src,
+    int len, int nonblock, int *done)
+{
+	int error, segsize, space;
+
+	PIPE_LOCK_ASSERT(rpipe, MA_OWNED);
+	*done = 0;
+	PIPE_UNLOCK(rpipe);
+	PIPE_LOCK(wpipe);
+	if (wpipe->pipe_present != PIPE_ACTIVE ||
+	    (wpipe->pipe_state & PIPE_EOF) != 0) {
+		error = EPIPE;
+		goto out;
+	}
+	if ((wpipe->pipe_state & PIPE_LOCKFL) != 0)
+		goto wait;
+	if (wpipe->pipe_buffer.size == 0) {
+		error = ENOMEM;
+		goto out;
+	}
+	space = wpipe->pipe_buffer.size - wpipe->pipe_buffer.cnt;
+	if ((wpipe->pipe_state & PIPE_DIRECTW) != 0 || space == 0) {
+		if (wpipe->pipe_state & PIPE_WANTR) {
+			wpipe->pipe_state &= ~PIPE_WANTR;
+			wakeup(wpipe);
+		}
+		pipeselwakeup(wpipe);
+		if (nonblock) {
+			error = EAGAIN;
+			goto out;
+		}
+		goto wait;
+	}
+	if (len > space)
+		len = space;
+	(void)pipelock(wpipe, 0);
+	PIPE_UNLOCK(wpipe);
+
+	segsize = wpipe->pipe_buffer.size - wpipe->pipe_buffer.in;
+	if (segsize > len)
+		segsize = len;
+	bcopy(src, &wpipe->pipe_buffer.buffer[wpipe->pipe_buffer.in], segsize);
+	if (segsize < len)
+		bcopy(src + segsize, &wpipe->pipe_buffer.buffer[0],
+		    len - segsize);
+
+	PIPE_LOCK(wpipe);
+	wpipe->pipe_buffer.in += len;
+	if (wpipe->pipe_buffer.in >= wpipe->pipe_buffer.size)
+		wpipe->pipe_buffer.in -= wpipe->pipe_buffer.size;
+	wpipe->pipe_buffer.cnt += len;
+	KASSERT(wpipe->pipe_buffer.cnt <= wpipe->pipe_buffer.size,
+	    ("Pipe buffer overflow"));
+	if (wpipe->pipe_state & PIPE_WANTR) {
+		wpipe->pipe_state &= ~PIPE_WANTR;
+		wakeup(wpipe);
+	}
+	vfs_timestamp(&wpipe->pipe_mtime);
+	pipeselwakeup(wpipe);
+	pipeunlock(wpipe);
+	*done = len;
+	error = 0;
+out:
+	PIPE_UNLOCK(wpipe);
+	PIPE_LOCK(rpipe);
+	return (error);
+
+wait:
+	/*
+	 * The pipe mutexes of the two pairs are never held together, so
+	 * rpipe is unlocked before the wait condition is checked again.
+	 */
+	PIPE_UNLOCK(wpipe);
+	PIPE_LOCK(rpipe);
+	pipeunlock(rpipe);
+	PIPE_UNLOCK(rpipe);
+	PIPE_LOCK(wpipe);
+	/* Hold off pipeclose() and get woken up by it. */
+	++wpipe->pipe_busy;
+	error = 0;
+	if ((wpipe->pipe_state & PIPE_LOCKFL) != 0) {
+		wpipe->pipe_state |= PIPE_LWANT;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH,
+		    "pipelk", 0);
+	} else if (wpipe->pipe_present == PIPE_ACTIVE &&
+	    (wpipe->pipe_state & PIPE_EOF) == 0 &&
+	    ((wpipe->pipe_state & PIPE_DIRECTW) != 0 ||
+	    wpipe->pipe_buffer.cnt == wpipe->pipe_buffer.size)) {
+		wpipe->pipe_state |= PIPE_WANTW;
+		error = msleep(wpipe, PIPE_MTX(wpipe), PRIBIO | PCATCH,
+		    "pipespw", 0);
+	}
+	if (--wpipe->pipe_busy == 0 && (wpipe->pipe_state & PIPE_WANT)) {
+		wpipe->pipe_state &= ~(PIPE_WANT | PIPE_WANTR);
+		wakeup(wpipe);
+	}
+	PIPE_UNLOCK(wpipe);
+	PIPE_LOCK(rpipe);
+	(void)pipelock(rpipe, 0);
+	return (error != 0 ? error : EBUSY);
+}
+
+/*
+ * Move up to fsa->len bytes from the pipe to descriptor fsa->fd.  The
+ * data is written straight from the pipe buffer, or from the writer's
+ * pages for a direct write, so it is never copied out to user space
+ * and back.  Like read(2), this waits for data unless the pipe is
+ * non-blocking and returns short once something was moved.  The byte
+ * count moved is returned in fsa->len.
+ */
+static int
+pipe_splice(fp, fsa, active_cred, td)
+	struct file *fp;
+	struct fiosplice_arg *fsa;
+	struct ucred *active_cred;
+	struct thread *td;
+{
+	struct file *dfp;
+	struct pipe *rpipe, *wpipe;
+	cap_rights_t rights;
+	int done, error, moved, nonblock, size;
+#ifndef PIPE_NODIRECT
+	struct sf_buf *sf;
+	int off;
+#endif
+
+	rpipe = fp->f_data;
+	if ((fp->f_flag & FREAD) == 0)
+		return (EBADF);
+	if (fsa->len < 0)
+		return (EINVAL);
+	error = fget_write(td, fsa->fd, cap_rights_init(&rights, CAP_WRITE),
+	    &dfp);
+	if (error != 0)
+		return (error);
+	if (dfp->f_ops == &pipeops &&
+	    ((struct pipe *)dfp->f_data)->pipe_pair == rpipe->pipe_pair) {
+		fdrop(dfp, td);
+		return (EINVAL);
+	}
+	wpipe = NULL;
+	if (dfp->f_ops == &pipeops) {
+		wpipe = PIPE_PEER((struct pipe *)dfp->f_data);
+#ifdef MAC
+		PIPE_LOCK(wpipe);
+		error = mac_pipe_check_write(active_cred, wpipe->pipe_pair);
+		PIPE_UNLOCK(wpipe);
+		if (error) {
+			fdrop(dfp, td);
+			return (error);
+		}
+#endif
+	}
+
+	moved = 0;
+	PIPE_LOCK(rpipe);
+	++rpipe->pipe_busy;
+	error = pipelock(rpipe, 1);
+	if (error)
+		goto unlocked_error;
+
+#ifdef MAC
+	error = mac_pipe_check_read(active_cred, rpipe->pipe_pair);
+	if (error)
+		goto locked_error;
+#endif
+	while (moved < fsa->len) {
+		if (rpipe->pipe_buffer.cnt > 0) {
+			size = rpipe->pipe_buffer.size - rpipe->pipe_buffer.out;
+			if (size > rpipe->pipe_buffer.cnt)
+				size = rpipe->pipe_buffer.cnt;
+			if (size > fsa->len - moved)
+				size = fsa->len - moved;
+
+			nonblock = moved > 0 || (dfp->f_flag & FNONBLOCK) != 0;
+			if (wpipe != NULL) {
+				error = pipe_splice_pipe(rpipe, wpipe,
+				    &rpipe->pipe_buffer.buffer[
+				    rpipe->pipe_buffer.out], size, nonblock,
+				    &done);
+				if (error == EBUSY)
+					continue;
+			} else {
+				PIPE_UNLOCK(rpipe);
+				error = pipe_splice_out(dfp,
+				    &rpipe->pipe_buffer.buffer[
+				    rpipe->pipe_buffer.out], size, td, &done);
+				PIPE_LOCK(rpipe);
+			}
+
+			rpipe->pipe_buffer.out += done;
+			if (rpipe->pipe_buffer.out >= rpipe->pipe_buffer.size)
+				rpipe->pipe_buffer.out = 0;
+			rpipe->pipe_buffer.cnt -= done;
+			if (rpipe->pipe_buffer.cnt == 0) {
+				rpipe->pipe_buffer.in = 0;
+				rpipe->pipe_buffer.out = 0;
+			}
+			moved += done;
+			if (error != 0 || done < size)
+				break;
+#ifndef PIPE_NODIRECT
+		} else if ((size = rpipe->pipe_map.cnt) &&
+			   (rpipe->pipe_state & PIPE_DIRECTW)) {
+			/*
+			 * One page at a time, through an sf_buf mapping.
+			 */
+			off = rpipe->pipe_map.pos & PAGE_MASK;
+			if (size > PAGE_SIZE - off)
+				size = PAGE_SIZE - off;
+			if (size > fsa->len - moved)
+				size = fsa->len - moved;
+
+			PIPE_UNLOCK(rpipe);
+			sf = sf_buf_alloc(rpipe->pipe_map.ms[
+			    rpipe->pipe_map.pos >> PAGE_SHIFT], SFB_CATCH);
+			if (sf == NULL) {
+				PIPE_LOCK(rpipe);
+				error = EINTR;
+				break;
+			}
+			if (wpipe != NULL) {
+				nonblock = moved > 0 ||
+				    (dfp->f_flag & FNONBLOCK) != 0;
+				PIPE_LOCK(rpipe);
+				error = pipe_splice_pipe(rpipe, wpipe,
+				    (char *)sf_buf_kva(sf) + off, size,
+				    nonblock, &done);
+				PIPE_UNLOCK(rpipe);
+			} else
+				error = pipe_splice_out(dfp,
+				    (char *)sf_buf_kva(sf) + off, size, td,
+				    &done);
+			sf_buf_free(sf);
+			PIPE_LOCK(rpipe);
+			if (error == EBUSY)
+				continue;
+
+			rpipe->pipe_map.pos += done;
+			rpipe->pipe_map.cnt -= done;
+			if (rpipe->pipe_map.cnt == 0) {
+				if (rpipe->pipe_state & PIPE_LOANED)
+					pipe_loan_done(rpipe);
+				rpipe->pipe_state &= ~(PIPE_DIRECTW|PIPE_WANTW);
+				wakeup(rpipe);
+			}
+			moved += done;
+			if (error != 0 || done < size)
+				break;
+#endif
+		} else {
+			if (rpipe->pipe_state & PIPE_EOF)
+				break;
+
+			if (rpipe->pipe_state & PIPE_WANTW) {
+				rpipe->pipe_state &= ~PIPE_WANTW;
+				wakeup(rpipe);
+			}
+
+			if (moved > 0)
+				break;
+
+			pipeunlock(rpipe);
+			if (fp->f_flag & FNONBLOCK) {
+				error = EAGAIN;
+			} else {
+				rpipe->pipe_state |= PIPE_WANTR;
+				if ((error = msleep(rpipe, PIPE_MTX(rpipe),
+				    PRIBIO | PCATCH,
+				    "pipesp", 0)) == 0)
+					error = pipelock(rpipe, 1);
+			}
+			if (error)
+				goto unlocked_error;
+		}
+	}
+#ifdef MAC
+locked_error:
+#endif
+	pipeunlock(rpipe);
+
+	if (moved > 0)
+		vfs_timestamp(&rpipe->pipe_atime);
+unlocked_error:
+	--rpipe->pipe_busy;
+
+	if ((rpipe->pipe_busy == 0) && (rpipe->pipe_state & PIPE_WANT)) {
+		rpipe->pipe_state &= ~(PIPE_WANT|PIPE_WANTW);
+		wakeup(rpipe);
+	} else if (rpipe->pipe_buffer.cnt < MINPIPESIZE) {
+		if (rpipe->pipe_state & PIPE_WANTW) {
+			rpipe->pipe_state &= ~PIPE_WANTW;
+			wakeup(rpipe);
+		}
+	}
+
+	if ((rpipe->pipe_buffer.size - rpipe->pipe_buffer.cnt) >= PIPE_BUF)
+		pipeselwakeup(rpipe);
+
+	PIPE_UNLOCK(rpipe);
+	fdrop(dfp, td);
+	if (moved > 0 && (error == ERESTART || error == EINTR ||
+	    error == EWOULDBLOCK))
+		error = 0;
+	fsa->len = moved;
+	return (error);
+}
+
 /* ARGSUSED */
 static int
 pipe_truncate(fp, length, active_cred, td)
@@ -1391,6 +1822,12 @@ pipe_ioctl(fp, cmd, data, active_cred, td)
 		*(int *)data = fgetown(&mpipe->pipe_sigio);
 		break;
 
+	case FIOSPLICE:
+		PIPE_UNLOCK(mpipe);
+		error = pipe_splice(fp, (struct fiosplice_arg *)data,
+		    active_cred, td);
+		goto out_unlocked;
+
 	/* This is deprecated, FIOSETOWN should be used instead. */
 	case TIOCSPGRP:
 		PIPE_UNLOCK(mpipe);
@@ -1687,6 +2124,14 @@ pipeclose(cpipe)
 		KNOTE_LOCKED(&ppipe->pipe_sel.si_note, 0);
 	}
 
+#ifndef PIPE_NODIRECT
+	/*
+	 * Nobody is left to drain a loaned direct write.
+	 */
+	if (cpipe->pipe_state & PIPE_LOANED)
+		pipe_loan_done(cpipe);
+#endif
+
 	/*
 	 * Mark this endpoint as free.  Release kmem resources.  We
 	 * don't mark this endpoint as unused until we've finished
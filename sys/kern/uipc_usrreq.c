@@ -77,8 +77,10 @@ __FBSDID("$FreeBSD: head/sys/kern/uipc_usrreq.c 293432 2016-01-08 19:03:20Z gleb
 #include <sys/proc.h>
 #include <sys/protosw.h>
 #include <sys/queue.h>
+#include <sys/refcount.h>
 #include <sys/resourcevar.h>
 #include <sys/rwlock.h>
+#include <sys/sf_buf.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
 #include <sys/signalvar.h>
@@ -87,6 +89,7 @@ __FBSDID("$FreeBSD: head/sys/kern/uipc_usrreq.c 293432 2016-01-08 19:03:20Z gleb
 #include <sys/sysctl.h>
 #include <sys/systm.h>
 #include <sys/taskqueue.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/unpcb.h>
 #include <sys/vnode.h>
@@ -99,6 +102,12 @@ __FBSDID("$FreeBSD: head/sys/kern/uipc_usrreq.c 293432 2016-01-08 19:03:20Z gleb
 
 #include <security/mac/mac_framework.h>
 
+#include <vm/vm.h>
+#include <vm/vm_param.h>
+#include <vm/vm_extern.h>
+#include <vm/pmap.h>
+#include <vm/vm_map.h>
+#include <vm/vm_page.h>
 #include <vm/uma.h>
 
 MALLOC_DECLARE(M_FILECAPS);
@@ -192,10 +201,16 @@ SYSCTL_INT(_net_local, OID_AUTO, deferred, CTLFLAG_RD,
  * Three types of locks exit in the local domain socket implementation: a
  * global list mutex, a global linkage rwlock, and per-unpcb mutexes.  Of the
  * global locks, the list lock protects the socket count, global generation
- * number, and stream/datagram global lists.  The linkage lock protects the
- * interconnection of unpcbs, the v_socket and unp_vnode pointers, and can be
- * held exclusively over the acquisition of multiple unpcb locks to prevent
- * deadlock.
+ * number, and stream/datagram global lists.  The linkage lock protects only
+ * the accounting of file descriptors in flight (unp_rights, unp_msgcount and
+ * unp_file), and is used by the garbage collector to get a stable view of
+ * it; no socket operation on the data path acquires it.
+ *
+ * The v_socket pointer of a socket vnode and the matching unp_vnode pointer
+ * are protected by a pool mutex chosen by the vnode address (the "vplock"),
+ * which is held over bind, connect, detach and vnode reclamation.  As long
+ * as it is held, the socket named by v_socket cannot complete pru_detach(),
+ * so connect may use the listening socket without a reference of its own.
  *
  * UNIX domain sockets each have an unpcb hung off of their so_pcb pointer,
  * allocated in pru_attach() and freed in pru_detach().  The validity of that
@@ -214,10 +229,18 @@ SYSCTL_INT(_net_local, OID_AUTO, deferred, CTLFLAG_RD,
  *
  * Fields of unpcbss are locked using a per-unpcb lock, unp_mtx.  Individual
  * atomic reads without the lock may be performed "lockless", but more
- * complex reads and read-modify-writes require the mutex to be held.  No
- * lock order is defined between unpcb locks -- multiple unpcb locks may be
- * acquired at the same time only when holding the linkage rwlock
- * exclusively, which prevents deadlocks.
+ * complex reads and read-modify-writes require the mutex to be held.  The
+ * unp_conn pointer and unp_refs list change only with the locks of both
+ * ends held, so holding either one keeps the peer from disconnecting or
+ * being freed.  unpcb locks are ordered by address: a thread holding a
+ * unpcb lock may block on a unpcb at a higher address, but must otherwise
+ * try-lock, and on failure take a reference on the other unpcb (unp_refcount),
+ * drop its own lock and relock both in order; see unp_pcb_lock_other().  The
+ * one exception is connect, which locks the listening socket, the socket
+ * created by sonewconn() and the connecting socket in that order: a listener
+ * is never reached through unp_conn or unp_refs, and neither the new nor the
+ * connecting stream socket has a peer whose lock could be waited upon.
+ * Lock order is therefore vplock, unpcb, list lock, socket buffers.
  *
  * Blocking with UNIX domain sockets is a tricky issue: unlike most network
  * protocols, bind() is a non-atomic operation, and connect() requires
@@ -266,6 +289,7 @@ static struct mtx	unp_defers_lock;
 					    MTX_DUPOK|MTX_DEF|MTX_RECURSE)
 #define	UNP_PCB_LOCK_DESTROY(unp)	mtx_destroy(&(unp)->unp_mtx)
 #define	UNP_PCB_LOCK(unp)		mtx_lock(&(unp)->unp_mtx)
+#define	UNP_PCB_TRYLOCK(unp)		mtx_trylock(&(unp)->unp_mtx)
 #define	UNP_PCB_UNLOCK(unp)		mtx_unlock(&(unp)->unp_mtx)
 #define	UNP_PCB_LOCK_ASSERT(unp)	mtx_assert(&(unp)->unp_mtx, MA_OWNED)
 
@@ -273,6 +297,8 @@ static int	uipc_connect2(struct socket *, struct socket *);
 static int	uipc_ctloutput(struct socket *, struct sockopt *);
 static int	unp_connect(struct socket *, struct sockaddr *,
 		    struct thread *);
+static int	unp_lookup(int, struct socket *, struct sockaddr *,
+		    struct thread *, struct vnode **, struct socket **);
 static int	unp_connectat(int, struct socket *, struct sockaddr *,
 		    struct thread *);
 static int	unp_connect2(struct socket *so, struct socket *so2, int);
@@ -281,6 +307,11 @@ static void	unp_dispose(struct mbuf *);
 static void	unp_dispose_so(struct socket *so);
 static void	unp_shutdown(struct unpcb *);
 static void	unp_drop(struct unpcb *, int);
+static void	unp_pcb_hold(struct unpcb *);
+static int	unp_pcb_rele(struct unpcb *);
+static int	unp_pcb_lock_other(struct unpcb *, struct unpcb *);
+static struct unpcb	*unp_pcb_lock_peer(struct unpcb *);
+static void	unp_pcb_lock2(struct unpcb *, struct unpcb *);
 static void	unp_gc(__unused void *, int);
 static void	unp_scan(struct mbuf *, void (*)(struct filedescent **, int));
 static void	unp_discard(struct file *);
@@ -341,6 +372,89 @@ static struct domain localdomain = {
 };
 DOMAIN_SET(local);
 
+static void
+unp_pcb_hold(struct unpcb *unp)
+{
+
+	refcount_acquire(&unp->unp_refcount);
+}
+
+/*
+ * Drop a reference on a locked unpcb.  Returns 1 if that was the last
+ * reference, in which case the unpcb has been unlocked and freed.
+ */
+static int
+unp_pcb_rele(struct unpcb *unp)
+{
+
+	UNP_PCB_LOCK_ASSERT(unp);
+	if (!refcount_release(&unp->unp_refcount))
+		return (0);
+	UNP_PCB_UNLOCK(unp);
+	UNP_PCB_LOCK_DESTROY(unp);
+	uma_zfree(unp_zone, unp);
+	return (1);
+}
+
+/*
+ * Acquire the lock on unp2, reached through unp_conn or unp_refs of the
+ * locked unp, without violating the address order of unpcb locks.  Returns 1
+ * with both unpcbs locked if unp's lock was held throughout.  Otherwise unp's
+ * lock had to be dropped while waiting for unp2; 0 is returned with only unp
+ * locked, and the caller must look its peer up again.
+ */
+static int
+unp_pcb_lock_other(struct unpcb *unp, struct unpcb *unp2)
+{
+
+	UNP_PCB_LOCK_ASSERT(unp);
+	if (unp2 == unp || unp < unp2) {
+		UNP_PCB_LOCK(unp2);
+		return (1);
+	}
+	if (UNP_PCB_TRYLOCK(unp2))
+		return (1);
+	unp_pcb_hold(unp2);
+	UNP_PCB_UNLOCK(unp);
+	UNP_PCB_LOCK(unp2);
+	UNP_PCB_LOCK(unp);
+	if (!unp_pcb_rele(unp2))
+		UNP_PCB_UNLOCK(unp2);
+	return (0);
+}
+
+/*
+ * Lock the peer of the locked unp, if it has one, and return it.
+ */
+static struct unpcb *
+unp_pcb_lock_peer(struct unpcb *unp)
+{
+	struct unpcb *unp2;
+
+	UNP_PCB_LOCK_ASSERT(unp);
+	while ((unp2 = unp->unp_conn) != NULL) {
+		if (unp_pcb_lock_other(unp, unp2))
+			break;
+	}
+	return (unp2);
+}
+
+/*
+ * Lock two unpcbs neither of which is held by the caller.
+ */
+static void
+unp_pcb_lock2(struct unpcb *unp, struct unpcb *unp2)
+{
+
+	if (unp2 < unp) {
+		UNP_PCB_LOCK(unp2);
+		UNP_PCB_LOCK(unp);
+	} else {
+		UNP_PCB_LOCK(unp);
+		UNP_PCB_LOCK(unp2);
+	}
+}
+
 static void
 uipc_abort(struct socket *so)
 {
@@ -349,16 +463,13 @@ uipc_abort(struct socket *so)
 	unp = sotounpcb(so);
 	KASSERT(unp != NULL, ("uipc_abort: unp == NULL"));
 
-	UNP_LINK_WLOCK();
 	UNP_PCB_LOCK(unp);
-	unp2 = unp->unp_conn;
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL) {
-		UNP_PCB_LOCK(unp2);
 		unp_drop(unp2, ECONNABORTED);
 		UNP_PCB_UNLOCK(unp2);
 	}
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
 }
 
 static int
@@ -375,18 +486,18 @@ uipc_accept(struct socket *so, struct sockaddr **nam)
 	KASSERT(unp != NULL, ("uipc_accept: unp == NULL"));
 
 	*nam = malloc(sizeof(struct sockaddr_un), M_SONAME, M_WAITOK);
-	UNP_LINK_RLOCK();
-	unp2 = unp->unp_conn;
+	UNP_PCB_LOCK(unp);
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL && unp2->unp_addr != NULL) {
-		UNP_PCB_LOCK(unp2);
 		sa = (struct sockaddr *) unp2->unp_addr;
 		bcopy(sa, *nam, sa->sa_len);
-		UNP_PCB_UNLOCK(unp2);
 	} else {
 		sa = &sun_noname;
 		bcopy(sa, *nam, sa->sa_len);
 	}
-	UNP_LINK_RUNLOCK();
+	if (unp2 != NULL)
+		UNP_PCB_UNLOCK(unp2);
+	UNP_PCB_UNLOCK(unp);
 	return (0);
 }
 
@@ -429,7 +540,7 @@ uipc_attach(struct socket *so, int proto, struct thread *td)
 	UNP_PCB_LOCK_INIT(unp);
 	unp->unp_socket = so;
 	so->so_pcb = unp;
-	unp->unp_refcount = 1;
+	refcount_init(&unp->unp_refcount, 1);
 
 	UNP_LIST_LOCK();
 	unp->unp_gencnt = ++unp_gencnt;
@@ -465,6 +576,7 @@ uipc_bindat(int fd, struct socket *so, struct sockaddr *nam, struct thread *td)
 	struct unpcb *unp;
 	struct vnode *vp;
 	struct mount *mp;
+	struct mtx *vplock;
 	cap_rights_t rights;
 	char *buf;
 
@@ -548,14 +660,15 @@ restart:
 	ASSERT_VOP_ELOCKED(vp, "uipc_bind");
 	soun = (struct sockaddr_un *)sodupsockaddr(nam, M_WAITOK);
 
-	UNP_LINK_WLOCK();
+	vplock = mtx_pool_find(mtxpool_sleep, vp);
+	mtx_lock(vplock);
 	UNP_PCB_LOCK(unp);
 	VOP_UNP_BIND(vp, unp->unp_socket);
 	unp->unp_vnode = vp;
 	unp->unp_addr = soun;
 	unp->unp_flags &= ~UNP_BINDING;
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
+	mtx_unlock(vplock);
 	VOP_UNLOCK(vp, 0);
 	vn_finished_write(mp);
 	free(buf, M_TEMP);
@@ -579,26 +692,18 @@ uipc_bind(struct socket *so, struct sockaddr *nam, struct thread *td)
 static int
 uipc_connect(struct socket *so, struct sockaddr *nam, struct thread *td)
 {
-	int error;
 
 	KASSERT(td == curthread, ("uipc_connect: td != curthread"));
-	UNP_LINK_WLOCK();
-	error = unp_connect(so, nam, td);
-	UNP_LINK_WUNLOCK();
-	return (error);
+	return (unp_connect(so, nam, td));
 }
 
 static int
 uipc_connectat(int fd, struct socket *so, struct sockaddr *nam,
     struct thread *td)
 {
-	int error;
 
 	KASSERT(td == curthread, ("uipc_connectat: td != curthread"));
-	UNP_LINK_WLOCK();
-	error = unp_connectat(fd, so, nam, td);
-	UNP_LINK_WUNLOCK();
-	return (error);
+	return (unp_connectat(fd, so, nam, td));
 }
 
 static void
@@ -609,16 +714,13 @@ uipc_close(struct socket *so)
 	unp = sotounpcb(so);
 	KASSERT(unp != NULL, ("uipc_close: unp == NULL"));
 
-	UNP_LINK_WLOCK();
 	UNP_PCB_LOCK(unp);
-	unp2 = unp->unp_conn;
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL) {
-		UNP_PCB_LOCK(unp2);
 		unp_disconnect(unp, unp2);
 		UNP_PCB_UNLOCK(unp2);
 	}
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
 }
 
 static int
@@ -627,78 +729,75 @@ uipc_connect2(struct socket *so1, struct socket *so2)
 	struct unpcb *unp, *unp2;
 	int error;
 
-	UNP_LINK_WLOCK();
 	unp = so1->so_pcb;
 	KASSERT(unp != NULL, ("uipc_connect2: unp == NULL"));
-	UNP_PCB_LOCK(unp);
 	unp2 = so2->so_pcb;
 	KASSERT(unp2 != NULL, ("uipc_connect2: unp2 == NULL"));
-	UNP_PCB_LOCK(unp2);
+	unp_pcb_lock2(unp, unp2);
 	error = unp_connect2(so1, so2, PRU_CONNECT2);
 	UNP_PCB_UNLOCK(unp2);
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
 	return (error);
 }
 
 static void
 uipc_detach(struct socket *so)
 {
-	struct unpcb *unp, *unp2;
+	struct unpcb *unp, *unp2, *ref;
 	struct sockaddr_un *saved_unp_addr;
 	struct vnode *vp;
-	int freeunp, local_unp_rights;
+	struct mtx *vplock;
+	int local_unp_rights;
 
 	unp = sotounpcb(so);
 	KASSERT(unp != NULL, ("uipc_detach: unp == NULL"));
 
-	UNP_LINK_WLOCK();
 	UNP_LIST_LOCK();
-	UNP_PCB_LOCK(unp);
 	LIST_REMOVE(unp, unp_link);
 	unp->unp_gencnt = ++unp_gencnt;
 	--unp_count;
 	UNP_LIST_UNLOCK();
 
 	/*
+	 * Only vfs_unp_reclaim() may clear unp_vnode behind our back, so an
+	 * unlocked read is enough to choose the vplock; the binding is then
+	 * revalidated with it held.
+	 *
 	 * XXXRW: Should assert vp->v_socket == so.
 	 */
+	vplock = NULL;
 	if ((vp = unp->unp_vnode) != NULL) {
-		VOP_UNP_DETACH(vp);
-		unp->unp_vnode = NULL;
+		vplock = mtx_pool_find(mtxpool_sleep, vp);
+		mtx_lock(vplock);
 	}
-	unp2 = unp->unp_conn;
+	UNP_PCB_LOCK(unp);
+	if (vp != NULL) {
+		if (unp->unp_vnode == vp) {
+			VOP_UNP_DETACH(vp);
+			unp->unp_vnode = NULL;
+		} else
+			vp = NULL;
+		mtx_unlock(vplock);
+	}
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL) {
-		UNP_PCB_LOCK(unp2);
 		unp_disconnect(unp, unp2);
 		UNP_PCB_UNLOCK(unp2);
 	}
-
-	/*
-	 * We hold the linkage lock exclusively, so it's OK to acquire
-	 * multiple pcb locks at a time.
-	 */
-	while (!LIST_EMPTY(&unp->unp_refs)) {
-		struct unpcb *ref = LIST_FIRST(&unp->unp_refs);
-
-		UNP_PCB_LOCK(ref);
+	while ((ref = LIST_FIRST(&unp->unp_refs)) != NULL) {
+		if (!unp_pcb_lock_other(unp, ref))
+			continue;
 		unp_drop(ref, ECONNRESET);
 		UNP_PCB_UNLOCK(ref);
 	}
 	local_unp_rights = unp_rights;
-	UNP_LINK_WUNLOCK();
 	unp->unp_socket->so_pcb = NULL;
 	saved_unp_addr = unp->unp_addr;
 	unp->unp_addr = NULL;
-	unp->unp_refcount--;
-	freeunp = (unp->unp_refcount == 0);
+	if (!unp_pcb_rele(unp))
+		UNP_PCB_UNLOCK(unp);
 	if (saved_unp_addr != NULL)
 		free(saved_unp_addr, M_SONAME);
-	if (freeunp) {
-		UNP_PCB_LOCK_DESTROY(unp);
-		uma_zfree(unp_zone, unp);
-	} else
-		UNP_PCB_UNLOCK(unp);
 	if (vp)
 		vrele(vp);
 	if (local_unp_rights)
@@ -713,16 +812,13 @@ uipc_disconnect(struct socket *so)
 	unp = sotounpcb(so);
 	KASSERT(unp != NULL, ("uipc_disconnect: unp == NULL"));
 
-	UNP_LINK_WLOCK();
 	UNP_PCB_LOCK(unp);
-	unp2 = unp->unp_conn;
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL) {
-		UNP_PCB_LOCK(unp2);
 		unp_disconnect(unp, unp2);
 		UNP_PCB_UNLOCK(unp2);
 	}
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
 	return (0);
 }
 
@@ -765,15 +861,14 @@ uipc_peeraddr(struct socket *so, struct sockaddr **nam)
 	KASSERT(unp != NULL, ("uipc_peeraddr: unp == NULL"));
 
 	*nam = malloc(sizeof(struct sockaddr_un), M_SONAME, M_WAITOK);
-	UNP_LINK_RLOCK();
+	UNP_PCB_LOCK(unp);
 	/*
 	 * XXX: It seems that this test always fails even when connection is
 	 * established.  So, this else clause is added as workaround to
 	 * return PF_LOCAL sockaddr.
 	 */
-	unp2 = unp->unp_conn;
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 != NULL) {
-		UNP_PCB_LOCK(unp2);
 		if (unp2->unp_addr != NULL)
 			sa = (struct sockaddr *) unp2->unp_addr;
 		else
@@ -784,7 +879,7 @@ uipc_peeraddr(struct socket *so, struct sockaddr **nam)
 		sa = &sun_noname;
 		bcopy(sa, *nam, sa->sa_len);
 	}
-	UNP_LINK_RUNLOCK();
+	UNP_PCB_UNLOCK(unp);
 	return (0);
 }
 
@@ -844,6 +939,8 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 {
 	struct unpcb *unp, *unp2;
 	struct socket *so2;
+	struct vnode *vp;
+	struct mtx *vplock;
 	u_int mbcnt, sbcc;
 	int error = 0;
 
@@ -859,43 +956,45 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 	}
 	if (control != NULL && (error = unp_internalize(&control, td)))
 		goto release;
-	if ((nam != NULL) || (flags & PRUS_EOF))
-		UNP_LINK_WLOCK();
-	else
-		UNP_LINK_RLOCK();
 	switch (so->so_type) {
 	case SOCK_DGRAM:
 	{
 		const struct sockaddr *from;
 
-		unp2 = unp->unp_conn;
+		vp = NULL;
 		if (nam != NULL) {
-			UNP_LINK_WLOCK_ASSERT();
-			if (unp2 != NULL) {
+			/*
+			 * Deliver straight to the socket bound at nam rather
+			 * than connecting to it for the duration of the send,
+			 * so that concurrent sendto() calls, and send() on
+			 * this socket, never see a temporary peer.  The
+			 * vplock keeps the target from being detached.
+			 */
+			error = unp_lookup(AT_FDCWD, so, nam, td, &vp, &so2);
+			if (error)
+				break;
+			vplock = mtx_pool_find(mtxpool_sleep, vp);
+			unp2 = sotounpcb(so2);
+			unp_pcb_lock2(unp, unp2);
+			if (unp->unp_conn != NULL) {
+				UNP_PCB_UNLOCK(unp2);
+				UNP_PCB_UNLOCK(unp);
+				mtx_unlock(vplock);
+				vput(vp);
 				error = EISCONN;
 				break;
 			}
-			error = unp_connect(so, nam, td);
-			if (error)
+		} else {
+			UNP_PCB_LOCK(unp);
+			unp2 = unp_pcb_lock_peer(unp);
+			if (unp2 == NULL) {
+				UNP_PCB_UNLOCK(unp);
+				error = ENOTCONN;
 				break;
-			unp2 = unp->unp_conn;
-		}
-
-		/*
-		 * Because connect() and send() are non-atomic in a sendto()
-		 * with a target address, it's possible that the socket will
-		 * have disconnected before the send() can run.  In that case
-		 * return the slightly counter-intuitive but otherwise
-		 * correct error that the socket is not connected.
-		 */
-		if (unp2 == NULL) {
-			error = ENOTCONN;
-			break;
+			}
 		}
-		/* Lockless read. */
 		if (unp2->unp_flags & UNP_WANTCRED)
 			control = unp_addsockcred(td, control);
-		UNP_PCB_LOCK(unp);
 		if (unp->unp_addr != NULL)
 			from = (struct sockaddr *)unp->unp_addr;
 		else
@@ -911,13 +1010,12 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 			SOCKBUF_UNLOCK(&so2->so_rcv);
 			error = ENOBUFS;
 		}
-		if (nam != NULL) {
-			UNP_LINK_WLOCK_ASSERT();
-			UNP_PCB_LOCK(unp2);
-			unp_disconnect(unp, unp2);
-			UNP_PCB_UNLOCK(unp2);
-		}
+		UNP_PCB_UNLOCK(unp2);
 		UNP_PCB_UNLOCK(unp);
+		if (vp != NULL) {
+			mtx_unlock(vplock);
+			vput(vp);
+		}
 		break;
 	}
 
@@ -925,7 +1023,6 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 	case SOCK_STREAM:
 		if ((so->so_state & SS_ISCONNECTED) == 0) {
 			if (nam != NULL) {
-				UNP_LINK_WLOCK_ASSERT();
 				error = unp_connect(so, nam, td);
 				if (error)
 					break;	/* XXX */
@@ -948,19 +1045,20 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 		 * return the slightly counter-intuitive but otherwise
 		 * correct error that the socket is not connected.
 		 *
-		 * Locking here must be done carefully: the linkage lock
-		 * prevents interconnections between unpcbs from changing, so
-		 * we can traverse from unp to unp2 without acquiring unp's
-		 * lock.  Socket buffer locks follow unpcb locks, so we can
-		 * acquire both remote and lock socket buffer locks.
+		 * Locking here must be done carefully: holding the locks of
+		 * both ends keeps the connection from changing under us
+		 * without serializing against unrelated socket pairs.  Socket
+		 * buffer locks follow unpcb locks, so we can acquire both
+		 * remote and lock socket buffer locks.
 		 */
-		unp2 = unp->unp_conn;
+		UNP_PCB_LOCK(unp);
+		unp2 = unp_pcb_lock_peer(unp);
 		if (unp2 == NULL) {
+			UNP_PCB_UNLOCK(unp);
 			error = ENOTCONN;
 			break;
 		}
 		so2 = unp2->unp_socket;
-		UNP_PCB_LOCK(unp2);
 		SOCKBUF_LOCK(&so2->so_rcv);
 		if (unp2->unp_flags & UNP_WANTCRED) {
 			/*
@@ -1020,6 +1118,7 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 			so->so_snd.sb_flags |= SB_STOP;
 		SOCKBUF_UNLOCK(&so->so_snd);
 		UNP_PCB_UNLOCK(unp2);
+		UNP_PCB_UNLOCK(unp);
 		m = NULL;
 		break;
 	}
@@ -1034,11 +1133,6 @@ uipc_send(struct socket *so, int flags, struct mbuf *m, struct sockaddr *nam,
 		UNP_PCB_UNLOCK(unp);
 	}
 
-	if ((nam != NULL) || (flags & PRUS_EOF))
-		UNP_LINK_WUNLOCK();
-	else
-		UNP_LINK_RUNLOCK();
-
 	if (control != NULL && error != 0)
 		unp_dispose(control);
 
@@ -1050,6 +1144,147 @@ release:
 	return (error);
 }
 
+/*
+ * Page loaning for stream sockets (LOCAL_LOAN).
+ *
+ * A large write from a page aligned user buffer is sent as a chain of
+ * read-only external mbufs that map the sender's held pages, so that the
+ * data is copied only once, by the receiver.  The pages are loaned with
+ * vm_page_loan() as for pipe direct writes: a later store by the sender
+ * faults and is given a private copy, so the writer returns as soon as the
+ * data is queued.  Pages that cannot be loaned are copied instead.
+ */
+#define	UNP_LOAN_MAXPAGES	16
+
+/*
+ * ext_free routine of loaned mbufs.
+ */
+static void
+unp_loan_free(struct mbuf *m, void *arg1, void *arg2)
+{
+	struct sf_buf *sf;
+	vm_page_t pg;
+
+	sf = arg1;
+	pg = sf_buf_page(sf);
+	sf_buf_free(sf);
+	vm_page_unloan(&pg, 1);
+	vm_page_lock(pg);
+	vm_page_unhold(pg);
+	vm_page_unlock(pg);
+}
+
+static int
+unp_sosend_loan(struct socket *so, struct uio *uio, int flags,
+    struct thread *td)
+{
+	vm_page_t ma[UNP_LOAN_MAXPAGES];
+	struct mbuf *top, *m, **mp;
+	struct sf_buf *sf;
+	struct iovec *iov;
+	long space;
+	int error, i, len, mlen, n;
+
+	td->td_ru.ru_msgsnd++;
+	error = sblock(&so->so_snd, SBL_WAIT);
+	if (error)
+		return (error);
+	iov = uio->uio_iov;
+	while (uio->uio_resid > 0) {
+		SOCKBUF_LOCK(&so->so_snd);
+		if (so->so_snd.sb_state & SBS_CANTSENDMORE) {
+			SOCKBUF_UNLOCK(&so->so_snd);
+			error = EPIPE;
+			break;
+		}
+		if (so->so_error) {
+			error = so->so_error;
+			so->so_error = 0;
+			SOCKBUF_UNLOCK(&so->so_snd);
+			break;
+		}
+		if ((so->so_state & SS_ISCONNECTED) == 0) {
+			SOCKBUF_UNLOCK(&so->so_snd);
+			error = ENOTCONN;
+			break;
+		}
+		space = sbspace(&so->so_snd);
+		if (space < PAGE_SIZE && space < uio->uio_resid) {
+			error = sbwait(&so->so_snd);
+			SOCKBUF_UNLOCK(&so->so_snd);
+			if (error)
+				break;
+			continue;
+		}
+		SOCKBUF_UNLOCK(&so->so_snd);
+
+		/*
+		 * Only whole pages are sent until the last one, so the user
+		 * address stays page aligned from one round to the next.
+		 */
+		len = MIN(uio->uio_resid, UNP_LOAN_MAXPAGES * PAGE_SIZE);
+		if (len > space)
+			len = trunc_page(space);
+		n = vm_fault_quick_hold_pages(&td->td_proc->p_vmspace->vm_map,
+		    (vm_offset_t)iov->iov_base, len, VM_PROT_READ, ma,
+		    UNP_LOAN_MAXPAGES);
+		if (n < 0) {
+			error = EFAULT;
+			break;
+		}
+		top = NULL;
+		mp = &top;
+		for (i = 0; i < n; i++) {
+			mlen = MIN(PAGE_SIZE, len - i * PAGE_SIZE);
+			sf = sf_buf_alloc(ma[i], 0);
+			if (vm_page_loan(&ma[i], 1)) {
+				m = m_get(M_WAITOK, MT_DATA);
+				(void)m_extadd(m, (caddr_t)sf_buf_kva(sf),
+				    PAGE_SIZE, unp_loan_free, sf, NULL,
+				    M_RDONLY, EXT_MOD_TYPE, M_WAITOK);
+			} else {
+				m = m_getjcl(M_WAITOK, MT_DATA, 0,
+				    MJUMPAGESIZE);
+				bcopy((void *)sf_buf_kva(sf), mtod(m, void *),
+				    mlen);
+				sf_buf_free(sf);
+				vm_page_unhold_pages(&ma[i], 1);
+			}
+			m->m_len = mlen;
+			*mp = m;
+			mp = &m->m_next;
+		}
+		iov->iov_base = (char *)iov->iov_base + len;
+		iov->iov_len -= len;
+		uio->uio_resid -= len;
+		uio->uio_offset += len;
+		error = (*so->so_proto->pr_usrreqs->pru_send)(so,
+		    uio->uio_resid > 0 ? PRUS_MORETOCOME : 0, top, NULL, NULL,
+		    td);
+		if (error)
+			break;
+	}
+	sbunlock(&so->so_snd);
+	return (error);
+}
+
+static int
+uipc_sosend_stream(struct socket *so, struct sockaddr *addr, struct uio *uio,
+    struct mbuf *top, struct mbuf *control, int flags, struct thread *td)
+{
+
+	if ((sotounpcb(so)->unp_flags & UNP_LOAN) == 0 || uio == NULL ||
+	    top != NULL || control != NULL || addr != NULL || td == NULL ||
+	    (flags & (MSG_OOB | MSG_EOR | MSG_EOF | MSG_NBIO)) != 0 ||
+	    (so->so_state & SS_NBIO) != 0 ||
+	    uio->uio_segflg != UIO_USERSPACE || uio->uio_iovcnt != 1 ||
+	    uio->uio_resid < PAGE_SIZE ||
+	    ((vm_offset_t)uio->uio_iov->iov_base & PAGE_MASK) != 0)
+		return (sosend_generic(so, addr, uio, top, control, flags,
+		    td));
+	return (unp_sosend_loan(so, uio, flags, td));
+}
+
 static int
 uipc_ready(struct socket *so, struct mbuf *m, int count)
 {
@@ -1059,9 +1294,8 @@ uipc_ready(struct socket *so, struct mbuf *m, int count)
 
 	unp = sotounpcb(so);
 
-	UNP_LINK_RLOCK();
-	unp2 = unp->unp_conn;
-	UNP_PCB_LOCK(unp2);
+	UNP_PCB_LOCK(unp);
+	unp2 = unp_pcb_lock_peer(unp);
 	so2 = unp2->unp_socket;
 
 	SOCKBUF_LOCK(&so2->so_rcv);
@@ -1071,7 +1305,7 @@ uipc_ready(struct socket *so, struct mbuf *m, int count)
 		SOCKBUF_UNLOCK(&so2->so_rcv);
 
 	UNP_PCB_UNLOCK(unp2);
-	UNP_LINK_RUNLOCK();
+	UNP_PCB_UNLOCK(unp);
 
 	return (error);
 }
@@ -1102,12 +1336,10 @@ uipc_shutdown(struct socket *so)
 	unp = sotounpcb(so);
 	KASSERT(unp != NULL, ("uipc_shutdown: unp == NULL"));
 
-	UNP_LINK_WLOCK();
 	UNP_PCB_LOCK(unp);
 	socantsendmore(so);
 	unp_shutdown(unp);
 	UNP_PCB_UNLOCK(unp);
-	UNP_LINK_WUNLOCK();
 	return (0);
 }
 
@@ -1194,6 +1426,7 @@ static struct pr_usrreqs uipc_usrreqs_stream = {
 	.pru_sense =		uipc_sense,
 	.pru_shutdown =		uipc_shutdown,
 	.pru_sockaddr =		uipc_sockaddr,
+	.pru_sosend =		uipc_sosend_stream,
 	.pru_soreceive =	soreceive_generic,
 	.pru_close =		uipc_close,
 };
@@ -1241,6 +1474,12 @@ uipc_ctloutput(struct socket *so, struct sockopt *sopt)
 			error = sooptcopyout(sopt, &optval, sizeof(optval));
 			break;
 
+		case LOCAL_LOAN:
+			/* Unlocked read. */
+			optval = unp->unp_flags & UNP_LOAN ? 1 : 0;
+			error = sooptcopyout(sopt, &optval, sizeof(optval));
+			break;
+
 		default:
 			error = EOPNOTSUPP;
 			break;
@@ -1251,6 +1490,12 @@ uipc_ctloutput(struct socket *so, struct sockopt *sopt)
 		switch (sopt->sopt_name) {
 		case LOCAL_CREDS:
 		case LOCAL_CONNWAIT:
+		case LOCAL_LOAN:
+			if (sopt->sopt_name == LOCAL_LOAN &&
+			    so->so_type != SOCK_STREAM) {
+				error = ENOPROTOOPT;
+				break;
+			}
 			error = sooptcopyin(sopt, &optval, sizeof(optval),
 					    sizeof(optval));
 			if (error)
@@ -1274,6 +1519,10 @@ uipc_ctloutput(struct socket *so, struct sockopt *sopt)
 				OPTSET(UNP_CONNWAIT);
 				break;
 
+			case LOCAL_LOAN:
+				OPTSET(UNP_LOAN);
+				break;
+
 			default:
 				break;
 			}
@@ -1299,28 +1548,27 @@ unp_connect(struct socket *so, struct sockaddr *nam, struct thread *td)
 	return (unp_connectat(AT_FDCWD, so, nam, td));
 }
 
+/*
+ * Look up the socket bound to the path in nam, of the same type as so.
+ * On success the socket vnode is returned locked in *vpp and its vplock
+ * is held; the vplock keeps v_socket stable, and keeps the socket it
+ * names from being detached, until the caller drops it.
+ */
 static int
-unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
-    struct thread *td)
+unp_lookup(int fd, struct socket *so, struct sockaddr *nam,
+    struct thread *td, struct vnode **vpp, struct socket **so2p)
 {
 	struct sockaddr_un *soun = (struct sockaddr_un *)nam;
 	struct vnode *vp;
-	struct socket *so2, *so3;
-	struct unpcb *unp, *unp2, *unp3;
+	struct socket *so2;
 	struct nameidata nd;
 	char buf[SOCK_MAXADDRLEN];
-	struct sockaddr *sa;
+	struct mtx *vplock;
 	cap_rights_t rights;
 	int error, len;
 
 	if (nam->sa_family != AF_UNIX)
 		return (EAFNOSUPPORT);
-
-	UNP_LINK_WLOCK_ASSERT();
-
-	unp = sotounpcb(so);
-	KASSERT(unp != NULL, ("unp_connect: unp == NULL"));
-
 	if (nam->sa_len > sizeof(struct sockaddr_un))
 		return (EINVAL);
 	len = nam->sa_len - offsetof(struct sockaddr_un, sun_path);
@@ -1329,27 +1577,14 @@ unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
 	bcopy(soun->sun_path, buf, len);
 	buf[len] = 0;
 
-	UNP_PCB_LOCK(unp);
-	if (unp->unp_flags & UNP_CONNECTING) {
-		UNP_PCB_UNLOCK(unp);
-		return (EALREADY);
-	}
-	UNP_LINK_WUNLOCK();
-	unp->unp_flags |= UNP_CONNECTING;
-	UNP_PCB_UNLOCK(unp);
-
-	sa = malloc(sizeof(struct sockaddr_un), M_SONAME, M_WAITOK);
 	NDINIT_ATRIGHTS(&nd, LOOKUP, FOLLOW | LOCKSHARED | LOCKLEAF,
 	    UIO_SYSSPACE, buf, fd, cap_rights_init(&rights, CAP_CONNECTAT), td);
 	error = namei(&nd);
 	if (error)
-		vp = NULL;
-	else
-		vp = nd.ni_vp;
-	ASSERT_VOP_LOCKED(vp, "unp_connect");
+		return (error);
+	vp = nd.ni_vp;
+	ASSERT_VOP_LOCKED(vp, "unp_lookup");
 	NDFREE(&nd, NDF_ONLY_PNBUF);
-	if (error)
-		goto bad;
 
 	if (vp->v_type != VSOCK) {
 		error = ENOTSOCK;
@@ -1364,24 +1599,61 @@ unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
 	if (error)
 		goto bad;
 
-	unp = sotounpcb(so);
-	KASSERT(unp != NULL, ("unp_connect: unp == NULL"));
-
-	/*
-	 * Lock linkage lock for two reasons: make sure v_socket is stable,
-	 * and to protect simultaneous locking of multiple pcbs.
-	 */
-	UNP_LINK_WLOCK();
+	vplock = mtx_pool_find(mtxpool_sleep, vp);
+	mtx_lock(vplock);
 	VOP_UNP_CONNECT(vp, &so2);
-	if (so2 == NULL) {
+	if (so2 == NULL)
 		error = ECONNREFUSED;
-		goto bad2;
-	}
-	if (so->so_type != so2->so_type) {
+	else if (so->so_type != so2->so_type)
 		error = EPROTOTYPE;
-		goto bad2;
+	if (error) {
+		mtx_unlock(vplock);
+		goto bad;
+	}
+	*vpp = vp;
+	*so2p = so2;
+	return (0);
+bad:
+	vput(vp);
+	return (error);
+}
+
+static int
+unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
+    struct thread *td)
+{
+	struct vnode *vp;
+	struct socket *so2, *so3;
+	struct unpcb *unp, *unp2, *unp3;
+	struct sockaddr *sa;
+	struct mtx *vplock;
+	int error;
+
+	unp = sotounpcb(so);
+	KASSERT(unp != NULL, ("unp_connect: unp == NULL"));
+
+	UNP_PCB_LOCK(unp);
+	if (unp->unp_flags & UNP_CONNECTING) {
+		UNP_PCB_UNLOCK(unp);
+		return (EALREADY);
 	}
+	unp->unp_flags |= UNP_CONNECTING;
+	UNP_PCB_UNLOCK(unp);
+
+	sa = malloc(sizeof(struct sockaddr_un), M_SONAME, M_WAITOK);
+	error = unp_lookup(fd, so, nam, td, &vp, &so2);
+	if (error)
+		goto bad;
+	vplock = mtx_pool_find(mtxpool_sleep, vp);
+	unp2 = sotounpcb(so2);
 	if (so->so_proto->pr_flags & PR_CONNREQUIRED) {
+		/*
+		 * The listener's lock is held across sonewconn() and until
+		 * the new socket is connected: until then the new socket is
+		 * on the listener's incomplete queue, and a concurrent close
+		 * of the listener could otherwise abort it under us.
+		 */
+		UNP_PCB_LOCK(unp2);
 		if (so2->so_options & SO_ACCEPTCONN) {
 			CURVNET_SET(so2->so_vnet);
 			so3 = sonewconn(so2, 0);
@@ -1389,15 +1661,13 @@ unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
 		} else
 			so3 = NULL;
 		if (so3 == NULL) {
+			UNP_PCB_UNLOCK(unp2);
 			error = ECONNREFUSED;
 			goto bad2;
 		}
-		unp = sotounpcb(so);
-		unp2 = sotounpcb(so2);
 		unp3 = sotounpcb(so3);
-		UNP_PCB_LOCK(unp);
-		UNP_PCB_LOCK(unp2);
 		UNP_PCB_LOCK(unp3);
+		UNP_PCB_LOCK(unp);
 		if (unp2->unp_addr != NULL) {
 			bcopy(unp2->unp_addr, sa, unp2->unp_addr->sun_len);
 			unp3->unp_addr = (struct sockaddr_un *) sa;
@@ -1424,32 +1694,25 @@ unp_connectat(int fd, struct socket *so, struct sockaddr *nam,
 		unp->unp_flags |= UNP_HAVEPC;
 		if (unp2->unp_flags & UNP_WANTCRED)
 			unp3->unp_flags |= UNP_WANTCRED;
-		UNP_PCB_UNLOCK(unp3);
-		UNP_PCB_UNLOCK(unp2);
-		UNP_PCB_UNLOCK(unp);
 #ifdef MAC
 		mac_socketpeer_set_from_socket(so, so3);
 		mac_socketpeer_set_from_socket(so3, so);
 #endif
-
-		so2 = so3;
+		error = unp_connect2(so, so3, PRU_CONNECT);
+		UNP_PCB_UNLOCK(unp);
+		UNP_PCB_UNLOCK(unp3);
+		UNP_PCB_UNLOCK(unp2);
+	} else {
+		unp_pcb_lock2(unp, unp2);
+		error = unp_connect2(so, so2, PRU_CONNECT);
+		UNP_PCB_UNLOCK(unp2);
+		UNP_PCB_UNLOCK(unp);
 	}
-	unp = sotounpcb(so);
-	KASSERT(unp != NULL, ("unp_connect: unp == NULL"));
-	unp2 = sotounpcb(so2);
-	KASSERT(unp2 != NULL, ("unp_connect: unp2 == NULL"));
-	UNP_PCB_LOCK(unp);
-	UNP_PCB_LOCK(unp2);
-	error = unp_connect2(so, so2, PRU_CONNECT);
-	UNP_PCB_UNLOCK(unp2);
-	UNP_PCB_UNLOCK(unp);
 bad2:
-	UNP_LINK_WUNLOCK();
+	mtx_unlock(vplock);
+	vput(vp);
 bad:
-	if (vp != NULL)
-		vput(vp);
 	free(sa, M_SONAME);
-	UNP_LINK_WLOCK();
 	UNP_PCB_LOCK(unp);
 	unp->unp_flags &= ~UNP_CONNECTING;
 	UNP_PCB_UNLOCK(unp);
@@ -1467,12 +1730,13 @@ unp_connect2(struct socket *so, struct socket *so2, int req)
 	unp2 = sotounpcb(so2);
 	KASSERT(unp2 != NULL, ("unp_connect2: unp2 == NULL"));
 
-	UNP_LINK_WLOCK_ASSERT();
 	UNP_PCB_LOCK_ASSERT(unp);
 	UNP_PCB_LOCK_ASSERT(unp2);
 
 	if (so2->so_type != so->so_type)
 		return (EPROTOTYPE);
+	if (unp->unp_conn != NULL)
+		return (EISCONN);
 	unp->unp_conn = unp2;
 
 	switch (so->so_type) {
@@ -1505,7 +1769,6 @@ unp_disconnect(struct unpcb *unp, struct unpcb *unp2)
 
 	KASSERT(unp2 != NULL, ("unp_disconnect: unp2 == NULL"));
 
-	UNP_LINK_WLOCK_ASSERT();
 	UNP_PCB_LOCK_ASSERT(unp);
 	UNP_PCB_LOCK_ASSERT(unp2);
 
@@ -1539,7 +1802,6 @@ static int
 unp_pcblist(SYSCTL_HANDLER_ARGS)
 {
 	int error, i, n;
-	int freeunp;
 	struct unpcb *unp, **unp_list;
 	unp_gen_t gencnt;
 	struct xunpgen *xug;
@@ -1598,20 +1860,20 @@ unp_pcblist(SYSCTL_HANDLER_ARGS)
 
 	unp_list = malloc(n * sizeof *unp_list, M_TEMP, M_WAITOK);
 
+	/*
+	 * unp_gencnt and unp_socket are stable while the unpcb is on the
+	 * list, so the unpcb locks are not needed to pick the entries.
+	 */
 	UNP_LIST_LOCK();
 	for (unp = LIST_FIRST(head), i = 0; unp && i < n;
 	     unp = LIST_NEXT(unp, unp_link)) {
-		UNP_PCB_LOCK(unp);
 		if (unp->unp_gencnt <= gencnt) {
 			if (cr_cansee(req->td->td_ucred,
-			    unp->unp_socket->so_cred)) {
-				UNP_PCB_UNLOCK(unp);
+			    unp->unp_socket->so_cred))
 				continue;
-			}
 			unp_list[i++] = unp;
-			unp->unp_refcount++;
+			unp_pcb_hold(unp);
 		}
-		UNP_PCB_UNLOCK(unp);
 	}
 	UNP_LIST_UNLOCK();
 	n = i;			/* In case we lost some during malloc. */
@@ -1621,8 +1883,9 @@ unp_pcblist(SYSCTL_HANDLER_ARGS)
 	for (i = 0; i < n; i++) {
 		unp = unp_list[i];
 		UNP_PCB_LOCK(unp);
-		unp->unp_refcount--;
-	        if (unp->unp_refcount != 0 && unp->unp_gencnt <= gencnt) {
+		if (unp_pcb_rele(unp))
+			continue;
+		if (unp->unp_gencnt <= gencnt) {
 			xu->xu_len = sizeof *xu;
 			xu->xu_unpp = unp;
 			/*
@@ -1641,14 +1904,8 @@ unp_pcblist(SYSCTL_HANDLER_ARGS)
 			sotoxsocket(unp->unp_socket, &xu->xu_socket);
 			UNP_PCB_UNLOCK(unp);
 			error = SYSCTL_OUT(req, xu, sizeof *xu);
-		} else {
-			freeunp = (unp->unp_refcount == 0);
+		} else
 			UNP_PCB_UNLOCK(unp);
-			if (freeunp) {
-				UNP_PCB_LOCK_DESTROY(unp);
-				uma_zfree(unp_zone, unp);
-			}
-		}
 	}
 	free(xu, M_TEMP);
 	if (!error) {
@@ -1685,7 +1942,9 @@ unp_shutdown(struct unpcb *unp)
 	struct unpcb *unp2;
 	struct socket *so;
 
-	UNP_LINK_WLOCK_ASSERT();
+	/*
+	 * The lock on unp is enough to keep unp_conn and its socket valid.
+	 */
 	UNP_PCB_LOCK_ASSERT(unp);
 
 	unp2 = unp->unp_conn;
@@ -1697,20 +1956,22 @@ unp_shutdown(struct unpcb *unp)
 	}
 }
 
+/*
+ * The caller holds the lock of unp.  Its peer is locked here: for a
+ * datagram socket that may be a third unpcb the caller knows nothing of.
+ */
 static void
 unp_drop(struct unpcb *unp, int errno)
 {
 	struct socket *so = unp->unp_socket;
 	struct unpcb *unp2;
 
-	UNP_LINK_WLOCK_ASSERT();
 	UNP_PCB_LOCK_ASSERT(unp);
 
 	so->so_error = errno;
-	unp2 = unp->unp_conn;
+	unp2 = unp_pcb_lock_peer(unp);
 	if (unp2 == NULL)
 		return;
-	UNP_PCB_LOCK(unp2);
 	unp_disconnect(unp, unp2);
 	UNP_PCB_UNLOCK(unp2);
 }
@@ -2411,6 +2672,7 @@ vfs_unp_reclaim(struct vnode *vp)
 {
 	struct socket *so;
 	struct unpcb *unp;
+	struct mtx *vplock;
 	int active;
 
 	ASSERT_VOP_ELOCKED(vp, "vfs_unp_reclaim");
@@ -2418,7 +2680,8 @@ vfs_unp_reclaim(struct vnode *vp)
 	    ("vfs_unp_reclaim: vp->v_type != VSOCK"));
 
 	active = 0;
-	UNP_LINK_WLOCK();
+	vplock = mtx_pool_find(mtxpool_sleep, vp);
+	mtx_lock(vplock);
 	VOP_UNP_CONNECT(vp, &so);
 	if (so == NULL)
 		goto done;
@@ -2433,7 +2696,7 @@ vfs_unp_reclaim(struct vnode *vp)
 	}
 	UNP_PCB_UNLOCK(unp);
 done:
-	UNP_LINK_WUNLOCK();
+	mtx_unlock(vplock);
 	if (active)
 		vunref(vp);
 }
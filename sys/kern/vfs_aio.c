@@ -44,7 +44,9 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_aio.c 289941 2015-10-25 18:48:09Z pjd $");
 #include <sys/posix4.h>
 #include <sys/proc.h>
 #include <sys/resourcevar.h>
+#include <sys/sched.h>
 #include <sys/signalvar.h>
+#include <sys/smp.h>
 #include <sys/protosw.h>
 #include <sys/rwlock.h>
 #include <sys/sema.h>
@@ -61,6 +63,8 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_aio.c 289941 2015-10-25 18:48:09Z pjd $");
 #include <sys/mount.h>
 #include <geom/geom.h>
 
+#include <security/mac/mac_framework.h>
+
 #include <machine/atomic.h>
 
 #include <vm/vm.h>
@@ -177,6 +181,11 @@ static int unloadable = 0;
 SYSCTL_INT(_vfs_aio, OID_AUTO, unloadable, CTLFLAG_RW, &unloadable, 0,
     "Allow unload of aio (not recommended)");
 
+static int native_vnode_aio = 1;
+SYSCTL_INT(_vfs_aio, OID_AUTO, native_vnode_aio, CTLFLAG_RW,
+    &native_vnode_aio, 0,
+    "Issue O_DIRECT reads of regular files straight to the disk");
+
 
 static int max_aio_per_proc = MAX_AIO_PER_PROC;
 SYSCTL_INT(_vfs_aio, OID_AUTO, max_aio_per_proc, CTLFLAG_RW, &max_aio_per_proc,
@@ -241,6 +250,7 @@ struct aiocblist {
 	struct	proc *userproc;		/* (*) user process */
 	struct  ucred *cred;		/* (*) active credential when created */
 	struct	file *fd_file;		/* (*) pointer to file structure */
+	void	*rlcookie;		/* (*) range lock of a vnode read */
 	struct	aioliojob *lio;		/* (*) optional lio job */
 	struct	aiocb *uuaiocb;		/* (*) pointer in userspace of aiocb */
 	struct	knlist klist;		/* (a) list of knotes */
@@ -265,6 +275,7 @@ struct aiothreadlist {
 	int aiothreadflags;			/* (c) AIO proc flags */
 	TAILQ_ENTRY(aiothreadlist) list;	/* (c) list of processes */
 	struct thread *aiothread;		/* (*) the AIO thread */
+	u_int aiothreadcpu;			/* (*) CPU the daemon is bound to */
 };
 
 /*
@@ -330,7 +341,8 @@ struct aiocb_ops {
 	int	(*store_aiocb)(struct aiocb **ujobp, struct aiocb *ujob);
 };
 
-static TAILQ_HEAD(,aiothreadlist) aio_freeproc;		/* (c) Idle daemons */
+static TAILQ_HEAD(,aiothreadlist) aio_freeproc[MAXCPU]; /* (c) Idle daemons */
+static int aio_nfreeproc;				/* (c) Idle daemons */
 static struct sema aio_newproc_sem;
 static struct mtx aio_job_mtx;
 static struct mtx aio_sock_mtx;
@@ -347,6 +359,9 @@ static int	aio_newproc(int *);
 int		aio_aqueue(struct thread *td, struct aiocb *job,
 			struct aioliojob *lio, int type, struct aiocb_ops *ops);
 static void	aio_physwakeup(struct bio *bp);
+static void	aio_bufwakeup(struct buf *pbuf);
+static int	aio_qvnode(struct aiocblist *aiocbe, struct vnode **vpp,
+		    off_t *offp);
 static void	aio_proc_rundown(void *arg, struct proc *p);
 static void	aio_proc_rundown_exec(void *arg, struct proc *p, struct image_params *imgp);
 static int	aio_qphysio(struct proc *p, struct aiocblist *iocb);
@@ -356,6 +371,7 @@ static int	aio_unload(void);
 static void	aio_bio_done_notify(struct proc *userp, struct aiocblist *aiocbe, int type);
 #define DONE_BUF	1
 #define DONE_QUEUE	2
+static struct aiothreadlist *aio_idleproc(void);
 static int	aio_kick(struct proc *userp);
 static void	aio_kick_nowait(struct proc *userp);
 static void	aio_kick_helper(void *context, int pending);
@@ -478,7 +494,7 @@ MODULE_VERSION(aio, 1);
 static int
 aio_onceonly(void)
 {
-	int error;
+	int error, i;
 
 	/* XXX: should probably just use so->callback */
 	aio_swake = &aio_swake_cb;
@@ -488,7 +504,11 @@ aio_onceonly(void)
 	    EVENTHANDLER_PRI_ANY);
 	kqueue_add_filteropts(EVFILT_AIO, &aio_filtops);
 	kqueue_add_filteropts(EVFILT_LIO, &lio_filtops);
-	TAILQ_INIT(&aio_freeproc);
+	for (i = 0; i < MAXCPU; i++)
+		TAILQ_INIT(&aio_freeproc[i]);
+	/* Keep at least one daemon per CPU. */
+	max_aio_procs = MAX(max_aio_procs, mp_ncpus);
+	target_aio_procs = MAX(target_aio_procs, mp_ncpus);
 	sema_init(&aio_newproc_sem, 0, "aio_new_proc");
 	mtx_init(&aio_job_mtx, "aio_job", NULL, MTX_DEF);
 	mtx_init(&aio_sock_mtx, "aio_sock", NULL, MTX_DEF);
@@ -1088,6 +1108,17 @@ aio_daemon(void *_id)
 	aiop->aiothread = td;
 	aiop->aiothreadflags = 0;
 
+	/*
+	 * Spread the daemons over the CPUs, so that a job is normally
+	 * run on the CPU that queued it; see aio_idleproc().
+	 */
+	aiop->aiothreadcpu = (id - 1) % (mp_maxid + 1);
+	while (CPU_ABSENT(aiop->aiothreadcpu))
+		aiop->aiothreadcpu = (aiop->aiothreadcpu + 1) % (mp_maxid + 1);
+	thread_lock(td);
+	sched_bind(td, aiop->aiothreadcpu);
+	thread_unlock(td);
+
 	/* The daemon resides in its own pgrp. */
 	sys_setsid(td, NULL);
 
@@ -1109,7 +1140,9 @@ aio_daemon(void *_id)
 		 * Take daemon off of free queue
 		 */
 		if (aiop->aiothreadflags & AIOP_FREE) {
-			TAILQ_REMOVE(&aio_freeproc, aiop, list);
+			TAILQ_REMOVE(&aio_freeproc[aiop->aiothreadcpu], aiop,
+			    list);
+			aio_nfreeproc--;
 			aiop->aiothreadflags &= ~AIOP_FREE;
 		}
 
@@ -1218,7 +1251,9 @@ aio_daemon(void *_id)
 
 		mtx_assert(&aio_job_mtx, MA_OWNED);
 
-		TAILQ_INSERT_HEAD(&aio_freeproc, aiop, list);
+		TAILQ_INSERT_HEAD(&aio_freeproc[aiop->aiothreadcpu], aiop,
+		    list);
+		aio_nfreeproc++;
 		aiop->aiothreadflags |= AIOP_FREE;
 
 		/*
@@ -1230,7 +1265,10 @@ aio_daemon(void *_id)
 			if (TAILQ_EMPTY(&aio_jobs)) {
 				if ((aiop->aiothreadflags & AIOP_FREE) &&
 				    (num_aio_procs > target_aio_procs)) {
-					TAILQ_REMOVE(&aio_freeproc, aiop, list);
+					TAILQ_REMOVE(
+					    &aio_freeproc[aiop->aiothreadcpu],
+					    aiop, list);
+					aio_nfreeproc--;
 					num_aio_procs--;
 					mtx_unlock(&aio_job_mtx);
 					uma_zfree(aiop_zone, aiop);
@@ -1297,11 +1335,12 @@ aio_qphysio(struct proc *p, struct aiocblist *aiocbe)
 	struct file *fp;
 	struct bio *bp;
 	struct buf *pbuf;
-	struct vnode *vp;
+	struct vnode *devvp, *vp;
 	struct cdevsw *csw;
 	struct cdev *dev;
 	struct kaioinfo *ki;
 	struct aioliojob *lj;
+	off_t offset;
 	int error, ref, unmap, poff;
 	vm_prot_t prot;
 
@@ -1312,30 +1351,50 @@ aio_qphysio(struct proc *p, struct aiocblist *aiocbe)
 		return (-1);
 
 	vp = fp->f_vnode;
-	if (vp->v_type != VCHR)
-		return (-1);
-	if (vp->v_bufobj.bo_bsize == 0)
-		return (-1);
-	if (cb->aio_nbytes % vp->v_bufobj.bo_bsize)
-		return (-1);
-
+	offset = cb->aio_offset;
 	ref = 0;
-	csw = devvn_refthread(vp, &dev, &ref);
-	if (csw == NULL)
-		return (ENXIO);
+	devvp = NULL;
+	csw = NULL;
+	dev = NULL;
+	pbuf = NULL;
+	if (vp->v_type == VREG) {
+		/*
+		 * On success devvp is the referenced disk vnode.  The file
+		 * system holds the disk open through its own GEOM consumer
+		 * rather than through devfs, so the request must go through
+		 * the disk vnode's bufobj and not the cdevsw.
+		 */
+		devvp = vp;
+		if (aio_qvnode(aiocbe, &devvp, &offset) != 0)
+			return (-1);
+	} else {
+		if (vp->v_type != VCHR)
+			return (-1);
+		if (vp->v_bufobj.bo_bsize == 0)
+			return (-1);
+		if (cb->aio_nbytes % vp->v_bufobj.bo_bsize)
+			return (-1);
 
-	if ((csw->d_flags & D_DISK) == 0) {
-		error = -1;
-		goto unref;
+		csw = devvn_refthread(vp, &dev, &ref);
+		if (csw == NULL)
+			return (ENXIO);
 	}
-	if (cb->aio_nbytes > dev->si_iosize_max) {
-		error = -1;
-		goto unref;
+
+	if (devvp == NULL) {
+		if ((csw->d_flags & D_DISK) == 0) {
+			error = -1;
+			goto unref;
+		}
+		if (cb->aio_nbytes > dev->si_iosize_max) {
+			error = -1;
+			goto unref;
+		}
 	}
 
 	ki = p->p_aioinfo;
 	poff = (vm_offset_t)cb->aio_buf & PAGE_MASK;
-	unmap = ((dev->si_flags & SI_UNMAPPED) && unmapped_buf_allowed);
+	unmap = (devvp == NULL && (dev->si_flags & SI_UNMAPPED) &&
+	    unmapped_buf_allowed);
 	if (unmap) {
 		if (cb->aio_nbytes > MAXPHYS) {
 			error = -1;
@@ -1374,7 +1433,7 @@ aio_qphysio(struct proc *p, struct aiocblist *aiocbe)
 	bp->bio_bcount = cb->aio_nbytes;
 	bp->bio_done = aio_physwakeup;
 	bp->bio_data = (void *)(uintptr_t)cb->aio_buf;
-	bp->bio_offset = cb->aio_offset;
+	bp->bio_offset = offset;
 	bp->bio_cmd = cb->aio_lio_opcode == LIO_WRITE ? BIO_WRITE : BIO_READ;
 	bp->bio_dev = dev;
 	bp->bio_caller1 = (void *)aiocbe;
@@ -1406,8 +1465,22 @@ aio_qphysio(struct proc *p, struct aiocblist *aiocbe)
 		atomic_add_int(&num_buf_aio, 1);
 
 	/* Perform transfer. */
-	csw->d_strategy(bp);
-	dev_relthread(dev, ref);
+	if (devvp != NULL) {
+		pbuf->b_iocmd = BIO_READ;
+		pbuf->b_ioflags = 0;
+		pbuf->b_blkno = btodb(offset);
+		pbuf->b_iooffset = offset;
+		pbuf->b_bcount = cb->aio_nbytes;
+		pbuf->b_bufsize = cb->aio_nbytes;
+		pbuf->b_data = bp->bio_data;
+		pbuf->b_iodone = aio_bufwakeup;
+		pbuf->b_caller1 = aiocbe;
+		BO_STRATEGY(&devvp->v_bufobj, pbuf);
+		vrele(devvp);
+	} else {
+		csw->d_strategy(bp);
+		dev_relthread(dev, ref);
+	}
 	return (0);
 
 doerror:
@@ -1428,10 +1501,113 @@ doerror:
 	g_destroy_bio(bp);
 	aiocbe->bp = NULL;
 unref:
-	dev_relthread(dev, ref);
+	if (devvp != NULL)
+		vrele(devvp);
+	else
+		dev_relthread(dev, ref);
+
+	if (aiocbe->rlcookie != NULL) {
+		vn_rangelock_unlock(fp->f_vnode, aiocbe->rlcookie);
+		aiocbe->rlcookie = NULL;
+	}
 	return (error);
 }
 
+/*
+ * Map an O_DIRECT read of a regular file onto the disk below the file
+ * system, so that aio_qphysio() can issue it without an aio daemon.
+ * This is only done when the file system supports VOP_BMAP() onto a
+ * disk, the whole range is allocated and contiguous on that disk, and
+ * nothing newer than the disk copy is cached.  Nothing here may sleep:
+ * whenever a lock is contended or a check fails, the request is left to
+ * the aio daemons, which go through vn_read().  On success the range
+ * stays read-locked against writes and truncation until aio_physwakeup(),
+ * and *vpp is the disk vnode, referenced.  The caller issues the read
+ * through the disk vnode's bufobj, which belongs to the file system.
+ */
+static int
+aio_qvnode(struct aiocblist *aiocbe, struct vnode **vpp, off_t *offp)
+{
+	struct aiocb *cb;
+	struct bufobj *bo;
+	struct vattr va;
+	struct vnode *devvp, *vp;
+	vm_object_t obj;
+	vm_page_t m;
+	daddr_t pbn;
+	off_t off;
+	void *cookie;
+	long bsize;
+	int cached, run, ssize;
+
+	cb = &aiocbe->uaiocb;
+	vp = *vpp;
+	off = cb->aio_offset;
+	if (!native_vnode_aio || cb->aio_lio_opcode != LIO_READ ||
+	    (aiocbe->fd_file->f_flag & O_DIRECT) == 0 ||
+	    cb->aio_nbytes == 0 || off < 0 || vp->v_mount == NULL)
+		return (-1);
+	bsize = vp->v_mount->mnt_stat.f_iosize;
+	if (bsize <= 0)
+		return (-1);
+
+	cookie = vn_rangelock_tryrlock(vp, off, off + cb->aio_nbytes);
+	if (cookie == NULL)
+		return (-1);
+	if (vn_lock(vp, LK_SHARED | LK_NOWAIT) != 0)
+		goto fail;
+#ifdef MAC
+	/* A denial is reported by the daemon's vn_read(). */
+	if (mac_vnode_check_read(aiocbe->cred, aiocbe->fd_file->f_cred,
+	    vp) != 0)
+		goto unlock;
+#endif
+	if ((vp->v_iflag & VI_DOOMED) != 0 ||
+	    VOP_GETATTR(vp, &va, aiocbe->cred) != 0 ||
+	    off + cb->aio_nbytes > va.va_size ||
+	    VOP_BMAP(vp, off / bsize, &bo, &pbn, &run, NULL) != 0 ||
+	    pbn == -1 || off % bsize + cb->aio_nbytes > (run + 1) * bsize)
+		goto unlock;
+
+	/* File systems without a disk map the file onto itself. */
+	devvp = bo->__bo_vnode;
+	if (devvp == NULL || devvp == vp || devvp->v_type != VCHR)
+		goto unlock;
+	ssize = devvp->v_bufobj.bo_bsize;
+	if (ssize == 0 || cb->aio_nbytes % ssize != 0 ||
+	    (dbtob(pbn) + off % bsize) % ssize != 0)
+		goto unlock;
+
+	/* Dirty buffers and resident pages may be newer than the disk. */
+	if (vp->v_bufobj.bo_dirty.bv_cnt != 0)
+		goto unlock;
+	cached = 0;
+	obj = vp->v_object;
+	if (obj != NULL) {
+		VM_OBJECT_RLOCK(obj);
+		m = vm_page_find_least(obj, OFF_TO_IDX(off));
+		if (m != NULL &&
+		    IDX_TO_OFF(m->pindex) < off + (off_t)cb->aio_nbytes)
+			cached = 1;
+		VM_OBJECT_RUNLOCK(obj);
+	}
+	if (cached)
+		goto unlock;
+
+	vref(devvp);
+	VOP_UNLOCK(vp, 0);
+	aiocbe->rlcookie = cookie;
+	*vpp = devvp;
+	*offp = dbtob(pbn) + off % bsize;
+	return (0);
+
+unlock:
+	VOP_UNLOCK(vp, 0);
+fail:
+	vn_rangelock_unlock(vp, cookie);
+	return (-1);
+}
+
 /*
  * Wake up aio requests that may be serviceable now.
  */
@@ -1847,6 +2023,33 @@ done:
 	return (error);
 }
 
+/*
+ * Take an idle daemon off the free lists, preferring the one bound to
+ * the current CPU and then its nearest neighbours.
+ */
+static struct aiothreadlist *
+aio_idleproc(void)
+{
+	struct aiothreadlist *aiop;
+	u_int cpu, i;
+
+	mtx_assert(&aio_job_mtx, MA_OWNED);
+	if (aio_nfreeproc == 0)
+		return (NULL);
+	cpu = PCPU_GET(cpuid);
+	for (i = 0; i <= mp_maxid; i++) {
+		aiop = TAILQ_FIRST(&aio_freeproc[(cpu + i) % (mp_maxid + 1)]);
+		if (aiop != NULL) {
+			TAILQ_REMOVE(&aio_freeproc[aiop->aiothreadcpu], aiop,
+			    list);
+			aio_nfreeproc--;
+			aiop->aiothreadflags &= ~AIOP_FREE;
+			return (aiop);
+		}
+	}
+	panic("aio_idleproc: %d idle daemons not found", aio_nfreeproc);
+}
+
 static void
 aio_kick_nowait(struct proc *userp)
 {
@@ -1854,9 +2057,7 @@ aio_kick_nowait(struct proc *userp)
 	struct aiothreadlist *aiop;
 
 	mtx_assert(&aio_job_mtx, MA_OWNED);
-	if ((aiop = TAILQ_FIRST(&aio_freeproc)) != NULL) {
-		TAILQ_REMOVE(&aio_freeproc, aiop, list);
-		aiop->aiothreadflags &= ~AIOP_FREE;
+	if ((aiop = aio_idleproc()) != NULL) {
 		wakeup(aiop->aiothread);
 	} else if (((num_aio_resv_start + num_aio_procs) < max_aio_procs) &&
 	    ((ki->kaio_active_count + num_aio_resv_start) <
@@ -1874,9 +2075,7 @@ aio_kick(struct proc *userp)
 
 	mtx_assert(&aio_job_mtx, MA_OWNED);
 retryproc:
-	if ((aiop = TAILQ_FIRST(&aio_freeproc)) != NULL) {
-		TAILQ_REMOVE(&aio_freeproc, aiop, list);
-		aiop->aiothreadflags &= ~AIOP_FREE;
+	if ((aiop = aio_idleproc()) != NULL) {
 		wakeup(aiop->aiothread);
 	} else if (((num_aio_resv_start + num_aio_procs) < max_aio_procs) &&
 	    ((ki->kaio_active_count + num_aio_resv_start) <
@@ -2457,6 +2656,11 @@ aio_physwakeup(struct bio *bp)
 		atomic_subtract_int(&num_buf_aio, 1);
 	}
 	vm_page_unhold_pages(aiocbe->pages, aiocbe->npages);
+	if (aiocbe->rlcookie != NULL) {
+		vn_rangelock_unlock(aiocbe->fd_file->f_vnode,
+		    aiocbe->rlcookie);
+		aiocbe->rlcookie = NULL;
+	}
 
 	bp = aiocbe->bp;
 	aiocbe->bp = NULL;
@@ -2480,6 +2684,25 @@ aio_physwakeup(struct bio *bp)
 	g_destroy_bio(bp);
 }
 
+/*
+ * Completion of a native vnode request issued through a file system's
+ * bufobj with BO_STRATEGY(): hand the result over to the bio that
+ * tracks the job.
+ */
+static void
+aio_bufwakeup(struct buf *pbuf)
+{
+	struct aiocblist *aiocbe = pbuf->b_caller1;
+	struct bio *bp = aiocbe->bp;
+
+	bp->bio_resid = pbuf->b_resid;
+	if ((pbuf->b_ioflags & BIO_ERROR) != 0) {
+		bp->bio_flags |= BIO_ERROR;
+		bp->bio_error = pbuf->b_error;
+	}
+	aio_physwakeup(bp);
+}
+
 /* syscall - wait for the next completion of an aio request */
 static int
 kern_aio_waitcomplete(struct thread *td, struct aiocb **aiocbp,
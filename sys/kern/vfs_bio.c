@@ -60,6 +60,7 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_bio.c 292299 2015-12-16 00:13:16Z adrian $
 #include <sys/mutex.h>
 #include <sys/kernel.h>
 #include <sys/kthread.h>
+#include <sys/pcpu.h>
 #include <sys/proc.h>
 #include <sys/resourcevar.h>
 #include <sys/rwlock.h>
@@ -127,7 +128,7 @@ static __inline void bd_wakeup(void);
 static int sysctl_runningspace(SYSCTL_HANDLER_ARGS);
 static void bufkva_reclaim(vmem_t *, int);
 static void bufkva_free(struct buf *);
-static int buf_import(void *, void **, int, int);
+static int buf_import(void *, void **, int, int, int);
 static void buf_release(void *, void **, int);
 
 #if defined(COMPAT_FREEBSD4) || defined(COMPAT_FREEBSD5) || \
@@ -244,6 +245,27 @@ SYSCTL_INT(_vfs, OID_AUTO, unmapped_buf_allowed, CTLFLAG_RD,
     &unmapped_buf_allowed, 0,
     "Permit the use of the unmapped i/o");
 
+/*
+ * Per-cpu buffer cache accounting.  bufspace and numdirtybuffers change on
+ * every getblk() and brelse(), so each cpu accumulates its changes locally
+ * and folds them into the global counters once they exceed a batch.  The
+ * deltas are changed and folded in critical sections, so the global values
+ * lag by less than the slack: mp_ncpus batches plus one change per cpu.
+ * Limit checks and wakeup decisions compare the global values and only add
+ * in the deltas pending on every cpu, with bufspace_sum() and bdirty_sum(),
+ * when a global value is within the slack of the limit.
+ */
+struct bufpcpu {
+	long	bpc_space;		/* Unreconciled bufspace delta */
+	int	bpc_dirty;		/* Unreconciled numdirtybuffers delta */
+	u_int	bpc_recycle;		/* Rotor for buf_recycle() */
+};
+static DPCPU_DEFINE(struct bufpcpu, bufpcpu);
+static long bufspace_batch;
+static long bufspace_slack;
+static int bufdirty_batch;
+static int bufdirty_slack;
+
 /*
  * This lock synchronizes access to bd_request.
  */
@@ -325,7 +347,7 @@ static int bdirtywait;
 #define QUEUE_SENTINEL	1024	/* not an queue index, but mark for sentinel */
 
 /* Maximum number of clean buffer queues. */
-#define	CLEAN_QUEUES	16
+#define	CLEAN_QUEUES	64
 
 /* Configured number of clean queues. */
 static int clean_queues;
@@ -402,12 +424,17 @@ sysctl_bufspace(SYSCTL_HANDLER_ARGS)
 }
 #endif
 
+/*
+ *	bqcleanq:
+ *
+ *	Return the clean queue of the current cpu.  New clean buffers are
+ *	inserted there, so that cpus mostly work on their own queue lock.
+ */
 static int
 bqcleanq(void)
 {
-	static int nextq;
 
-	return ((atomic_fetchadd_int(&nextq, 1) % clean_queues) + QUEUE_CLEAN);
+	return ((PCPU_GET(cpuid) % clean_queues) + QUEUE_CLEAN);
 }
 
 static int
@@ -445,6 +472,93 @@ bdirtywakeup(void)
 	mtx_unlock(&bdirtylock);
 }
 
+/*
+ *	bdirty_sum:
+ *
+ *	Return numdirtybuffers including the deltas pending on all cpus.
+ */
+static int
+bdirty_sum(void)
+{
+	struct bufpcpu *bpc;
+	int dirty, i;
+
+	dirty = numdirtybuffers;
+	CPU_FOREACH(i) {
+		bpc = DPCPU_ID_PTR(i, bufpcpu);
+		dirty += bpc->bpc_dirty;
+	}
+	return (dirty);
+}
+
+/*
+ *	bdirty_atleast:
+ *
+ *	Return true if numdirtybuffers, including the deltas pending on all
+ *	cpus, is at least limit.  The lagging global count decides unless
+ *	it is within bufdirty_slack of the limit.
+ */
+static bool
+bdirty_atleast(int limit)
+{
+	int dirty;
+
+	dirty = numdirtybuffers;
+	if (dirty >= limit + bufdirty_slack)
+		return (true);
+	if (dirty + bufdirty_slack < limit)
+		return (false);
+	return (bdirty_sum() >= limit);
+}
+
+/*
+ *	bdirty_folded:
+ *
+ *	Called after delta was folded into numdirtybuffers.  Wakeup the buf
+ *	daemon or any threads blocked in bwillwrite() when the count is past
+ *	the midpoint between the watermarks.  bd_wakeup() and bdirtywakeup()
+ *	only wake sleepers once, and folds happen once per batch, so
+ *	repeating them is cheap.
+ */
+static void
+bdirty_folded(int delta)
+{
+	int mid;
+
+	mid = (lodirtybuffers + hidirtybuffers) / 2;
+	if (delta > 0 && bdirty_atleast(mid + 1))
+		bd_wakeup();
+	else if (delta < 0 && !bdirty_atleast(mid))
+		bdirtywakeup();
+}
+
+/*
+ *	bdirty_add:
+ *
+ *	Account for a change in the number of dirty buffers on this cpu,
+ *	folding it into numdirtybuffers once a batch has accumulated.
+ *	Atomics on the per-cpu delta let bufcount_reconcile() drain it
+ *	from another cpu; they do not contend.
+ */
+static void
+bdirty_add(int diff)
+{
+	struct bufpcpu *bpc;
+	int delta;
+
+	critical_enter();
+	bpc = DPCPU_PTR(bufpcpu);
+	delta = atomic_fetchadd_int(&bpc->bpc_dirty, diff) + diff;
+	if (delta >= bufdirty_batch || delta <= -bufdirty_batch) {
+		delta = atomic_readandclear_int(&bpc->bpc_dirty);
+		atomic_add_int(&numdirtybuffers, delta);
+	} else
+		delta = 0;
+	critical_exit();
+	if (delta != 0)
+		bdirty_folded(delta);
+}
+
 /*
  *	bdirtysub:
  *
@@ -455,9 +569,7 @@ static void
 bdirtysub(void)
 {
 
-	if (atomic_fetchadd_int(&numdirtybuffers, -1) ==
-	    (lodirtybuffers + hidirtybuffers) / 2)
-		bdirtywakeup();
+	bdirty_add(-1);
 }
 
 /*
@@ -470,13 +582,7 @@ static void
 bdirtyadd(void)
 {
 
-	/*
-	 * Only do the wakeup once as we cross the boundary.  The
-	 * buf daemon will keep running until the condition clears.
-	 */
-	if (atomic_fetchadd_int(&numdirtybuffers, 1) ==
-	    (lodirtybuffers + hidirtybuffers) / 2)
-		bd_wakeup();
+	bdirty_add(1);
 }
 
 /*
@@ -523,6 +629,146 @@ bufspace_daemonwakeup(void)
 	rw_runlock(&nblock);
 }
 
+/*
+ *	bufspace_pending:
+ *
+ *	Return the bufspace deltas not yet folded in from all cpus.
+ */
+static long
+bufspace_pending(void)
+{
+	struct bufpcpu *bpc;
+	long space;
+	int i;
+
+	space = 0;
+	CPU_FOREACH(i) {
+		bpc = DPCPU_ID_PTR(i, bufpcpu);
+		space += bpc->bpc_space;
+	}
+	return (space);
+}
+
+/*
+ *	bufspace_sum:
+ *
+ *	Return bufspace including the deltas pending on all cpus.
+ */
+static long
+bufspace_sum(void)
+{
+
+	return (bufspace + bufspace_pending());
+}
+
+/*
+ *	bufspace_atleast:
+ *
+ *	Return true if bufspace, including the deltas pending on all cpus,
+ *	is at least limit.  The lagging global count decides unless it is
+ *	within bufspace_slack of the limit.
+ */
+static bool
+bufspace_atleast(long limit)
+{
+	long space;
+
+	space = bufspace;
+	if (space >= limit + bufspace_slack)
+		return (true);
+	if (space + bufspace_slack < limit)
+		return (false);
+	return (bufspace_sum() >= limit);
+}
+
+/*
+ *	bufspace_folded:
+ *
+ *	Called after delta was folded into bufspace.  Wake the bufspace
+ *	daemon if the count is at bufspacethresh.
+ */
+static void
+bufspace_folded(long delta)
+{
+
+	if (delta > 0 && bufspace_atleast(bufspacethresh))
+		bufspace_daemonwakeup();
+}
+
+/*
+ *	bufspace_add_cpu:
+ *
+ *	Add diff to this cpu's bufspace delta, folding the delta into the
+ *	global count once a batch has accumulated.  Must be called in a
+ *	critical section, which bounds the delta of every cpu that is not
+ *	inside this function by a batch.  Returns the amount folded.
+ */
+static long
+bufspace_add_cpu(long diff)
+{
+	struct bufpcpu *bpc;
+	long delta;
+
+	bpc = DPCPU_PTR(bufpcpu);
+	delta = atomic_fetchadd_long(&bpc->bpc_space, diff) + diff;
+	if (delta < bufspace_batch && delta > -bufspace_batch)
+		return (0);
+	delta = atomic_readandclear_long(&bpc->bpc_space);
+	atomic_add_long(&bufspace, delta);
+	return (delta);
+}
+
+/*
+ *	bufspace_add:
+ *
+ *	Account for a change in bufspace on this cpu.
+ */
+static void
+bufspace_add(long diff)
+{
+	long delta;
+
+	critical_enter();
+	delta = bufspace_add_cpu(diff);
+	critical_exit();
+	if (delta != 0)
+		bufspace_folded(delta);
+}
+
+/*
+ *	bufcount_reconcile:
+ *
+ *	Fold the pending bufspace and dirty buffer deltas of all cpus into
+ *	the global counts.  Must not be called with bdlock or nblock held,
+ *	since the folds may issue wakeups.
+ */
+static void
+bufcount_reconcile(void)
+{
+	struct bufpcpu *bpc;
+	long space, s;
+	int dirty, d, i;
+
+	space = 0;
+	dirty = 0;
+	CPU_FOREACH(i) {
+		bpc = DPCPU_ID_PTR(i, bufpcpu);
+		/* Keep the drained deltas within the slack while in transit. */
+		critical_enter();
+		s = atomic_readandclear_long(&bpc->bpc_space);
+		atomic_add_long(&bufspace, s);
+		d = atomic_readandclear_int(&bpc->bpc_dirty);
+		atomic_add_int(&numdirtybuffers, d);
+		critical_exit();
+		space += s;
+		dirty += d;
+	}
+	if (space != 0)
+		bufspace_folded(space);
+	if (dirty != 0)
+		bdirty_folded(dirty);
+}
+
 /*
  *	bufspace_adjust:
  *
@@ -532,21 +778,14 @@ bufspace_daemonwakeup(void)
 static void
 bufspace_adjust(struct buf *bp, int bufsize)
 {
-	long space;
 	int diff;
 
 	KASSERT((bp->b_flags & B_MALLOC) == 0,
 	    ("bufspace_adjust: malloc buf %p", bp));
 	diff = bufsize - bp->b_bufsize;
-	if (diff < 0) {
-		atomic_subtract_long(&bufspace, -diff);
+	bufspace_add(diff);
+	if (diff < 0)
 		bufspace_wakeup();
-	} else {
-		space = atomic_fetchadd_long(&bufspace, diff);
-		/* Wake up the daemon on the transition. */
-		if (space < bufspacethresh && space + diff >= bufspacethresh)
-			bufspace_daemonwakeup();
-	}
 	bp->b_bufsize = bufsize;
 }
 
@@ -554,26 +793,42 @@ bufspace_adjust(struct buf *bp, int bufsize)
  *	bufspace_reserve:
  *
  *	Reserve bufspace before calling allocbuf().  metadata has a
- *	different space limit than data.
+ *	different space limit than data.  A reservation that leaves the
+ *	lagging global count more than bufspace_slack below the limit goes
+ *	to this cpu's delta, in the same critical section as the check.
+ *	Closer to the limit, it is checked against the summed count and
+ *	made on the global count with a compare-and-set, so that concurrent
+ *	reservers cannot overrun the limit.
  */
 static int
 bufspace_reserve(int size, bool metadata)
 {
-	long limit;
-	long space;
+	long delta, limit;
+	long space, sum;
 
 	if (metadata)
 		limit = maxbufspace;
 	else
 		limit = hibufspace;
+	critical_enter();
+	if (bufspace + bufspace_slack + size <= limit) {
+		delta = bufspace_add_cpu(size);
+		critical_exit();
+		if (delta != 0)
+			bufspace_folded(delta);
+		return (0);
+	}
+	critical_exit();
+
 	do {
 		space = bufspace;
-		if (space + size > limit)
+		sum = space + bufspace_pending();
+		if (sum + size > limit)
 			return (ENOSPC);
 	} while (atomic_cmpset_long(&bufspace, space, space + size) == 0);
 
 	/* Wake up the daemon on the transition. */
-	if (space < bufspacethresh && space + size >= bufspacethresh)
+	if (sum < bufspacethresh && sum + size >= bufspacethresh)
 		bufspace_daemonwakeup();
 
 	return (0);
@@ -587,7 +842,8 @@ bufspace_reserve(int size, bool metadata)
 static void
 bufspace_release(int size)
 {
-	atomic_subtract_long(&bufspace, size);
+
+	bufspace_add(-size);
 	bufspace_wakeup();
 }
 
@@ -662,6 +918,7 @@ bufspace_daemon(void)
 {
 	for (;;) {
 		kproc_suspend_check(bufspacedaemonproc);
+		bufcount_reconcile();
 
 		/*
 		 * Free buffers from the clean queue until we meet our
@@ -688,7 +945,7 @@ bufspace_daemon(void)
 		 *	which will inefficiently trade bufs with bqrelse
 		 *	until we return to condition 2.
 		 */
-		while (bufspace > lobufspace ||
+		while (bufspace_atleast(lobufspace + 1) ||
 		    numfreebuffers < hifreebuffers) {
 			if (buf_recycle(false) != 0) {
 				atomic_set_int(&needsbuffer, 1);
@@ -709,8 +966,9 @@ bufspace_daemon(void)
 		/*
 		 * Re-check our limits under the exclusive nblock.
 		 */
+		bufcount_reconcile();
 		rw_wlock(&nblock);
-		if (bufspace < bufspacethresh &&
+		if (!bufspace_atleast(bufspacethresh) &&
 		    numfreebuffers > lofreebuffers) {
 			bufspace_request = 0;
 			rw_sleep(&bufspace_request, &nblock, PRIBIO|PDROP,
@@ -1100,6 +1358,18 @@ bufinit(void)
 	}
 	lodirtybuffers = hidirtybuffers / 2;
 
+	/*
+	 * Size the per-cpu accounting batches so that the deltas pending on
+	 * all cpus stay within a quarter of the gap between the low and high
+	 * watermarks.
+	 */
+	bufspace_batch = lmax(lmin(MAXBCACHEBUF,
+	    (maxbufspace - hibufspace) / (4 * mp_ncpus)), 1);
+	bufdirty_batch = imax(imin(16,
+	    (hidirtybuffers - lodirtybuffers) / (4 * mp_ncpus)), 1);
+	bufspace_slack = mp_ncpus * (bufspace_batch + MAXBCACHEBUF);
+	bufdirty_slack = mp_ncpus * (bufdirty_batch + 1);
+
 	/*
 	 * lofreebuffers should be sufficient to avoid stalling waiting on
 	 * buf headers under heavy utilization.  The bufs in per-cpu caches
@@ -1122,11 +1392,13 @@ bufinit(void)
 	    NULL, NULL, NULL, NULL, buf_import, buf_release, NULL, 0);
 
 	/*
-	 * Size the clean queue according to the amount of buffer space.
-	 * One queue per-256mb up to the max.  More queues gives better
-	 * concurrency but less accurate LRU.
+	 * Size the clean queue according to the amount of buffer space and
+	 * the number of cpus.  One queue per-256mb, and at least one per
+	 * cpu, up to the max.  More queues gives better concurrency but less
+	 * accurate LRU.
 	 */
-	clean_queues = MIN(howmany(maxbufspace, 256*1024*1024), CLEAN_QUEUES);
+	clean_queues = MIN(MAX(howmany(maxbufspace, 256*1024*1024), mp_ncpus),
+	    CLEAN_QUEUES);
 
 }
 
@@ -1396,7 +1668,7 @@ buf_free(struct buf *bp)
  *	only as a per-cpu cache of bufs still maintained on a global list.
  */
 static int
-buf_import(void *arg, void **store, int cnt, int flags)
+buf_import(void *arg, void **store, int cnt, int domain, int flags)
 {
 	struct buf *bp;
 	int i;
@@ -1568,14 +1840,19 @@ buf_qrecycle(int qindex, bool kva)
  *	buf_recycle:
  *
  *	Iterate through all clean queues until we find a buf to recycle or
- *	exhaust the search.
+ *	exhaust the search.  Each cpu starts at the queue after the one it
+ *	started at last time, so that the oldest buffers of every queue are
+ *	recycled in turn rather than the cpu's own queue being emptied first.
+ *	The rotor is per-cpu and a lost update only repeats a start queue.
  */
 static int
 buf_recycle(bool kva)
 {
+	struct bufpcpu *bpc;
 	int qindex, first_qindex;
 
-	qindex = first_qindex = bqcleanq();
+	bpc = DPCPU_PTR(bufpcpu);
+	qindex = first_qindex = QUEUE_CLEAN + bpc->bpc_recycle++ % clean_queues;
 	do {
 		if (buf_qrecycle(qindex, kva) == 0)
 			return (0);
@@ -2205,9 +2482,9 @@ void
 bwillwrite(void)
 {
 
-	if (numdirtybuffers >= hidirtybuffers) {
+	if (bdirty_atleast(hidirtybuffers)) {
 		mtx_lock(&bdirtylock);
-		while (numdirtybuffers >= hidirtybuffers) {
+		while (bdirty_atleast(hidirtybuffers)) {
 			bdirtywait = 1;
 			msleep(&bdirtywait, &bdirtylock, (PRIBIO + 4),
 			    "flswai", 0);
@@ -2223,7 +2500,7 @@ int
 buf_dirty_count_severe(void)
 {
 
-	return(numdirtybuffers >= hidirtybuffers);
+	return(bdirty_atleast(hidirtybuffers));
 }
 
 /*
@@ -2909,7 +3186,7 @@ getnewbuf(struct vnode *vp, int slpflag, int slptimeo, int maxsize, int gbflags)
 	} while (buf_scan(false) == 0);
 
 	if (reserved)
-		atomic_subtract_long(&bufspace, maxsize);
+		bufspace_add(-maxsize);
 	if (bp != NULL) {
 		bp->b_flags |= B_INVAL;
 		brelse(bp);
@@ -2955,7 +3232,7 @@ buf_flush(struct vnode *vp, int target)
 static void
 buf_daemon()
 {
-	int lodirty;
+	int dirty, lodirty;
 
 	/*
 	 * This process needs to be suspended prior to shutdown sync.
@@ -2973,9 +3250,10 @@ buf_daemon()
 		mtx_unlock(&bdlock);
 
 		kproc_suspend_check(bufdaemonproc);
+		bufcount_reconcile();
 		lodirty = lodirtybuffers;
 		if (bd_speedupreq) {
-			lodirty = numdirtybuffers / 2;
+			lodirty = bdirty_sum() / 2;
 			bd_speedupreq = 0;
 		}
 		/*
@@ -2983,8 +3261,8 @@ buf_daemon()
 		 * allow to build up, otherwise we would completely saturate
 		 * the I/O system.
 		 */
-		while (numdirtybuffers > lodirty) {
-			if (buf_flush(NULL, numdirtybuffers - lodirty) == 0)
+		while ((dirty = bdirty_sum()) > lodirty) {
+			if (buf_flush(NULL, dirty - lodirty) == 0)
 				break;
 			kern_yield(PRI_USER);
 		}
@@ -2999,8 +3277,9 @@ buf_daemon()
 		 * find any flushable buffers, we sleep for a short period
 		 * to avoid endless loops on unlockable buffers.
 		 */
+		bufcount_reconcile();
 		mtx_lock(&bdlock);
-		if (numdirtybuffers <= lodirtybuffers) {
+		if (bdirty_sum() <= lodirtybuffers) {
 			/*
 			 * We reached our low water mark, reset the
 			 * request and sleep until we are needed again.
@@ -39,6 +39,7 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_cache.c 293295 2016-01-07 02:04:17Z mjg $"
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/counter.h>
 #include <sys/filedesc.h>
 #include <sys/fnv_hash.h>
 #include <sys/kernel.h>
@@ -46,10 +47,12 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_cache.c 293295 2016-01-07 02:04:17Z mjg $"
 #include <sys/malloc.h>
 #include <sys/fcntl.h>
 #include <sys/mount.h>
+#include <sys/mutex.h>
 #include <sys/namei.h>
 #include <sys/proc.h>
 #include <sys/rwlock.h>
 #include <sys/sdt.h>
+#include <sys/smp.h>
 #include <sys/syscallsubr.h>
 #include <sys/sysctl.h>
 #include <sys/sysproto.h>
@@ -130,6 +133,7 @@ struct	namecache_ts {
 #define NCF_ISDOTDOT	0x02
 #define	NCF_TS		0x04
 #define	NCF_DTS		0x08
+#define	NCF_DVDROP	0x10
 
 /*
  * Name caching works as follows:
@@ -148,13 +152,37 @@ struct	namecache_ts {
  * name is located in the cache, it will be dropped.
  */
 
+/*
+ * Locking.
+ *
+ * The cache used to be protected by a single global rwlock.  It is now
+ * covered by three classes of locks, always acquired in this order:
+ *
+ * 1. vnodelocks - mutexes hashed by vnode address.  The lock of a vnode
+ *    protects its v_cache_src, v_cache_dst and v_cache_dd fields.  When
+ *    several vnodelocks are needed they are taken in ascending address
+ *    order.
+ * 2. bucketlocks - rwlocks hashed by the entry hash.  A bucketlock covers
+ *    every hash chain that maps onto it.  Two bucketlocks are likewise
+ *    taken in ascending address order.
+ * 3. neglist locks - one per negative entry LRU list.
+ *
+ * Inserting or removing an entry requires the vnodelocks of both nc_dvp and
+ * nc_vp and the bucketlock of the entry in write mode; a negative entry also
+ * needs the lock of its neglist.  Holding any one of those locks therefore
+ * keeps the entries reachable through it from being freed, and a hit only
+ * needs the bucketlock in read mode (or the vnodelock of dvp for "..").
+ *
+ * Negative entries are spread over numneglists LRU lists.  Eviction walks
+ * them round-robin and is serialized by ncneg_shrink_lock.
+ */
+
 /*
  * Structures associated with name cacheing.
  */
 #define NCHHASH(hash) \
 	(&nchashtbl[(hash) & nchash])
 static LIST_HEAD(nchashhead, namecache) *nchashtbl;	/* Hash Table */
-static TAILQ_HEAD(, namecache) ncneg;	/* Hash Table */
 static u_long	nchash;			/* size of hash table */
 SYSCTL_ULONG(_debug, OID_AUTO, nchash, CTLFLAG_RD, &nchash, 0,
     "Size of namecache hash table");
@@ -176,14 +204,44 @@ SYSCTL_UINT(_vfs, OID_AUTO, ncsizefactor, CTLFLAG_RW, &ncsizefactor, 0,
 
 struct nchstats	nchstats;		/* cache effectiveness statistics */
 
-static struct rwlock cache_lock;
-RW_SYSINIT(vfscache, &cache_lock, "Name Cache");
+static struct rwlock_padalign *bucketlocks;
+static u_int	numbucketlocks;
+SYSCTL_UINT(_debug, OID_AUTO, ncbucketlocks, CTLFLAG_RD, &numbucketlocks, 0,
+    "Number of namecache bucket locks");
+#define	HASH2BUCKETLOCK(hash) \
+	((struct rwlock *)(&bucketlocks[((hash) & (numbucketlocks - 1))]))
+
+static struct mtx_padalign *vnodelocks;
+static u_int	numvnodelocks;
+SYSCTL_UINT(_debug, OID_AUTO, ncvnodelocks, CTLFLAG_RD, &numvnodelocks, 0,
+    "Number of namecache vnode locks");
+
+static __inline struct mtx *
+VP2VNODELOCK(struct vnode *vp)
+{
+
+	if (vp == NULL)
+		return (NULL);
+	return ((struct mtx *)(&vnodelocks[(((uintptr_t)(vp) >> 8) &
+	    (numvnodelocks - 1))]));
+}
 
-#define	CACHE_UPGRADE_LOCK()	rw_try_upgrade(&cache_lock)
-#define	CACHE_RLOCK()		rw_rlock(&cache_lock)
-#define	CACHE_RUNLOCK()		rw_runlock(&cache_lock)
-#define	CACHE_WLOCK()		rw_wlock(&cache_lock)
-#define	CACHE_WUNLOCK()		rw_wunlock(&cache_lock)
+struct neglist {
+	struct mtx		nl_lock;
+	TAILQ_HEAD(, namecache)	nl_list;
+} __aligned(CACHE_LINE_SIZE);
+
+static struct neglist *neglists;
+static u_int	numneglists;
+static u_int	neglist_rotor;		/* protected by ncneg_shrink_lock */
+static struct mtx ncneg_shrink_lock;
+
+static __inline struct neglist *
+NCP2NEGLIST(struct namecache *ncp)
+{
+
+	return (&neglists[(((uintptr_t)(ncp) >> 8) & (numneglists - 1))]);
+}
 
 /*
  * UMA zones for the VFS cache.
@@ -215,6 +273,11 @@ cache_alloc(int len, int ts)
 		return (uma_zalloc(cache_zone_small, M_WAITOK));
 }
 
+/*
+ * Free an entry which has been removed from the cache.  This must be done
+ * with no name cache locks held, since dropping the hold on the parent
+ * directory may free it.
+ */
 static void
 cache_free(struct namecache *ncp)
 {
@@ -222,6 +285,8 @@ cache_free(struct namecache *ncp)
 
 	if (ncp == NULL)
 		return;
+	if ((ncp->nc_flag & NCF_DVDROP) != 0)
+		vdrop(ncp->nc_dvp);
 	ts = ncp->nc_flag & NCF_TS;
 	if (ncp->nc_nlen <= CACHE_PATH_CUTOFF) {
 		if (ts)
@@ -259,51 +324,96 @@ cache_out_ts(struct namecache *ncp, struct timespec *tsp, int *ticksp)
 		*ticksp = ((struct namecache_ts *)ncp)->nc_ticks;
 }
 
+static __inline uint32_t
+cache_get_hash(char *name, u_char len, struct vnode *dvp)
+{
+	uint32_t hash;
+
+	hash = fnv_32_buf(name, len, FNV1_32_INIT);
+	hash = fnv_32_buf(&dvp, sizeof(dvp), hash);
+	return (hash);
+}
+
+static __inline struct rwlock *
+NCP2BUCKETLOCK(struct namecache *ncp)
+{
+
+	return (HASH2BUCKETLOCK(cache_get_hash(nc_get_name(ncp), ncp->nc_nlen,
+	    ncp->nc_dvp)));
+}
+
 static int	doingcache = 1;		/* 1 => enable the cache */
 SYSCTL_INT(_debug, OID_AUTO, vfscache, CTLFLAG_RW, &doingcache, 0,
     "VFS namecache enabled");
 
+static int	cache_fast_lookup = 1;
+SYSCTL_INT(_vfs, OID_AUTO, cache_fast_lookup, CTLFLAG_RW,
+    &cache_fast_lookup, 0, "Resolve fully cached paths without vnode locks");
+
 /* Export size information to userland */
 SYSCTL_INT(_debug_sizeof, OID_AUTO, namecache, CTLFLAG_RD, SYSCTL_NULL_INT_PTR,
     sizeof(struct namecache), "sizeof(struct namecache)");
 
 /*
  * The new name cache statistics
+ *
+ * Counters bumped on the lookup path are per-CPU so that hits do not
+ * bounce a shared cache line.
  */
 static SYSCTL_NODE(_vfs, OID_AUTO, cache, CTLFLAG_RW, 0,
     "Name cache statistics");
-#define STATNODE(mode, name, var, descr) \
-	SYSCTL_ULONG(_vfs_cache, OID_AUTO, name, mode, var, 0, descr);
-STATNODE(CTLFLAG_RD, numneg, &numneg, "Number of negative cache entries");
-STATNODE(CTLFLAG_RD, numcache, &numcache, "Number of cache entries");
-static u_long numcalls; STATNODE(CTLFLAG_RD, numcalls, &numcalls,
-    "Number of cache lookups");
-static u_long dothits; STATNODE(CTLFLAG_RD, dothits, &dothits,
-    "Number of '.' hits");
-static u_long dotdothits; STATNODE(CTLFLAG_RD, dotdothits, &dotdothits,
-    "Number of '..' hits");
-static u_long numchecks; STATNODE(CTLFLAG_RD, numchecks, &numchecks,
-    "Number of checks in lookup");
-static u_long nummiss; STATNODE(CTLFLAG_RD, nummiss, &nummiss,
-    "Number of cache misses");
-static u_long nummisszap; STATNODE(CTLFLAG_RD, nummisszap, &nummisszap,
-    "Number of cache misses we do not want to cache");
-static u_long numposzaps; STATNODE(CTLFLAG_RD, numposzaps, &numposzaps,
+#define STATNODE_ULONG(name, descr)					\
+	SYSCTL_ULONG(_vfs_cache, OID_AUTO, name, CTLFLAG_RD, &name, 0, descr);
+#define STATNODE_COUNTER(name, descr)					\
+	static counter_u64_t name;					\
+	SYSCTL_COUNTER_U64(_vfs_cache, OID_AUTO, name, CTLFLAG_RD, &name, descr);
+STATNODE_ULONG(numneg, "Number of negative cache entries");
+STATNODE_ULONG(numcache, "Number of cache entries");
+STATNODE_COUNTER(numcalls, "Number of cache lookups");
+STATNODE_COUNTER(dothits, "Number of '.' hits");
+STATNODE_COUNTER(dotdothits, "Number of '..' hits");
+STATNODE_COUNTER(numchecks, "Number of checks in lookup");
+STATNODE_COUNTER(nummiss, "Number of cache misses");
+STATNODE_COUNTER(nummisszap, "Number of cache misses we do not want to cache");
+STATNODE_COUNTER(numposzaps,
     "Number of cache hits (positive) we do not want to cache");
-static u_long numposhits; STATNODE(CTLFLAG_RD, numposhits, &numposhits,
-    "Number of cache hits (positive)");
-static u_long numnegzaps; STATNODE(CTLFLAG_RD, numnegzaps, &numnegzaps,
+STATNODE_COUNTER(numposhits, "Number of cache hits (positive)");
+STATNODE_COUNTER(numnegzaps,
     "Number of cache hits (negative) we do not want to cache");
-static u_long numneghits; STATNODE(CTLFLAG_RD, numneghits, &numneghits,
-    "Number of cache hits (negative)");
-static u_long numupgrades; STATNODE(CTLFLAG_RD, numupgrades, &numupgrades,
-    "Number of updates of the cache after lookup (write lock + retry)");
+STATNODE_COUNTER(numneghits, "Number of cache hits (negative)");
+STATNODE_COUNTER(numrelocks,
+    "Number of zaps which had to drop locks to respect the lock order");
+STATNODE_COUNTER(numnegevicts, "Number of negative entries evicted");
+STATNODE_COUNTER(numfplookups, "Number of lockless path walks attempted");
+STATNODE_COUNTER(numfpfallbacks,
+    "Number of lockless path walks which fell back to the locked walk");
 
-SYSCTL_OPAQUE(_vfs_cache, OID_AUTO, nchstats, CTLFLAG_RD | CTLFLAG_MPSAFE,
-    &nchstats, sizeof(nchstats), "LU",
+/*
+ * The hit and miss members of nchstats are folded in from the per-CPU
+ * counters above; the remaining ones are still updated by filesystems.
+ */
+static int
+sysctl_nchstats(SYSCTL_HANDLER_ARGS)
+{
+	struct nchstats snap;
+
+	if (req->oldptr == NULL)
+		return (SYSCTL_OUT(req, 0, sizeof(snap)));
+
+	snap = nchstats;
+	snap.ncs_goodhits = counter_u64_fetch(numposhits);
+	snap.ncs_neghits = counter_u64_fetch(numneghits);
+	snap.ncs_badhits = counter_u64_fetch(numposzaps) +
+	    counter_u64_fetch(numnegzaps);
+	snap.ncs_miss = counter_u64_fetch(nummisszap) +
+	    counter_u64_fetch(nummiss);
+
+	return (SYSCTL_OUT(req, &snap, sizeof(snap)));
+}
+SYSCTL_PROC(_vfs_cache, OID_AUTO, nchstats, CTLTYPE_OPAQUE | CTLFLAG_RD |
+    CTLFLAG_MPSAFE, 0, 0, sysctl_nchstats, "LU",
     "VFS cache effectiveness statistics");
 
-static void cache_zap(struct namecache *ncp);
 static int vn_vptocnp_locked(struct vnode **vp, struct ucred *cred, char *buf,
     u_int *buflen);
 static int vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
@@ -311,6 +421,24 @@ static int vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 
 static MALLOC_DEFINE(M_VFSCACHE, "vfscache", "VFS name cache entries");
 
+static void
+cache_lock_all_buckets(void)
+{
+	u_int i;
+
+	for (i = 0; i < numbucketlocks; i++)
+		rw_wlock(&bucketlocks[i]);
+}
+
+static void
+cache_unlock_all_buckets(void)
+{
+	u_int i;
+
+	for (i = 0; i < numbucketlocks; i++)
+		rw_wunlock(&bucketlocks[i]);
+}
+
 #ifdef DIAGNOSTIC
 /*
  * Grab an atomic snapshot of the name cache hash chain lengths
@@ -330,9 +458,9 @@ retry:
 	if (req->oldptr == NULL)
 		return SYSCTL_OUT(req, 0, n_nchash * sizeof(int));
 	cntbuf = malloc(n_nchash * sizeof(int), M_TEMP, M_ZERO | M_WAITOK);
-	CACHE_RLOCK();
+	cache_lock_all_buckets();
 	if (n_nchash != nchash + 1) {
-		CACHE_RUNLOCK();
+		cache_unlock_all_buckets();
 		free(cntbuf, M_TEMP);
 		goto retry;
 	}
@@ -340,7 +468,7 @@ retry:
 	for (ncpp = nchashtbl, i = 0; i < n_nchash; ncpp++, i++)
 		LIST_FOREACH(ncp, ncpp, nc_hash)
 			cntbuf[i]++;
-	CACHE_RUNLOCK();
+	cache_unlock_all_buckets();
 	for (error = 0, i = 0; i < n_nchash; i++)
 		if ((error = SYSCTL_OUT(req, &cntbuf[i], sizeof(int))) != 0)
 			break;
@@ -363,7 +491,7 @@ sysctl_debug_hashstat_nchash(SYSCTL_HANDLER_ARGS)
 	if (!req->oldptr)
 		return SYSCTL_OUT(req, 0, 4 * sizeof(int));
 
-	CACHE_RLOCK();
+	cache_lock_all_buckets();
 	n_nchash = nchash + 1;	/* nchash is max index, not count */
 	used = 0;
 	maxlength = 0;
@@ -380,7 +508,7 @@ sysctl_debug_hashstat_nchash(SYSCTL_HANDLER_ARGS)
 			maxlength = count;
 	}
 	n_nchash = nchash + 1;
-	CACHE_RUNLOCK();
+	cache_unlock_all_buckets();
 	pct = (used * 100) / (n_nchash / 100);
 	error = SYSCTL_OUT(req, &n_nchash, sizeof(n_nchash));
 	if (error)
@@ -402,17 +530,130 @@ SYSCTL_PROC(_debug_hashstat, OID_AUTO, nchash, CTLTYPE_INT|CTLFLAG_RD|
 #endif
 
 /*
- * cache_zap():
+ * Helpers for the vnodelocks.  Either lock may be NULL (negative entries
+ * have no target vnode) and both may hash to the same mutex.
+ */
+static void
+cache_sort(struct mtx **vlp1, struct mtx **vlp2)
+{
+	struct mtx *tmp;
+
+	if (*vlp1 > *vlp2) {
+		tmp = *vlp2;
+		*vlp2 = *vlp1;
+		*vlp1 = tmp;
+	}
+}
+
+static void
+cache_lock_vnodes(struct mtx *vlp1, struct mtx *vlp2)
+{
+
+	MPASS(vlp1 <= vlp2);
+	if (vlp1 != NULL)
+		mtx_lock(vlp1);
+	if (vlp2 != NULL && vlp2 != vlp1)
+		mtx_lock(vlp2);
+}
+
+static void
+cache_unlock_vnodes(struct mtx *vlp1, struct mtx *vlp2)
+{
+
+	if (vlp1 != NULL)
+		mtx_unlock(vlp1);
+	if (vlp2 != NULL && vlp2 != vlp1)
+		mtx_unlock(vlp2);
+}
+
+static int
+cache_trylock_vnodes(struct mtx *vlp1, struct mtx *vlp2)
+{
+
+	if (vlp1 != NULL && !mtx_trylock(vlp1))
+		return (EAGAIN);
+	if (vlp2 != NULL && vlp2 != vlp1 && !mtx_trylock(vlp2)) {
+		if (vlp1 != NULL)
+			mtx_unlock(vlp1);
+		return (EAGAIN);
+	}
+	return (0);
+}
+
+static void
+cache_assert_vnode_locked(struct vnode *vp)
+{
+	struct mtx *vlp;
+
+	vlp = VP2VNODELOCK(vp);
+	if (vlp == NULL)
+		return;
+	mtx_assert(vlp, MA_OWNED);
+}
+
+/*
+ * Negative entry LRU maintenance.  The neglist lock is the innermost
+ * lock of the cache.
+ */
+static void
+cache_negative_insert(struct namecache *ncp)
+{
+	struct neglist *neglist;
+
+	MPASS(ncp->nc_vp == NULL);
+	neglist = NCP2NEGLIST(ncp);
+	mtx_lock(&neglist->nl_lock);
+	TAILQ_INSERT_TAIL(&neglist->nl_list, ncp, nc_dst);
+	mtx_unlock(&neglist->nl_lock);
+	atomic_add_long(&numneg, 1);
+}
+
+static void
+cache_negative_remove(struct namecache *ncp)
+{
+	struct neglist *neglist;
+
+	MPASS(ncp->nc_vp == NULL);
+	neglist = NCP2NEGLIST(ncp);
+	mtx_lock(&neglist->nl_lock);
+	TAILQ_REMOVE(&neglist->nl_list, ncp, nc_dst);
+	mtx_unlock(&neglist->nl_lock);
+	atomic_subtract_long(&numneg, 1);
+}
+
+/*
+ * We found a "negative" match, so we shift it to the end of its
+ * "negative" cache entries queue to satisfy LRU.
+ */
+static void
+cache_negative_hit(struct namecache *ncp)
+{
+	struct neglist *neglist;
+
+	MPASS(ncp->nc_vp == NULL);
+	neglist = NCP2NEGLIST(ncp);
+	mtx_lock(&neglist->nl_lock);
+	TAILQ_REMOVE(&neglist->nl_list, ncp, nc_dst);
+	TAILQ_INSERT_TAIL(&neglist->nl_list, ncp, nc_dst);
+	mtx_unlock(&neglist->nl_lock);
+}
+
+/*
+ * cache_zap_locked():
  *
  *   Removes a namecache entry from cache, whether it contains an actual
- *   pointer to a vnode or if it is just a negative cache entry.
+ *   pointer to a vnode or if it is just a negative cache entry.  The
+ *   vnodelocks of nc_dvp and nc_vp and the write-locked bucketlock of the
+ *   entry must be held.  The entry is freed by the caller with
+ *   cache_free() once all the locks are dropped.
  */
 static void
-cache_zap(struct namecache *ncp)
+cache_zap_locked(struct namecache *ncp)
 {
-	struct vnode *vp;
 
-	rw_assert(&cache_lock, RA_WLOCKED);
+	cache_assert_vnode_locked(ncp->nc_dvp);
+	cache_assert_vnode_locked(ncp->nc_vp);
+	rw_assert(NCP2BUCKETLOCK(ncp), RA_WLOCKED);
 	CTR2(KTR_VFS, "cache_zap(%p) vp %p", ncp, ncp->nc_vp);
 	if (ncp->nc_vp != NULL) {
 		SDT_PROBE3(vfs, namecache, zap, done, ncp->nc_dvp,
@@ -421,7 +662,6 @@ cache_zap(struct namecache *ncp)
 		SDT_PROBE2(vfs, namecache, zap_negative, done, ncp->nc_dvp,
 		    nc_get_name(ncp));
 	}
-	vp = NULL;
 	LIST_REMOVE(ncp, nc_hash);
 	if (ncp->nc_flag & NCF_ISDOTDOT) {
 		if (ncp == ncp->nc_dvp->v_cache_dd)
@@ -429,8 +669,8 @@ cache_zap(struct namecache *ncp)
 	} else {
 		LIST_REMOVE(ncp, nc_src);
 		if (LIST_EMPTY(&ncp->nc_dvp->v_cache_src)) {
-			vp = ncp->nc_dvp;
-			numcachehv--;
+			ncp->nc_flag |= NCF_DVDROP;
+			atomic_subtract_long(&numcachehv, 1);
 		}
 	}
 	if (ncp->nc_vp) {
@@ -438,13 +678,194 @@ cache_zap(struct namecache *ncp)
 		if (ncp == ncp->nc_vp->v_cache_dd)
 			ncp->nc_vp->v_cache_dd = NULL;
 	} else {
-		TAILQ_REMOVE(&ncneg, ncp, nc_dst);
-		numneg--;
+		cache_negative_remove(ncp);
 	}
-	numcache--;
+	atomic_subtract_long(&numcache, 1);
+}
+
+/*
+ * Zap an entry reached through vp with the vnodelock of vp held.  The
+ * other vnodelock and the bucketlock are acquired here.  If the other
+ * vnodelock sorts below ours and cannot be trylocked, every lock is dropped
+ * and EAGAIN is returned so that the caller can restart; otherwise only the
+ * vnodelock of vp is still held on return.
+ */
+static int
+cache_zap_locked_vnode(struct namecache *ncp, struct vnode *vp)
+{
+	struct mtx *pvlp, *vlp;
+	struct rwlock *blp;
+
+	MPASS(vp == ncp->nc_dvp || vp == ncp->nc_vp);
+	pvlp = VP2VNODELOCK(vp);
+	mtx_assert(pvlp, MA_OWNED);
+	if (vp == ncp->nc_dvp)
+		vlp = VP2VNODELOCK(ncp->nc_vp);
+	else
+		vlp = VP2VNODELOCK(ncp->nc_dvp);
+	if (vlp == pvlp)
+		vlp = NULL;
+	if (vlp != NULL) {
+		if (vlp > pvlp)
+			mtx_lock(vlp);
+		else if (!mtx_trylock(vlp)) {
+			mtx_unlock(pvlp);
+			/* Wait for the owner so that the retry is likely to win. */
+			cache_lock_vnodes(vlp, pvlp);
+			cache_unlock_vnodes(vlp, pvlp);
+			counter_u64_add(numrelocks, 1);
+			return (EAGAIN);
+		}
+	}
+	blp = NCP2BUCKETLOCK(ncp);
+	rw_wlock(blp);
+	cache_zap_locked(ncp);
+	rw_wunlock(blp);
+	if (vlp != NULL)
+		mtx_unlock(vlp);
+	return (0);
+}
+
+/*
+ * Zap an entry found through its write-locked bucket.  The vnodelocks sort
+ * above the bucketlock, so they can only be trylocked here.  On failure the
+ * bucketlock is dropped and EAGAIN is returned; on success the bucketlock
+ * is still held.
+ */
+static int
+cache_zap_wlocked_bucket(struct namecache *ncp, struct rwlock *blp)
+{
+	struct mtx *dvlp, *vlp;
+
+	rw_assert(blp, RA_WLOCKED);
+	dvlp = VP2VNODELOCK(ncp->nc_dvp);
+	vlp = VP2VNODELOCK(ncp->nc_vp);
+	cache_sort(&dvlp, &vlp);
+	if (cache_trylock_vnodes(dvlp, vlp) == 0) {
+		cache_zap_locked(ncp);
+		cache_unlock_vnodes(dvlp, vlp);
+		return (0);
+	}
+	rw_wunlock(blp);
+	cache_lock_vnodes(dvlp, vlp);
+	cache_unlock_vnodes(dvlp, vlp);
+	counter_u64_add(numrelocks, 1);
+	return (EAGAIN);
+}
+
+/*
+ * Remove the entry named by cnp in dvp, if there is one.
+ */
+static void
+cache_zap_by_name(struct vnode *dvp, struct componentname *cnp,
+    uint32_t hash)
+{
+	struct namecache *ncp;
+	struct rwlock *blp;
+
+	blp = HASH2BUCKETLOCK(hash);
+retry:
+	rw_wlock(blp);
+	LIST_FOREACH(ncp, (NCHHASH(hash)), nc_hash) {
+		if (ncp->nc_dvp == dvp && ncp->nc_nlen == cnp->cn_namelen &&
+		    !bcmp(nc_get_name(ncp), cnp->cn_nameptr, ncp->nc_nlen))
+			break;
+	}
+	if (ncp != NULL && cache_zap_wlocked_bucket(ncp, blp) != 0)
+		goto retry;
+	rw_wunlock(blp);
+	cache_free(ncp);
+}
+
+/*
+ * Remove the ".." entry of dvp, if there is one, and clear v_cache_dd.
+ */
+static void
+cache_zap_dd(struct vnode *dvp)
+{
+	struct namecache *ncp;
+	struct mtx *dvlp;
+
+	dvlp = VP2VNODELOCK(dvp);
+retry:
+	mtx_lock(dvlp);
+	ncp = dvp->v_cache_dd;
+	if (ncp != NULL && (ncp->nc_flag & NCF_ISDOTDOT) != 0) {
+		if (cache_zap_locked_vnode(ncp, dvp) != 0)
+			goto retry;
+	} else
+		ncp = NULL;
+	dvp->v_cache_dd = NULL;
+	mtx_unlock(dvlp);
 	cache_free(ncp);
-	if (vp != NULL)
-		vdrop(vp);
+}
+
+/*
+ * Evict the least recently used entry of the next non-empty neglist.
+ * Only one thread shrinks at a time; others skip the work, since the
+ * thread already at it keeps numneg in check.
+ */
+static void
+cache_negative_zap_one(void)
+{
+	struct namecache *ncp, *ncp2;
+	struct neglist *neglist;
+	struct vnode *dvp;
+	struct mtx *dvlp;
+	struct rwlock *blp;
+	uint32_t hash;
+	u_int i;
+
+	if (!mtx_trylock(&ncneg_shrink_lock))
+		return;
+	ncp = NULL;
+	neglist = NULL;
+	for (i = 0; i < numneglists; i++) {
+		neglist = &neglists[neglist_rotor++ & (numneglists - 1)];
+		mtx_lock(&neglist->nl_lock);
+		ncp = TAILQ_FIRST(&neglist->nl_list);
+		if (ncp != NULL)
+			break;
+		mtx_unlock(&neglist->nl_lock);
+	}
+	if (ncp == NULL) {
+		mtx_unlock(&ncneg_shrink_lock);
+		return;
+	}
+	dvp = ncp->nc_dvp;
+	hash = cache_get_hash(nc_get_name(ncp), ncp->nc_nlen, dvp);
+	mtx_unlock(&neglist->nl_lock);
+
+	dvlp = VP2VNODELOCK(dvp);
+	blp = HASH2BUCKETLOCK(hash);
+	mtx_lock(dvlp);
+	rw_wlock(blp);
+	/*
+	 * The entry may have been zapped while the neglist lock was dropped.
+	 * Only evict it if it is still hashed as a negative entry of dvp.
+	 */
+	LIST_FOREACH(ncp2, (NCHHASH(hash)), nc_hash) {
+		if (ncp2 == ncp && ncp2->nc_dvp == dvp && ncp2->nc_vp == NULL)
+			break;
+	}
+	if (ncp2 != NULL) {
+		cache_zap_locked(ncp2);
+		counter_u64_add(numnegevicts, 1);
+	}
+	rw_wunlock(blp);
+	mtx_unlock(dvlp);
+	mtx_unlock(&ncneg_shrink_lock);
+	cache_free(ncp2);
+}
+
+static void
+cache_lookup_unlock(struct rwlock *blp, struct mtx *vlp)
+{
+
+	if (blp != NULL)
+		rw_runlock(blp);
+	else if (vlp != NULL)
+		mtx_unlock(vlp);
 }
 
 /*
@@ -462,6 +883,10 @@ cache_zap(struct namecache *ncp)
  * vpp is locked and ref'd on return.  If we're looking up DOTDOT, dvp is
  * unlocked.  If we're looking up . an extra ref is taken, but the lock is
  * not recursively acquired.
+ *
+ * Hits are served with only the bucketlock of the name held in read mode,
+ * or the vnodelock of dvp for "..".  Entries which have to be dropped are
+ * removed after those locks are released.
  */
 
 int
@@ -469,26 +894,28 @@ cache_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp,
     struct timespec *tsp, int *ticksp)
 {
 	struct namecache *ncp;
+	struct rwlock *blp;
+	struct mtx *dvlp;
 	uint32_t hash;
-	int error, ltype, wlocked;
+	int error, ltype;
 
 	if (!doingcache) {
 		cnp->cn_flags &= ~MAKEENTRY;
 		return (0);
 	}
 retry:
-	CACHE_RLOCK();
-	wlocked = 0;
-	numcalls++;
+	blp = NULL;
+	dvlp = NULL;
+	hash = 0;
 	error = 0;
+	counter_u64_add(numcalls, 1);
 
-retry_wlocked:
 	if (cnp->cn_nameptr[0] == '.') {
 		if (cnp->cn_namelen == 1) {
 			*vpp = dvp;
 			CTR2(KTR_VFS, "cache_lookup(%p, %s) found via .",
 			    dvp, cnp->cn_nameptr);
-			dothits++;
+			counter_u64_add(dothits, 1);
 			SDT_PROBE3(vfs, namecache, lookup, hit, dvp, ".", *vpp);
 			if (tsp != NULL)
 				timespecclear(tsp);
@@ -497,19 +924,17 @@ retry_wlocked:
 			goto success;
 		}
 		if (cnp->cn_namelen == 2 && cnp->cn_nameptr[1] == '.') {
-			dotdothits++;
+			counter_u64_add(dotdothits, 1);
+			dvlp = VP2VNODELOCK(dvp);
+			mtx_lock(dvlp);
 			if (dvp->v_cache_dd == NULL) {
 				SDT_PROBE3(vfs, namecache, lookup, miss, dvp,
 				    "..", NULL);
 				goto unlock;
 			}
 			if ((cnp->cn_flags & MAKEENTRY) == 0) {
-				if (!wlocked && !CACHE_UPGRADE_LOCK())
-					goto wlock;
-				if (dvp->v_cache_dd->nc_flag & NCF_ISDOTDOT)
-					cache_zap(dvp->v_cache_dd);
-				dvp->v_cache_dd = NULL;
-				CACHE_WUNLOCK();
+				mtx_unlock(dvlp);
+				cache_zap_dd(dvp);
 				return (0);
 			}
 			ncp = dvp->v_cache_dd;
@@ -533,10 +958,11 @@ retry_wlocked:
 		}
 	}
 
-	hash = fnv_32_buf(cnp->cn_nameptr, cnp->cn_namelen, FNV1_32_INIT);
-	hash = fnv_32_buf(&dvp, sizeof(dvp), hash);
+	hash = cache_get_hash(cnp->cn_nameptr, cnp->cn_namelen, dvp);
+	blp = HASH2BUCKETLOCK(hash);
+	rw_rlock(blp);
 	LIST_FOREACH(ncp, (NCHHASH(hash)), nc_hash) {
-		numchecks++;
+		counter_u64_add(numchecks, 1);
 		if (ncp->nc_dvp == dvp && ncp->nc_nlen == cnp->cn_namelen &&
 		    !bcmp(nc_get_name(ncp), cnp->cn_nameptr, ncp->nc_nlen))
 			break;
@@ -547,29 +973,24 @@ retry_wlocked:
 		SDT_PROBE3(vfs, namecache, lookup, miss, dvp, cnp->cn_nameptr,
 		    NULL);
 		if ((cnp->cn_flags & MAKEENTRY) == 0) {
-			nummisszap++;
+			counter_u64_add(nummisszap, 1);
 		} else {
-			nummiss++;
+			counter_u64_add(nummiss, 1);
 		}
-		nchstats.ncs_miss++;
 		goto unlock;
 	}
 
 	/* We don't want to have an entry, so dump it */
 	if ((cnp->cn_flags & MAKEENTRY) == 0) {
-		numposzaps++;
-		nchstats.ncs_badhits++;
-		if (!wlocked && !CACHE_UPGRADE_LOCK())
-			goto wlock;
-		cache_zap(ncp);
-		CACHE_WUNLOCK();
+		counter_u64_add(numposzaps, 1);
+		rw_runlock(blp);
+		cache_zap_by_name(dvp, cnp, hash);
 		return (0);
 	}
 
 	/* We found a "positive" match, return the vnode */
 	if (ncp->nc_vp) {
-		numposhits++;
-		nchstats.ncs_goodhits++;
+		counter_u64_add(numposhits, 1);
 		*vpp = ncp->nc_vp;
 		CTR4(KTR_VFS, "cache_lookup(%p, %s) found %p via ncp %p",
 		    dvp, cnp->cn_nameptr, *vpp, ncp);
@@ -582,46 +1003,29 @@ retry_wlocked:
 negative_success:
 	/* We found a negative match, and want to create it, so purge */
 	if (cnp->cn_nameiop == CREATE) {
-		numnegzaps++;
-		nchstats.ncs_badhits++;
-		if (!wlocked && !CACHE_UPGRADE_LOCK())
-			goto wlock;
-		cache_zap(ncp);
-		CACHE_WUNLOCK();
+		counter_u64_add(numnegzaps, 1);
+		cache_lookup_unlock(blp, dvlp);
+		if (blp != NULL)
+			cache_zap_by_name(dvp, cnp, hash);
+		else
+			cache_zap_dd(dvp);
 		return (0);
 	}
 
-	if (!wlocked && !CACHE_UPGRADE_LOCK())
-		goto wlock;
-	numneghits++;
+	counter_u64_add(numneghits, 1);
+	cache_negative_hit(ncp);
 	/*
-	 * We found a "negative" match, so we shift it to the end of
-	 * the "negative" cache entries queue to satisfy LRU.  Also,
-	 * check to see if the entry is a whiteout; indicate this to
+	 * Check to see if the entry is a whiteout; indicate this to
 	 * the componentname, if so.
 	 */
-	TAILQ_REMOVE(&ncneg, ncp, nc_dst);
-	TAILQ_INSERT_TAIL(&ncneg, ncp, nc_dst);
-	nchstats.ncs_neghits++;
 	if (ncp->nc_flag & NCF_WHITE)
 		cnp->cn_flags |= ISWHITEOUT;
 	SDT_PROBE2(vfs, namecache, lookup, hit__negative, dvp,
 	    nc_get_name(ncp));
 	cache_out_ts(ncp, tsp, ticksp);
-	CACHE_WUNLOCK();
+	cache_lookup_unlock(blp, dvlp);
 	return (ENOENT);
 
-wlock:
-	/*
-	 * We need to update the cache after our lookup, so upgrade to
-	 * a write lock and retry the operation.
-	 */
-	CACHE_RUNLOCK();
-	CACHE_WLOCK();
-	numupgrades++;
-	wlocked = 1;
-	goto retry_wlocked;
-
 success:
 	/*
 	 * On success we return a locked and ref'd vnode as per the lookup
@@ -629,10 +1033,7 @@ success:
 	 */
 	if (dvp == *vpp) {   /* lookup on "." */
 		VREF(*vpp);
-		if (wlocked)
-			CACHE_WUNLOCK();
-		else
-			CACHE_RUNLOCK();
+		cache_lookup_unlock(blp, dvlp);
 		/*
 		 * When we lookup "." we still can be asked to lock it
 		 * differently...
@@ -652,16 +1053,17 @@ success:
 		}
 		return (-1);
 	}
+	/*
+	 * The hold keeps *vpp from being freed once the entry which points
+	 * to it is no longer protected by our lock.
+	 */
+	vhold(*vpp);
+	cache_lookup_unlock(blp, dvlp);
 	ltype = 0;	/* silence gcc warning */
 	if (cnp->cn_flags & ISDOTDOT) {
 		ltype = VOP_ISLOCKED(dvp);
 		VOP_UNLOCK(dvp, 0);
 	}
-	vhold(*vpp);
-	if (wlocked)
-		CACHE_WUNLOCK();
-	else
-		CACHE_RUNLOCK();
 	error = vget(*vpp, cnp->cn_lkflags | LK_VNHELD, cnp->cn_thread);
 	if (cnp->cn_flags & ISDOTDOT) {
 		vn_lock(dvp, ltype | LK_RETRY);
@@ -683,27 +1085,28 @@ success:
 	return (-1);
 
 unlock:
-	if (wlocked)
-		CACHE_WUNLOCK();
-	else
-		CACHE_RUNLOCK();
+	cache_lookup_unlock(blp, dvlp);
 	return (0);
 }
 
 /*
  * Add an entry to the cache.
+ *
+ * The vnodelocks of dvp and vp are taken first, then the bucketlock of
+ * the new entry.  Entering a directory vp replaces its ".." entry, which
+ * also needs the vnodelock of that entry's target and its bucketlock.
  */
 void
 cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
     struct timespec *tsp, struct timespec *dtsp)
 {
-	struct namecache *ncp, *n2;
+	struct namecache *ncp, *n2, *ndd;
 	struct namecache_ts *n3;
 	struct nchashhead *ncpp;
+	struct mtx *vlp1, *vlp2, *vlp3;
+	struct rwlock *blp, *blp2;
 	uint32_t hash;
 	int flag;
-	int hold;
-	int zap;
 	int len;
 
 	CTR3(KTR_VFS, "cache_enter(%p, %p, %s)", dvp, vp, cnp->cn_nameptr);
@@ -726,44 +1129,18 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 		if (cnp->cn_namelen == 1)
 			return;
 		if (cnp->cn_namelen == 2 && cnp->cn_nameptr[1] == '.') {
-			CACHE_WLOCK();
 			/*
-			 * If dotdot entry already exists, just retarget it
-			 * to new parent vnode, otherwise continue with new
-			 * namecache entry allocation.
+			 * Drop an existing dotdot entry rather than retarget
+			 * it in place, which would need the vnodelocks of the
+			 * old and the new parent on top of ours.  Then continue
+			 * with new namecache entry allocation.
 			 */
-			if ((ncp = dvp->v_cache_dd) != NULL &&
-			    ncp->nc_flag & NCF_ISDOTDOT) {
-				KASSERT(ncp->nc_dvp == dvp,
-				    ("wrong isdotdot parent"));
-				if (ncp->nc_vp != NULL) {
-					TAILQ_REMOVE(&ncp->nc_vp->v_cache_dst,
-					    ncp, nc_dst);
-				} else {
-					TAILQ_REMOVE(&ncneg, ncp, nc_dst);
-					numneg--;
-				}
-				if (vp != NULL) {
-					TAILQ_INSERT_HEAD(&vp->v_cache_dst,
-					    ncp, nc_dst);
-				} else {
-					TAILQ_INSERT_TAIL(&ncneg, ncp, nc_dst);
-					numneg++;
-				}
-				ncp->nc_vp = vp;
-				CACHE_WUNLOCK();
-				return;
-			}
-			dvp->v_cache_dd = NULL;
+			cache_zap_dd(dvp);
 			SDT_PROBE3(vfs, namecache, enter, done, dvp, "..", vp);
-			CACHE_WUNLOCK();
 			flag = NCF_ISDOTDOT;
 		}
 	}
 
-	hold = 0;
-	zap = 0;
-
 	/*
 	 * Calculate the hash key and setup as much of the new
 	 * namecache entry as possible before acquiring the lock.
@@ -783,10 +1160,44 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 		}
 	}
 	len = ncp->nc_nlen = cnp->cn_namelen;
-	hash = fnv_32_buf(cnp->cn_nameptr, len, FNV1_32_INIT);
 	strlcpy(nc_get_name(ncp), cnp->cn_nameptr, len + 1);
-	hash = fnv_32_buf(&dvp, sizeof(dvp), hash);
-	CACHE_WLOCK();
+	hash = cache_get_hash(nc_get_name(ncp), len, dvp);
+	vlp1 = VP2VNODELOCK(dvp);
+	vlp2 = VP2VNODELOCK(vp);
+	cache_sort(&vlp1, &vlp2);
+retry:
+	cache_lock_vnodes(vlp1, vlp2);
+	ndd = NULL;
+	vlp3 = NULL;
+	if (flag != NCF_ISDOTDOT && vp != NULL && vp->v_type == VDIR &&
+	    (ndd = vp->v_cache_dd) != NULL) {
+		if ((ndd->nc_flag & NCF_ISDOTDOT) == 0)
+			ndd = NULL;
+		else {
+			vlp3 = VP2VNODELOCK(ndd->nc_vp);
+			if (vlp3 == vlp1 || vlp3 == vlp2)
+				vlp3 = NULL;
+			else if (vlp3 > vlp2)
+				mtx_lock(vlp3);
+			else if (vlp3 != NULL && !mtx_trylock(vlp3)) {
+				cache_unlock_vnodes(vlp1, vlp2);
+				/* Wait for the owner before retrying. */
+				mtx_lock(vlp3);
+				mtx_unlock(vlp3);
+				counter_u64_add(numrelocks, 1);
+				goto retry;
+			}
+		}
+	}
+	blp = HASH2BUCKETLOCK(hash);
+	blp2 = NULL;
+	if (ndd != NULL && NCP2BUCKETLOCK(ndd) != blp)
+		blp2 = NCP2BUCKETLOCK(ndd);
+	if (blp2 != NULL && blp2 < blp)
+		rw_wlock(blp2);
+	rw_wlock(blp);
+	if (blp2 != NULL && blp2 > blp)
+		rw_wlock(blp2);
 
 	/*
 	 * See if this vnode or negative entry is already in the cache
@@ -813,9 +1224,7 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 					n3->nc_flag |= NCF_DTS;
 				}
 			}
-			CACHE_WUNLOCK();
-			cache_free(ncp);
-			return;
+			goto out_free;
 		}
 	}
 
@@ -824,19 +1233,15 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 		 * See if we are trying to add .. entry, but some other lookup
 		 * has populated v_cache_dd pointer already.
 		 */
-		if (dvp->v_cache_dd != NULL) {
-			CACHE_WUNLOCK();
-			cache_free(ncp);
-			return;
-		}
+		if (dvp->v_cache_dd != NULL)
+			goto out_free;
 		KASSERT(vp == NULL || vp->v_type == VDIR,
 		    ("wrong vnode type %p", vp));
 		dvp->v_cache_dd = ncp;
 	}
 
-	numcache++;
+	atomic_add_long(&numcache, 1);
 	if (vp == NULL) {
-		numneg++;
 		if (cnp->cn_flags & ISWHITEOUT)
 			ncp->nc_flag |= NCF_WHITE;
 	} else if (vp->v_type == VDIR) {
@@ -846,9 +1251,8 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 			 * directory name in it and the name ".." for the
 			 * directory's parent.
 			 */
-			if ((n2 = vp->v_cache_dd) != NULL &&
-			    (n2->nc_flag & NCF_ISDOTDOT) != 0)
-				cache_zap(n2);
+			if (ndd != NULL)
+				cache_zap_locked(ndd);
 			vp->v_cache_dd = ncp;
 		}
 	} else {
@@ -862,8 +1266,8 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 	LIST_INSERT_HEAD(ncpp, ncp, nc_hash);
 	if (flag != NCF_ISDOTDOT) {
 		if (LIST_EMPTY(&dvp->v_cache_src)) {
-			hold = 1;
-			numcachehv++;
+			vhold(dvp);
+			atomic_add_long(&numcachehv, 1);
 		}
 		LIST_INSERT_HEAD(&dvp->v_cache_src, ncp, nc_src);
 	}
@@ -878,21 +1282,40 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 		SDT_PROBE3(vfs, namecache, enter, done, dvp, nc_get_name(ncp),
 		    vp);
 	} else {
-		TAILQ_INSERT_TAIL(&ncneg, ncp, nc_dst);
+		cache_negative_insert(ncp);
 		SDT_PROBE2(vfs, namecache, enter_negative, done, dvp,
 		    nc_get_name(ncp));
 	}
-	if (numneg * ncnegfactor > numcache) {
-		ncp = TAILQ_FIRST(&ncneg);
-		KASSERT(ncp->nc_vp == NULL, ("ncp %p vp %p on ncneg",
-		    ncp, ncp->nc_vp));
-		zap = 1;
-	}
-	if (hold)
-		vhold(dvp);
-	if (zap)
-		cache_zap(ncp);
-	CACHE_WUNLOCK();
+	rw_wunlock(blp);
+	if (blp2 != NULL)
+		rw_wunlock(blp2);
+	if (vlp3 != NULL)
+		mtx_unlock(vlp3);
+	cache_unlock_vnodes(vlp1, vlp2);
+	cache_free(ndd);
+	if (numneg * ncnegfactor > numcache)
+		cache_negative_zap_one();
+	return;
+
+out_free:
+	rw_wunlock(blp);
+	if (blp2 != NULL)
+		rw_wunlock(blp2);
+	if (vlp3 != NULL)
+		mtx_unlock(vlp3);
+	cache_unlock_vnodes(vlp1, vlp2);
+	cache_free(ncp);
+}
+
+static u_int
+cache_roundup_2(u_int val)
+{
+	u_int res;
+
+	for (res = 1; res <= val; res <<= 1)
+		continue;
+
+	return (res);
 }
 
 /*
@@ -901,23 +1324,66 @@ cache_enter_time(struct vnode *dvp, struct vnode *vp, struct componentname *cnp,
 static void
 nchinit(void *dummy __unused)
 {
-
-	TAILQ_INIT(&ncneg);
+	u_int i;
 
 	cache_zone_small = uma_zcreate("S VFS Cache",
 	    sizeof(struct namecache) + CACHE_PATH_CUTOFF + 1,
-	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT);
+	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT |
+	    UMA_ZONE_NUMA);
 	cache_zone_small_ts = uma_zcreate("STS VFS Cache",
 	    sizeof(struct namecache_ts) + CACHE_PATH_CUTOFF + 1,
-	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT);
+	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT |
+	    UMA_ZONE_NUMA);
 	cache_zone_large = uma_zcreate("L VFS Cache",
 	    sizeof(struct namecache) + NAME_MAX + 1,
-	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT);
+	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT |
+	    UMA_ZONE_NUMA);
 	cache_zone_large_ts = uma_zcreate("LTS VFS Cache",
 	    sizeof(struct namecache_ts) + NAME_MAX + 1,
-	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT);
+	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_ZINIT |
+	    UMA_ZONE_NUMA);
 
 	nchashtbl = hashinit(desiredvnodes * 2, M_VFSCACHE, &nchash);
+
+	/*
+	 * Every hash chain must map onto exactly one bucketlock, so there
+	 * can not be more bucketlocks than chains.
+	 */
+	numbucketlocks = cache_roundup_2(mp_ncpus * 64);
+	if (numbucketlocks > nchash + 1)
+		numbucketlocks = nchash + 1;
+	bucketlocks = malloc(sizeof(*bucketlocks) * numbucketlocks, M_VFSCACHE,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < numbucketlocks; i++)
+		rw_init_flags(&bucketlocks[i], "ncbuc", RW_DUPOK);
+	numvnodelocks = cache_roundup_2(mp_ncpus * 64);
+	vnodelocks = malloc(sizeof(*vnodelocks) * numvnodelocks, M_VFSCACHE,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < numvnodelocks; i++)
+		mtx_init(&vnodelocks[i], "ncvn", NULL, MTX_DUPOK);
+	numneglists = cache_roundup_2(mp_ncpus * 4);
+	neglists = malloc(sizeof(*neglists) * numneglists, M_VFSCACHE,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < numneglists; i++) {
+		mtx_init(&neglists[i].nl_lock, "ncnegl", NULL, MTX_DEF);
+		TAILQ_INIT(&neglists[i].nl_list);
+	}
+	mtx_init(&ncneg_shrink_lock, "ncnegs", NULL, MTX_DEF);
+
+	numcalls = counter_u64_alloc(M_WAITOK);
+	dothits = counter_u64_alloc(M_WAITOK);
+	dotdothits = counter_u64_alloc(M_WAITOK);
+	numchecks = counter_u64_alloc(M_WAITOK);
+	nummiss = counter_u64_alloc(M_WAITOK);
+	nummisszap = counter_u64_alloc(M_WAITOK);
+	numposzaps = counter_u64_alloc(M_WAITOK);
+	numposhits = counter_u64_alloc(M_WAITOK);
+	numnegzaps = counter_u64_alloc(M_WAITOK);
+	numneghits = counter_u64_alloc(M_WAITOK);
+	numrelocks = counter_u64_alloc(M_WAITOK);
+	numnegevicts = counter_u64_alloc(M_WAITOK);
+	numfplookups = counter_u64_alloc(M_WAITOK);
+	numfpfallbacks = counter_u64_alloc(M_WAITOK);
 }
 SYSINIT(vfs, SI_SUB_VFS, SI_ORDER_SECOND, nchinit, NULL);
 
@@ -931,8 +1397,11 @@ cache_changesize(int newmaxvnodes)
 	int i;
 
 	new_nchashtbl = hashinit(newmaxvnodes * 2, M_VFSCACHE, &new_nchash);
-	/* If same hash table size, nothing to do */
-	if (nchash == new_nchash) {
+	/*
+	 * If same hash table size, or too small to keep one bucketlock per
+	 * chain, nothing to do.
+	 */
+	if (nchash == new_nchash || new_nchash + 1 < numbucketlocks) {
 		free(new_nchashtbl, M_VFSCACHE);
 		return;
 	}
@@ -940,23 +1409,23 @@ cache_changesize(int newmaxvnodes)
 	 * Move everything from the old hash table to the new table.
 	 * None of the namecache entries in the table can be removed
 	 * because to do so, they have to be removed from the hash table.
+	 * The bucketlock of an entry depends on its hash only, so it does
+	 * not change.
 	 */
-	CACHE_WLOCK();
+	cache_lock_all_buckets();
 	old_nchashtbl = nchashtbl;
 	old_nchash = nchash;
 	nchashtbl = new_nchashtbl;
 	nchash = new_nchash;
 	for (i = 0; i <= old_nchash; i++) {
 		while ((ncp = LIST_FIRST(&old_nchashtbl[i])) != NULL) {
-			hash = fnv_32_buf(nc_get_name(ncp), ncp->nc_nlen,
-			    FNV1_32_INIT);
-			hash = fnv_32_buf(&ncp->nc_dvp, sizeof(ncp->nc_dvp),
-			    hash);
+			hash = cache_get_hash(nc_get_name(ncp), ncp->nc_nlen,
+			    ncp->nc_dvp);
 			LIST_REMOVE(ncp, nc_hash);
 			LIST_INSERT_HEAD(NCHHASH(hash), ncp, nc_hash);
 		}
 	}
-	CACHE_WUNLOCK();
+	cache_unlock_all_buckets();
 	free(old_nchashtbl, M_VFSCACHE);
 }
 
@@ -966,21 +1435,36 @@ cache_changesize(int newmaxvnodes)
 void
 cache_purge(struct vnode *vp)
 {
+	TAILQ_HEAD(, namecache) ncps;
+	struct namecache *ncp, *nnp;
+	struct mtx *vlp;
 
 	CTR1(KTR_VFS, "cache_purge(%p)", vp);
 	SDT_PROBE1(vfs, namecache, purge, done, vp);
-	CACHE_WLOCK();
-	while (!LIST_EMPTY(&vp->v_cache_src))
-		cache_zap(LIST_FIRST(&vp->v_cache_src));
-	while (!TAILQ_EMPTY(&vp->v_cache_dst))
-		cache_zap(TAILQ_FIRST(&vp->v_cache_dst));
-	if (vp->v_cache_dd != NULL) {
-		KASSERT(vp->v_cache_dd->nc_flag & NCF_ISDOTDOT,
-		   ("lost dotdot link"));
-		cache_zap(vp->v_cache_dd);
+	TAILQ_INIT(&ncps);
+	vlp = VP2VNODELOCK(vp);
+retry:
+	mtx_lock(vlp);
+	for (;;) {
+		ncp = LIST_FIRST(&vp->v_cache_src);
+		if (ncp == NULL)
+			ncp = TAILQ_FIRST(&vp->v_cache_dst);
+		if (ncp == NULL && vp->v_cache_dd != NULL) {
+			ncp = vp->v_cache_dd;
+			KASSERT(ncp->nc_flag & NCF_ISDOTDOT,
+			   ("lost dotdot link"));
+		}
+		if (ncp == NULL)
+			break;
+		if (cache_zap_locked_vnode(ncp, vp) != 0)
+			goto retry;
+		/* Unlinked entries reuse nc_dst until they are freed. */
+		TAILQ_INSERT_TAIL(&ncps, ncp, nc_dst);
 	}
 	KASSERT(vp->v_cache_dd == NULL, ("incomplete purge"));
-	CACHE_WUNLOCK();
+	mtx_unlock(vlp);
+	TAILQ_FOREACH_SAFE(ncp, &ncps, nc_dst, nnp)
+		cache_free(ncp);
 }
 
 /*
@@ -989,37 +1473,64 @@ cache_purge(struct vnode *vp)
 void
 cache_purge_negative(struct vnode *vp)
 {
+	TAILQ_HEAD(, namecache) ncps;
 	struct namecache *cp, *ncp;
+	struct mtx *vlp;
+	int error;
 
 	CTR1(KTR_VFS, "cache_purge_negative(%p)", vp);
 	SDT_PROBE1(vfs, namecache, purge_negative, done, vp);
-	CACHE_WLOCK();
+	TAILQ_INIT(&ncps);
+	vlp = VP2VNODELOCK(vp);
+	mtx_lock(vlp);
 	LIST_FOREACH_SAFE(cp, &vp->v_cache_src, nc_src, ncp) {
-		if (cp->nc_vp == NULL)
-			cache_zap(cp);
+		if (cp->nc_vp != NULL)
+			continue;
+		/* Negative entries need no second vnodelock, so no retry. */
+		error = cache_zap_locked_vnode(cp, vp);
+		MPASS(error == 0);
+		TAILQ_INSERT_TAIL(&ncps, cp, nc_dst);
 	}
-	CACHE_WUNLOCK();
+	mtx_unlock(vlp);
+	TAILQ_FOREACH_SAFE(cp, &ncps, nc_dst, ncp)
+		cache_free(cp);
 }
 
 /*
  * Flush all entries referencing a particular filesystem.
+ *
+ * The chains are scanned one bucketlock at a time; the chains covered by
+ * bucketlock j are j, j + numbucketlocks, j + 2 * numbucketlocks, ...
  */
 void
 cache_purgevfs(struct mount *mp)
 {
-	struct nchashhead *ncpp;
+	TAILQ_HEAD(, namecache) ncps;
 	struct namecache *ncp, *nnp;
+	struct rwlock *blp;
+	u_long i;
+	u_int j;
 
 	/* Scan hash tables for applicable entries */
 	SDT_PROBE1(vfs, namecache, purgevfs, done, mp);
-	CACHE_WLOCK();
-	for (ncpp = &nchashtbl[nchash]; ncpp >= nchashtbl; ncpp--) {
-		LIST_FOREACH_SAFE(ncp, ncpp, nc_hash, nnp) {
-			if (ncp->nc_dvp->v_mount == mp)
-				cache_zap(ncp);
+	TAILQ_INIT(&ncps);
+	for (j = 0; j < numbucketlocks; j++) {
+		blp = (struct rwlock *)&bucketlocks[j];
+retry:
+		rw_wlock(blp);
+		for (i = j; i <= nchash; i += numbucketlocks) {
+			LIST_FOREACH_SAFE(ncp, &nchashtbl[i], nc_hash, nnp) {
+				if (ncp->nc_dvp->v_mount != mp)
+					continue;
+				if (cache_zap_wlocked_bucket(ncp, blp) != 0)
+					goto retry;
+				TAILQ_INSERT_TAIL(&ncps, ncp, nc_dst);
+			}
 		}
+		rw_wunlock(blp);
 	}
-	CACHE_WUNLOCK();
+	TAILQ_FOREACH_SAFE(ncp, &ncps, nc_dst, nnp)
+		cache_free(ncp);
 }
 
 /*
@@ -1070,6 +1581,203 @@ vfs_cache_lookup(struct vop_lookup_args *ap)
 	return (error);
 }
 
+/*
+ * Lockless path walk.
+ *
+ * cache_fplookup() resolves as much of a pathname as possible from the name
+ * cache without touching the vnode lock or the reference counts of the
+ * directories along the way.  The walk is done hand-over-hand on the
+ * namecache vnodelocks: holding the vnodelock of a directory keeps every
+ * entry hanging off it, and therefore the vnode it points to, from going
+ * away.  Since vgonel() purges a vnode from the cache before reclaiming it,
+ * a vnode reached through an entry still has its filesystem private data.
+ *
+ * Anything the walk is not prepared to handle makes it bail out with
+ * EAGAIN, in which case the caller restarts the lookup from scratch with
+ * the regular locked walk.
+ */
+
+/*
+ * Check whether vp is still referenced by any entry.  Called with the
+ * vnodelock of vp held.
+ */
+static __inline int
+cache_fplookup_cached(struct vnode *vp)
+{
+
+	cache_assert_vnode_locked(vp);
+	return (!LIST_EMPTY(&vp->v_cache_src) ||
+	    !TAILQ_EMPTY(&vp->v_cache_dst) || vp->v_cache_dd != NULL);
+}
+
+/*
+ * Check search permission on dvp.  Called with the vnodelock of dvp held
+ * and only once dvp is known to be in the cache.
+ */
+static int
+cache_fplookup_vexec(struct vnode *dvp, struct componentname *cnp)
+{
+	struct mount *mp;
+
+	mp = dvp->v_mount;
+	if ((dvp->v_iflag & VI_DOOMED) != 0 || mp == NULL ||
+	    (mp->mnt_kern_flag & MNTK_FPLOOKUP) == 0)
+		return (EAGAIN);
+	return (VOP_FPLOOKUP_VEXEC(dvp, cnp->cn_cred, cnp->cn_thread));
+}
+
+/*
+ * Walk the path starting at cnp->cn_nameptr from dvp, which the caller
+ * keeps referenced.
+ *
+ * On success the final vnode is returned held in *vpp and the nameidata
+ * is left describing the last component, as lookup() would.  ENOENT is
+ * returned when the last component is covered by a negative entry.  Any
+ * other outcome is reported as EAGAIN with the nameidata untouched.
+ */
+int
+cache_fplookup(struct nameidata *ndp, struct vnode *dvp, struct vnode **vpp)
+{
+	struct componentname *cnp;
+	struct namecache *ncp;
+	struct vnode *vp;
+	struct rwlock *blp;
+	struct mtx *dvlp, *vlp;
+	char *cp, *name;
+	uint32_t hash;
+	size_t pathlen;
+	int error, isdotdot, last, namelen;
+
+	if (!doingcache || !cache_fast_lookup)
+		return (EAGAIN);
+	counter_u64_add(numfplookups, 1);
+	cnp = &ndp->ni_cnd;
+	name = cnp->cn_nameptr;
+	pathlen = ndp->ni_pathlen;
+	error = 0;
+	dvlp = VP2VNODELOCK(dvp);
+	mtx_lock(dvlp);
+	for (;;) {
+		for (cp = name; *cp != '\0' && *cp != '/'; cp++)
+			continue;
+		namelen = cp - name;
+		if (namelen == 0 || namelen > NAME_MAX)
+			goto fallback;
+		pathlen -= namelen;
+		/* Trailing slashes need the checks done by lookup(). */
+		while (*cp == '/') {
+			if (cp[1] == '\0')
+				goto fallback;
+			cp++;
+			pathlen--;
+		}
+		last = (*cp == '\0');
+		isdotdot = (namelen == 2 && name[0] == '.' && name[1] == '.');
+
+		if (namelen == 1 && name[0] == '.') {
+			if (!cache_fplookup_cached(dvp))
+				goto fallback;
+			vp = dvp;
+		} else if (isdotdot) {
+			if (dvp == ndp->ni_rootdir || dvp == ndp->ni_topdir ||
+			    dvp == rootvnode || (dvp->v_vflag & VV_ROOT) != 0)
+				goto fallback;
+			ncp = dvp->v_cache_dd;
+			if (ncp == NULL)
+				goto fallback;
+			if (ncp->nc_flag & NCF_ISDOTDOT)
+				vp = ncp->nc_vp;
+			else
+				vp = ncp->nc_dvp;
+			if (vp == NULL)
+				goto fallback;
+		} else {
+			hash = cache_get_hash(name, namelen, dvp);
+			blp = HASH2BUCKETLOCK(hash);
+			rw_rlock(blp);
+			LIST_FOREACH(ncp, (NCHHASH(hash)), nc_hash) {
+				if (ncp->nc_dvp == dvp &&
+				    ncp->nc_nlen == namelen &&
+				    !bcmp(nc_get_name(ncp), name, namelen))
+					break;
+			}
+			if (ncp == NULL) {
+				rw_runlock(blp);
+				goto fallback;
+			}
+			vp = ncp->nc_vp;
+			if (vp == NULL) {
+				if (!last || (ncp->nc_flag & NCF_WHITE) != 0 ||
+				    ((dvp->v_vflag & VV_ROOT) != 0 &&
+				    (dvp->v_mount->mnt_flag & MNT_UNION) != 0)) {
+					rw_runlock(blp);
+					goto fallback;
+				}
+				cache_negative_hit(ncp);
+			}
+			/*
+			 * The entry can not be removed without the vnodelock
+			 * of dvp, so the bucket is not needed any further.
+			 */
+			rw_runlock(blp);
+		}
+
+		error = cache_fplookup_vexec(dvp, cnp);
+		if (error != 0)
+			goto fallback;
+		if (vp == NULL) {
+			counter_u64_add(numneghits, 1);
+			error = ENOENT;
+			break;
+		}
+		if (vp->v_mountedhere != NULL)
+			goto fallback;
+		if (last) {
+			if (vp->v_type == VLNK && (cnp->cn_flags & FOLLOW) != 0)
+				goto fallback;
+			vhold(vp);
+			break;
+		}
+		if (vp->v_type != VDIR)
+			goto fallback;
+
+		/*
+		 * Move over to vp.  Its vnodelock is taken while the entry
+		 * pointing to it is still pinned by the vnodelock of dvp,
+		 * honouring the address order or only trying the lock.
+		 */
+		vlp = VP2VNODELOCK(vp);
+		if (vlp != dvlp) {
+			if (vlp > dvlp)
+				mtx_lock(vlp);
+			else if (!mtx_trylock(vlp))
+				goto fallback;
+			mtx_unlock(dvlp);
+			dvlp = vlp;
+		}
+		dvp = vp;
+		name = cp;
+	}
+	mtx_unlock(dvlp);
+
+	cnp->cn_nameptr = name;
+	cnp->cn_namelen = namelen;
+	cnp->cn_consume = 0;
+	cnp->cn_flags |= ISLASTCN | MAKEENTRY;
+	cnp->cn_flags &= ~(ISSYMLINK | ISDOTDOT);
+	if (isdotdot)
+		cnp->cn_flags |= ISDOTDOT;
+	ndp->ni_next = cp;
+	ndp->ni_pathlen = pathlen;
+	*vpp = vp;
+	return (error);
+
+fallback:
+	mtx_unlock(dvlp);
+	counter_u64_add(numfpfallbacks, 1);
+	return (EAGAIN);
+}
+
 /*
  * XXX All of these sysctls would probably be more productive dead.
  */
@@ -1211,30 +1919,32 @@ vn_fullpath_global(struct thread *td, struct vnode *vn,
 int
 vn_vptocnp(struct vnode **vp, struct ucred *cred, char *buf, u_int *buflen)
 {
-	int error;
 
-	CACHE_RLOCK();
-	error = vn_vptocnp_locked(vp, cred, buf, buflen);
-	if (error == 0)
-		CACHE_RUNLOCK();
-	return (error);
+	mtx_lock(VP2VNODELOCK(*vp));
+	return (vn_vptocnp_locked(vp, cred, buf, buflen));
 }
 
+/*
+ * Called with the vnodelock of *vp held, which is always dropped on return.
+ */
 static int
 vn_vptocnp_locked(struct vnode **vp, struct ucred *cred, char *buf,
     u_int *buflen)
 {
 	struct vnode *dvp;
 	struct namecache *ncp;
+	struct mtx *vlp;
 	int error;
 
+	vlp = VP2VNODELOCK(*vp);
+	mtx_assert(vlp, MA_OWNED);
 	TAILQ_FOREACH(ncp, &((*vp)->v_cache_dst), nc_dst) {
 		if ((ncp->nc_flag & NCF_ISDOTDOT) == 0)
 			break;
 	}
 	if (ncp != NULL) {
 		if (*buflen < ncp->nc_nlen) {
-			CACHE_RUNLOCK();
+			mtx_unlock(vlp);
 			vrele(*vp);
 			numfullpathfail4++;
 			error = ENOMEM;
@@ -1249,14 +1959,13 @@ vn_vptocnp_locked(struct vnode **vp, struct ucred *cred, char *buf,
 		dvp = *vp;
 		*vp = ncp->nc_dvp;
 		vref(*vp);
-		CACHE_RUNLOCK();
+		mtx_unlock(vlp);
 		vrele(dvp);
-		CACHE_RLOCK();
 		return (0);
 	}
 	SDT_PROBE1(vfs, namecache, fullpath, miss, vp);
 
-	CACHE_RUNLOCK();
+	mtx_unlock(vlp);
 	vn_lock(*vp, LK_SHARED | LK_RETRY);
 	error = VOP_VPTOCNP(*vp, &dvp, cred, buf, buflen);
 	vput(*vp);
@@ -1267,10 +1976,8 @@ vn_vptocnp_locked(struct vnode **vp, struct ucred *cred, char *buf,
 	}
 
 	*vp = dvp;
-	CACHE_RLOCK();
 	if (dvp->v_iflag & VI_DOOMED) {
 		/* forced unmount */
-		CACHE_RUNLOCK();
 		vrele(dvp);
 		error = ENOENT;
 		SDT_PROBE3(vfs, namecache, fullpath, return, error, vp, NULL);
@@ -1285,6 +1992,9 @@ vn_vptocnp_locked(struct vnode **vp, struct ucred *cred, char *buf,
 
 /*
  * The magic behind kern___getcwd() and vn_fullpath().
+ *
+ * Only the reference on vp is carried from one component to the next;
+ * the vnodelock of each vnode is held just while its entry is read.
  */
 static int
 vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
@@ -1304,13 +2014,11 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 	SDT_PROBE1(vfs, namecache, fullpath, entry, vp);
 	numfullpathcalls++;
 	vref(vp);
-	CACHE_RLOCK();
 	if (vp->v_type != VDIR) {
-		error = vn_vptocnp_locked(&vp, td->td_ucred, buf, &buflen);
+		error = vn_vptocnp(&vp, td->td_ucred, buf, &buflen);
 		if (error)
 			return (error);
 		if (buflen == 0) {
-			CACHE_RUNLOCK();
 			vrele(vp);
 			return (ENOMEM);
 		}
@@ -1320,7 +2028,6 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 	while (vp != rdir && vp != rootvnode) {
 		if (vp->v_vflag & VV_ROOT) {
 			if (vp->v_iflag & VI_DOOMED) {	/* forced unmount */
-				CACHE_RUNLOCK();
 				vrele(vp);
 				error = ENOENT;
 				SDT_PROBE3(vfs, namecache, fullpath, return,
@@ -1329,14 +2036,11 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 			}
 			vp1 = vp->v_mount->mnt_vnodecovered;
 			vref(vp1);
-			CACHE_RUNLOCK();
 			vrele(vp);
 			vp = vp1;
-			CACHE_RLOCK();
 			continue;
 		}
 		if (vp->v_type != VDIR) {
-			CACHE_RUNLOCK();
 			vrele(vp);
 			numfullpathfail1++;
 			error = ENOTDIR;
@@ -1344,11 +2048,10 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 			    error, vp, NULL);
 			break;
 		}
-		error = vn_vptocnp_locked(&vp, td->td_ucred, buf, &buflen);
+		error = vn_vptocnp(&vp, td->td_ucred, buf, &buflen);
 		if (error)
 			break;
 		if (buflen == 0) {
-			CACHE_RUNLOCK();
 			vrele(vp);
 			error = ENOMEM;
 			SDT_PROBE3(vfs, namecache, fullpath, return, error,
@@ -1362,7 +2065,6 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 		return (error);
 	if (!slash_prefixed) {
 		if (buflen == 0) {
-			CACHE_RUNLOCK();
 			vrele(vp);
 			numfullpathfail4++;
 			SDT_PROBE3(vfs, namecache, fullpath, return, ENOMEM,
@@ -1372,7 +2074,6 @@ vn_fullpath1(struct thread *td, struct vnode *vp, struct vnode *rdir,
 		buf[--buflen] = '/';
 	}
 	numfullpathfound++;
-	CACHE_RUNLOCK();
 	vrele(vp);
 
 	SDT_PROBE3(vfs, namecache, fullpath, return, 0, startvp, buf + buflen);
@@ -1385,20 +2086,22 @@ vn_dir_dd_ino(struct vnode *vp)
 {
 	struct namecache *ncp;
 	struct vnode *ddvp;
+	struct mtx *vlp;
 
 	ASSERT_VOP_LOCKED(vp, "vn_dir_dd_ino");
-	CACHE_RLOCK();
+	vlp = VP2VNODELOCK(vp);
+	mtx_lock(vlp);
 	TAILQ_FOREACH(ncp, &(vp->v_cache_dst), nc_dst) {
 		if ((ncp->nc_flag & NCF_ISDOTDOT) != 0)
 			continue;
 		ddvp = ncp->nc_dvp;
 		vhold(ddvp);
-		CACHE_RUNLOCK();
+		mtx_unlock(vlp);
 		if (vget(ddvp, LK_SHARED | LK_NOWAIT | LK_VNHELD, curthread))
 			return (NULL);
 		return (ddvp);
 	}
-	CACHE_RUNLOCK();
+	mtx_unlock(vlp);
 	return (NULL);
 }
 
@@ -1406,19 +2109,21 @@ int
 vn_commname(struct vnode *vp, char *buf, u_int buflen)
 {
 	struct namecache *ncp;
+	struct mtx *vlp;
 	int l;
 
-	CACHE_RLOCK();
+	vlp = VP2VNODELOCK(vp);
+	mtx_lock(vlp);
 	TAILQ_FOREACH(ncp, &vp->v_cache_dst, nc_dst)
 		if ((ncp->nc_flag & NCF_ISDOTDOT) == 0)
 			break;
 	if (ncp == NULL) {
-		CACHE_RUNLOCK();
+		mtx_unlock(vlp);
 		return (ENOENT);
 	}
 	l = min(ncp->nc_nlen, buflen - 1);
 	memcpy(buf, nc_get_name(ncp), l);
-	CACHE_RUNLOCK();
+	mtx_unlock(vlp);
 	buf[l] = '\0';
 	return (0);
 }
@@ -133,6 +133,72 @@ namei_handle_root(struct nameidata *ndp, struct vnode **dpp)
 	return (0);
 }
 
+static int compute_cn_lkflags(struct mount *mp, int lkflags, int cnflags);
+static __inline int needs_exclusive_leaf(struct mount *mp, int flags);
+
+/*
+ * Try to translate the whole path from the name cache without locking or
+ * referencing the directories in between, see cache_fplookup().  Only
+ * plain LOOKUP requests are eligible.  EAGAIN means the caller has to do
+ * the regular walk; the nameidata and the reference on dp are then left
+ * as they were.  Otherwise the reference on dp is consumed and the result
+ * is what lookup() would have returned.
+ */
+static int
+namei_fplookup(struct nameidata *ndp, struct vnode *dp)
+{
+	struct componentname *cnp;
+	struct vnode *vp;
+	char *nameptr;
+	size_t pathlen;
+	int error, flags, lkflags;
+
+	cnp = &ndp->ni_cnd;
+	if (cnp->cn_nameiop != LOOKUP || ndp->ni_strictrelative != 0 ||
+	    (cnp->cn_flags & (LOCKPARENT | WANTPARENT | SAVESTART |
+	    NOCACHE)) != 0)
+		return (EAGAIN);
+#ifdef MAC
+	if ((cnp->cn_flags & NOMACCHECK) == 0)
+		return (EAGAIN);
+#endif
+	nameptr = cnp->cn_nameptr;
+	pathlen = ndp->ni_pathlen;
+	flags = cnp->cn_flags;
+	error = cache_fplookup(ndp, dp, &vp);
+	if (error == EAGAIN)
+		return (error);
+	ndp->ni_dvp = NULL;
+	ndp->ni_vp = NULL;
+	if (error != 0) {
+		vrele(dp);
+		return (error);
+	}
+	lkflags = lookup_shared ? LK_SHARED : LK_EXCLUSIVE;
+	if (needs_exclusive_leaf(vp->v_mount, cnp->cn_flags))
+		lkflags = LK_EXCLUSIVE;
+	lkflags = compute_cn_lkflags(vp->v_mount, lkflags, cnp->cn_flags);
+	if (vget(vp, lkflags | LK_VNHELD, cnp->cn_thread) != 0) {
+		/*
+		 * The vnode was doomed after the walk found it, let the
+		 * regular walk sort it out from the start.
+		 */
+		cnp->cn_nameptr = nameptr;
+		ndp->ni_pathlen = pathlen;
+		cnp->cn_flags = flags;
+		return (EAGAIN);
+	}
+	vrele(dp);
+	ndp->ni_vp = vp;
+	if (cnp->cn_flags & AUDITVNODE1)
+		AUDIT_ARG_VNODE1(vp);
+	else if (cnp->cn_flags & AUDITVNODE2)
+		AUDIT_ARG_VNODE2(vp);
+	if ((cnp->cn_flags & LOCKLEAF) == 0)
+		VOP_UNLOCK(vp, 0);
+	return (0);
+}
+
 /*
  * Convert a pathname into a pointer to a locked vnode.
  *
@@ -313,6 +379,21 @@ namei(struct nameidata *ndp)
 	SDT_PROBE3(vfs, namei, lookup, entry, dp, cnp->cn_pnbuf,
 	    cnp->cn_flags);
 
+	/*
+	 * Fully cached paths are resolved without locking the directories
+	 * in between.  No symbolic link is followed on this path.
+	 */
+	error = namei_fplookup(ndp, dp);
+	if (error != EAGAIN) {
+		vrele(ndp->ni_rootdir);
+		if (error != 0 || (cnp->cn_flags & (SAVENAME | SAVESTART)) == 0)
+			namei_cleanup_cnp(cnp);
+		else
+			cnp->cn_flags |= HASBUF;
+		SDT_PROBE2(vfs, namei, lookup, return, error, ndp->ni_vp);
+		return (error);
+	}
+
 	for (;;) {
 		ndp->ni_startdir = dp;
 		/* Lookup the vnode corresponding pathname component */
@@ -76,6 +76,7 @@ __FBSDID("$FreeBSD: head/sys/kern/vfs_subr.c 293197 2016-01-05 14:48:40Z kib $")
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
+#include <sys/taskqueue.h>
 #include <sys/vmmeter.h>
 #include <sys/vnode.h>
 #include <sys/watchdog.h>
@@ -106,7 +107,7 @@ static void	v_init_counters(struct vnode *);
 static void	v_incr_usecount(struct vnode *);
 static void	v_incr_devcount(struct vnode *);
 static void	v_decr_devcount(struct vnode *);
-static void	vnlru_free(int);
+static int	vnlru_free(int);
 static void	vgonel(struct vnode *);
 static void	vfs_knllock(void *arg);
 static void	vfs_knlunlock(void *arg);
@@ -141,9 +142,25 @@ int vttoif_tab[10] = {
 };
 
 /*
- * List of vnodes that are ready for recycling.
+ * Lists of vnodes that are ready for recycling.  A vnode freed by vdrop()
+ * is first put on its mount point's batch list (mnt_tmpfreevnodelist).
+ * Once mnt_free_list_batch vnodes have collected there, the whole batch
+ * is moved onto the free list of the cpu doing the vdrop().  Recycling
+ * takes vnodes from the local cpu's list first and moves on to the other
+ * lists only when it is empty, so that neither vdrop() nor getnewvnode()
+ * serialize on a single lock.
  */
-static TAILQ_HEAD(freelst, vnode) vnode_free_list;
+TAILQ_HEAD(freelst, vnode);
+struct vfreelist {
+	struct mtx	vfl_lock;
+	struct freelst	vfl_list;
+	u_long		vfl_count;
+} __aligned(CACHE_LINE_SIZE);
+static struct vfreelist vnode_free_lists[MAXCPU];
+
+static int mnt_free_list_batch = 128;
+SYSCTL_INT(_vfs, OID_AUTO, mnt_free_list_batch, CTLFLAG_RW,
+    &mnt_free_list_batch, 0, "Limit of vnodes held on mnt's free list");
 
 /*
  * "Free" vnode target.  Free vnodes are rarely completely free, but are
@@ -198,11 +215,10 @@ static struct mtx mntid_mtx;
 
 /*
  * Lock for any access to the following:
- *	vnode_free_list
- *	numvnodes
- *	freevnodes
+ *	vnlruproc_sig
+ * numvnodes and freevnodes are updated with atomics.
  */
-static struct mtx vnode_free_list_mtx;
+static struct mtx vnlru_mtx;
 
 /* Publicly exported FS */
 struct nfs_public nfs_pub;
@@ -436,10 +452,14 @@ vntblinit(void *dummy __unused)
 	}
 	wantfreevnodes = desiredvnodes / 4;
 	mtx_init(&mntid_mtx, "mntid", NULL, MTX_DEF);
-	TAILQ_INIT(&vnode_free_list);
-	mtx_init(&vnode_free_list_mtx, "vnode_free_list", NULL, MTX_DEF);
+	for (i = 0; i < MAXCPU; i++) {
+		TAILQ_INIT(&vnode_free_lists[i].vfl_list);
+		mtx_init(&vnode_free_lists[i].vfl_lock, "vnode_free_list", NULL,
+		    MTX_DEF);
+	}
+	mtx_init(&vnlru_mtx, "vnlru", NULL, MTX_DEF);
 	vnode_zone = uma_zcreate("VNODE", sizeof (struct vnode), NULL, NULL,
-	    vnode_init, vnode_fini, UMA_ALIGN_PTR, 0);
+	    vnode_init, vnode_fini, UMA_ALIGN_PTR, UMA_ZONE_NUMA);
 	vnodepoll_zone = uma_zcreate("VNODEPOLL", sizeof (struct vpollinfo),
 	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 	/*
@@ -921,18 +941,114 @@ relock_mnt:
 }
 
 /*
- * Attempt to reduce the free list by the requested amount.
+ * Remove a free vnode from the per-cpu free list it was moved to.
  */
 static void
-vnlru_free(int count)
+vfreelist_remove(struct vnode *vp)
+{
+	struct vfreelist *vfl;
+
+	ASSERT_VI_LOCKED(vp, __func__);
+	vfl = &vnode_free_lists[vp->v_freelist];
+	mtx_lock(&vfl->vfl_lock);
+	TAILQ_REMOVE(&vfl->vfl_list, vp, v_actfreelist);
+	vfl->vfl_count--;
+	mtx_unlock(&vfl->vfl_lock);
+}
+
+/*
+ * Put a free vnode which does not belong to a mount point directly on
+ * the free list of the current cpu.
+ */
+static void
+vfreelist_insert(struct vnode *vp)
 {
+	struct vfreelist *vfl;
+
+	ASSERT_VI_LOCKED(vp, __func__);
+	vp->v_freelist = curcpu;
+	vfl = &vnode_free_lists[vp->v_freelist];
+	mtx_lock(&vfl->vfl_lock);
+	TAILQ_INSERT_TAIL(&vfl->vfl_list, vp, v_actfreelist);
+	vfl->vfl_count++;
+	mtx_unlock(&vfl->vfl_lock);
+}
+
+/*
+ * Move the batch of free vnodes collected on the mount point onto the
+ * free list of the current cpu.
+ */
+static void
+vnlru_return_batch_locked(struct mount *mp)
+{
+	struct vfreelist *vfl;
 	struct vnode *vp;
+	u_int idx;
+
+	mtx_assert(&mp->mnt_listmtx, MA_OWNED);
+	if (mp->mnt_tmpfreevnodelistsize == 0)
+		return;
+	idx = curcpu;
+	vfl = &vnode_free_lists[idx];
+	TAILQ_FOREACH(vp, &mp->mnt_tmpfreevnodelist, v_actfreelist) {
+		VNASSERT((vp->v_mflag & VMP_TMPMNTFREELIST) != 0, vp,
+		    ("vnode without VMP_TMPMNTFREELIST on mnt_tmpfreevnodelist"));
+		vp->v_mflag &= ~VMP_TMPMNTFREELIST;
+		vp->v_freelist = idx;
+	}
+	mtx_lock(&vfl->vfl_lock);
+	TAILQ_CONCAT(&vfl->vfl_list, &mp->mnt_tmpfreevnodelist, v_actfreelist);
+	vfl->vfl_count += mp->mnt_tmpfreevnodelistsize;
+	mtx_unlock(&vfl->vfl_lock);
+	mp->mnt_tmpfreevnodelistsize = 0;
+}
 
-	mtx_assert(&vnode_free_list_mtx, MA_OWNED);
-	for (; count > 0; count--) {
-		vp = TAILQ_FIRST(&vnode_free_list);
+static void
+vnlru_return_batch(struct mount *mp)
+{
+
+	mtx_lock(&mp->mnt_listmtx);
+	vnlru_return_batch_locked(mp);
+	mtx_unlock(&mp->mnt_listmtx);
+}
+
+/*
+ * Make the partial batches of all mount points available for recycling.
+ */
+static void
+vnlru_return_batches(void)
+{
+	struct mount *mp, *nmp;
+
+	mtx_lock(&mountlist_mtx);
+	for (mp = TAILQ_FIRST(&mountlist); mp != NULL; mp = nmp) {
+		if (vfs_busy(mp, MBF_NOWAIT | MBF_MNTLSTLOCK)) {
+			nmp = TAILQ_NEXT(mp, mnt_list);
+			continue;
+		}
+		vnlru_return_batch(mp);
+		mtx_lock(&mountlist_mtx);
+		nmp = TAILQ_NEXT(mp, mnt_list);
+		vfs_unbusy(mp);
+	}
+	mtx_unlock(&mountlist_mtx);
+}
+
+/*
+ * Attempt to reduce one free list by the requested amount.  Returns the
+ * number of vnodes examined.
+ */
+static int
+vnlru_free_list(struct vfreelist *vfl, int count)
+{
+	struct vnode *vp;
+	int n;
+
+	mtx_assert(&vfl->vfl_lock, MA_OWNED);
+	for (n = 0; n < count; n++) {
+		vp = TAILQ_FIRST(&vfl->vfl_list);
 		/*
-		 * The list can be modified while the free_list_mtx
+		 * The list can be modified while the list lock
 		 * has been dropped and vp could be NULL here.
 		 */
 		if (!vp)
@@ -943,12 +1059,12 @@ vnlru_free(int count)
 		    ("Removing vnode not on freelist"));
 		KASSERT((vp->v_iflag & VI_ACTIVE) == 0,
 		    ("Mangling active vnode"));
-		TAILQ_REMOVE(&vnode_free_list, vp, v_actfreelist);
+		TAILQ_REMOVE(&vfl->vfl_list, vp, v_actfreelist);
 		/*
 		 * Don't recycle if we can't get the interlock.
 		 */
 		if (!VI_TRYLOCK(vp)) {
-			TAILQ_INSERT_TAIL(&vnode_free_list, vp, v_actfreelist);
+			TAILQ_INSERT_TAIL(&vfl->vfl_list, vp, v_actfreelist);
 			continue;
 		}
 		VNASSERT((vp->v_iflag & VI_FREE) != 0 && vp->v_holdcnt == 0,
@@ -962,11 +1078,12 @@ vnlru_free(int count)
 		 * of vholdl(), to avoid triggering assertions or
 		 * activating.
 		 */
-		freevnodes--;
+		vfl->vfl_count--;
+		atomic_subtract_long(&freevnodes, 1);
 		vp->v_iflag &= ~VI_FREE;
 		refcount_acquire(&vp->v_holdcnt);
 
-		mtx_unlock(&vnode_free_list_mtx);
+		mtx_unlock(&vfl->vfl_lock);
 		VI_UNLOCK(vp);
 		vtryrecycle(vp);
 		/*
@@ -975,8 +1092,32 @@ vnlru_free(int count)
 		 * the free list.
 		 */
 		vdrop(vp);
-		mtx_lock(&vnode_free_list_mtx);
+		mtx_lock(&vfl->vfl_lock);
 	}
+	return (n);
+}
+
+/*
+ * Attempt to reduce the free lists by the requested amount, starting
+ * with the list of the current cpu.  No global lock is taken.  Returns
+ * the part of the request which could not be satisfied.
+ */
+static int
+vnlru_free(int count)
+{
+	struct vfreelist *vfl;
+	u_int i, idx;
+
+	idx = curcpu;
+	for (i = 0; i <= mp_maxid && count > 0; i++) {
+		vfl = &vnode_free_lists[(idx + i) % (mp_maxid + 1)];
+		if (vfl->vfl_count == 0)
+			continue;
+		mtx_lock(&vfl->vfl_lock);
+		count -= vnlru_free_list(vfl, count);
+		mtx_unlock(&vfl->vfl_lock);
+	}
+	return (count);
 }
 
 /* XXX some names and initialization are bad for limits and watermarks. */
@@ -996,6 +1137,83 @@ vspace(void)
 	return (space);
 }
 
+/*
+ * vlrureclaim() of each mount point is handed to a pool of vnlru threads,
+ * so that reclamation of several file systems proceeds in parallel.
+ */
+struct vlrureclaim_work {
+	struct task	vw_task;
+	struct mount	*vw_mp;
+	int		vw_reclaim_nc_src;
+	int		vw_trigger;
+	int		vw_done;
+};
+
+static struct taskqueue *vnlru_tq;
+static int vnlru_threads;
+SYSCTL_INT(_vfs, OID_AUTO, vnlru_threads, CTLFLAG_RDTUN, &vnlru_threads, 0,
+    "Number of threads reclaiming vnodes from mount points in parallel");
+
+static void
+vlrureclaim_task(void *arg, int pending __unused)
+{
+	struct vlrureclaim_work *vw;
+
+	vw = arg;
+	vw->vw_done = vlrureclaim(vw->vw_mp, vw->vw_reclaim_nc_src,
+	    vw->vw_trigger);
+}
+
+/*
+ * Run vlrureclaim() on all mount points in parallel and return the total
+ * number of vnodes reclaimed.  Mount points added while the pass is
+ * running are left for the next pass.
+ */
+static int
+vlrureclaim_all(int reclaim_nc_src, int trigger)
+{
+	struct vlrureclaim_work *vw;
+	struct mount *mp, *nmp;
+	int done, i, n, nmounts;
+
+	nmounts = 0;
+	mtx_lock(&mountlist_mtx);
+	TAILQ_FOREACH(mp, &mountlist, mnt_list)
+		nmounts++;
+	mtx_unlock(&mountlist_mtx);
+	if (nmounts == 0)
+		return (0);
+	vw = malloc(nmounts * sizeof(*vw), M_TEMP, M_WAITOK | M_ZERO);
+
+	n = 0;
+	mtx_lock(&mountlist_mtx);
+	for (mp = TAILQ_FIRST(&mountlist); mp != NULL && n < nmounts;
+	    mp = nmp) {
+		if (vfs_busy(mp, MBF_NOWAIT | MBF_MNTLSTLOCK)) {
+			nmp = TAILQ_NEXT(mp, mnt_list);
+			continue;
+		}
+		vw[n].vw_mp = mp;
+		vw[n].vw_reclaim_nc_src = reclaim_nc_src;
+		vw[n].vw_trigger = trigger;
+		TASK_INIT(&vw[n].vw_task, 0, vlrureclaim_task, &vw[n]);
+		taskqueue_enqueue(vnlru_tq, &vw[n].vw_task);
+		n++;
+		mtx_lock(&mountlist_mtx);
+		nmp = TAILQ_NEXT(mp, mnt_list);
+	}
+	mtx_unlock(&mountlist_mtx);
+
+	done = 0;
+	for (i = 0; i < n; i++) {
+		taskqueue_drain(vnlru_tq, &vw[i].vw_task);
+		done += vw[i].vw_done;
+		vfs_unbusy(vw[i].vw_mp);
+	}
+	free(vw, M_TEMP);
+	return (done);
+}
+
 /*
  * Attempt to recycle vnodes in a context that is always safe to block.
  * Calling vlrurecycle() from the bowels of filesystem code has some
@@ -1007,17 +1225,27 @@ static int vnlruproc_sig;
 static void
 vnlru_proc(void)
 {
-	struct mount *mp, *nmp;
 	unsigned long ofreevnodes, onumvnodes;
 	int done, force, reclaim_nc_src, trigger, usevnodes;
 
 	EVENTHANDLER_REGISTER(shutdown_pre_sync, kproc_shutdown, vnlruproc,
 	    SHUTDOWN_PRI_FIRST);
 
+	if (vnlru_threads <= 0)
+		vnlru_threads = imin(mp_ncpus, 4);
+	vnlru_tq = taskqueue_create("vnlru", M_WAITOK,
+	    taskqueue_thread_enqueue, &vnlru_tq);
+	taskqueue_start_threads(&vnlru_tq, vnlru_threads, PVFS,
+	    "vnlru reclaim");
+
 	force = 0;
 	for (;;) {
 		kproc_suspend_check(vnlruproc);
-		mtx_lock(&vnode_free_list_mtx);
+		/*
+		 * Make the vnodes batched on the mount points available
+		 * to vnlru_free() and getnewvnode().
+		 */
+		vnlru_return_batches();
 		/*
 		 * If numvnodes is too large (due to desiredvnodes being
 		 * adjusted using its sysctl, or emergency growth), first
@@ -1026,6 +1254,7 @@ vnlru_proc(void)
 		if (numvnodes > desiredvnodes && freevnodes > 0)
 			vnlru_free(ulmin(numvnodes - desiredvnodes,
 			    freevnodes));
+		mtx_lock(&vnlru_mtx);
 		/*
 		 * Sleep if the vnode cache is in a good state.  This is
 		 * when it is not over-full and has space for about a 4%
@@ -1040,11 +1269,11 @@ vnlru_proc(void)
 		if (vspace() >= vlowat && force == 0) {
 			vnlruproc_sig = 0;
 			wakeup(&vnlruproc_sig);
-			msleep(vnlruproc, &vnode_free_list_mtx,
+			msleep(vnlruproc, &vnlru_mtx,
 			    PVFS|PDROP, "vlruwt", hz);
 			continue;
 		}
-		mtx_unlock(&vnode_free_list_mtx);
+		mtx_unlock(&vnlru_mtx);
 		done = 0;
 		ofreevnodes = freevnodes;
 		onumvnodes = numvnodes;
@@ -1073,18 +1302,7 @@ vnlru_proc(void)
 		if (force < 2)
 			trigger = vsmalltrigger;
 		reclaim_nc_src = force >= 3;
-		mtx_lock(&mountlist_mtx);
-		for (mp = TAILQ_FIRST(&mountlist); mp != NULL; mp = nmp) {
-			if (vfs_busy(mp, MBF_NOWAIT | MBF_MNTLSTLOCK)) {
-				nmp = TAILQ_NEXT(mp, mnt_list);
-				continue;
-			}
-			done += vlrureclaim(mp, reclaim_nc_src, trigger);
-			mtx_lock(&mountlist_mtx);
-			nmp = TAILQ_NEXT(mp, mnt_list);
-			vfs_unbusy(mp);
-		}
-		mtx_unlock(&mountlist_mtx);
+		done = vlrureclaim_all(reclaim_nc_src, trigger);
 		if (onumvnodes > desiredvnodes && numvnodes <= desiredvnodes)
 			uma_reclaim();
 		if (done == 0) {
@@ -1196,7 +1414,7 @@ static int
 getnewvnode_wait(int suspended)
 {
 
-	mtx_assert(&vnode_free_list_mtx, MA_OWNED);
+	mtx_lock(&vnlru_mtx);
 	if (numvnodes >= desiredvnodes) {
 		if (suspended) {
 			/*
@@ -1204,15 +1422,17 @@ getnewvnode_wait(int suspended)
 			 * risk a deadlock here, so allow allocation of
 			 * another vnode even if this would give too many.
 			 */
+			mtx_unlock(&vnlru_mtx);
 			return (0);
 		}
 		if (vnlruproc_sig == 0) {
 			vnlruproc_sig = 1;	/* avoid unnecessary wakeups */
 			wakeup(vnlruproc);
 		}
-		msleep(&vnlruproc_sig, &vnode_free_list_mtx, PVFS,
+		msleep(&vnlruproc_sig, &vnlru_mtx, PVFS,
 		    "vlruwk", hz);
 	}
+	mtx_unlock(&vnlru_mtx);
 	/* Post-adjust like the pre-adjust in getnewvnode(). */
 	if (numvnodes + 1 > desiredvnodes && freevnodes > 1)
 		vnlru_free(1);
@@ -1229,12 +1449,9 @@ getnewvnode_reserve(u_int count)
 	struct thread *td;
 
 	/* Pre-adjust like the pre-adjust in getnewvnode(), with any count. */
-	/* XXX no longer so quick, but this part is not racy. */
-	mtx_lock(&vnode_free_list_mtx);
 	if (numvnodes + count > desiredvnodes && freevnodes > wantfreevnodes)
 		vnlru_free(ulmin(numvnodes + count - desiredvnodes,
 		    freevnodes - wantfreevnodes));
-	mtx_unlock(&vnode_free_list_mtx);
 
 	td = curthread;
 	/* First try to be quick and racy. */
@@ -1245,7 +1462,6 @@ getnewvnode_reserve(u_int count)
 	} else
 		atomic_subtract_long(&numvnodes, count);
 
-	mtx_lock(&vnode_free_list_mtx);
 	while (count > 0) {
 		if (getnewvnode_wait(0) == 0) {
 			count--;
@@ -1254,7 +1470,6 @@ getnewvnode_reserve(u_int count)
 		}
 	}
 	vcheckspace();
-	mtx_unlock(&vnode_free_list_mtx);
 }
 
 /*
@@ -1295,7 +1510,10 @@ getnewvnode(const char *tag, struct mount *mp, struct vop_vector *vops,
 		td->td_vp_reserv -= 1;
 		goto alloc;
 	}
-	mtx_lock(&vnode_free_list_mtx);
+	/*
+	 * cyclecount and vstir are only hints to vnlru_proc() and are
+	 * updated without synchronization.
+	 */
 	if (numvnodes < desiredvnodes)
 		cyclecount = 0;
 	else if (cyclecount++ >= freevnodes) {
@@ -1314,21 +1532,26 @@ getnewvnode(const char *tag, struct mount *mp, struct vop_vector *vops,
 	 */
 	if (numvnodes + 1 <= desiredvnodes)
 		;
-	else if (freevnodes > 0)
-		vnlru_free(1);
-	else {
+	else if (freevnodes > 0) {
+		/*
+		 * The free vnodes may all still be batched on their
+		 * mount points.  Release our own mount's batch before
+		 * giving up on reclaiming.
+		 */
+		if (vnlru_free(1) != 0 && mp != NULL) {
+			vnlru_return_batch(mp);
+			vnlru_free(1);
+		}
+	} else {
 		error = getnewvnode_wait(mp != NULL && (mp->mnt_kern_flag &
 		    MNTK_SUSPEND));
 #if 0	/* XXX Not all VFS_VGET/ffs_vget callers check returns. */
-		if (error != 0) {
-			mtx_unlock(&vnode_free_list_mtx);
+		if (error != 0)
 			return (error);
-		}
 #endif
 	}
 	vcheckspace();
 	atomic_add_long(&numvnodes, 1);
-	mtx_unlock(&vnode_free_list_mtx);
 alloc:
 	atomic_add_long(&vnodes_created, 1);
 	vp = (struct vnode *) uma_zalloc(vnode_zone, M_WAITOK);
@@ -1412,10 +1635,10 @@ delmntque(struct vnode *vp)
 	active = vp->v_iflag & VI_ACTIVE;
 	vp->v_iflag &= ~VI_ACTIVE;
 	if (active) {
-		mtx_lock(&vnode_free_list_mtx);
+		mtx_lock(&mp->mnt_listmtx);
 		TAILQ_REMOVE(&mp->mnt_activevnodelist, vp, v_actfreelist);
 		mp->mnt_activevnodelistsize--;
-		mtx_unlock(&vnode_free_list_mtx);
+		mtx_unlock(&mp->mnt_listmtx);
 	}
 	vp->v_mount = NULL;
 	VI_UNLOCK(vp);
@@ -1455,8 +1678,8 @@ insmntque1(struct vnode *vp, struct mount *mp,
 	 * vnode cannot be recycled by another process releasing a
 	 * holdcnt on it before we get it on both the vnode list
 	 * and the active vnode list. The mount mutex protects only
-	 * manipulation of the vnode list and the vnode freelist
-	 * mutex protects only manipulation of the active vnode list.
+	 * manipulation of the vnode list and the mount list mutex
+	 * protects only manipulation of the active vnode list.
 	 * Hence the need to hold the vnode interlock throughout.
 	 */
 	MNT_ILOCK(mp);
@@ -1480,10 +1703,10 @@ insmntque1(struct vnode *vp, struct mount *mp,
 	KASSERT((vp->v_iflag & VI_ACTIVE) == 0,
 	    ("Activating already active vnode"));
 	vp->v_iflag |= VI_ACTIVE;
-	mtx_lock(&vnode_free_list_mtx);
+	mtx_lock(&mp->mnt_listmtx);
 	TAILQ_INSERT_HEAD(&mp->mnt_activevnodelist, vp, v_actfreelist);
 	mp->mnt_activevnodelistsize++;
-	mtx_unlock(&vnode_free_list_mtx);
+	mtx_unlock(&mp->mnt_listmtx);
 	VI_UNLOCK(vp);
 	MNT_IUNLOCK(mp);
 	return (0);
@@ -2728,19 +2951,29 @@ _vhold(struct vnode *vp, bool locked)
 	    ("%s: vnode already reclaimed.", __func__));
 	/*
 	 * Remove a vnode from the free list, mark it as in use,
-	 * and put it on the active list.
+	 * and put it on the active list.  The vnode is either still
+	 * on its mount point's batch list or on a per-cpu free list.
 	 */
-	mtx_lock(&vnode_free_list_mtx);
-	TAILQ_REMOVE(&vnode_free_list, vp, v_actfreelist);
-	freevnodes--;
-	vp->v_iflag &= ~VI_FREE;
-	KASSERT((vp->v_iflag & VI_ACTIVE) == 0,
-	    ("Activating already active vnode"));
-	vp->v_iflag |= VI_ACTIVE;
 	mp = vp->v_mount;
-	TAILQ_INSERT_HEAD(&mp->mnt_activevnodelist, vp, v_actfreelist);
-	mp->mnt_activevnodelistsize++;
-	mtx_unlock(&vnode_free_list_mtx);
+	if (mp != NULL) {
+		mtx_lock(&mp->mnt_listmtx);
+		if ((vp->v_mflag & VMP_TMPMNTFREELIST) != 0) {
+			TAILQ_REMOVE(&mp->mnt_tmpfreevnodelist, vp,
+			    v_actfreelist);
+			mp->mnt_tmpfreevnodelistsize--;
+			vp->v_mflag &= ~VMP_TMPMNTFREELIST;
+		} else
+			vfreelist_remove(vp);
+		KASSERT((vp->v_iflag & VI_ACTIVE) == 0,
+		    ("Activating already active vnode"));
+		vp->v_iflag |= VI_ACTIVE;
+		TAILQ_INSERT_HEAD(&mp->mnt_activevnodelist, vp, v_actfreelist);
+		mp->mnt_activevnodelistsize++;
+		mtx_unlock(&mp->mnt_listmtx);
+	} else
+		vfreelist_remove(vp);
+	vp->v_iflag &= ~VI_FREE;
+	atomic_subtract_long(&freevnodes, 1);
 	refcount_acquire(&vp->v_holdcnt);
 	if (!locked)
 		VI_UNLOCK(vp);
@@ -2795,18 +3028,34 @@ _vdrop(struct vnode *vp, bool locked)
 		active = vp->v_iflag & VI_ACTIVE;
 		if ((vp->v_iflag & VI_OWEINACT) == 0) {
 			vp->v_iflag &= ~VI_ACTIVE;
+			atomic_add_long(&freevnodes, 1);
+			vp->v_iflag |= VI_FREE;
 			mp = vp->v_mount;
-			mtx_lock(&vnode_free_list_mtx);
-			if (active) {
-				TAILQ_REMOVE(&mp->mnt_activevnodelist, vp,
-				    v_actfreelist);
-				mp->mnt_activevnodelistsize--;
+			if (mp != NULL) {
+				/*
+				 * Batch the vnode on its mount point and
+				 * hand the batch to a per-cpu free list
+				 * once it is full.
+				 */
+				mtx_lock(&mp->mnt_listmtx);
+				if (active) {
+					TAILQ_REMOVE(&mp->mnt_activevnodelist,
+					    vp, v_actfreelist);
+					mp->mnt_activevnodelistsize--;
+				}
+				TAILQ_INSERT_TAIL(&mp->mnt_tmpfreevnodelist,
+				    vp, v_actfreelist);
+				mp->mnt_tmpfreevnodelistsize++;
+				vp->v_mflag |= VMP_TMPMNTFREELIST;
+				if (mp->mnt_tmpfreevnodelistsize >=
+				    mnt_free_list_batch)
+					vnlru_return_batch_locked(mp);
+				mtx_unlock(&mp->mnt_listmtx);
+			} else {
+				VNASSERT(active == 0, vp,
+				    ("vdropl: active vnode not on a mount"));
+				vfreelist_insert(vp);
 			}
-			TAILQ_INSERT_TAIL(&vnode_free_list, vp,
-			    v_actfreelist);
-			freevnodes++;
-			vp->v_iflag |= VI_FREE;
-			mtx_unlock(&vnode_free_list_mtx);
 		} else {
 			atomic_add_long(&free_owe_inact, 1);
 		}
@@ -2827,6 +3076,8 @@ _vdrop(struct vnode *vp, bool locked)
 	bo = &vp->v_bufobj;
 	VNASSERT((vp->v_iflag & VI_FREE) == 0, vp,
 	    ("cleaned vnode still on the free list."));
+	VNASSERT((vp->v_mflag & VMP_TMPMNTFREELIST) == 0, vp,
+	    ("cleaned vnode still on the mount free list."));
 	VNASSERT(vp->v_data == NULL, vp, ("cleaned vnode isn't"));
 	VNASSERT(vp->v_holdcnt == 0, vp, ("Non-zero hold count"));
 	VNASSERT(vp->v_usecount == 0, vp, ("Non-zero use count"));
@@ -3215,6 +3466,13 @@ vgonel(struct vnode *vp)
 	vp->v_bufobj.bo_flag |= BO_DEAD;
 	BO_UNLOCK(&vp->v_bufobj);
 
+	/*
+	 * Purge the name cache before the filesystem tears down v_data.
+	 * cache_fplookup() inspects vnodes reached through the cache while
+	 * holding only a namecache vnodelock and relies on an entry never
+	 * pointing to a reclaimed vnode.
+	 */
+	cache_purge(vp);
 	/*
 	 * Reclaim the vnode.
 	 */
@@ -3233,7 +3491,6 @@ vgonel(struct vnode *vp)
 	 * Delete from old mount point vnode list.
 	 */
 	delmntque(vp);
-	cache_purge(vp);
 	/*
 	 * Done with purge, reset to the standard lock and invalidate
 	 * the vnode.
@@ -3509,6 +3766,7 @@ DB_SHOW_COMMAND(mount, db_show_mount)
 	MNT_KERN_FLAG(MNTK_LOOKUP_EXCL_DOTDOT);
 	MNT_KERN_FLAG(MNTK_MARKER);
 	MNT_KERN_FLAG(MNTK_USES_BCACHE);
+	MNT_KERN_FLAG(MNTK_FPLOOKUP);
 	MNT_KERN_FLAG(MNTK_NOASYNC);
 	MNT_KERN_FLAG(MNTK_UNMOUNT);
 	MNT_KERN_FLAG(MNTK_MWAIT);
@@ -3562,6 +3820,8 @@ DB_SHOW_COMMAND(mount, db_show_mount)
 	db_printf("    mnt_nvnodelistsize = %d\n", mp->mnt_nvnodelistsize);
 	db_printf("    mnt_activevnodelistsize = %d\n",
 	    mp->mnt_activevnodelistsize);
+	db_printf("    mnt_tmpfreevnodelistsize = %d\n",
+	    mp->mnt_tmpfreevnodelistsize);
 	db_printf("    mnt_writeopcount = %d\n", mp->mnt_writeopcount);
 	db_printf("    mnt_maxsymlinklen = %d\n", mp->mnt_maxsymlinklen);
 	db_printf("    mnt_iosize_max = %d\n", mp->mnt_iosize_max);
@@ -5184,7 +5444,7 @@ mnt_vnode_next_active(struct vnode **mvp, struct mount *mp)
 {
 	struct vnode *vp, *nvp;
 
-	mtx_assert(&vnode_free_list_mtx, MA_OWNED);
+	mtx_assert(&mp->mnt_listmtx, MA_OWNED);
 	KASSERT((*mvp)->v_mount == mp, ("marker vnode mount list mismatch"));
 restart:
 	vp = TAILQ_NEXT(*mvp, v_actfreelist);
@@ -5197,9 +5457,9 @@ restart:
 		if (!VI_TRYLOCK(vp)) {
 			if (mp_ncpus == 1 || should_yield()) {
 				TAILQ_INSERT_BEFORE(vp, *mvp, v_actfreelist);
-				mtx_unlock(&vnode_free_list_mtx);
+				mtx_unlock(&mp->mnt_listmtx);
 				pause("vnacti", 1);
-				mtx_lock(&vnode_free_list_mtx);
+				mtx_lock(&mp->mnt_listmtx);
 				goto restart;
 			}
 			continue;
@@ -5216,12 +5476,12 @@ restart:
 
 	/* Check if we are done */
 	if (vp == NULL) {
-		mtx_unlock(&vnode_free_list_mtx);
+		mtx_unlock(&mp->mnt_listmtx);
 		mnt_vnode_markerfree_active(mvp, mp);
 		return (NULL);
 	}
 	TAILQ_INSERT_AFTER(&mp->mnt_activevnodelist, vp, *mvp, v_actfreelist);
-	mtx_unlock(&vnode_free_list_mtx);
+	mtx_unlock(&mp->mnt_listmtx);
 	ASSERT_VI_LOCKED(vp, "active iter");
 	KASSERT((vp->v_iflag & VI_ACTIVE) != 0, ("Non-active vp %p", vp));
 	return (vp);
@@ -5233,7 +5493,7 @@ __mnt_vnode_next_active(struct vnode **mvp, struct mount *mp)
 
 	if (should_yield())
 		kern_yield(PRI_USER);
-	mtx_lock(&vnode_free_list_mtx);
+	mtx_lock(&mp->mnt_listmtx);
 	return (mnt_vnode_next_active(mvp, mp));
 }
 
@@ -5249,10 +5509,10 @@ __mnt_vnode_first_active(struct vnode **mvp, struct mount *mp)
 	(*mvp)->v_type = VMARKER;
 	(*mvp)->v_mount = mp;
 
-	mtx_lock(&vnode_free_list_mtx);
+	mtx_lock(&mp->mnt_listmtx);
 	vp = TAILQ_FIRST(&mp->mnt_activevnodelist);
 	if (vp == NULL) {
-		mtx_unlock(&vnode_free_list_mtx);
+		mtx_unlock(&mp->mnt_listmtx);
 		mnt_vnode_markerfree_active(mvp, mp);
 		return (NULL);
 	}
@@ -5267,8 +5527,8 @@ __mnt_vnode_markerfree_active(struct vnode **mvp, struct mount *mp)
 	if (*mvp == NULL)
 		return;
 
-	mtx_lock(&vnode_free_list_mtx);
+	mtx_lock(&mp->mnt_listmtx);
 	TAILQ_REMOVE(&mp->mnt_activevnodelist, *mvp, v_actfreelist);
-	mtx_unlock(&vnode_free_list_mtx);
+	mtx_unlock(&mp->mnt_listmtx);
 	mnt_vnode_markerfree_active(mvp, mp);
 }
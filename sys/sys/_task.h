@@ -47,6 +47,7 @@ struct task {
 	STAILQ_ENTRY(task) ta_link;	/* (q) link for queue */
 	u_short	ta_pending;		/* (q) count times queued */
 	u_short	ta_priority;		/* (c) Priority */
+	u_short	ta_cpu;			/* (q) per-cpu queue it is on */
 	task_fn_t *ta_func;		/* (c) task handler */
 	void	*ta_context;		/* (c) argument for handler */
 };
@@ -30,6 +30,7 @@
 #define _SYS_EVENT_H_
 
 #include <sys/queue.h> 
+#include <sys/ioccom.h>
 
 #define EVFILT_READ		(-1)
 #define EVFILT_WRITE		(-2)
@@ -141,6 +142,38 @@ struct kevent {
 #define NOTE_USECONDS		0x00000004	/* data is microseconds */
 #define NOTE_NSECONDS		0x00000008	/* data is nanoseconds */
 
+/*
+ * ioctl(2) on a kqueue descriptor shared by several threads: when set,
+ * each event which becomes ready wakes only one thread sleeping in
+ * kevent(2) instead of all of them.
+ */
+#define	KQIOCEXCL		_IOW('K', 1, int)
+
+/*
+ * Completion ring shared between a process and its kqueue, registered
+ * with KQIOCSETRING.  The kernel wires the ring and stores an event at
+ * kr_tail as soon as an EV_CLEAR or EV_DISPATCH knote without EV_ONESHOT
+ * triggers, e.g. an AIO completion requested with SIGEV_KEVENT.  Other
+ * events, and events that find the ring full, are returned by kevent(2)
+ * as before; kevent(2) does not sleep while the ring holds events.  The
+ * process consumes events from kr_head.  Both indices run freely and
+ * are taken modulo kr_nentries.  The ring is shared across fork(2).
+ */
+struct kevent_ring {
+	volatile u_int	kr_head;	/* consumer index (process) */
+	volatile u_int	kr_tail;	/* producer index (kernel) */
+	u_int		kr_nentries;	/* slots, a power of 2 (kernel) */
+	u_int		kr_spare;
+	/* struct kevent kr_events[kr_nentries] follows */
+};
+#define	KEVENT_RING_EVENTS(kr)	((struct kevent *)((kr) + 1))
+
+struct kevent_ring_args {
+	void		*kra_ring;	/* page aligned */
+	size_t		kra_len;	/* in bytes */
+};
+#define	KQIOCSETRING		_IOW('K', 2, struct kevent_ring_args)
+
 struct knote;
 SLIST_HEAD(klist, knote);
 struct kqueue;
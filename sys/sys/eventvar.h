@@ -55,12 +55,19 @@ struct kqueue {
 #define KQ_CLOSING	0x10
 #define	KQ_TASKSCHED	0x20			/* task scheduled */
 #define	KQ_TASKDRAIN	0x40			/* waiting for task to drain */
+#define	KQ_EXCL		0x80			/* wake one scanner per event */
+	int		kq_sleepers;		/* scanners asleep, KQ_EXCL */
 	int		kq_knlistsize;		/* size of knlist */
 	struct		klist *kq_knlist;	/* list of knotes */
 	u_long		kq_knhashmask;		/* size of knhash */
 	struct		klist *kq_knhash;	/* hash table for knotes */
 	struct		task kq_task;
 	struct		ucred *kq_cred;
+	struct		kevent_ring *kq_ring;	/* completion ring, kva */
+	struct		vm_page **kq_ringma;	/* wired pages of the ring */
+	int		kq_ringnpages;
+	u_int		kq_ringmask;		/* kr_nentries - 1 */
+	u_int		kq_ringtail;		/* kernel copy of kr_tail */
 };
 
 #endif /* !_SYS_EVENTVAR_H_ */
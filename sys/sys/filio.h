@@ -57,6 +57,11 @@ struct fiodgname_arg {
 #define	FIODGNAME	_IOW('f', 120, struct fiodgname_arg) /* get dev. name */
 #define	FIONWRITE	_IOR('f', 119, int)	/* get # bytes (yet) to write */
 #define	FIONSPACE	_IOR('f', 118, int)	/* get space in send queue */
+struct fiosplice_arg {
+	int	fd;		/* destination descriptor */
+	int	len;		/* in: max bytes, out: bytes moved */
+};
+#define	FIOSPLICE	_IOWR('f', 117, struct fiosplice_arg) /* pipe to fd */
 /* Handle lseek SEEK_DATA and SEEK_HOLE for holey file knowledge. */
 #define	FIOSEEKDATA	_IOWR('f', 97, off_t)	/* SEEK_DATA */
 #define	FIOSEEKHOLE	_IOWR('f', 98, off_t)	/* SEEK_HOLE */
@@ -112,6 +112,7 @@ void	taskqueue_thread_enqueue(void *context);
 #define TASK_INIT(task, priority, func, context) do {	\
 	(task)->ta_pending = 0;				\
 	(task)->ta_priority = (priority);		\
+	(task)->ta_cpu = 0;				\
 	(task)->ta_func = (func);			\
 	(task)->ta_context = (context);			\
 } while (0)
@@ -203,4 +204,13 @@ struct taskqueue *taskqueue_create_fast(const char *name, int mflags,
 				    taskqueue_enqueue_fn enqueue,
 				    void *context);
 
+/*
+ * A taskqueue with one queue and one worker thread per cpu.  Tasks are
+ * queued on the enqueuing cpu, and an idle worker steals from busy
+ * workers in its memory domain.  The usual taskqueue functions all
+ * apply to the returned queue.
+ */
+struct taskqueue *taskqueue_create_pcpu(const char *name, int mflags,
+				    int pri);
+
 #endif /* !_SYS_TASKQUEUE_H_ */
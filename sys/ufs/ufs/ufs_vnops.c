@@ -102,6 +102,7 @@ static int ufs_chmod(struct vnode *, int, struct ucred *, struct thread *);
 static int ufs_chown(struct vnode *, uid_t, gid_t, struct ucred *, struct thread *);
 static vop_close_t	ufs_close;
 static vop_create_t	ufs_create;
+static vop_fplookup_vexec_t	ufs_fplookup_vexec;
 static vop_getattr_t	ufs_getattr;
 static vop_ioctl_t	ufs_ioctl;
 static vop_link_t	ufs_link;
@@ -447,6 +448,41 @@ relock:
 	return (error);	/* Return errno */
 }
 
+/*
+ * Search permission check for the lockless lookup in vfs_cache.c.  The
+ * vnode is not locked, only kept from being reclaimed, so the inode is
+ * read racily and anything but the plain mode bits granting access is
+ * left to VOP_ACCESS() by returning EAGAIN.
+ */
+static int
+ufs_fplookup_vexec(ap)
+	struct vop_fplookup_vexec_args /* {
+		struct vnode *a_vp;
+		struct ucred *a_cred;
+		struct thread *a_td;
+	} */ *ap;
+{
+	struct vnode *vp = ap->a_vp;
+	struct ucred *cred = ap->a_cred;
+	struct inode *ip;
+	mode_t mode;
+
+	ip = VTOI(vp);
+	if (ip == NULL ||
+	    (vp->v_mount->mnt_flag & (MNT_ACLS | MNT_NFS4ACLS)) != 0)
+		return (EAGAIN);
+	mode = ip->i_mode;
+	if (cred->cr_uid == ip->i_uid) {
+		if ((mode & S_IXUSR) != 0)
+			return (0);
+	} else if (groupmember(ip->i_gid, cred)) {
+		if ((mode & S_IXGRP) != 0)
+			return (0);
+	} else if ((mode & S_IXOTH) != 0)
+		return (0);
+	return (EAGAIN);
+}
+
 /* ARGSUSED */
 static int
 ufs_getattr(ap)
@@ -2767,6 +2803,7 @@ struct vop_vector ufs_vnodeops = {
 	.vop_cachedlookup =	ufs_lookup,
 	.vop_close =		ufs_close,
 	.vop_create =		ufs_create,
+	.vop_fplookup_vexec =	ufs_fplookup_vexec,
 	.vop_getattr =		ufs_getattr,
 	.vop_inactive =		ufs_inactive,
 	.vop_ioctl =		ufs_ioctl,
@@ -158,5 +158,15 @@ void		 pmap_zero_page_idle(vm_page_t);
 #define	pmap_resident_count(pm)	((pm)->pm_stats.resident_count)
 #define	pmap_wired_count(pm)	((pm)->pm_stats.wired_count)
 
+/*
+ * A pmap may defer and coalesce the TLB shootdowns of pmap_remove()
+ * and pmap_protect() calls made between pmap_invl_batch_begin() and
+ * pmap_invl_batch_end().  The caller must not sleep inside the batch.
+ */
+#ifndef PMAP_HAS_INVL_BATCH
+#define	pmap_invl_batch_begin(pmap)	do { } while (0)
+#define	pmap_invl_batch_end(pmap)	do { } while (0)
+#endif
+
 #endif /* _KERNEL */
 #endif /* _PMAP_VM_ */
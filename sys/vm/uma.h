@@ -124,9 +124,11 @@ typedef int (*uma_init)(void *mem, int size, int flags);
 typedef void (*uma_fini)(void *mem, int size);
 
 /*
- * Import new memory into a cache zone.
+ * Import new memory into a cache zone.  The domain is the memory domain
+ * the caller would like the items to come from, or UMA_ANYDOMAIN.
  */
-typedef int (*uma_import)(void *arg, void **store, int count, int flags);
+typedef int (*uma_import)(void *arg, void **store, int count, int domain,
+    int flags);
 
 /*
  * Free memory from a cache zone.
@@ -279,6 +281,12 @@ uma_zone_t uma_zcache_create(char *name, int size, uma_ctor ctor, uma_dtor dtor,
 					 * Allocates mp_ncpus slabs sized to
 					 * sizeof(struct pcpu).
 					 */
+#define	UMA_ZONE_NUMA		0x10000	/*
+					 * Keep items in the memory domain of
+					 * the CPU that allocates them
+					 * (first-touch) rather than spreading
+					 * slabs round-robin over all domains.
+					 */
 
 /*
  * These flags are shared between the keg and zone.  In zones wishing to add
@@ -287,7 +295,11 @@ uma_zone_t uma_zcache_create(char *name, int size, uma_ctor ctor, uma_dtor dtor,
  */
 #define	UMA_ZONE_INHERIT						\
     (UMA_ZONE_OFFPAGE | UMA_ZONE_MALLOC | UMA_ZONE_NOFREE |		\
-    UMA_ZONE_HASH | UMA_ZONE_REFCNT | UMA_ZONE_VTOSLAB | UMA_ZONE_PCPU)
+    UMA_ZONE_HASH | UMA_ZONE_REFCNT | UMA_ZONE_VTOSLAB | UMA_ZONE_PCPU | \
+    UMA_ZONE_NUMA)
+
+/* Any memory domain will do, see uma_import. */
+#define	UMA_ANYDOMAIN	-1
 
 /* Definitions for align */
 #define UMA_ALIGN_PTR	(sizeof(void *) - 1)	/* Alignment fit for ptr */
@@ -364,6 +376,42 @@ uma_zfree(uma_zone_t zone, void *item)
 	uma_zfree_arg(zone, item, NULL);
 }
 
+/*
+ * Allocates a batch of items out of a zone
+ *
+ * Arguments:
+ *	zone  The zone we are allocating from
+ *	items Array receiving the allocated items
+ *	count The number of items wanted
+ *	arg   This data is passed to the ctor function of each item
+ *	flags See sys/malloc.h for available flags.
+ *
+ * Returns:
+ *	The number of items stored at the front of items.  This is only
+ *	guaranteed to be count if the wait flag is M_WAITOK and no ctor fails.
+ *
+ * Discussion:
+ *	Items are taken from the per-cpu cache and the zone's full buckets a
+ *	run at a time, and any shortfall is imported from the backend in a
+ *	single call.  This is cheaper than count calls to uma_zalloc_arg.
+ */
+int uma_zalloc_bulk(uma_zone_t zone, void **items, int count, void *arg,
+    int flags);
+
+/*
+ * Frees a batch of items back into the specified zone.
+ *
+ * Arguments:
+ *	zone  The zone the items were originally allocated out of.
+ *	items Array of the items to be freed; none may be NULL.
+ *	count The number of items in the array.
+ *	arg   Argument passed to the destructor of each item
+ *
+ * Returns:
+ *	Nothing.
+ */
+void uma_zfree_bulk(uma_zone_t zone, void **items, int count, void *arg);
+
 /*
  * XXX The rest of the prototypes in this header are h0h0 magic for the VM.
  * If you think you need to use it for a normal zone you're probably incorrect.
@@ -375,6 +423,7 @@ uma_zfree(uma_zone_t zone, void *item)
  * Arguments:
  *	zone  The zone that is requesting pages.
  *	size  The number of bytes being requested.
+ *	domain The memory domain to prefer, or UMA_ANYDOMAIN.
  *	pflag Flags for these memory pages, see below.
  *	wait  Indicates our willingness to block.
  *
@@ -382,8 +431,8 @@ uma_zfree(uma_zone_t zone, void *item)
  *	A pointer to the allocated memory or NULL on failure.
  */
 
-typedef void *(*uma_alloc)(uma_zone_t zone, vm_size_t size, uint8_t *pflag,
-    int wait);
+typedef void *(*uma_alloc)(uma_zone_t zone, vm_size_t size, int domain,
+    uint8_t *pflag, int wait);
 
 /*
  * Backend page free routines
@@ -447,6 +496,20 @@ void uma_startup2(void);
 
 void uma_reclaim(void);
 
+/*
+ * Frees the items cached by a zone, including the per-CPU caches where the
+ * calling thread is free to migrate between CPUs.
+ *
+ * Arguments:
+ *	zone  The zone to reclaim.
+ * Returns:
+ *	None
+ *
+ * The caller must be able to sleep and must not hold the drain lock.
+ */
+
+void uma_zone_reclaim(uma_zone_t zone);
+
 /*
  * Sets the alignment mask to be used for all zones requesting cache
  * alignment.  Should be called by MD boot code prior to starting VM/UMA.
@@ -693,7 +756,8 @@ struct uma_type_header {
 	uint64_t	uth_frees;	/* Zone: number of frees. */
 	uint64_t	uth_fails;	/* Zone: number of alloc failures. */
 	uint64_t	uth_sleeps;	/* Zone: number of alloc sleeps. */
-	uint64_t	_uth_reserved1[2];	/* Reserved. */
+	uint64_t	uth_wss;	/* Zone: working set size estimate. */
+	uint64_t	uth_lockfails;	/* Zone: lock contention events. */
 };
 
 struct uma_percpu_stat {
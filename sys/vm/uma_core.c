@@ -85,6 +85,7 @@ __FBSDID("$FreeBSD: head/sys/vm/uma_core.c 292484 2015-12-20 02:05:33Z jtl $");
 #include <vm/vm_page.h>
 #include <vm/vm_pageout.h>
 #include <vm/vm_param.h>
+#include <vm/vm_phys.h>
 #include <vm/vm_map.h>
 #include <vm/vm_kern.h>
 #include <vm/vm_extern.h>
@@ -230,14 +231,14 @@ enum zfreeskip { SKIP_NONE = 0, SKIP_DTOR, SKIP_FINI };
 
 /* Prototypes.. */
 
-static void *noobj_alloc(uma_zone_t, vm_size_t, uint8_t *, int);
-static void *page_alloc(uma_zone_t, vm_size_t, uint8_t *, int);
-static void *startup_alloc(uma_zone_t, vm_size_t, uint8_t *, int);
+static void *noobj_alloc(uma_zone_t, vm_size_t, int, uint8_t *, int);
+static void *page_alloc(uma_zone_t, vm_size_t, int, uint8_t *, int);
+static void *startup_alloc(uma_zone_t, vm_size_t, int, uint8_t *, int);
 static void page_free(void *, vm_size_t, uint8_t);
-static uma_slab_t keg_alloc_slab(uma_keg_t, uma_zone_t, int);
+static uma_slab_t keg_alloc_slab(uma_keg_t, uma_zone_t, int, int);
 static void cache_drain(uma_zone_t);
 static void bucket_drain(uma_zone_t, uma_bucket_t);
-static void bucket_cache_drain(uma_zone_t zone);
+static void bucket_cache_reclaim(uma_zone_t zone, bool drain);
 static int keg_ctor(void *, int, void *, int);
 static void keg_dtor(void *, int, void *);
 static int zone_ctor(void *, int, void *, int);
@@ -252,21 +253,25 @@ static int hash_expand(struct uma_hash *, struct uma_hash *);
 static void hash_free(struct uma_hash *hash);
 static void uma_timeout(void *);
 static void uma_startup3(void);
-static void *zone_alloc_item(uma_zone_t, void *, int);
+static void *zone_alloc_item(uma_zone_t, void *, int, int);
 static void zone_free_item(uma_zone_t, void *, void *, enum zfreeskip);
 static void bucket_enable(void);
 static void bucket_init(void);
 static uma_bucket_t bucket_alloc(uma_zone_t zone, void *, int);
 static void bucket_free(uma_zone_t zone, uma_bucket_t, void *);
 static void bucket_zone_drain(void);
-static uma_bucket_t zone_alloc_bucket(uma_zone_t zone, void *, int flags);
-static uma_slab_t zone_fetch_slab(uma_zone_t zone, uma_keg_t last, int flags);
-static uma_slab_t zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last, int flags);
+static uma_bucket_t zone_alloc_bucket(uma_zone_t zone, void *, int domain,
+    int flags);
+static uma_slab_t zone_fetch_slab(uma_zone_t zone, uma_keg_t last,
+    int domain, int flags);
+static uma_slab_t zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last,
+    int domain, int flags);
 static void *slab_alloc_item(uma_keg_t keg, uma_slab_t slab);
 static void slab_free_item(uma_keg_t keg, uma_slab_t slab, void *item);
 static uma_keg_t uma_kcreate(uma_zone_t zone, size_t size, uma_init uminit,
     uma_fini fini, int align, uint32_t flags);
-static int zone_import(uma_zone_t zone, void **bucket, int max, int flags);
+static int zone_import(uma_zone_t zone, void **bucket, int max, int domain,
+    int flags);
 static void zone_release(uma_zone_t zone, void **bucket, int cnt);
 static void uma_zero_item(void *item, uma_zone_t zone);
 
@@ -287,6 +292,10 @@ static int zone_warnings = 1;
 SYSCTL_INT(_vm, OID_AUTO, zone_warnings, CTLFLAG_RWTUN, &zone_warnings, 0,
     "Warn when UMA zones becomes full");
 
+static int zone_trim = 1;
+SYSCTL_INT(_vm, OID_AUTO, zone_trim, CTLFLAG_RWTUN, &zone_trim, 0,
+    "Periodically trim cached buckets down to the zone working set");
+
 /*
  * This routine checks to see whether or not it's safe to enable buckets.
  */
@@ -447,6 +456,109 @@ zone_foreach_keg(uma_zone_t zone, void (*kegfn)(uma_keg_t))
 		kegfn(klink->kl_keg);
 }
 
+/*
+ * Memory domain policy.
+ *
+ * First-touch zones (UMA_ZONE_NUMA) hand out items from the memory domain
+ * of the allocating CPU: full buckets are cached per domain and buckets are
+ * filled from the slabs of that domain.  All other zones share the bucket
+ * cache of domain 0 and let the keg spread new slabs round-robin.
+ *
+ * Returns the domain the current CPU should allocate from, or UMA_ANYDOMAIN.
+ * The caller must be in a critical section or otherwise tolerate migration.
+ */
+static __inline int
+zone_domain(uma_zone_t zone)
+{
+
+	if ((zone->uz_flags & UMA_ZONE_NUMA) == 0 || vm_ndomains == 1)
+		return (UMA_ANYDOMAIN);
+	return (PCPU_GET(domain));
+}
+
+static __inline uma_zone_domain_t
+zone_dom(uma_zone_t zone, int domain)
+{
+
+	return (&zone->uz_domain[domain == UMA_ANYDOMAIN ? 0 : domain]);
+}
+
+/*
+ * Count the items held in the full bucket caches of all domains.  Expects
+ * a locked zone.
+ */
+static int
+zone_cached_items(uma_zone_t zone)
+{
+	int cached, i;
+
+	cached = 0;
+	for (i = 0; i < vm_ndomains; i++)
+		cached += zone->uz_domain[i].uzd_nitems;
+	return (cached);
+}
+
+/*
+ * Take the most recently cached full bucket from a domain, updating the
+ * working-set low water mark.  Expects a locked zone.
+ */
+static uma_bucket_t
+zone_try_fetch_bucket(uma_zone_t zone, uma_zone_domain_t zdom)
+{
+	uma_bucket_t bucket;
+
+	ZONE_LOCK_ASSERT(zone);
+	if ((bucket = TAILQ_FIRST(&zdom->uzd_buckets)) != NULL) {
+		KASSERT(bucket->ub_cnt != 0,
+		    ("zone_try_fetch_bucket: Returning an empty bucket."));
+		TAILQ_REMOVE(&zdom->uzd_buckets, bucket, ub_link);
+		zdom->uzd_nitems -= bucket->ub_cnt;
+		if (zdom->uzd_imin > zdom->uzd_nitems)
+			zdom->uzd_imin = zdom->uzd_nitems;
+	}
+	return (bucket);
+}
+
+/*
+ * Cache a full bucket in a domain.  Buckets that belong to the working set
+ * go to the head of the list and raise the high water mark; buckets pulled
+ * out of idle per-CPU caches go to the tail where they are trimmed first.
+ * Expects a locked zone.
+ */
+static void
+zone_put_bucket(uma_zone_t zone, uma_zone_domain_t zdom, uma_bucket_t bucket,
+    bool ws)
+{
+
+	ZONE_LOCK_ASSERT(zone);
+	KASSERT(bucket->ub_cnt != 0,
+	    ("zone_put_bucket: Caching an empty bucket."));
+	if (ws)
+		TAILQ_INSERT_HEAD(&zdom->uzd_buckets, bucket, ub_link);
+	else
+		TAILQ_INSERT_TAIL(&zdom->uzd_buckets, bucket, ub_link);
+	zdom->uzd_nitems += bucket->ub_cnt;
+	if (ws && zdom->uzd_imax < zdom->uzd_nitems)
+		zdom->uzd_imax = zdom->uzd_nitems;
+}
+
+/*
+ * Fold the water marks of the period that just ended into the domain's
+ * working-set estimate and start a new period.  The estimate is a moving
+ * average weighted towards the latest period so that a burst is followed
+ * quickly while a single quiet period does not release everything.
+ */
+static void
+zone_domain_update_wss(uma_zone_domain_t zdom)
+{
+	long wss;
+
+	MPASS(zdom->uzd_imax >= zdom->uzd_imin);
+	wss = zdom->uzd_imax - zdom->uzd_imin;
+	zdom->uzd_imax = zdom->uzd_imin = zdom->uzd_nitems;
+	zdom->uzd_wss = (4 * wss + zdom->uzd_wss) / 5;
+}
+
 /*
  * Routine called by timeout which is used to fire off some time interval
  * based calculations.  (stats, hash size, etc.)
@@ -519,8 +631,36 @@ keg_timeout(uma_keg_t keg)
 static void
 zone_timeout(uma_zone_t zone)
 {
+	int i;
 
 	zone_foreach_keg(zone, &keg_timeout);
+
+	ZONE_LOCK(zone);
+	for (i = 0; i < vm_ndomains; i++)
+		zone_domain_update_wss(&zone->uz_domain[i]);
+
+	/*
+	 * Bucket sizes grow on lock contention in the allocation and free
+	 * paths.  Give one step back for every period in which the zone lock
+	 * was not contended at all.
+	 */
+	if (zone->uz_lockfails == zone->uz_lastfails &&
+	    zone->uz_count > zone->uz_count_min)
+		zone->uz_count--;
+	zone->uz_lastfails = zone->uz_lockfails;
+
+	/*
+	 * Trim the idle part of the bucket cache.  This drops the zone lock,
+	 * so interlock with zone_drain_wait() and zone_dtor() the same way
+	 * it does, and leave the zone alone if a drain is in progress.
+	 */
+	if (zone_trim && (zone->uz_flags & UMA_ZFLAG_DRAINING) == 0) {
+		zone->uz_flags |= UMA_ZFLAG_DRAINING;
+		bucket_cache_reclaim(zone, false);
+		zone->uz_flags &= ~UMA_ZFLAG_DRAINING;
+		wakeup(zone);
+	}
+	ZONE_UNLOCK(zone);
 }
 
 /*
@@ -550,7 +690,7 @@ hash_alloc(struct uma_hash *hash)
 	} else {
 		alloc = sizeof(hash->uh_slab_hash[0]) * UMA_HASH_SIZE_INIT;
 		hash->uh_slab_hash = zone_alloc_item(hashzone, NULL,
-		    M_WAITOK);
+		    UMA_ANYDOMAIN, M_WAITOK);
 		hash->uh_hashsize = UMA_HASH_SIZE_INIT;
 	}
 	if (hash->uh_slab_hash) {
@@ -695,7 +835,7 @@ cache_drain(uma_zone_t zone)
 		cache->uc_allocbucket = cache->uc_freebucket = NULL;
 	}
 	ZONE_LOCK(zone);
-	bucket_cache_drain(zone);
+	bucket_cache_reclaim(zone, true);
 	ZONE_UNLOCK(zone);
 }
 
@@ -716,6 +856,7 @@ cache_drain_safe_cpu(uma_zone_t zone)
 {
 	uma_cache_t cache;
 	uma_bucket_t b1, b2;
+	uma_zone_domain_t zdom;
 
 	if (zone->uz_flags & UMA_ZFLAG_INTERNAL)
 		return;
@@ -724,18 +865,19 @@ cache_drain_safe_cpu(uma_zone_t zone)
 	ZONE_LOCK(zone);
 	critical_enter();
 	cache = &zone->uz_cpu[curcpu];
+	zdom = zone_dom(zone, zone_domain(zone));
 	if (cache->uc_allocbucket) {
 		if (cache->uc_allocbucket->ub_cnt != 0)
-			LIST_INSERT_HEAD(&zone->uz_buckets,
-			    cache->uc_allocbucket, ub_link);
+			zone_put_bucket(zone, zdom, cache->uc_allocbucket,
+			    false);
 		else
 			b1 = cache->uc_allocbucket;
 		cache->uc_allocbucket = NULL;
 	}
 	if (cache->uc_freebucket) {
 		if (cache->uc_freebucket->ub_cnt != 0)
-			LIST_INSERT_HEAD(&zone->uz_buckets,
-			    cache->uc_freebucket, ub_link);
+			zone_put_bucket(zone, zdom, cache->uc_freebucket,
+			    false);
 		else
 			b2 = cache->uc_freebucket;
 		cache->uc_freebucket = NULL;
@@ -784,30 +926,50 @@ cache_drain_safe(uma_zone_t zone)
 }
 
 /*
- * Drain the cached buckets from a zone.  Expects a locked zone on entry.
+ * Release cached buckets from a zone.  If drain is set, all of them are
+ * freed, we just keep two per cpu (alloc/free).  Otherwise only the least
+ * recently used buckets in excess of the working-set estimate are.
+ * Expects a locked zone on entry.
  */
 static void
-bucket_cache_drain(uma_zone_t zone)
+bucket_cache_reclaim(uma_zone_t zone, bool drain)
 {
+	uma_zone_domain_t zdom;
 	uma_bucket_t bucket;
+	long target;
+	int i;
 
-	/*
-	 * Drain the bucket queues and free the buckets, we just keep two per
-	 * cpu (alloc/free).
-	 */
-	while ((bucket = LIST_FIRST(&zone->uz_buckets)) != NULL) {
-		LIST_REMOVE(bucket, ub_link);
-		ZONE_UNLOCK(zone);
-		bucket_drain(zone, bucket);
-		bucket_free(zone, bucket, NULL);
-		ZONE_LOCK(zone);
+	for (i = 0; i < vm_ndomains; i++) {
+		zdom = &zone->uz_domain[i];
+
+		/*
+		 * When trimming, keep the working set as well as anything
+		 * cached since the low water mark of the current period.
+		 */
+		for (;;) {
+			target = drain ? 0 : lmax(zdom->uzd_wss,
+			    zdom->uzd_nitems - zdom->uzd_imin);
+			if (zdom->uzd_nitems <= target)
+				break;
+			bucket = TAILQ_LAST(&zdom->uzd_buckets, uma_bucketlist);
+			if (bucket == NULL)
+				break;
+			TAILQ_REMOVE(&zdom->uzd_buckets, bucket, ub_link);
+			zdom->uzd_nitems -= bucket->ub_cnt;
+			if (zdom->uzd_imin > zdom->uzd_nitems)
+				zdom->uzd_imin = zdom->uzd_nitems;
+			ZONE_UNLOCK(zone);
+			bucket_drain(zone, bucket);
+			bucket_free(zone, bucket, NULL);
+			ZONE_LOCK(zone);
+		}
 	}
 
 	/*
 	 * Shrink further bucket sizes.  Price of single zone lock collision
 	 * is probably lower then price of global cache drain.
 	 */
-	if (zone->uz_count > zone->uz_count_min)
+	if (drain && zone->uz_count > zone->uz_count_min)
 		zone->uz_count--;
 }
 
@@ -847,6 +1009,7 @@ keg_drain(uma_keg_t keg)
 	struct slabhead freeslabs = { 0 };
 	uma_slab_t slab;
 	uma_slab_t n;
+	int i;
 
 	/*
 	 * We don't want to take pages from statically allocated kegs at this
@@ -862,26 +1025,29 @@ keg_drain(uma_keg_t keg)
 	if (keg->uk_free == 0)
 		goto finished;
 
-	slab = LIST_FIRST(&keg->uk_free_slab);
-	while (slab) {
-		n = LIST_NEXT(slab, us_link);
+	for (i = 0; i < vm_ndomains; i++) {
+		slab = LIST_FIRST(&keg->uk_domain[i].ud_free_slab);
+		while (slab) {
+			n = LIST_NEXT(slab, us_link);
 
-		/* We have no where to free these to */
-		if (slab->us_flags & UMA_SLAB_BOOT) {
-			slab = n;
-			continue;
-		}
+			/* We have no where to free these to */
+			if (slab->us_flags & UMA_SLAB_BOOT) {
+				slab = n;
+				continue;
+			}
 
-		LIST_REMOVE(slab, us_link);
-		keg->uk_pages -= keg->uk_ppera;
-		keg->uk_free -= keg->uk_ipers;
+			LIST_REMOVE(slab, us_link);
+			keg->uk_pages -= keg->uk_ppera;
+			keg->uk_free -= keg->uk_ipers;
 
-		if (keg->uk_flags & UMA_ZONE_HASH)
-			UMA_HASH_REMOVE(&keg->uk_hash, slab, slab->us_data);
+			if (keg->uk_flags & UMA_ZONE_HASH)
+				UMA_HASH_REMOVE(&keg->uk_hash, slab,
+				    slab->us_data);
 
-		SLIST_INSERT_HEAD(&freeslabs, slab, us_hlink);
+			SLIST_INSERT_HEAD(&freeslabs, slab, us_hlink);
 
-		slab = n;
+			slab = n;
+		}
 	}
 finished:
 	KEG_UNLOCK(keg);
@@ -909,7 +1075,7 @@ zone_drain_wait(uma_zone_t zone, int waitok)
 		msleep(zone, zone->uz_lockptr, PVM, "zonedrain", 1);
 	}
 	zone->uz_flags |= UMA_ZFLAG_DRAINING;
-	bucket_cache_drain(zone);
+	bucket_cache_reclaim(zone, true);
 	ZONE_UNLOCK(zone);
 	/*
 	 * The DRAINING flag protects us from being freed while
@@ -935,6 +1101,7 @@ zone_drain(uma_zone_t zone)
  * Allocate a new slab for a keg.  This does not insert the slab onto a list.
  *
  * Arguments:
+ *	domain  Preferred memory domain, or UMA_ANYDOMAIN.
  *	wait  Shall we wait?
  *
  * Returns:
@@ -942,7 +1109,7 @@ zone_drain(uma_zone_t zone)
  *	caller specified M_NOWAIT.
  */
 static uma_slab_t
-keg_alloc_slab(uma_keg_t keg, uma_zone_t zone, int wait)
+keg_alloc_slab(uma_keg_t keg, uma_zone_t zone, int domain, int wait)
 {
 	uma_slabrefcnt_t slabref;
 	uma_alloc allocf;
@@ -962,7 +1129,8 @@ keg_alloc_slab(uma_keg_t keg, uma_zone_t zone, int wait)
 	KEG_UNLOCK(keg);
 
 	if (keg->uk_flags & UMA_ZONE_OFFPAGE) {
-		slab = zone_alloc_item(keg->uk_slabzone, NULL, wait);
+		slab = zone_alloc_item(keg->uk_slabzone, NULL, domain,
+		    wait);
 		if (slab == NULL)
 			goto out;
 	}
@@ -982,8 +1150,14 @@ keg_alloc_slab(uma_keg_t keg, uma_zone_t zone, int wait)
 	if (keg->uk_flags & UMA_ZONE_NODUMP)
 		wait |= M_NODUMP;
 
-	/* zone is passed for legacy reasons. */
-	mem = allocf(zone, keg->uk_ppera * PAGE_SIZE, &flags, wait);
+	/*
+	 * zone is passed for legacy reasons.  The page allocators prefer the
+	 * requested domain but fall back to the others when it is short of
+	 * memory; the slab records where its pages ended up.
+	 */
+	if (vm_ndomains == 1)
+		domain = UMA_ANYDOMAIN;
+	mem = allocf(zone, keg->uk_ppera * PAGE_SIZE, domain, &flags, wait);
 	if (mem == NULL) {
 		if (keg->uk_flags & UMA_ZONE_OFFPAGE)
 			zone_free_item(keg->uk_slabzone, slab, NULL, SKIP_NONE);
@@ -1003,6 +1177,12 @@ keg_alloc_slab(uma_keg_t keg, uma_zone_t zone, int wait)
 	slab->us_data = mem;
 	slab->us_freecount = keg->uk_ipers;
 	slab->us_flags = flags;
+	slab->us_domain = 0;
+#if MAXMEMDOM > 1
+	if (vm_ndomains > 1 && (flags & UMA_SLAB_BOOT) == 0)
+		slab->us_domain = vm_phys_domidx(PHYS_TO_VM_PAGE(
+		    pmap_kextract((vm_offset_t)mem)));
+#endif
 	BIT_FILL(SLAB_SETSIZE, &slab->us_free);
 #ifdef INVARIANTS
 	BIT_ZERO(SLAB_SETSIZE, &slab->us_debugfree);
@@ -1044,7 +1224,8 @@ out:
  * the VM is ready.
  */
 static void *
-startup_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
+startup_alloc(uma_zone_t zone, vm_size_t bytes, int domain, uint8_t *pflag,
+    int wait)
 {
 	uma_keg_t keg;
 	uma_slab_t tmps;
@@ -1089,7 +1270,7 @@ startup_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
 #else
 	keg->uk_allocf = page_alloc;
 #endif
-	return keg->uk_allocf(zone, bytes, pflag, wait);
+	return keg->uk_allocf(zone, bytes, domain, pflag, wait);
 }
 
 /*
@@ -1097,6 +1278,7 @@ startup_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
  *
  * Arguments:
  *	bytes  The number of bytes requested
+ *	domain  Preferred memory domain, or UMA_ANYDOMAIN.
  *	wait  Shall we wait?
  *
  * Returns:
@@ -1104,12 +1286,13 @@ startup_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
  *	NULL if M_NOWAIT is set.
  */
 static void *
-page_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
+page_alloc(uma_zone_t zone, vm_size_t bytes, int domain, uint8_t *pflag,
+    int wait)
 {
 	void *p;	/* Returned page */
 
 	*pflag = UMA_SLAB_KMEM;
-	p = (void *) kmem_malloc(kmem_arena, bytes, wait);
+	p = (void *) kmem_malloc_domain(kmem_arena, bytes, domain, wait);
 
 	return (p);
 }
@@ -1119,6 +1302,7 @@ page_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
  *
  * Arguments:
  *	bytes  The number of bytes requested
+ *	domain Preferred memory domain, or UMA_ANYDOMAIN
  *	wait   Shall we wait?
  *
  * Returns:
@@ -1126,7 +1310,8 @@ page_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag, int wait)
  *	NULL if M_NOWAIT is set.
  */
 static void *
-noobj_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *flags, int wait)
+noobj_alloc(uma_zone_t zone, vm_size_t bytes, int domain, uint8_t *flags,
+    int wait)
 {
 	TAILQ_HEAD(, vm_page) alloctail;
 	u_long npages;
@@ -1139,7 +1324,7 @@ noobj_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *flags, int wait)
 
 	npages = howmany(bytes, PAGE_SIZE);
 	while (npages > 0) {
-		p = vm_page_alloc(NULL, 0, VM_ALLOC_INTERRUPT |
+		p = vm_page_alloc_domain(NULL, 0, domain, VM_ALLOC_INTERRUPT |
 		    VM_ALLOC_WIRED | VM_ALLOC_NOOBJ);
 		if (p != NULL) {
 			/*
@@ -1568,8 +1753,11 @@ zone_ctor(void *mem, int size, void *udata, int flags)
 	uma_zone_t zone = mem;
 	uma_zone_t z;
 	uma_keg_t keg;
+	int i;
 
 	bzero(zone, size);
+	for (i = 0; i < MAXMEMDOM; i++)
+		TAILQ_INIT(&zone->uz_domain[i].uzd_buckets);
 	zone->uz_name = arg->name;
 	zone->uz_ctor = arg->ctor;
 	zone->uz_dtor = arg->dtor;
@@ -1678,6 +1866,7 @@ out:
 	else
 		zone->uz_count = BUCKET_MAX;
 	zone->uz_count_min = zone->uz_count;
+	zone->uz_count_max = BUCKET_MAX;
 
 	return (0);
 }
@@ -1761,7 +1950,8 @@ zone_dtor(void *arg, int size, void *udata)
 }
 
 /*
- * Traverses every zone in the system and calls a callback
+ * Traverses every zone in the system, including the cache zones that have
+ * no keg, and calls a callback
  *
  * Arguments:
  *	zfunc  A pointer to a function which accepts a zone
@@ -1781,6 +1971,8 @@ zone_foreach(void (*zfunc)(uma_zone_t))
 		LIST_FOREACH(zone, &keg->uk_zones, uz_link)
 			zfunc(zone);
 	}
+	LIST_FOREACH(zone, &uma_cachezones, uz_link)
+		zfunc(zone);
 	rw_runlock(&uma_rwlock);
 }
 
@@ -1918,7 +2110,7 @@ uma_kcreate(uma_zone_t zone, size_t size, uma_init uminit, uma_fini fini,
 	args.align = (align == UMA_ALIGN_CACHE) ? uma_align_cache : align;
 	args.flags = flags;
 	args.zone = zone;
-	return (zone_alloc_item(kegs, &args, M_WAITOK));
+	return (zone_alloc_item(kegs, &args, UMA_ANYDOMAIN, M_WAITOK));
 }
 
 /* See uma.h */
@@ -1972,7 +2164,7 @@ uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
 		sx_slock(&uma_drain_lock);
 		locked = true;
 	}
-	res = zone_alloc_item(zones, &args, M_WAITOK);
+	res = zone_alloc_item(zones, &args, UMA_ANYDOMAIN, M_WAITOK);
 	if (locked)
 		sx_sunlock(&uma_drain_lock);
 	return (res);
@@ -2007,7 +2199,7 @@ uma_zsecond_create(char *name, uma_ctor ctor, uma_dtor dtor,
 		locked = true;
 	}
 	/* XXX Attaches only one keg of potentially many. */
-	res = zone_alloc_item(zones, &args, M_WAITOK);
+	res = zone_alloc_item(zones, &args, UMA_ANYDOMAIN, M_WAITOK);
 	if (locked)
 		sx_sunlock(&uma_drain_lock);
 	return (res);
@@ -2034,7 +2226,7 @@ uma_zcache_create(char *name, int size, uma_ctor ctor, uma_dtor dtor,
 	args.align = 0;
 	args.flags = flags;
 
-	return (zone_alloc_item(zones, &args, M_WAITOK));
+	return (zone_alloc_item(zones, &args, UMA_ANYDOMAIN, M_WAITOK));
 }
 
 static void
@@ -2140,7 +2332,9 @@ uma_zalloc_arg(uma_zone_t zone, void *udata, int flags)
 	void *item;
 	uma_cache_t cache;
 	uma_bucket_t bucket;
+	uma_zone_domain_t zdom;
 	int lockfail;
+	int domain;
 	int cpu;
 
 	/* Enable entropy collection for RANDOM_ENABLE_UMA kernel option */
@@ -2248,8 +2442,10 @@ zalloc_start:
 		bucket_free(zone, bucket, udata);
 
 	/* Short-circuit for zones without buckets and low memory. */
-	if (zone->uz_count == 0 || bucketdisable)
+	if (zone->uz_count == 0 || bucketdisable) {
+		domain = zone_domain(zone);
 		goto zalloc_item;
+	}
 
 	/*
 	 * Attempt to retrieve the item from the per-CPU cache has failed, so
@@ -2285,13 +2481,11 @@ zalloc_start:
 	}
 
 	/*
-	 * Check the zone's cache of buckets.
+	 * Check the zone's cache of buckets for our domain.
 	 */
-	if ((bucket = LIST_FIRST(&zone->uz_buckets)) != NULL) {
-		KASSERT(bucket->ub_cnt != 0,
-		    ("uma_zalloc_arg: Returning an empty bucket."));
-
-		LIST_REMOVE(bucket, ub_link);
+	domain = zone_domain(zone);
+	zdom = zone_dom(zone, domain);
+	if ((bucket = zone_try_fetch_bucket(zone, zdom)) != NULL) {
 		cache->uc_allocbucket = bucket;
 		ZONE_UNLOCK(zone);
 		goto zalloc_start;
@@ -2303,8 +2497,11 @@ zalloc_start:
 	 * We bump the uz count when the cache size is insufficient to
 	 * handle the working set.
 	 */
-	if (lockfail && zone->uz_count < BUCKET_MAX)
-		zone->uz_count++;
+	if (lockfail) {
+		zone->uz_lockfails++;
+		if (zone->uz_count < zone->uz_count_max)
+			zone->uz_count++;
+	}
 	ZONE_UNLOCK(zone);
 
 	/*
@@ -2312,7 +2509,7 @@ zalloc_start:
 	 * works we'll restart the allocation from the begining and it
 	 * will use the just filled bucket.
 	 */
-	bucket = zone_alloc_bucket(zone, udata, flags);
+	bucket = zone_alloc_bucket(zone, udata, domain, flags);
 	if (bucket != NULL) {
 		ZONE_LOCK(zone);
 		critical_enter();
@@ -2326,7 +2523,7 @@ zalloc_start:
 		if (cache->uc_allocbucket == NULL)
 			cache->uc_allocbucket = bucket;
 		else
-			LIST_INSERT_HEAD(&zone->uz_buckets, bucket, ub_link);
+			zone_put_bucket(zone, zdom, bucket, true);
 		ZONE_UNLOCK(zone);
 		goto zalloc_start;
 	}
@@ -2339,15 +2536,197 @@ zalloc_start:
 #endif
 
 zalloc_item:
-	item = zone_alloc_item(zone, udata, flags);
+	item = zone_alloc_item(zone, udata, domain, flags);
 
 	return (item);
 }
 
+/* See uma.h */
+int
+uma_zalloc_bulk(uma_zone_t zone, void **items, int count, void *udata,
+    int flags)
+{
+	uma_cache_t cache;
+	uma_bucket_t bucket;
+	uma_zone_domain_t zdom;
+	int domain, i, m, n, nimport;
+
+	/* Enable entropy collection for RANDOM_ENABLE_UMA kernel option */
+	random_harvest_fast_uma(&zone, sizeof(zone), 1, RANDOM_UMA);
+
+	CTR4(KTR_UMA, "uma_zalloc_bulk thread %x zone %s count %d flags %d",
+	    curthread, zone->uz_name, count, flags);
+
+	if (flags & M_WAITOK) {
+		WITNESS_WARN(WARN_GIANTOK | WARN_SLEEPOK, NULL,
+		    "uma_zalloc_bulk: zone \"%s\"", zone->uz_name);
+	}
+	KASSERT(curthread->td_critnest == 0 || SCHEDULER_STOPPED(),
+	    ("uma_zalloc_bulk: called with spinlock or critical section held"));
+
+#ifdef DEBUG_MEMGUARD
+	if (memguard_cmp_zone(zone)) {
+		for (n = 0; n < count; n++)
+			if ((items[n] = uma_zalloc_arg(zone, udata,
+			    flags)) == NULL)
+				break;
+		return (n);
+	}
+#endif
+	n = 0;
+
+	/*
+	 * Take runs of items from the per-CPU cache, switching to the free
+	 * bucket once the alloc bucket runs dry, just as the single item
+	 * path does.  Constructors are run later, outside of the critical
+	 * section.
+	 */
+	critical_enter();
+	cache = &zone->uz_cpu[curcpu];
+	while (n < count) {
+		bucket = cache->uc_allocbucket;
+		if (bucket == NULL || bucket->ub_cnt == 0) {
+			bucket = cache->uc_freebucket;
+			if (bucket == NULL || bucket->ub_cnt == 0)
+				break;
+			cache->uc_freebucket = cache->uc_allocbucket;
+			cache->uc_allocbucket = bucket;
+		}
+		m = MIN(bucket->ub_cnt, count - n);
+		bucket->ub_cnt -= m;
+		bcopy(&bucket->ub_bucket[bucket->ub_cnt], &items[n],
+		    m * sizeof(void *));
+#ifdef INVARIANTS
+		bzero(&bucket->ub_bucket[bucket->ub_cnt], m * sizeof(void *));
+#endif
+		cache->uc_allocs += m;
+		n += m;
+	}
+	domain = zone_domain(zone);
+	critical_exit();
+
+	/*
+	 * Then consume whole buckets from the zone's cache.  A bucket that is
+	 * not used up goes back to the head of the cache.
+	 */
+	while (n < count && zone->uz_count != 0 && !bucketdisable) {
+		zdom = zone_dom(zone, domain);
+		ZONE_LOCK(zone);
+		bucket = zone_try_fetch_bucket(zone, zdom);
+		ZONE_UNLOCK(zone);
+		if (bucket == NULL)
+			break;
+		m = MIN(bucket->ub_cnt, count - n);
+		bucket->ub_cnt -= m;
+		bcopy(&bucket->ub_bucket[bucket->ub_cnt], &items[n],
+		    m * sizeof(void *));
+#ifdef INVARIANTS
+		bzero(&bucket->ub_bucket[bucket->ub_cnt], m * sizeof(void *));
+#endif
+		atomic_add_long(&zone->uz_allocs, m);
+		n += m;
+		if (bucket->ub_cnt != 0) {
+			ZONE_LOCK(zone);
+			zone_put_bucket(zone, zdom, bucket, true);
+			ZONE_UNLOCK(zone);
+		} else
+			bucket_free(zone, bucket, udata);
+	}
+
+	/*
+	 * Import whatever is still missing straight from the backend and
+	 * initialize it, as zone_alloc_item() would for a single item.
+	 */
+	while (n < count) {
+		nimport = zone->uz_import(zone->uz_arg, &items[n], count - n,
+		    domain, flags);
+		if (nimport == 0)
+			break;
+		if (zone->uz_init != NULL) {
+			for (i = 0; i < nimport; i++)
+				if (zone->uz_init(items[n + i], zone->uz_size,
+				    flags) != 0)
+					break;
+			/*
+			 * If we couldn't initialize the whole run, put the
+			 * rest back onto the freelist.
+			 */
+			if (i != nimport) {
+				zone->uz_release(zone->uz_arg, &items[n + i],
+				    nimport - i);
+				atomic_add_long(&zone->uz_allocs, i);
+				n += i;
+				break;
+			}
+		}
+		atomic_add_long(&zone->uz_allocs, nimport);
+		n += nimport;
+	}
+
+	/*
+	 * Construct the items, compacting the array over any whose ctor
+	 * fails.
+	 */
+	for (i = m = 0; i < n; i++) {
+		if (zone->uz_ctor != NULL &&
+		    zone->uz_ctor(items[i], zone->uz_size, udata, flags) != 0) {
+			zone_free_item(zone, items[i], udata, SKIP_DTOR);
+			continue;
+		}
+#ifdef INVARIANTS
+		uma_dbg_alloc(zone, NULL, items[i]);
+#endif
+		if (flags & M_ZERO)
+			uma_zero_item(items[i], zone);
+		items[m++] = items[i];
+	}
+	if (m != count)
+		atomic_add_long(&zone->uz_fails, 1);
+
+	return (m);
+}
+
+/*
+ * Find a slab with some space in the given domain, or in any domain
+ * starting from the given one if anydom is set.  Prefer slabs that are
+ * partially used over those that are totally free.  This helps to reduce
+ * fragmentation.
+ */
+static uma_slab_t
+keg_first_slab(uma_keg_t keg, int domain, int anydom)
+{
+	uma_domain_t dom;
+	uma_slab_t slab;
+	int i;
+
+	mtx_assert(&keg->uk_lock, MA_OWNED);
+	for (i = 0; i < vm_ndomains; i++) {
+		dom = &keg->uk_domain[(domain + i) % vm_ndomains];
+		if ((slab = LIST_FIRST(&dom->ud_part_slab)) != NULL)
+			return (slab);
+		if ((slab = LIST_FIRST(&dom->ud_free_slab)) != NULL) {
+			LIST_REMOVE(slab, us_link);
+			LIST_INSERT_HEAD(&dom->ud_part_slab, slab, us_link);
+			return (slab);
+		}
+		if (!anydom)
+			break;
+	}
+	return (NULL);
+}
+
+/*
+ * Fetch a slab with free items from the keg, allocating a new one if
+ * needed.  A first-touch request only takes slabs of its own domain as long
+ * as new memory may be allocated there; a round-robin request
+ * (UMA_ANYDOMAIN) starts at the next domain in turn and takes whatever it
+ * finds.
+ */
 static uma_slab_t
-keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int flags)
+keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int domain, int flags)
 {
 	uma_slab_t slab;
+	int anydom;
 	int reserve;
 
 	mtx_assert(&keg->uk_lock, MA_OWNED);
@@ -2356,23 +2735,23 @@ keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int flags)
 	if ((flags & M_USE_RESERVE) == 0)
 		reserve = keg->uk_reserve;
 
+	anydom = (domain == UMA_ANYDOMAIN);
+	if (anydom)
+		domain = keg->uk_cursor++ % vm_ndomains;
+
 	for (;;) {
 		/*
-		 * Find a slab with some space.  Prefer slabs that are partially
-		 * used over those that are totally full.  This helps to reduce
-		 * fragmentation.
+		 * A first-touch request settles for another domain once it
+		 * may not allocate memory for its own.
 		 */
 		if (keg->uk_free > reserve) {
-			if (!LIST_EMPTY(&keg->uk_part_slab)) {
-				slab = LIST_FIRST(&keg->uk_part_slab);
-			} else {
-				slab = LIST_FIRST(&keg->uk_free_slab);
-				LIST_REMOVE(slab, us_link);
-				LIST_INSERT_HEAD(&keg->uk_part_slab, slab,
-				    us_link);
+			slab = keg_first_slab(keg, domain, anydom ||
+			    (flags & M_NOVM) != 0 || (keg->uk_maxpages &&
+			    keg->uk_pages >= keg->uk_maxpages));
+			if (slab != NULL) {
+				MPASS(slab->us_keg == keg);
+				return (slab);
 			}
-			MPASS(slab->us_keg == keg);
-			return (slab);
 		}
 
 		/*
@@ -2398,7 +2777,7 @@ keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int flags)
 			msleep(keg, &keg->uk_lock, PVM, "keglimit", 0);
 			continue;
 		}
-		slab = keg_alloc_slab(keg, zone, flags);
+		slab = keg_alloc_slab(keg, zone, domain, flags);
 		/*
 		 * If we got a slab here it's safe to mark it partially used
 		 * and return.  We assume that the caller is going to remove
@@ -2406,7 +2785,8 @@ keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int flags)
 		 */
 		if (slab) {
 			MPASS(slab->us_keg == keg);
-			LIST_INSERT_HEAD(&keg->uk_part_slab, slab, us_link);
+			LIST_INSERT_HEAD(&keg->uk_domain[slab->us_domain].
+			    ud_part_slab, slab, us_link);
 			return (slab);
 		}
 		/*
@@ -2420,7 +2800,7 @@ keg_fetch_slab(uma_keg_t keg, uma_zone_t zone, int flags)
 }
 
 static uma_slab_t
-zone_fetch_slab(uma_zone_t zone, uma_keg_t keg, int flags)
+zone_fetch_slab(uma_zone_t zone, uma_keg_t keg, int domain, int flags)
 {
 	uma_slab_t slab;
 
@@ -2430,7 +2810,7 @@ zone_fetch_slab(uma_zone_t zone, uma_keg_t keg, int flags)
 	}
 
 	for (;;) {
-		slab = keg_fetch_slab(keg, zone, flags);
+		slab = keg_fetch_slab(keg, zone, domain, flags);
 		if (slab)
 			return (slab);
 		if (flags & (M_NOWAIT | M_NOVM))
@@ -2447,7 +2827,7 @@ zone_fetch_slab(uma_zone_t zone, uma_keg_t keg, int flags)
  * The last pointer is used to seed the search.  It is not required.
  */
 static uma_slab_t
-zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last, int rflags)
+zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last, int domain, int rflags)
 {
 	uma_klink_t klink;
 	uma_slab_t slab;
@@ -2467,7 +2847,7 @@ zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last, int rflags)
 	 * the search.
 	 */
 	if (last != NULL) {
-		slab = keg_fetch_slab(last, zone, flags);
+		slab = keg_fetch_slab(last, zone, domain, flags);
 		if (slab)
 			return (slab);
 		KEG_UNLOCK(last);
@@ -2488,7 +2868,8 @@ zone_fetch_slab_multi(uma_zone_t zone, uma_keg_t last, int rflags)
 			keg = klink->kl_keg;
 			KEG_LOCK(keg);
 			if ((keg->uk_flags & UMA_ZFLAG_FULL) == 0) {
-				slab = keg_fetch_slab(keg, zone, flags);
+				slab = keg_fetch_slab(keg, zone, domain,
+				    flags);
 				if (slab)
 					return (slab);
 			}
@@ -2539,14 +2920,15 @@ slab_alloc_item(uma_keg_t keg, uma_slab_t slab)
 	/* Move this slab to the full list */
 	if (slab->us_freecount == 0) {
 		LIST_REMOVE(slab, us_link);
-		LIST_INSERT_HEAD(&keg->uk_full_slab, slab, us_link);
+		LIST_INSERT_HEAD(&keg->uk_domain[slab->us_domain].ud_full_slab,
+		    slab, us_link);
 	}
 
 	return (item);
 }
 
 static int
-zone_import(uma_zone_t zone, void **bucket, int max, int flags)
+zone_import(uma_zone_t zone, void **bucket, int max, int domain, int flags)
 {
 	uma_slab_t slab;
 	uma_keg_t keg;
@@ -2556,7 +2938,7 @@ zone_import(uma_zone_t zone, void **bucket, int max, int flags)
 	keg = NULL;
 	/* Try to keep the buckets totally full */
 	for (i = 0; i < max; ) {
-		if ((slab = zone->uz_slab(zone, keg, flags)) == NULL)
+		if ((slab = zone->uz_slab(zone, keg, domain, flags)) == NULL)
 			break;
 		keg = slab->us_keg;
 		while (slab->us_freecount && i < max) { 
@@ -2575,7 +2957,7 @@ zone_import(uma_zone_t zone, void **bucket, int max, int flags)
 }
 
 static uma_bucket_t
-zone_alloc_bucket(uma_zone_t zone, void *udata, int flags)
+zone_alloc_bucket(uma_zone_t zone, void *udata, int domain, int flags)
 {
 	uma_bucket_t bucket;
 	int max;
@@ -2587,7 +2969,7 @@ zone_alloc_bucket(uma_zone_t zone, void *udata, int flags)
 
 	max = MIN(bucket->ub_entries, zone->uz_count);
 	bucket->ub_cnt = zone->uz_import(zone->uz_arg, bucket->ub_bucket,
-	    max, flags);
+	    max, domain, flags);
 
 	/*
 	 * Initialize the memory if necessary.
@@ -2629,6 +3011,7 @@ zone_alloc_bucket(uma_zone_t zone, void *udata, int flags)
  * Arguments
  *	zone   The zone to alloc for.
  *	udata  The data to be passed to the constructor.
+ *	domain The preferred memory domain, or UMA_ANYDOMAIN.
  *	flags  M_WAITOK, M_NOWAIT, M_ZERO.
  *
  * Returns
@@ -2637,7 +3020,7 @@ zone_alloc_bucket(uma_zone_t zone, void *udata, int flags)
  */
 
 static void *
-zone_alloc_item(uma_zone_t zone, void *udata, int flags)
+zone_alloc_item(uma_zone_t zone, void *udata, int domain, int flags)
 {
 	void *item;
 
@@ -2646,7 +3029,7 @@ zone_alloc_item(uma_zone_t zone, void *udata, int flags)
 #ifdef UMA_DEBUG_ALLOC
 	printf("INTERNAL: Allocating one item from %s(%p)\n", zone->uz_name, zone);
 #endif
-	if (zone->uz_import(zone->uz_arg, &item, 1, flags) != 1)
+	if (zone->uz_import(zone->uz_arg, &item, 1, domain, flags) != 1)
 		goto fail;
 	atomic_add_long(&zone->uz_allocs, 1);
 
@@ -2687,6 +3070,7 @@ uma_zfree_arg(uma_zone_t zone, void *item, void *udata)
 {
 	uma_cache_t cache;
 	uma_bucket_t bucket;
+	uma_zone_domain_t zdom;
 	int lockfail;
 	int cpu;
 
@@ -2809,9 +3193,8 @@ zfree_start:
 		printf("uma_zfree: Putting old bucket on the free list.\n");
 #endif
 		/* ub_cnt is pointing to the last free item */
-		KASSERT(bucket->ub_cnt != 0,
-		    ("uma_zfree: Attempting to insert an empty bucket onto the full list.\n"));
-		LIST_INSERT_HEAD(&zone->uz_buckets, bucket, ub_link);
+		zdom = zone_dom(zone, zone_domain(zone));
+		zone_put_bucket(zone, zdom, bucket, true);
 	}
 
 	/* We are no longer associated with this CPU. */
@@ -2821,8 +3204,11 @@ zfree_start:
 	 * We bump the uz count when the cache size is insufficient to
 	 * handle the working set.
 	 */
-	if (lockfail && zone->uz_count < BUCKET_MAX)
-		zone->uz_count++;
+	if (lockfail) {
+		zone->uz_lockfails++;
+		if (zone->uz_count < zone->uz_count_max)
+			zone->uz_count++;
+	}
 	ZONE_UNLOCK(zone);
 
 #ifdef UMA_DEBUG_ALLOC
@@ -2855,21 +3241,130 @@ zfree_item:
 	return;
 }
 
+/* See uma.h */
+void
+uma_zfree_bulk(uma_zone_t zone, void **items, int count, void *udata)
+{
+	uma_cache_t cache;
+	uma_bucket_t bucket, newbucket;
+	int i, m, n;
+
+	/* Enable entropy collection for RANDOM_ENABLE_UMA kernel option */
+	random_harvest_fast_uma(&zone, sizeof(zone), 1, RANDOM_UMA);
+
+	CTR3(KTR_UMA, "uma_zfree_bulk thread %x zone %s count %d", curthread,
+	    zone->uz_name, count);
+
+	KASSERT(curthread->td_critnest == 0 || SCHEDULER_STOPPED(),
+	    ("uma_zfree_bulk: called with spinlock or critical section held"));
+
+#ifdef DEBUG_MEMGUARD
+	for (i = 0; i < count; i++) {
+		if (is_memguard_addr(items[i])) {
+			for (i = 0; i < count; i++)
+				uma_zfree_arg(zone, items[i], udata);
+			return;
+		}
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		KASSERT(items[i] != NULL,
+		    ("uma_zfree_bulk: NULL item at index %d", i));
+#ifdef INVARIANTS
+		if (zone->uz_flags & UMA_ZONE_MALLOC)
+			uma_dbg_free(zone, udata, items[i]);
+		else
+			uma_dbg_free(zone, NULL, items[i]);
+#endif
+		if (zone->uz_dtor != NULL)
+			zone->uz_dtor(items[i], zone->uz_size, udata);
+	}
+
+	n = 0;
+	if (zone->uz_flags & UMA_ZFLAG_FULL)
+		goto zfree_release;
+
+	/*
+	 * Fill the per-CPU buckets a run at a time, alloc bucket first for
+	 * LIFO ordering.  When both are full, hand the free bucket to the
+	 * zone and install an empty one, as uma_zfree_arg() does.
+	 */
+	critical_enter();
+	cache = &zone->uz_cpu[curcpu];
+	while (n < count) {
+		bucket = cache->uc_allocbucket;
+		if (bucket == NULL || bucket->ub_cnt >= bucket->ub_entries)
+			bucket = cache->uc_freebucket;
+		if (bucket != NULL && bucket->ub_cnt < bucket->ub_entries) {
+			m = MIN(bucket->ub_entries - bucket->ub_cnt, count - n);
+			bcopy(&items[n], &bucket->ub_bucket[bucket->ub_cnt],
+			    m * sizeof(void *));
+			bucket->ub_cnt += m;
+			cache->uc_frees += m;
+			n += m;
+			continue;
+		}
+		critical_exit();
+		if (zone->uz_count == 0 || bucketdisable)
+			goto zfree_release;
+		newbucket = bucket_alloc(zone, udata, M_NOWAIT);
+		if (newbucket == NULL)
+			goto zfree_release;
+		ZONE_LOCK(zone);
+		critical_enter();
+		cache = &zone->uz_cpu[curcpu];
+		bucket = cache->uc_freebucket;
+		if (bucket != NULL && bucket->ub_cnt == bucket->ub_entries) {
+			zone_put_bucket(zone, zone_dom(zone, zone_domain(zone)),
+			    bucket, true);
+			cache->uc_freebucket = NULL;
+		}
+		if (cache->uc_freebucket == NULL) {
+			cache->uc_freebucket = newbucket;
+			newbucket = NULL;
+		}
+		ZONE_UNLOCK(zone);
+		if (newbucket != NULL) {
+			/* We lost the race, another thread refilled it. */
+			critical_exit();
+			bucket_free(zone, newbucket, udata);
+			critical_enter();
+			cache = &zone->uz_cpu[curcpu];
+		}
+	}
+	critical_exit();
+	return;
+
+zfree_release:
+	/*
+	 * Return whatever did not fit in a bucket straight to the backend.
+	 */
+	if (n == count)
+		return;
+	if (zone->uz_fini != NULL)
+		for (i = n; i < count; i++)
+			zone->uz_fini(items[i], zone->uz_size);
+	atomic_add_long(&zone->uz_frees, count - n);
+	zone->uz_release(zone->uz_arg, &items[n], count - n);
+}
+
 static void
 slab_free_item(uma_keg_t keg, uma_slab_t slab, void *item)
 {
+	uma_domain_t dom;
 	uint8_t freei;
 
 	mtx_assert(&keg->uk_lock, MA_OWNED);
 	MPASS(keg == slab->us_keg);
 
 	/* Do we need to remove from any lists? */
+	dom = &keg->uk_domain[slab->us_domain];
 	if (slab->us_freecount+1 == keg->uk_ipers) {
 		LIST_REMOVE(slab, us_link);
-		LIST_INSERT_HEAD(&keg->uk_free_slab, slab, us_link);
+		LIST_INSERT_HEAD(&dom->ud_free_slab, slab, us_link);
 	} else if (slab->us_freecount == 0) {
 		LIST_REMOVE(slab, us_link);
-		LIST_INSERT_HEAD(&keg->uk_part_slab, slab, us_link);
+		LIST_INSERT_HEAD(&dom->ud_part_slab, slab, us_link);
 	}
 
 	/* Slab management. */
@@ -3191,7 +3686,7 @@ uma_zone_reserve_kva(uma_zone_t zone, int count)
 void
 uma_prealloc(uma_zone_t zone, int items)
 {
-	int slabs;
+	int domain, slabs;
 	uma_slab_t slab;
 	uma_keg_t keg;
 
@@ -3202,13 +3697,17 @@ uma_prealloc(uma_zone_t zone, int items)
 	slabs = items / keg->uk_ipers;
 	if (slabs * keg->uk_ipers < items)
 		slabs++;
+	/* Spread the slabs evenly over the memory domains. */
+	domain = 0;
 	while (slabs > 0) {
-		slab = keg_alloc_slab(keg, zone, M_WAITOK);
+		slab = keg_alloc_slab(keg, zone, domain, M_WAITOK);
 		if (slab == NULL)
 			break;
 		MPASS(slab->us_keg == keg);
-		LIST_INSERT_HEAD(&keg->uk_free_slab, slab, us_link);
+		LIST_INSERT_HEAD(&keg->uk_domain[slab->us_domain].ud_free_slab,
+		    slab, us_link);
 		slabs--;
+		domain = (domain + 1) % vm_ndomains;
 	}
 	KEG_UNLOCK(keg);
 }
@@ -3267,6 +3766,16 @@ uma_reclaim(void)
 	sx_xunlock(&uma_drain_lock);
 }
 
+/* See uma.h */
+void
+uma_zone_reclaim(uma_zone_t zone)
+{
+
+	if (curthread->td_pinned == 0 && !sched_is_bound(curthread))
+		cache_drain_safe(zone);
+	zone_drain(zone);
+}
+
 static int uma_reclaim_needed;
 
 void
@@ -3317,10 +3826,10 @@ uma_large_malloc(vm_size_t size, int wait)
 	uma_slab_t slab;
 	uint8_t flags;
 
-	slab = zone_alloc_item(slabzone, NULL, wait);
+	slab = zone_alloc_item(slabzone, NULL, UMA_ANYDOMAIN, wait);
 	if (slab == NULL)
 		return (NULL);
-	mem = page_alloc(NULL, size, &flags, wait);
+	mem = page_alloc(NULL, size, UMA_ANYDOMAIN, &flags, wait);
 	if (mem) {
 		vsetslab((vm_offset_t)mem, slab);
 		slab->us_data = mem;
@@ -3378,7 +3887,9 @@ cache_print(uma_cache_t cache)
 static void
 uma_print_keg(uma_keg_t keg)
 {
+	uma_domain_t dom;
 	uma_slab_t slab;
+	int i;
 
 	printf("keg: %s(%p) size %d(%d) flags %#x ipers %d ppera %d "
 	    "out %d free %d limit %d\n",
@@ -3386,15 +3897,18 @@ uma_print_keg(uma_keg_t keg)
 	    keg->uk_ipers, keg->uk_ppera,
 	    (keg->uk_ipers * keg->uk_pages) - keg->uk_free, keg->uk_free,
 	    (keg->uk_maxpages / keg->uk_ppera) * keg->uk_ipers);
-	printf("Part slabs:\n");
-	LIST_FOREACH(slab, &keg->uk_part_slab, us_link)
-		slab_print(slab);
-	printf("Free slabs:\n");
-	LIST_FOREACH(slab, &keg->uk_free_slab, us_link)
-		slab_print(slab);
-	printf("Full slabs:\n");
-	LIST_FOREACH(slab, &keg->uk_full_slab, us_link)
-		slab_print(slab);
+	for (i = 0; i < vm_ndomains; i++) {
+		dom = &keg->uk_domain[i];
+		printf("Domain %d part slabs:\n", i);
+		LIST_FOREACH(slab, &dom->ud_part_slab, us_link)
+			slab_print(slab);
+		printf("Domain %d free slabs:\n", i);
+		LIST_FOREACH(slab, &dom->ud_free_slab, us_link)
+			slab_print(slab);
+		printf("Domain %d full slabs:\n", i);
+		LIST_FOREACH(slab, &dom->ud_full_slab, us_link)
+			slab_print(slab);
+	}
 }
 
 void
@@ -3483,7 +3997,6 @@ sysctl_vm_zone_stats(SYSCTL_HANDLER_ARGS)
 	struct uma_stream_header ush;
 	struct uma_type_header uth;
 	struct uma_percpu_stat ups;
-	uma_bucket_t bucket;
 	struct sbuf sbuf;
 	uma_cache_t cache;
 	uma_klink_t kl;
@@ -3539,8 +4052,11 @@ sysctl_vm_zone_stats(SYSCTL_HANDLER_ARGS)
 			    (LIST_FIRST(&kz->uk_zones) != z))
 				uth.uth_zone_flags = UTH_ZONE_SECONDARY;
 
-			LIST_FOREACH(bucket, &z->uz_buckets, ub_link)
-				uth.uth_zone_free += bucket->ub_cnt;
+			uth.uth_zone_free += zone_cached_items(z);
+			uth.uth_bucketsize = z->uz_count;
+			for (i = 0; i < vm_ndomains; i++)
+				uth.uth_wss += z->uz_domain[i].uzd_wss;
+			uth.uth_lockfails = z->uz_lockfails;
 			uth.uth_allocs = z->uz_allocs;
 			uth.uth_frees = z->uz_frees;
 			uth.uth_fails = z->uz_fails;
@@ -3611,7 +4127,6 @@ sysctl_handle_uma_zone_cur(SYSCTL_HANDLER_ARGS)
 DB_SHOW_COMMAND(uma, db_show_uma)
 {
 	uint64_t allocs, frees, sleeps;
-	uma_bucket_t bucket;
 	uma_keg_t kz;
 	uma_zone_t z;
 	int cachefree;
@@ -3631,8 +4146,7 @@ DB_SHOW_COMMAND(uma, db_show_uma)
 			if (!((z->uz_flags & UMA_ZONE_SECONDARY) &&
 			    (LIST_FIRST(&kz->uk_zones) != z)))
 				cachefree += kz->uk_free;
-			LIST_FOREACH(bucket, &z->uz_buckets, ub_link)
-				cachefree += bucket->ub_cnt;
+			cachefree += zone_cached_items(z);
 			db_printf("%18s %8ju %8jd %8d %12ju %8ju %8u\n",
 			    z->uz_name, (uintmax_t)kz->uk_size,
 			    (intmax_t)(allocs - frees), cachefree,
@@ -3646,7 +4160,6 @@ DB_SHOW_COMMAND(uma, db_show_uma)
 DB_SHOW_COMMAND(umacache, db_show_umacache)
 {
 	uint64_t allocs, frees;
-	uma_bucket_t bucket;
 	uma_zone_t z;
 	int cachefree;
 
@@ -3654,8 +4167,7 @@ DB_SHOW_COMMAND(umacache, db_show_umacache)
 	    "Requests", "Bucket");
 	LIST_FOREACH(z, &uma_cachezones, uz_link) {
 		uma_zone_sumstat(z, &cachefree, &allocs, &frees, NULL);
-		LIST_FOREACH(bucket, &z->uz_buckets, ub_link)
-			cachefree += bucket->ub_cnt;
+		cachefree += zone_cached_items(z);
 		db_printf("%18s %8ju %8jd %8d %12ju %8u\n",
 		    z->uz_name, (uintmax_t)z->uz_size,
 		    (intmax_t)(allocs - frees), cachefree,
@@ -157,7 +157,7 @@ struct uma_hash {
  */
 
 struct uma_bucket {
-	LIST_ENTRY(uma_bucket)	ub_link;	/* Link into the zone */
+	TAILQ_ENTRY(uma_bucket)	ub_link;	/* Link into the zone */
 	int16_t	ub_cnt;				/* Count of free items. */
 	int16_t	ub_entries;			/* Max items. */
 	void	*ub_bucket[];			/* actual allocation storage */
@@ -174,6 +174,18 @@ struct uma_cache {
 
 typedef struct uma_cache * uma_cache_t;
 
+/*
+ * Per-domain slab lists.  Each slab sits on the lists of the memory domain
+ * its pages came from.
+ */
+struct uma_domain {
+	LIST_HEAD(,uma_slab)	ud_part_slab;	/* partially allocated slabs */
+	LIST_HEAD(,uma_slab)	ud_free_slab;	/* empty slab list */
+	LIST_HEAD(,uma_slab)	ud_full_slab;	/* full slabs */
+};
+
+typedef struct uma_domain * uma_domain_t;
+
 /*
  * Keg management structure
  *
@@ -185,9 +197,8 @@ struct uma_keg {
 	struct uma_hash	uk_hash;
 
 	LIST_HEAD(,uma_zone)	uk_zones;	/* Keg's zones */
-	LIST_HEAD(,uma_slab)	uk_part_slab;	/* partially allocated slabs */
-	LIST_HEAD(,uma_slab)	uk_free_slab;	/* empty slab list */
-	LIST_HEAD(,uma_slab)	uk_full_slab;	/* full slabs */
+	struct uma_domain	uk_domain[MAXMEMDOM];	/* Slab lists */
+	uint32_t	uk_cursor;	/* Round-robin domain cursor */
 
 	uint32_t	uk_align;	/* Alignment mask */
 	uint32_t	uk_pages;	/* Total page count */
@@ -242,7 +253,7 @@ struct uma_slab {
 #endif
 	uint16_t	us_freecount;		/* How many are free? */
 	uint8_t		us_flags;		/* Page flags see uma.h */
-	uint8_t		us_pad;			/* Pad to 32bits, unused. */
+	uint8_t		us_domain;		/* Backing memory domain. */
 };
 
 #define	us_link	us_type._us_link
@@ -259,7 +270,7 @@ struct uma_slab_refcnt {
 
 typedef struct uma_slab * uma_slab_t;
 typedef struct uma_slab_refcnt * uma_slabrefcnt_t;
-typedef uma_slab_t (*uma_slaballoc)(uma_zone_t, uma_keg_t, int);
+typedef uma_slab_t (*uma_slaballoc)(uma_zone_t, uma_keg_t, int, int);
 
 struct uma_klink {
 	LIST_ENTRY(uma_klink)	kl_link;
@@ -267,6 +278,25 @@ struct uma_klink {
 };
 typedef struct uma_klink *uma_klink_t;
 
+/*
+ * Per-domain cache of full buckets.  First-touch zones keep one per memory
+ * domain, round-robin zones only use the first.
+ *
+ * The most recently used buckets are kept at the head of the list.  The
+ * item counts track the high and low water marks of the cache over each
+ * UMA_TIMEOUT interval, from which a working-set size is estimated; idle
+ * buckets beyond it are trimmed from the tail.
+ */
+struct uma_zone_domain {
+	TAILQ_HEAD(uma_bucketlist, uma_bucket) uzd_buckets; /* full buckets */
+	long		uzd_nitems;	/* Items in the full buckets */
+	long		uzd_imax;	/* Maximum item count this period */
+	long		uzd_imin;	/* Minimum item count this period */
+	long		uzd_wss;	/* Working set size estimate */
+};
+
+typedef struct uma_zone_domain * uma_zone_domain_t;
+
 /*
  * Zone management structure 
  *
@@ -279,7 +309,7 @@ struct uma_zone {
 	const char		*uz_name;	/* Text name of the zone */
 
 	LIST_ENTRY(uma_zone)	uz_link;	/* List of all zones in keg */
-	LIST_HEAD(,uma_bucket)	uz_buckets;	/* full buckets */
+	struct uma_zone_domain	uz_domain[MAXMEMDOM]; /* full buckets */
 
 	LIST_HEAD(,uma_klink)	uz_kegs;	/* List of kegs. */
 	struct uma_klink	uz_klink;	/* klink for first keg. */
@@ -302,6 +332,9 @@ struct uma_zone {
 	uint64_t	uz_sleeps;	/* Total number of alloc sleeps */
 	uint16_t	uz_count;	/* Amount of items in full bucket */
 	uint16_t	uz_count_min;	/* Minimal amount of items there */
+	uint16_t	uz_count_max;	/* Maximal amount of items there */
+	u_long		uz_lockfails;	/* Zone lock contention events */
+	u_long		uz_lastfails;	/* uz_lockfails at last timeout */
 
 	/* The next two fields are used to print a rate-limited warnings. */
 	const char	*uz_warning;	/* Warning to print on failure */
@@ -375,6 +408,7 @@ void uma_large_free(uma_slab_t slab);
 #define	ZONE_LOCK(z)	mtx_lock((z)->uz_lockptr)
 #define	ZONE_TRYLOCK(z)	mtx_trylock((z)->uz_lockptr)
 #define	ZONE_UNLOCK(z)	mtx_unlock((z)->uz_lockptr)
+#define	ZONE_LOCK_ASSERT(z)	mtx_assert((z)->uz_lockptr, MA_OWNED)
 #define	ZONE_LOCK_FINI(z)	mtx_destroy(&(z)->uz_lock)
 
 /*
@@ -426,8 +460,8 @@ vsetslab(vm_offset_t va, uma_slab_t slab)
  * if they can provide more effecient allocation functions.  This is useful
  * for using direct mapped addresses.
  */
-void *uma_small_alloc(uma_zone_t zone, vm_size_t bytes, uint8_t *pflag,
-    int wait);
+void *uma_small_alloc(uma_zone_t zone, vm_size_t bytes, int domain,
+    uint8_t *pflag, int wait);
 void uma_small_free(void *mem, vm_size_t size, uint8_t flags);
 #endif /* _KERNEL */
 
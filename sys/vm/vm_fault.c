@@ -112,6 +112,12 @@ __FBSDID("$FreeBSD: head/sys/vm/vm_fault.c 292373 2015-12-16 21:30:45Z glebius $
 
 #define	VM_FAULT_DONTNEED_MIN	1048576
 
+/*
+ * The fault-around window of a MADV_SEQUENTIAL mapping is this many times
+ * larger than the default window.
+ */
+#define	VM_FAULT_AROUND_SEQ_SHIFT	2
+
 struct faultstate {
 	vm_page_t m;
 	vm_object_t object;
@@ -127,6 +133,8 @@ struct faultstate {
 
 static void vm_fault_dontneed(const struct faultstate *fs, vm_offset_t vaddr,
 	    int ahead);
+static boolean_t vm_fault_around(const struct faultstate *fs,
+	    vm_offset_t addra, vm_prot_t fault_type);
 static void vm_fault_prefault(const struct faultstate *fs, vm_offset_t addra,
 	    int backward, int forward);
 
@@ -238,6 +246,57 @@ vm_fault_dirty(vm_map_entry_t entry, vm_page_t m, vm_prot_t prot,
 		vm_pager_page_unswapped(m);
 }
 
+/*
+ * The faulting page is loaned read-only to a consumer that copies from
+ * it asynchronously (VPO_LOANED).  Substitute a private copy in the
+ * object so that the write does not change the loaned data.  The old
+ * page stays held by the borrower and is freed once it is released.
+ */
+static int
+vm_fault_unloan(struct faultstate *fs)
+{
+	vm_page_t mnew, mold;
+	int wired;
+
+	VM_OBJECT_ASSERT_WLOCKED(fs->object);
+	mold = fs->m;
+	vm_page_assert_xbusied(mold);
+	mnew = vm_page_alloc(NULL, 0, VM_ALLOC_NORMAL | VM_ALLOC_NOOBJ);
+	if (mnew == NULL)
+		return (ENOMEM);
+	pmap_remove_all(mold);
+	mnew->oflags = mold->oflags & VPO_NOSYNC;
+	pmap_copy_page(mold, mnew);
+	mnew->valid = VM_PAGE_BITS_ALL;
+	mnew->dirty = VM_PAGE_BITS_ALL;
+	vm_page_xbusy(mnew);
+
+	/*
+	 * Wirings belong to the mapping, not to the loaned page.
+	 */
+	if (mold->wire_count != 0) {
+		vm_page_lock(mold);
+		wired = 0;
+		while (mold->wire_count != 0) {
+			vm_page_unwire(mold, PQ_NONE);
+			wired++;
+		}
+		vm_page_unlock(mold);
+		vm_page_lock(mnew);
+		while (wired-- > 0)
+			vm_page_wire(mnew);
+		vm_page_unlock(mnew);
+	}
+	vm_page_replace_checked(mnew, fs->object, fs->pindex, mold);
+	mold->valid = 0;
+	vm_page_undirty(mold);
+	vm_page_lock(mold);
+	vm_page_free(mold);
+	vm_page_unlock(mold);
+	fs->m = mnew;
+	return (0);
+}
+
 /*
  *	vm_fault:
  *
@@ -363,12 +422,41 @@ RetryFault:;
 		    (fs.first_object->flags & OBJ_TMPFS_NODE) != 0) &&
 		    (fs.first_object->flags & OBJ_MIGHTBEDIRTY) == 0)
 			goto fast_failed;
-		m = vm_page_lookup(fs.first_object, fs.first_pindex);
-		/* A busy page can be mapped for read|execute access. */
+		fs.object = fs.first_object;
+		fs.pindex = fs.first_pindex;
+		m = vm_page_lookup(fs.object, fs.pindex);
+		/*
+		 * A read fault on an anonymous shadow chain, e.g. after
+		 * fork(), is satisfied by mapping the backing object's
+		 * page read-only, as the slow path would do.  Descend
+		 * with shared locks.  The first object stays read locked,
+		 * which keeps the chain from being collapsed, and only
+		 * OBJT_DEFAULT objects are skipped since they have no
+		 * pager that could hold a copy of the page.
+		 */
+		while (m == NULL &&
+		    (fault_type & (VM_PROT_WRITE | VM_PROT_COPY)) == 0 &&
+		    fs.object->type == OBJT_DEFAULT &&
+		    (next_object = fs.object->backing_object) != NULL) {
+			fs.pindex +=
+			    OFF_TO_IDX(fs.object->backing_object_offset);
+			VM_OBJECT_RLOCK(next_object);
+			if (fs.object != fs.first_object)
+				VM_OBJECT_RUNLOCK(fs.object);
+			fs.object = next_object;
+			m = vm_page_lookup(fs.object, fs.pindex);
+		}
+		/*
+		 * A busy page can be mapped for read|execute access.  A
+		 * loaned page must not be mapped writable; leave it to the
+		 * slow path, which maps it read-only or unloans it.
+		 */
 		if (m == NULL || ((prot & VM_PROT_WRITE) != 0 &&
-		    vm_page_busied(m)) || m->valid != VM_PAGE_BITS_ALL)
+		    (vm_page_busied(m) || (m->oflags & VPO_LOANED) != 0)) ||
+		    m->valid != VM_PAGE_BITS_ALL)
 			goto fast_failed;
-		result = pmap_enter(fs.map->pmap, vaddr, m, prot,
+		result = pmap_enter(fs.map->pmap, vaddr, m,
+		   fs.object != fs.first_object ? prot & ~VM_PROT_WRITE : prot,
 		   fault_type | PMAP_ENTER_NOSLEEP | (wired ? PMAP_ENTER_WIRED :
 		   0), 0);
 		if (result != KERN_SUCCESS)
@@ -379,15 +467,20 @@ RetryFault:;
 			vm_page_hold(m);
 			vm_page_unlock(m);
 		}
-		vm_fault_dirty(fs.entry, m, prot, fault_type, fault_flags,
-		    FALSE);
+		if (fs.object != fs.first_object)
+			VM_OBJECT_RUNLOCK(fs.object);
+		else
+			vm_fault_dirty(fs.entry, m, prot, fault_type,
+			    fault_flags, FALSE);
 		VM_OBJECT_RUNLOCK(fs.first_object);
-		if (!wired)
+		if (!wired && !vm_fault_around(&fs, vaddr, fault_type))
 			vm_fault_prefault(&fs, vaddr, PFBAK, PFFOR);
 		vm_map_lookup_done(fs.map, fs.entry);
 		curthread->td_ru.ru_minflt++;
 		return (KERN_SUCCESS);
 fast_failed:
+		if (fs.object != fs.first_object)
+			VM_OBJECT_RUNLOCK(fs.object);
 		if (!VM_OBJECT_TRYUPGRADE(fs.first_object)) {
 			VM_OBJECT_RUNLOCK(fs.first_object);
 			VM_OBJECT_WLOCK(fs.first_object);
@@ -788,6 +881,10 @@ vnode_locked:
 				 * Only one shadow object
 				 */
 				(fs.object->shadow_count == 1) &&
+				/*
+				 * The page is not loaned out
+				 */
+				((fs.m->oflags & VPO_LOANED) == 0) &&
 				/*
 				 * No COW refs, except us
 				 */
@@ -880,6 +977,21 @@ vnode_locked:
 		}
 	}
 
+	/*
+	 * A loaned page must not be modified in place: a write gets a
+	 * private copy, a read maps the loaned page read-only.
+	 */
+	if ((fs.m->oflags & VPO_LOANED) != 0) {
+		if ((fault_type & (VM_PROT_COPY | VM_PROT_WRITE)) == 0)
+			prot &= ~VM_PROT_WRITE;
+		else if (vm_fault_unloan(&fs) != 0) {
+			release_page(&fs);
+			unlock_and_deallocate(&fs);
+			VM_WAITPFAULT;
+			goto RetryFault;
+		}
+	}
+
 	/*
 	 * We must verify that the maps have not changed since our last
 	 * lookup.
@@ -963,8 +1075,8 @@ vnode_locked:
 	 */
 	pmap_enter(fs.map->pmap, vaddr, fs.m, prot,
 	    fault_type | (wired ? PMAP_ENTER_WIRED : 0), 0);
-	if (faultcount != 1 && (fault_flags & VM_FAULT_WIRE) == 0 &&
-	    wired == 0)
+	if ((fault_flags & VM_FAULT_WIRE) == 0 && wired == 0 &&
+	    !vm_fault_around(&fs, vaddr, fault_type) && faultcount != 1)
 		vm_fault_prefault(&fs, vaddr,
 		    faultcount > 0 ? behind : PFBAK,
 		    faultcount > 0 ? ahead : PFFOR);
@@ -1076,6 +1188,71 @@ vm_fault_dontneed(const struct faultstate *fs, vm_offset_t vaddr, int ahead)
 		VM_OBJECT_WUNLOCK(first_object);
 }
 
+static int vm_fault_around_pages = 16;
+SYSCTL_INT(_vm, OID_AUTO, fault_around, CTLFLAG_RWTUN,
+    &vm_fault_around_pages, 0,
+    "Number of resident file pages mapped around a read fault (0 disables)");
+
+/*
+ * vm_fault_around maps the resident, valid pages of a vnode object that
+ * surround the faulting virtual address, "addra", so that a process touching
+ * a cached file takes one fault per window rather than one per page.  The
+ * window is aligned to its size and clipped to the map entry.  For a
+ * MADV_SEQUENTIAL mapping, the window is larger and lies entirely ahead of
+ * "addra".  Unlike vm_fault_prefault, a missing page doesn't end the scan.
+ *
+ * Returns FALSE if the fault isn't a read fault on a vnode object, in which
+ * case the caller falls back to vm_fault_prefault.
+ */
+static boolean_t
+vm_fault_around(const struct faultstate *fs, vm_offset_t addra,
+    vm_prot_t fault_type)
+{
+	pmap_t pmap;
+	vm_map_entry_t entry;
+	vm_object_t object;
+	vm_offset_t addr, enda, starta;
+	vm_page_t m;
+	vm_size_t size;
+	int npages;
+
+	npages = vm_fault_around_pages;
+	entry = fs->entry;
+	object = fs->first_object;
+	if (npages <= 0 || (fault_type & VM_PROT_WRITE) != 0 ||
+	    object->type != OBJT_VNODE ||
+	    vm_map_entry_behavior(entry) == MAP_ENTRY_BEHAV_RANDOM)
+		return (FALSE);
+	pmap = fs->map->pmap;
+	if (pmap != vmspace_pmap(curthread->td_proc->p_vmspace))
+		return (TRUE);
+
+	size = ptoa((vm_size_t)npages);
+	if (vm_map_entry_behavior(entry) == MAP_ENTRY_BEHAV_SEQUENTIAL) {
+		size <<= VM_FAULT_AROUND_SEQ_SHIFT;
+		starta = addra + PAGE_SIZE;
+	} else
+		starta = rounddown(addra, size);
+	enda = starta + size;
+	if (starta < entry->start)
+		starta = entry->start;
+	if (enda > entry->end || enda < starta)
+		enda = entry->end;
+
+	VM_OBJECT_RLOCK(object);
+	for (m = vm_page_find_least(object, OFF_TO_IDX(entry->offset +
+	    (starta - entry->start))); m != NULL; m = TAILQ_NEXT(m, listq)) {
+		addr = entry->start + (IDX_TO_OFF(m->pindex) - entry->offset);
+		if (addr >= enda)
+			break;
+		if (addr != addra && m->valid == VM_PAGE_BITS_ALL &&
+		    (m->flags & PG_FICTITIOUS) == 0)
+			pmap_enter_quick(pmap, addr, m, entry->protection);
+	}
+	VM_OBJECT_RUNLOCK(object);
+	return (TRUE);
+}
+
 /*
  * vm_fault_prefault provides a quick way of clustering
  * pagefaults into a processes address space.  It is a "cousin"
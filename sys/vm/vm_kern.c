@@ -305,6 +305,19 @@ kmem_suballoc(vm_map_t parent, vm_offset_t *min, vm_offset_t *max,
  */
 vm_offset_t
 kmem_malloc(struct vmem *vmem, vm_size_t size, int flags)
+{
+
+	return (kmem_malloc_domain(vmem, size, -1, flags));
+}
+
+/*
+ *	kmem_malloc_domain:
+ *
+ *	Like kmem_malloc(), but back the allocation with pages from the
+ *	given memory domain when it has free pages.
+ */
+vm_offset_t
+kmem_malloc_domain(struct vmem *vmem, vm_size_t size, int domain, int flags)
 {
 	vm_offset_t addr;
 	int rv;
@@ -313,8 +326,8 @@ kmem_malloc(struct vmem *vmem, vm_size_t size, int flags)
 	if (vmem_alloc(vmem, size, flags | M_BESTFIT, &addr))
 		return (0);
 
-	rv = kmem_back((vmem == kmem_arena) ? kmem_object : kernel_object,
-	    addr, size, flags);
+	rv = kmem_back_domain((vmem == kmem_arena) ? kmem_object :
+	    kernel_object, addr, size, domain, flags);
 	if (rv != KERN_SUCCESS) {
 		vmem_free(vmem, addr, size);
 		return (0);
@@ -329,6 +342,20 @@ kmem_malloc(struct vmem *vmem, vm_size_t size, int flags)
  */
 int
 kmem_back(vm_object_t object, vm_offset_t addr, vm_size_t size, int flags)
+{
+
+	return (kmem_back_domain(object, addr, size, -1, flags));
+}
+
+/*
+ *	kmem_back_domain:
+ *
+ *	Allocate physical pages for the specified virtual address range,
+ *	preferring the given memory domain.
+ */
+int
+kmem_back_domain(vm_object_t object, vm_offset_t addr, vm_size_t size,
+    int domain, int flags)
 {
 	vm_offset_t offset, i;
 	vm_page_t m;
@@ -343,7 +370,8 @@ kmem_back(vm_object_t object, vm_offset_t addr, vm_size_t size, int flags)
 	VM_OBJECT_WLOCK(object);
 	for (i = 0; i < size; i += PAGE_SIZE) {
 retry:
-		m = vm_page_alloc(object, OFF_TO_IDX(offset + i), pflags);
+		m = vm_page_alloc_domain(object, OFF_TO_IDX(offset + i),
+		    domain, pflags);
 
 		/*
 		 * Ran out of space, free everything up and return. Don't need
@@ -2141,8 +2141,10 @@ vm_map_protect(vm_map_t map, vm_offset_t start, vm_offset_t end,
 
 	/*
 	 * Go back and fix up protections. [Note that clipping is not
-	 * necessary the second time.]
+	 * necessary the second time.]  The TLB shootdowns are batched
+	 * across the entries.
 	 */
+	pmap_invl_batch_begin(map->pmap);
 	current = entry;
 	while ((current != &map->header) && (current->start < end)) {
 		old_prot = current->protection;
@@ -2162,8 +2164,11 @@ vm_map_protect(vm_map_t map, vm_offset_t start, vm_offset_t end,
 		 */
 		if ((current->eflags & MAP_ENTRY_USER_WIRED) != 0 &&
 		    (current->protection & VM_PROT_WRITE) != 0 &&
-		    (old_prot & VM_PROT_WRITE) == 0)
+		    (old_prot & VM_PROT_WRITE) == 0) {
+			pmap_invl_batch_end(map->pmap);
 			vm_fault_copy_entry(map, map, current, current, NULL);
+			pmap_invl_batch_begin(map->pmap);
+		}
 
 		/*
 		 * When restricting access, update the physical map.  Worry
@@ -2177,9 +2182,18 @@ vm_map_protect(vm_map_t map, vm_offset_t start, vm_offset_t end,
 			    current->protection & MASK(current));
 #undef	MASK
 		}
-		vm_map_simplify_entry(map, current);
 		current = current->next;
 	}
+	pmap_invl_batch_end(map->pmap);
+
+	/*
+	 * Merge entries only once the batch is complete: a merge frees
+	 * an entry and drops object and vnode references, which may
+	 * sleep.
+	 */
+	for (current = entry; (current != &map->header) &&
+	     (current->start < end); current = current->next)
+		vm_map_simplify_entry(map, current);
 	vm_map_unlock(map);
 	return (KERN_SUCCESS);
 }
@@ -3060,6 +3074,48 @@ vm_map_entry_delete(vm_map_t map, vm_map_entry_t entry)
 	}
 }
 
+/*
+ *	vm_map_delete_removed:
+ *
+ *	Complete the batched TLB shootdown for the entries that
+ *	vm_map_delete() removed from the pmap, then delete the
+ *	entries from "first" up to, but not including, "last".
+ */
+static void
+vm_map_delete_removed(vm_map_t map, vm_map_entry_t first,
+    vm_map_entry_t last)
+{
+	vm_map_entry_t next;
+
+	pmap_invl_batch_end(vm_map_pmap(map));
+	for (; first != NULL && first != last; first = next) {
+		next = first->next;
+		vm_map_entry_delete(map, first);
+	}
+}
+
+/*
+ *	vm_map_delete_clip:
+ *
+ *	Clip the entries at both ends of the region being deleted and
+ *	return the first entry of the region.  This is done before the
+ *	TLB shootdowns are batched, since clipping may allocate a map
+ *	entry and sleep.
+ */
+static vm_map_entry_t
+vm_map_delete_clip(vm_map_t map, vm_offset_t start, vm_offset_t end)
+{
+	vm_map_entry_t entry, last_entry;
+
+	if (!vm_map_lookup_entry(map, start, &entry))
+		entry = entry->next;
+	else
+		vm_map_clip_start(map, entry, start);
+	if (vm_map_lookup_entry(map, end - 1, &last_entry))
+		vm_map_clip_end(map, last_entry, end);
+	return (entry);
+}
+
 /*
  *	vm_map_delete:	[ internal use only ]
  *
@@ -3070,25 +3126,25 @@ int
 vm_map_delete(vm_map_t map, vm_offset_t start, vm_offset_t end)
 {
 	vm_map_entry_t entry;
-	vm_map_entry_t first_entry;
+	vm_map_entry_t removed;
 
 	VM_MAP_ASSERT_LOCKED(map);
 	if (start == end)
 		return (KERN_SUCCESS);
 
 	/*
-	 * Find the start of the region, and clip it
+	 * Find the start of the region, and clip both ends of it
 	 */
-	if (!vm_map_lookup_entry(map, start, &first_entry))
-		entry = first_entry->next;
-	else {
-		entry = first_entry;
-		vm_map_clip_start(map, entry, start);
-	}
+	entry = vm_map_delete_clip(map, start, end);
 
 	/*
-	 * Step through all entries in this region
+	 * Step through all entries in this region.  The TLB shootdowns
+	 * for the removed mappings are batched, and the entries, whose
+	 * pages may be freed on deletion, are deleted once the batch
+	 * completes.
 	 */
+	removed = NULL;
+	pmap_invl_batch_begin(vm_map_pmap(map));
 	while ((entry != &map->header) && (entry->start < end)) {
 		vm_map_entry_t next;
 
@@ -3102,8 +3158,9 @@ vm_map_delete(vm_map_t map, vm_offset_t start, vm_offset_t end)
 		    vm_map_entry_system_wired_count(entry) != 0)) {
 			unsigned int last_timestamp;
 			vm_offset_t saved_start;
-			vm_map_entry_t tmp_entry;
 
+			vm_map_delete_removed(map, removed, entry);
+			removed = NULL;
 			saved_start = entry->start;
 			entry->eflags |= MAP_ENTRY_NEEDS_WAKEUP;
 			last_timestamp = map->timestamp;
@@ -3116,18 +3173,15 @@ vm_map_delete(vm_map_t map, vm_offset_t start, vm_offset_t end)
 				 * Specifically, the entry may have been
 				 * clipped, merged, or deleted.
 				 */
-				if (!vm_map_lookup_entry(map, saved_start,
-							 &tmp_entry))
-					entry = tmp_entry->next;
-				else {
-					entry = tmp_entry;
-					vm_map_clip_start(map, entry,
-							  saved_start);
-				}
+				entry = vm_map_delete_clip(map, saved_start,
+				    end);
 			}
+			pmap_invl_batch_begin(vm_map_pmap(map));
 			continue;
 		}
-		vm_map_clip_end(map, entry, end);
+		KASSERT(entry->end <= end,
+		    ("vm_map_delete: entry %p not clipped at %#jx", entry,
+		    (uintmax_t)end));
 
 		next = entry->next;
 
@@ -3143,13 +3197,15 @@ vm_map_delete(vm_map_t map, vm_offset_t start, vm_offset_t end)
 
 		/*
 		 * Delete the entry only after removing all pmap
-		 * entries pointing to its pages.  (Otherwise, its
-		 * page frames may be reallocated, and any modify bits
-		 * will be set in the wrong object!)
+		 * entries pointing to its pages and invalidating the
+		 * TLB.  (Otherwise, its page frames may be reallocated,
+		 * and any modify bits will be set in the wrong object!)
 		 */
-		vm_map_entry_delete(map, entry);
+		if (removed == NULL)
+			removed = entry;
 		entry = next;
 	}
+	vm_map_delete_removed(map, removed, entry);
 	return (KERN_SUCCESS);
 }
 
@@ -283,7 +283,7 @@ vm_object_init(void)
 	    kernel_object);
 #if VM_NRESERVLEVEL > 0
 	kernel_object->flags |= OBJ_COLORED;
-	kernel_object->pg_color = (u_short)atop(VM_MIN_KERNEL_ADDRESS);
+	kernel_object->pg_color = (u_int)atop(VM_MIN_KERNEL_ADDRESS);
 #endif
 
 	rw_init(&kmem_object->lock, "kmem vm object");
@@ -291,7 +291,7 @@ vm_object_init(void)
 	    kmem_object);
 #if VM_NRESERVLEVEL > 0
 	kmem_object->flags |= OBJ_COLORED;
-	kmem_object->pg_color = (u_short)atop(VM_MIN_KERNEL_ADDRESS);
+	kmem_object->pg_color = (u_int)atop(VM_MIN_KERNEL_ADDRESS);
 #endif
 
 	/*
@@ -1260,8 +1260,7 @@ vm_object_shadow(
 		source->shadow_count++;
 #if VM_NRESERVLEVEL > 0
 		result->flags |= source->flags & OBJ_COLORED;
-		result->pg_color = (source->pg_color + OFF_TO_IDX(*offset)) &
-		    ((1 << (VM_NFREEORDER - 1)) - 1);
+		result->pg_color = source->pg_color + OFF_TO_IDX(*offset);
 #endif
 		VM_OBJECT_WUNLOCK(source);
 	}
@@ -111,7 +111,7 @@ struct vm_object {
 	vm_memattr_t memattr;		/* default memory attribute for pages */
 	objtype_t type;			/* type of pager */
 	u_short flags;			/* see below */
-	u_short pg_color;		/* (c) color of first page in obj */
+	u_int pg_color;			/* (c) color of first page in obj */
 	u_int paging_in_progress;	/* Paging (in or out) so don't collapse or destroy */
 	int resident_page_count;	/* number of resident pages */
 	struct vm_object *backing_object; /* object that I'm a shadow of */
@@ -273,7 +273,7 @@ vm_object_set_flag(vm_object_t object, u_short bits)
  *	The object must be locked.
  */
 static __inline void
-vm_object_color(vm_object_t object, u_short color)
+vm_object_color(vm_object_t object, u_int color)
 {
 
 	if ((object->flags & OBJ_COLORED) == 0) {
@@ -100,6 +100,7 @@ __FBSDID("$FreeBSD: head/sys/vm/vm_page.c 292469 2015-12-19 18:42:50Z alc $");
 #include <sys/rwlock.h>
 #include <sys/sbuf.h>
 #include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 #include <sys/vmmeter.h>
 #include <sys/vnode.h>
 
@@ -154,12 +155,39 @@ static int vm_pageout_pages_needed;
 
 static uma_zone_t fakepg_zone;
 
+/*
+ * Per-CPU caches of free order-0 pages in front of the physical allocator,
+ * one for each free pool.  Pages held by them are counted as free, so an
+ * allocation from a cache takes its page out of the free page count against
+ * the request class's reserve, just like the free page queues do.  Since the
+ * physical allocator cannot see these pages, the caches are drained from a
+ * task when an allocation finds the free page queues empty or a thread
+ * starts waiting for free pages.  The UMA bucket caches are also trimmed
+ * periodically and drained by uma_reclaim() when the page daemon runs short.
+ */
+static uma_zone_t vm_pgcache_zones[VM_NFREEPOOL];
+static struct task vm_pgcache_drain_task;
+
+static int vm_pgcache_enable = 1;
+SYSCTL_INT(_vm, OID_AUTO, pgcache_enable, CTLFLAG_RDTUN, &vm_pgcache_enable,
+    0, "Cache free pages per CPU in front of the physical allocator");
+
+static u_int vm_pgcache_count;
+SYSCTL_UINT(_vm, OID_AUTO, pgcache_count, CTLFLAG_RD, &vm_pgcache_count, 0,
+    "Number of free pages held by the per-CPU page caches");
+
 static struct vnode *vm_page_alloc_init(vm_page_t m);
 static void vm_page_cache_turn_free(vm_page_t m);
 static void vm_page_clear_dirty_mask(vm_page_t m, vm_page_bits_t pagebits);
 static void vm_page_enqueue(uint8_t queue, vm_page_t m);
 static void vm_page_free_wakeup(void);
+static bool vm_page_free_count_take(int req_class);
+static void vm_page_pgcache_drain(void *arg, int pending);
 static void vm_page_init_fakepg(void *dummy);
+static void vm_page_init_pgcache(void *dummy);
+static int vm_page_import(void *arg, void **store, int cnt, int domain,
+    int flags);
+static void vm_page_release(void *arg, void **store, int cnt);
 static int vm_page_insert_after(vm_page_t m, vm_object_t object,
     vm_pindex_t pindex, vm_page_t mpred);
 static void vm_page_insert_radixdone(vm_page_t m, vm_object_t object,
@@ -177,6 +205,24 @@ vm_page_init_fakepg(void *dummy)
 	    NULL, NULL, UMA_ALIGN_PTR, UMA_ZONE_NOFREE | UMA_ZONE_VM);
 }
 
+SYSINIT(vm_pgcache, SI_SUB_VM_CONF, SI_ORDER_ANY, vm_page_init_pgcache, NULL);
+
+static void
+vm_page_init_pgcache(void *dummy)
+{
+	int pool;
+
+	if (!vm_pgcache_enable)
+		return;
+	TASK_INIT(&vm_pgcache_drain_task, 0, vm_page_pgcache_drain, NULL);
+	for (pool = 0; pool < VM_NFREEPOOL; pool++)
+		vm_pgcache_zones[pool] = uma_zcache_create(
+		    pool == VM_FREEPOOL_DIRECT ? "vm pgcache direct" :
+		    "vm pgcache", sizeof(struct vm_page), NULL, NULL, NULL,
+		    NULL, vm_page_import, vm_page_release,
+		    (void *)(uintptr_t)pool, UMA_ZONE_VM | UMA_ZONE_NUMA);
+}
+
 /* Make sure that u_long is at least 64 bits when PAGE_SIZE is 32K. */
 #if PAGE_SIZE == 32768
 #ifdef CTASSERT
@@ -857,6 +903,85 @@ vm_page_unhold_pages(vm_page_t *ma, int count)
 		mtx_unlock(mtx);
 }
 
+/*
+ *	vm_page_loan:
+ *
+ *	Loan the given held pages read-only to a consumer that copies from
+ *	them asynchronously, such as a pipe reader.  Each page is marked
+ *	VPO_LOANED and write-protected, so that the owner's next store to it
+ *	faults and is given a private copy instead (see vm_fault()).  Only
+ *	pages of unshared anonymous memory qualify, as nothing else writes
+ *	them without going through vm_fault().  Returns 1 if every page was
+ *	loaned, and 0, with nothing loaned, otherwise.
+ */
+int
+vm_page_loan(vm_page_t *ma, int count)
+{
+	vm_object_t object;
+	vm_page_t m;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		m = ma[i];
+		for (;;) {
+			object = m->object;
+			if (object == NULL)
+				goto fail;
+			VM_OBJECT_WLOCK(object);
+			if (object == m->object)
+				break;
+			VM_OBJECT_WUNLOCK(object);
+		}
+		if ((object->type != OBJT_DEFAULT &&
+		    object->type != OBJT_SWAP) ||
+		    (object->flags & (OBJ_ONEMAPPING | OBJ_TMPFS_NODE)) !=
+		    OBJ_ONEMAPPING ||
+		    (m->oflags & (VPO_UNMANAGED | VPO_LOANED)) != 0 ||
+		    vm_page_busied(m)) {
+			VM_OBJECT_WUNLOCK(object);
+			goto fail;
+		}
+		m->oflags |= VPO_LOANED;
+		pmap_remove_write(m);
+		VM_OBJECT_WUNLOCK(object);
+	}
+	return (1);
+fail:
+	vm_page_unloan(ma, i);
+	return (0);
+}
+
+/*
+ *	vm_page_unloan:
+ *
+ *	Take back pages loaned by vm_page_loan().  A page that the owner has
+ *	since copied on write is no longer in any object and is freed when
+ *	it is unheld.
+ */
+void
+vm_page_unloan(vm_page_t *ma, int count)
+{
+	vm_object_t object;
+	vm_page_t m;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		m = ma[i];
+		for (;;) {
+			object = m->object;
+			if (object == NULL)
+				break;
+			VM_OBJECT_WLOCK(object);
+			if (object == m->object) {
+				m->oflags &= ~VPO_LOANED;
+				VM_OBJECT_WUNLOCK(object);
+				break;
+			}
+			VM_OBJECT_WUNLOCK(object);
+		}
+	}
+}
+
 vm_page_t
 PHYS_TO_VM_PAGE(vm_paddr_t pa)
 {
@@ -1548,6 +1673,55 @@ vm_page_is_cached(vm_object_t object, vm_pindex_t pindex)
 	return (m != NULL);
 }
 
+/*
+ * Can this allocation be satisfied without the free page queues, from an
+ * existing reservation or the per-CPU page cache?  Requests that must look
+ * up a cached page of the object need the free page queues.  The object's
+ * cache can only become non-empty under the object lock, which the caller
+ * holds.
+ */
+static inline bool
+vm_page_pgcache_ok(vm_object_t object, int req)
+{
+
+	if ((req & VM_ALLOC_IFCACHED) != 0 ||
+	    mtx_owned(&vm_page_queue_free_mtx))
+		return (false);
+	if (object == NULL)
+		return (vm_pgcache_zones[VM_FREEPOOL_DIRECT] != NULL);
+	if (!vm_object_cache_is_empty(object))
+		return (false);
+#if VM_NRESERVLEVEL > 0
+	if ((object->flags & (OBJ_COLORED | OBJ_FICTITIOUS)) == OBJ_COLORED)
+		return (true);
+#endif
+	return (vm_pgcache_zones[VM_FREEPOOL_DEFAULT] != NULL);
+}
+
+/*
+ * Take a page out of the free page count if that leaves the reserve of the
+ * given request class intact.  The caller must then allocate a page that is
+ * counted as free and adjust its domain's count, or give the page back.
+ */
+static bool
+vm_page_free_count_take(int req_class)
+{
+	u_int free, limit;
+
+	if (req_class == VM_ALLOC_INTERRUPT)
+		limit = 0;
+	else if (req_class == VM_ALLOC_SYSTEM)
+		limit = vm_cnt.v_interrupt_free_min;
+	else
+		limit = vm_cnt.v_free_reserved;
+	do {
+		free = vm_cnt.v_free_count;
+		if (free == 0 || free + vm_cnt.v_cache_count <= limit)
+			return (false);
+	} while (!atomic_cmpset_int(&vm_cnt.v_free_count, free, free - 1));
+	return (true);
+}
+
 /*
  *	vm_page_alloc:
  *
@@ -1579,11 +1753,45 @@ vm_page_is_cached(vm_object_t object, vm_pindex_t pindex)
  */
 vm_page_t
 vm_page_alloc(vm_object_t object, vm_pindex_t pindex, int req)
+{
+
+	return (vm_page_alloc_domain(object, pindex, -1, req));
+}
+
+/*
+ * Allocate a single page from the physical free lists.  If a memory domain
+ * is given, it is tried first; the thread's domain policy picks the domains
+ * to fall back to.
+ *
+ * The free page queues must be locked.
+ */
+static vm_page_t
+vm_page_alloc_phys(int domain, int pool)
+{
+	vm_page_t m;
+
+	if (domain >= 0 &&
+	    (m = vm_phys_alloc_domain(domain, pool, 0)) != NULL)
+		return (m);
+	return (vm_phys_alloc_pages(pool, 0));
+}
+
+/*
+ *	vm_page_alloc_domain:
+ *
+ *	Allocate a page as vm_page_alloc() does, preferring the given memory
+ *	domain.  A domain of -1 leaves the choice to the thread's domain
+ *	policy.  Explicit requests bypass the per-CPU page cache and the
+ *	superpage reservations, neither of which can be steered to a domain.
+ */
+vm_page_t
+vm_page_alloc_domain(vm_object_t object, vm_pindex_t pindex, int domain,
+    int req)
 {
 	struct vnode *vp = NULL;
 	vm_object_t m_object;
 	vm_page_t m, mpred;
-	int flags, req_class;
+	int flags, pool, req_class;
 
 	mpred = 0;	/* XXX: pacify gcc */
 
@@ -1594,6 +1802,8 @@ vm_page_alloc(vm_object_t object, vm_pindex_t pindex, int req)
 	    (VM_ALLOC_NOBUSY | VM_ALLOC_SBUSY)),
 	    ("vm_page_alloc: inconsistent object(%p)/req(%x)", (void *)object,
 	    req));
+	KASSERT(domain >= -1 && domain < vm_ndomains,
+	    ("vm_page_alloc: domain %d is out of range", domain));
 	if (object != NULL)
 		VM_OBJECT_ASSERT_WLOCKED(object);
 
@@ -1617,6 +1827,34 @@ vm_page_alloc(vm_object_t object, vm_pindex_t pindex, int req)
 		   ("vm_page_alloc: pindex already allocated"));
 	}
 
+	/*
+	 * Try an existing reservation or the per-CPU page cache first.  Both
+	 * need only the object lock.  Objects that may be backed by
+	 * reservations do not use the cache, which would keep their
+	 * reservations from being populated.
+	 */
+	if (domain < 0 && vm_page_pgcache_ok(object, req) &&
+	    vm_page_free_count_take(req_class)) {
+#if VM_NRESERVLEVEL > 0
+		if (object != NULL && (object->flags & (OBJ_COLORED |
+		    OBJ_FICTITIOUS)) == OBJ_COLORED)
+			m = vm_reserv_extend(object, pindex, mpred);
+		else
+#endif
+		if ((m = uma_zalloc(vm_pgcache_zones[object != NULL ?
+		    VM_FREEPOOL_DEFAULT : VM_FREEPOOL_DIRECT], M_NOWAIT)) !=
+		    NULL)
+			atomic_subtract_int(&vm_pgcache_count, 1);
+		if (m != NULL) {
+			KASSERT(m->valid == 0,
+			    ("vm_page_alloc: free page %p is valid", m));
+			atomic_subtract_int(&vm_phys_domain(m)->vmd_free_count,
+			    1);
+			goto found;
+		}
+		atomic_add_int(&vm_cnt.v_free_count, 1);
+	}
+
 	/*
 	 * The page allocation request can came from consumers which already
 	 * hold the free page queue mutex, like vm_page_insert() in
@@ -1655,37 +1893,43 @@ vm_page_alloc(vm_object_t object, vm_pindex_t pindex, int req)
 			mtx_unlock(&vm_page_queue_free_mtx);
 			return (NULL);
 #if VM_NRESERVLEVEL > 0
-		} else if (object == NULL || (object->flags & (OBJ_COLORED |
-		    OBJ_FICTITIOUS)) != OBJ_COLORED || (m =
-		    vm_reserv_alloc_page(object, pindex, mpred)) == NULL) {
+		} else if (domain >= 0 || object == NULL ||
+		    (object->flags & (OBJ_COLORED | OBJ_FICTITIOUS)) !=
+		    OBJ_COLORED || (m = vm_reserv_alloc_page(object, pindex,
+		    mpred)) == NULL) {
 #else
 		} else {
 #endif
-			m = vm_phys_alloc_pages(object != NULL ?
-			    VM_FREEPOOL_DEFAULT : VM_FREEPOOL_DIRECT, 0);
+			pool = object != NULL ? VM_FREEPOOL_DEFAULT :
+			    VM_FREEPOOL_DIRECT;
+			m = vm_page_alloc_phys(domain, pool);
 #if VM_NRESERVLEVEL > 0
-			if (m == NULL && vm_reserv_reclaim_inactive()) {
-				m = vm_phys_alloc_pages(object != NULL ?
-				    VM_FREEPOOL_DEFAULT : VM_FREEPOOL_DIRECT,
-				    0);
-			}
+			if (m == NULL && vm_reserv_reclaim_inactive())
+				m = vm_page_alloc_phys(domain, pool);
 #endif
 		}
 	} else {
 		/*
 		 * Not allocatable, give up.
 		 */
+		m = NULL;
+	}
+	if (m == NULL) {
+		/*
+		 * The free page count covers the pages held by the per-CPU
+		 * page caches, which may be why the free page queues came up
+		 * empty.  Have them drained.
+		 */
 		mtx_unlock(&vm_page_queue_free_mtx);
+		if (vm_pgcache_count != 0)
+			taskqueue_enqueue(taskqueue_thread,
+			    &vm_pgcache_drain_task);
 		atomic_add_int(&vm_pageout_deficit,
 		    max((u_int)req >> VM_ALLOC_COUNT_SHIFT, 1));
 		pagedaemon_wakeup();
 		return (NULL);
 	}
 
-	/*
-	 *  At this point we had better have found a good page.
-	 */
-	KASSERT(m != NULL, ("vm_page_alloc: missing page"));
 	KASSERT(m->queue == PQ_NONE,
 	    ("vm_page_alloc: page %p has unexpected queue %d", m, m->queue));
 	KASSERT(m->wire_count == 0, ("vm_page_alloc: page %p is wired", m));
@@ -1719,6 +1963,7 @@ vm_page_alloc(vm_object_t object, vm_pindex_t pindex, int req)
 	}
 	mtx_unlock(&vm_page_queue_free_mtx);
 
+found:
 	/*
 	 * Initialize the page.  Only the PG_ZERO flag is inherited.
 	 */
@@ -1847,7 +2092,8 @@ vm_page_alloc_contig(vm_object_t object, vm_pindex_t pindex, int req,
 	struct spglist deferred_vdrop_list;
 	vm_page_t m, m_tmp, m_ret;
 	u_int flags;
-	int req_class;
+	int i, req_class;
+	bool drained;
 
 	KASSERT((object != NULL) == ((req & VM_ALLOC_NOOBJ) == 0) &&
 	    (object != NULL || (req & VM_ALLOC_SBUSY) == 0) &&
@@ -1871,6 +2117,8 @@ vm_page_alloc_contig(vm_object_t object, vm_pindex_t pindex, int req,
 		req_class = VM_ALLOC_SYSTEM;
 
 	SLIST_INIT(&deferred_vdrop_list);
+	drained = false;
+again:
 	mtx_lock(&vm_page_queue_free_mtx);
 	if (vm_cnt.v_free_count + vm_cnt.v_cache_count >= npages +
 	    vm_cnt.v_free_reserved || (req_class == VM_ALLOC_SYSTEM &&
@@ -1911,8 +2159,21 @@ retry:
 #endif
 	}
 	mtx_unlock(&vm_page_queue_free_mtx);
-	if (m_ret == NULL)
+	if (m_ret == NULL) {
+		/*
+		 * The physical allocator cannot see the pages held by the
+		 * per-CPU page caches.  Return the cached buckets to the free
+		 * page queues and try once more before failing.
+		 */
+		if (vm_pgcache_count != 0 && !drained) {
+			drained = true;
+			for (i = 0; i < VM_NFREEPOOL; i++)
+				if (vm_pgcache_zones[i] != NULL)
+					zone_drain(vm_pgcache_zones[i]);
+			goto again;
+		}
 		return (NULL);
+	}
 
 	/*
 	 * Initialize the pages.  Only the PG_ZERO flag is inherited.
@@ -2023,6 +2284,104 @@ vm_page_alloc_init(vm_page_t m)
 	return (drop);
 }
 
+/*
+ * Fill a per-CPU page cache from the given pool of the free page queues.
+ * The pages stay counted as free.  Only pages above the free reserve are
+ * moved, leaving the reserve in the free page queues for the request
+ * classes that are allowed to dig into it.
+ */
+static int
+vm_page_import(void *arg, void **store, int cnt, int domain, int flags)
+{
+	struct spglist deferred_vdrop_list;
+	struct vnode *drop;
+	vm_page_t m;
+	int avail, i, pool;
+
+	pool = (uintptr_t)arg;
+	SLIST_INIT(&deferred_vdrop_list);
+	mtx_lock(&vm_page_queue_free_mtx);
+	avail = (int)(vm_cnt.v_free_count + vm_cnt.v_cache_count) -
+	    (int)vm_pgcache_count - (int)vm_cnt.v_free_reserved;
+	cnt = imin(cnt, imax(avail, 0));
+	for (i = 0; i < cnt; i++) {
+		if (domain == UMA_ANYDOMAIN)
+			m = vm_phys_alloc_pages(pool, 0);
+		else
+			m = vm_phys_alloc_domain(domain, pool, 0);
+		if (m == NULL)
+			break;
+		/*
+		 * Cached pages are turned into free pages.  Count either as
+		 * free again.
+		 */
+		drop = vm_page_alloc_init(m);
+		vm_phys_freecnt_adj(m, 1);
+		if (drop != NULL) {
+			/*
+			 * Enqueue the vnode for deferred vdrop().
+			 */
+			m->plinks.s.pv = drop;
+			SLIST_INSERT_HEAD(&deferred_vdrop_list, m,
+			    plinks.s.ss);
+		}
+		store[i] = m;
+	}
+	atomic_add_int(&vm_pgcache_count, i);
+	mtx_unlock(&vm_page_queue_free_mtx);
+	vm_page_alloc_contig_vdrop(&deferred_vdrop_list);
+	if (vm_paging_needed())
+		pagedaemon_wakeup();
+	return (i);
+}
+
+/*
+ * Return pages from the per-CPU page cache to the free page queues.
+ */
+static void
+vm_page_release(void *arg, void **store, int cnt)
+{
+	vm_page_t m;
+	int i;
+
+	mtx_lock(&vm_page_queue_free_mtx);
+	atomic_subtract_int(&vm_pgcache_count, cnt);
+	for (i = 0; i < cnt; i++) {
+		m = store[i];
+		vm_phys_free_pages(m, 0);
+		if ((m->flags & PG_ZERO) != 0)
+			++vm_page_zero_count;
+		else
+			vm_page_zero_idle_wakeup();
+	}
+	vm_page_free_wakeup();
+	mtx_unlock(&vm_page_queue_free_mtx);
+}
+
+/*
+ * Return the pages held by the per-CPU page caches to the free page queues.
+ * The buckets cached by the zones are freed first.  Only if that does not
+ * refill the free page queues above the free reserve, or threads are still
+ * waiting for free pages, are the per-CPU buckets drained too, binding this
+ * thread to each CPU in turn.
+ */
+static void
+vm_page_pgcache_drain(void *arg __unused, int pending __unused)
+{
+	int pool;
+
+	for (pool = 0; pool < VM_NFREEPOOL; pool++)
+		if (vm_pgcache_zones[pool] != NULL)
+			zone_drain(vm_pgcache_zones[pool]);
+	if (!vm_pages_needed && (int)(vm_cnt.v_free_count +
+	    vm_cnt.v_cache_count - vm_pgcache_count) >
+	    (int)vm_cnt.v_free_reserved)
+		return;
+	for (pool = 0; pool < VM_NFREEPOOL; pool++)
+		if (vm_pgcache_zones[pool] != NULL)
+			uma_zone_reclaim(vm_pgcache_zones[pool]);
+}
+
 /*
  * 	vm_page_alloc_freelist:
  *
@@ -2706,6 +3065,9 @@ vm_wait(void)
 
 	mtx_lock(&vm_page_queue_free_mtx);
 	if (curproc == pageproc) {
+		if (!vm_pageout_pages_needed && vm_pgcache_count != 0)
+			taskqueue_enqueue(taskqueue_thread,
+			    &vm_pgcache_drain_task);
 		vm_pageout_pages_needed = 1;
 		msleep(&vm_pageout_pages_needed, &vm_page_queue_free_mtx,
 		    PDROP | PSWP, "VMWait", 0);
@@ -2713,6 +3075,9 @@ vm_wait(void)
 		if (!vm_pages_needed) {
 			vm_pages_needed = 1;
 			wakeup(&vm_pages_needed);
+			if (vm_pgcache_count != 0)
+				taskqueue_enqueue(taskqueue_thread,
+				    &vm_pgcache_drain_task);
 		}
 		msleep(&vm_cnt.v_free_count, &vm_page_queue_free_mtx, PDROP | PVM,
 		    "vmwait", 0);
@@ -2737,6 +3102,9 @@ vm_waitpfault(void)
 	if (!vm_pages_needed) {
 		vm_pages_needed = 1;
 		wakeup(&vm_pages_needed);
+		if (vm_pgcache_count != 0)
+			taskqueue_enqueue(taskqueue_thread,
+			    &vm_pgcache_drain_task);
 	}
 	msleep(&vm_cnt.v_free_count, &vm_page_queue_free_mtx, PDROP | PUSER,
 	    "pfault", 0);
@@ -3002,6 +3370,27 @@ vm_page_free_toq(vm_page_t m)
 		if (pmap_page_get_memattr(m) != VM_MEMATTR_DEFAULT)
 			pmap_page_set_memattr(m, VM_MEMATTR_DEFAULT);
 
+		/*
+		 * Pages outside of a reservation can go to their pool's
+		 * per-CPU cache, where they are still counted as free.  An
+		 * allocated page cannot join a reservation, so the unlocked
+		 * check is stable.  Bypass the cache while anybody waits for
+		 * free pages, since they need the wakeup from the free page
+		 * queues; the first waiter has the cache drained.
+		 */
+		if (vm_pgcache_zones[m->pool] != NULL &&
+		    !mtx_owned(&vm_page_queue_free_mtx) &&
+#if VM_NRESERVLEVEL > 0
+		    vm_reserv_level(m) < 0 &&
+#endif
+		    !vm_pages_needed && !vm_pageout_pages_needed &&
+		    !vm_page_count_min()) {
+			vm_phys_freecnt_adj(m, 1);
+			atomic_add_int(&vm_pgcache_count, 1);
+			uma_zfree(vm_pgcache_zones[m->pool], m);
+			return;
+		}
+
 		/*
 		 * Insert the page into the physical memory allocator's
 		 * cache/free page queues.
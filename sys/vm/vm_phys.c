@@ -787,6 +787,34 @@ vm_phys_alloc_pages(int pool, int order)
 	return (NULL);
 }
 
+/*
+ * Allocate a contiguous, power of two-sized set of physical pages from the
+ * free lists of the given memory domain only, regardless of the thread's
+ * domain policy.
+ *
+ * The free page queues must be locked.
+ */
+vm_page_t
+vm_phys_alloc_domain(int domain, int pool, int order)
+{
+	vm_page_t m;
+	int flind;
+
+	KASSERT(domain >= 0 && domain < vm_ndomains,
+	    ("vm_phys_alloc_domain: domain %d is out of range", domain));
+	KASSERT(pool < VM_NFREEPOOL,
+	    ("vm_phys_alloc_domain: pool %d is out of range", pool));
+	KASSERT(order < VM_NFREEORDER,
+	    ("vm_phys_alloc_domain: order %d is out of range", order));
+
+	for (flind = 0; flind < vm_nfreelists; flind++) {
+		m = vm_phys_alloc_domain_pages(domain, flind, pool, order);
+		if (m != NULL)
+			return (m);
+	}
+	return (NULL);
+}
+
 /*
  * Allocate a contiguous, power of two-sized set of physical pages from the
  * specified free list.  The free list must be specified using one of the
@@ -1339,6 +1367,44 @@ vm_phys_zero_pages_idle(void)
 	}
 }
 
+/*
+ * Allocate the contiguous set of physical pages of the given size "npages"
+ * that starts at the given page "m_start", if it consists entirely of free
+ * blocks of the largest order.  Returns TRUE if the set is allocated and
+ * FALSE otherwise.  Unlike vm_phys_alloc_contig(), this never searches the
+ * free lists.  "npages" must be a multiple of the largest block size, and
+ * "m_start" must be aligned to it.
+ *
+ * The free page queues must be locked.
+ */
+boolean_t
+vm_phys_alloc_run(vm_page_t m_start, u_long npages)
+{
+	struct vm_freelist *fl;
+	struct vm_phys_seg *seg;
+	vm_page_t m;
+
+	KASSERT(npages > 0 && (npages & ((1 << (VM_NFREEORDER - 1)) - 1)) == 0,
+	    ("vm_phys_alloc_run: npages %lu is not a multiple of the largest"
+	    " block size", npages));
+	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+	seg = &vm_phys_segs[m_start->segind];
+	if (VM_PAGE_TO_PHYS(m_start) + ptoa(npages) > seg->end)
+		return (FALSE);
+	for (m = m_start; m < &m_start[npages]; m += 1 << (VM_NFREEORDER - 1))
+		if (m->order != VM_NFREEORDER - 1)
+			return (FALSE);
+	for (m = m_start; m < &m_start[npages];
+	    m += 1 << (VM_NFREEORDER - 1)) {
+		fl = (*seg->free_queues)[m->pool];
+		vm_freelist_rem(fl, m, VM_NFREEORDER - 1);
+		if (m->pool != VM_FREEPOOL_DEFAULT)
+			vm_phys_set_pool(VM_FREEPOOL_DEFAULT, m,
+			    VM_NFREEORDER - 1);
+	}
+	return (TRUE);
+}
+
 /*
  * Allocate a contiguous set of physical pages of the given size
  * "npages" from the free lists.  All of the physical pages must be at
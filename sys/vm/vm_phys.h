@@ -73,8 +73,10 @@ void vm_phys_add_page(vm_paddr_t pa);
 void vm_phys_add_seg(vm_paddr_t start, vm_paddr_t end);
 vm_page_t vm_phys_alloc_contig(u_long npages, vm_paddr_t low, vm_paddr_t high,
     u_long alignment, vm_paddr_t boundary);
+vm_page_t vm_phys_alloc_domain(int domain, int pool, int order);
 vm_page_t vm_phys_alloc_freelist_pages(int freelist, int pool, int order);
 vm_page_t vm_phys_alloc_pages(int pool, int order);
+boolean_t vm_phys_alloc_run(vm_page_t m_start, u_long npages);
 boolean_t vm_phys_domain_intersects(long mask, vm_paddr_t low, vm_paddr_t high);
 int vm_phys_fictitious_reg_range(vm_paddr_t start, vm_paddr_t end,
     vm_memattr_t memattr);
@@ -92,12 +94,12 @@ boolean_t vm_phys_zero_pages_idle(void);
 int vm_phys_mem_affinity(int f, int t);
 
 /*
- *	vm_phys_domain:
+ *	vm_phys_domidx:
  *
- * 	Return the memory domain the page belongs to.
+ * 	Return the index of the memory domain the page belongs to.
  */
-static inline struct vm_domain *
-vm_phys_domain(vm_page_t m)
+static inline int
+vm_phys_domidx(vm_page_t m)
 {
 #if MAXMEMDOM > 1
 	int domn, segind;
@@ -107,19 +109,34 @@ vm_phys_domain(vm_page_t m)
 	KASSERT(segind < vm_phys_nsegs, ("segind %d m %p", segind, m));
 	domn = vm_phys_segs[segind].domain;
 	KASSERT(domn < vm_ndomains, ("domain %d m %p", domn, m));
-	return (&vm_dom[domn]);
+	return (domn);
 #else
-	return (&vm_dom[0]);
+	return (0);
 #endif
 }
 
+/*
+ *	vm_phys_domain:
+ *
+ * 	Return the memory domain the page belongs to.
+ */
+static inline struct vm_domain *
+vm_phys_domain(vm_page_t m)
+{
+
+	return (&vm_dom[vm_phys_domidx(m)]);
+}
+
+/*
+ * Adjust the free page counts.  They also cover the pages held by the
+ * per-CPU page cache, which are counted without the free page queue lock.
+ */
 static inline void
 vm_phys_freecnt_adj(vm_page_t m, int adj)
 {
 
-	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
-	vm_cnt.v_free_count += adj;
-	vm_phys_domain(m)->vmd_free_count += adj;
+	atomic_add_int(&vm_cnt.v_free_count, adj);
+	atomic_add_int(&vm_phys_domain(m)->vmd_free_count, adj);
 }
 
 #endif	/* _KERNEL */
@@ -92,6 +92,37 @@ __FBSDID("$FreeBSD: head/sys/vm/vm_reserv.c 292469 2015-12-19 18:42:50Z alc $");
 #define	VM_RESERV_INDEX(object, pindex)	\
     (((object)->pg_color + (pindex)) & (VM_LEVEL_0_NPAGES - 1))
 
+#if VM_NRESERVLEVEL > 1
+/*
+ * The number of level 0 reservations that are contained in a level 1
+ * reservation
+ */
+#define	VM_LEVEL_1_NRESERV	(1 << VM_LEVEL_1_ORDER)
+
+/*
+ * The number of small pages that are contained in a level 1 reservation
+ */
+#define	VM_LEVEL_1_NPAGES	(VM_LEVEL_1_NRESERV * VM_LEVEL_0_NPAGES)
+
+/*
+ * The number of bits by which a physical address is shifted to obtain the
+ * level 1 reservation number
+ */
+#define	VM_LEVEL_1_SHIFT	(VM_LEVEL_1_ORDER + VM_LEVEL_0_SHIFT)
+
+/*
+ * The size of a level 1 reservation in bytes
+ */
+#define	VM_LEVEL_1_SIZE		((vm_paddr_t)1 << VM_LEVEL_1_SHIFT)
+
+/*
+ * Computes the index of the small page underlying the given (object, pindex)
+ * within the level 1 reservation's array of small pages.
+ */
+#define	VM_RESERV1_INDEX(object, pindex)	\
+    (((object)->pg_color + (pindex)) & (VM_LEVEL_1_NPAGES - 1))
+#endif
+
 /*
  * The size of a population map entry
  */
@@ -169,6 +200,9 @@ struct vm_reserv {
 	vm_page_t	pages;			/* first page of a superpage */
 	int		popcnt;			/* # of pages in use */
 	char		inpartpopq;
+#if VM_NRESERVLEVEL > 1
+	char		inlevel1;		/* part of a level 1 reserv */
+#endif
 	popmap_t	popmap[NPOPMAP];	/* bit vector of used pages */
 };
 
@@ -195,6 +229,23 @@ struct vm_reserv {
  */
 static vm_reserv_t vm_reserv_array;
 
+/*
+ * The reservation locks
+ *
+ * A reservation's population map and count, and its "object" field while it
+ * is active, may only change with its lock held.  The free page queue lock,
+ * if also needed, must be acquired first.  vm_reserv_extend() only acquires
+ * the reservation lock.
+ */
+#define	VM_RESERV_NLOCKS	64
+
+static struct mtx_padalign vm_reserv_locks[VM_RESERV_NLOCKS];
+
+#define	vm_reserv_lockptr(rv)						\
+	    (&vm_reserv_locks[((rv) - vm_reserv_array) % VM_RESERV_NLOCKS])
+#define	vm_reserv_lock(rv)	mtx_lock(vm_reserv_lockptr(rv))
+#define	vm_reserv_unlock(rv)	mtx_unlock(vm_reserv_lockptr(rv))
+
 /*
  * The partially-populated reservation queue
  *
@@ -207,6 +258,50 @@ static vm_reserv_t vm_reserv_array;
 static TAILQ_HEAD(, vm_reserv) vm_rvq_partpop =
 			    TAILQ_HEAD_INITIALIZER(vm_rvq_partpop);
 
+#if VM_NRESERVLEVEL > 1
+/*
+ * The level 1 reservation structure
+ *
+ * A level 1 reservation is constructed when a large, suitably aligned
+ * anonymous object could be backed by a single huge physical page.  Its small
+ * pages are handed out through the level 0 reservations that it contains, so
+ * the level 0 population maps, partially-populated queue, and promotion work
+ * unchanged.  The level 1 reservation's "popcnt" counts the active level 0
+ * reservations within it, and its "fullcnt" counts those that are fully
+ * populated.  When "fullcnt" reaches VM_LEVEL_1_NRESERV, the first page's
+ * "psind" is raised to 2.  An active level 0 reservation within a level 1
+ * reservation has its "inlevel1" field set; an unused one is free.
+ *
+ * A level 1 reservation with unused level 0 reservations appears in the level
+ * 1 partially-populated reservation queue and may be broken at any time,
+ * returning its unused level 0 reservations to the physical memory allocator.
+ */
+struct vm_reserv1 {
+	TAILQ_ENTRY(vm_reserv1) partpopq;
+	vm_object_t	object;			/* containing object */
+	vm_pindex_t	pindex;			/* offset within object */
+	vm_page_t	pages;			/* first page of a superpage */
+	int		popcnt;			/* # of level 0 reservs in use */
+	int		fullcnt;		/* # of full level 0 reservs */
+	char		inpartpopq;
+};
+
+typedef struct vm_reserv1 *vm_reserv1_t;
+
+/*
+ * The level 1 reservation array, indexed like vm_reserv_array
+ */
+static vm_reserv1_t vm_reserv1_array;
+
+/*
+ * The partially-populated level 1 reservation queue
+ *
+ * Access to this queue is synchronized by the free page queue lock.
+ */
+static TAILQ_HEAD(, vm_reserv1) vm_rvq1_partpop =
+			    TAILQ_HEAD_INITIALIZER(vm_rvq1_partpop);
+#endif
+
 static SYSCTL_NODE(_vm, OID_AUTO, reserv, CTLFLAG_RD, 0, "Reservation Info");
 
 static long vm_reserv_broken;
@@ -231,6 +326,40 @@ static long vm_reserv_reclaimed;
 SYSCTL_LONG(_vm_reserv, OID_AUTO, reclaimed, CTLFLAG_RD,
     &vm_reserv_reclaimed, 0, "Cumulative number of reclaimed reservations");
 
+#if VM_NRESERVLEVEL > 1
+static int vm_reserv_level1_enabled = 1;
+SYSCTL_INT(_vm_reserv, OID_AUTO, level1_enabled, CTLFLAG_RWTUN,
+    &vm_reserv_level1_enabled, 0, "Create level 1 reservations");
+
+static long vm_reserv_level1_failed;
+SYSCTL_LONG(_vm_reserv, OID_AUTO, level1_failed, CTLFLAG_RD,
+    &vm_reserv_level1_failed, 0,
+    "Cumulative number of failed level 1 reservation allocations");
+
+/*
+ * After a failed level 1 allocation, further attempts are suppressed until
+ * this time.
+ */
+static time_t vm_reserv_level1_retry;
+
+/*
+ * A level 1 allocation examines at most VM_RESERV1_NPROBES candidate huge
+ * pages, continuing from where the previous one stopped, so that the time
+ * spent holding the free page queue lock is bounded.
+ */
+#define	VM_RESERV1_NPROBES	16
+
+static u_long vm_reserv1_count;
+static u_long vm_reserv1_cursor;
+
+static vm_page_t	vm_reserv1_alloc(vm_object_t object, vm_pindex_t pindex,
+			    vm_page_t mpred, vm_page_t msucc);
+static void		vm_reserv1_break(vm_reserv1_t rv1);
+static void		vm_reserv1_demote(vm_reserv_t rv);
+static void		vm_reserv1_depopulate(vm_reserv_t rv);
+static vm_reserv1_t	vm_reserv1_from_page(vm_page_t m);
+static void		vm_reserv1_promote(vm_reserv_t rv);
+#endif
 static void		vm_reserv_break(vm_reserv_t rv, vm_page_t m);
 static void		vm_reserv_depopulate(vm_reserv_t rv, int index);
 static vm_reserv_t	vm_reserv_from_page(vm_page_t m);
@@ -274,6 +403,9 @@ sysctl_vm_reserv_partpopq(SYSCTL_HANDLER_ARGS)
 {
 	struct sbuf sbuf;
 	vm_reserv_t rv;
+#if VM_NRESERVLEVEL > 1
+	vm_reserv1_t rv1;
+#endif
 	int counter, error, level, unused_pages;
 
 	error = sysctl_wire_old_buffer(req, 0);
@@ -285,10 +417,21 @@ sysctl_vm_reserv_partpopq(SYSCTL_HANDLER_ARGS)
 		counter = 0;
 		unused_pages = 0;
 		mtx_lock(&vm_page_queue_free_mtx);
-		TAILQ_FOREACH(rv, &vm_rvq_partpop/*[level]*/, partpopq) {
-			counter++;
-			unused_pages += VM_LEVEL_0_NPAGES - rv->popcnt;
+		if (level == -1) {
+			TAILQ_FOREACH(rv, &vm_rvq_partpop, partpopq) {
+				counter++;
+				unused_pages += VM_LEVEL_0_NPAGES - rv->popcnt;
+			}
+		}
+#if VM_NRESERVLEVEL > 1
+		else {
+			TAILQ_FOREACH(rv1, &vm_rvq1_partpop, partpopq) {
+				counter++;
+				unused_pages += (VM_LEVEL_1_NRESERV -
+				    rv1->popcnt) * VM_LEVEL_0_NPAGES;
+			}
 		}
+#endif
 		mtx_unlock(&vm_page_queue_free_mtx);
 		sbuf_printf(&sbuf, "%5d: %6dK, %6d\n", level,
 		    unused_pages * ((int)PAGE_SIZE / 1024), counter);
@@ -322,19 +465,31 @@ vm_reserv_depopulate(vm_reserv_t rv, int index)
 		TAILQ_REMOVE(&vm_rvq_partpop, rv, partpopq);
 		rv->inpartpopq = FALSE;
 	} else {
+#if VM_NRESERVLEVEL > 1
+		if (rv->inlevel1)
+			vm_reserv1_demote(rv);
+#endif
 		KASSERT(rv->pages->psind == 1,
 		    ("vm_reserv_depopulate: reserv %p is already demoted",
 		    rv));
 		rv->pages->psind = 0;
 	}
+	vm_reserv_lock(rv);
 	popmap_clear(rv->popmap, index);
 	rv->popcnt--;
 	if (rv->popcnt == 0) {
 		LIST_REMOVE(rv, objq);
 		rv->object = NULL;
-		vm_phys_free_pages(rv->pages, VM_LEVEL_0_ORDER);
+		vm_reserv_unlock(rv);
+#if VM_NRESERVLEVEL > 1
+		if (rv->inlevel1)
+			vm_reserv1_depopulate(rv);
+		else
+#endif
+			vm_phys_free_pages(rv->pages, VM_LEVEL_0_ORDER);
 		vm_reserv_freed++;
 	} else {
+		vm_reserv_unlock(rv);
 		rv->inpartpopq = TRUE;
 		TAILQ_INSERT_TAIL(&vm_rvq_partpop, rv, partpopq);
 	}
@@ -361,6 +516,138 @@ vm_reserv_has_pindex(vm_reserv_t rv, vm_pindex_t pindex)
 	return (((pindex - rv->pindex) & ~(VM_LEVEL_0_NPAGES - 1)) == 0);
 }
 
+#if VM_NRESERVLEVEL > 1
+/*
+ * Returns the level 1 reservation to which the given page might belong.
+ */
+static __inline vm_reserv1_t
+vm_reserv1_from_page(vm_page_t m)
+{
+
+	return (&vm_reserv1_array[VM_PAGE_TO_PHYS(m) >> VM_LEVEL_1_SHIFT]);
+}
+
+/*
+ * Returns TRUE if the given level 1 reservation contains the given page index
+ * and FALSE otherwise.
+ */
+static __inline boolean_t
+vm_reserv1_has_pindex(vm_reserv1_t rv1, vm_pindex_t pindex)
+{
+
+	return (((pindex - rv1->pindex) & ~(VM_LEVEL_1_NPAGES - 1)) == 0);
+}
+
+/*
+ * Activates the given unused level 0 reservation within its level 1
+ * reservation.  Moves the level 1 reservation to the tail of its partially-
+ * populated reservation queue, or removes it from that queue if it has no
+ * unused level 0 reservations left.
+ *
+ * The free page queue lock must be held.
+ */
+static void
+vm_reserv1_populate(vm_reserv1_t rv1, vm_reserv_t rv)
+{
+
+	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+	KASSERT(rv1->object != NULL,
+	    ("vm_reserv1_populate: reserv1 %p is free", rv1));
+	KASSERT(rv->object == NULL && !rv->inlevel1,
+	    ("vm_reserv1_populate: reserv %p isn't free", rv));
+	KASSERT(rv1->popcnt < VM_LEVEL_1_NRESERV,
+	    ("vm_reserv1_populate: reserv1 %p is already full", rv1));
+	if (rv1->inpartpopq) {
+		TAILQ_REMOVE(&vm_rvq1_partpop, rv1, partpopq);
+		rv1->inpartpopq = FALSE;
+	}
+	rv->inlevel1 = TRUE;
+	rv1->popcnt++;
+	if (rv1->popcnt < VM_LEVEL_1_NRESERV) {
+		rv1->inpartpopq = TRUE;
+		TAILQ_INSERT_TAIL(&vm_rvq1_partpop, rv1, partpopq);
+	}
+}
+
+/*
+ * Returns the given level 0 reservation, which has just become unused, to its
+ * level 1 reservation.  If the level 1 reservation becomes unused, it is
+ * destroyed and its physical pages are returned to the physical memory
+ * allocator.
+ *
+ * The free page queue lock must be held.
+ */
+static void
+vm_reserv1_depopulate(vm_reserv_t rv)
+{
+	vm_reserv1_t rv1;
+
+	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+	rv1 = vm_reserv1_from_page(rv->pages);
+	KASSERT(rv1->object != NULL,
+	    ("vm_reserv1_depopulate: reserv1 %p is free", rv1));
+	KASSERT(rv1->popcnt > 0,
+	    ("vm_reserv1_depopulate: reserv1 %p's popcnt is corrupted", rv1));
+	rv->inlevel1 = FALSE;
+	if (rv1->inpartpopq) {
+		TAILQ_REMOVE(&vm_rvq1_partpop, rv1, partpopq);
+		rv1->inpartpopq = FALSE;
+	}
+	rv1->popcnt--;
+	if (rv1->popcnt == 0) {
+		rv1->object = NULL;
+		vm_phys_free_contig(rv1->pages, VM_LEVEL_1_NPAGES);
+	} else {
+		rv1->inpartpopq = TRUE;
+		TAILQ_INSERT_TAIL(&vm_rvq1_partpop, rv1, partpopq);
+	}
+}
+
+/*
+ * Records that the given level 0 reservation within a level 1 reservation has
+ * become fully populated.  Marks the huge page as promotable once every level
+ * 0 reservation within it is full.
+ *
+ * The free page queue lock must be held.
+ */
+static void
+vm_reserv1_promote(vm_reserv_t rv)
+{
+	vm_reserv1_t rv1;
+
+	rv1 = vm_reserv1_from_page(rv->pages);
+	KASSERT(rv1->fullcnt < VM_LEVEL_1_NRESERV,
+	    ("vm_reserv1_promote: reserv1 %p's fullcnt is corrupted", rv1));
+	if (++rv1->fullcnt == VM_LEVEL_1_NRESERV) {
+		KASSERT(rv1->pages->psind == 1,
+		    ("vm_reserv1_promote: reserv1 %p's psind is corrupted",
+		    rv1));
+		rv1->pages->psind = 2;
+	}
+}
+
+/*
+ * Records that the given full level 0 reservation within a level 1
+ * reservation is about to lose a page.
+ *
+ * The free page queue lock must be held.
+ */
+static void
+vm_reserv1_demote(vm_reserv_t rv)
+{
+	vm_reserv1_t rv1;
+
+	rv1 = vm_reserv1_from_page(rv->pages);
+	KASSERT(rv1->fullcnt > 0,
+	    ("vm_reserv1_demote: reserv1 %p's fullcnt is corrupted", rv1));
+	if (rv1->fullcnt-- == VM_LEVEL_1_NRESERV) {
+		KASSERT(rv1->pages->psind == 2,
+		    ("vm_reserv1_demote: reserv1 %p is already demoted", rv1));
+		rv1->pages->psind = 1;
+	}
+}
+#endif
+
 /*
  * Increases the given reservation's population count.  Moves the reservation
  * to the tail of the partially-populated reservation queue.
@@ -385,13 +672,20 @@ vm_reserv_populate(vm_reserv_t rv, int index)
 		TAILQ_REMOVE(&vm_rvq_partpop, rv, partpopq);
 		rv->inpartpopq = FALSE;
 	}
+	vm_reserv_lock(rv);
 	popmap_set(rv->popmap, index);
 	rv->popcnt++;
+	vm_reserv_unlock(rv);
 	if (rv->popcnt < VM_LEVEL_0_NPAGES) {
 		rv->inpartpopq = TRUE;
 		TAILQ_INSERT_TAIL(&vm_rvq_partpop, rv, partpopq);
-	} else
+	} else {
 		rv->pages->psind = 1;
+#if VM_NRESERVLEVEL > 1
+		if (rv->inlevel1)
+			vm_reserv1_promote(rv);
+#endif
+	}
 }
 
 /*
@@ -682,9 +976,15 @@ vm_reserv_alloc_page(vm_object_t object, vm_pindex_t pindex, vm_page_t mpred)
 	}
 
 	/*
-	 * Allocate and populate the new reservation.
+	 * Allocate and populate the new reservation.  If possible, carve it
+	 * out of a level 1 reservation.
 	 */
+#if VM_NRESERVLEVEL > 1
+	if ((m = vm_reserv1_alloc(object, pindex, mpred, msucc)) == NULL)
+		m = vm_phys_alloc_pages(VM_FREEPOOL_DEFAULT, VM_LEVEL_0_ORDER);
+#else
 	m = vm_phys_alloc_pages(VM_FREEPOOL_DEFAULT, VM_LEVEL_0_ORDER);
+#endif
 	if (m == NULL)
 		return (NULL);
 	rv = vm_reserv_from_page(m);
@@ -720,6 +1020,237 @@ found:
 	return (m);
 }
 
+/*
+ * Allocates the page for the given (object, pindex) from an existing
+ * reservation without the free page queue lock, or returns NULL if there is
+ * no such reservation or the page needs the free page queues.  The caller
+ * must have taken the page out of the free page count.
+ *
+ * The population count is not allowed to reach the full size, so the page
+ * never completes a superpage, and the reservation keeps its place in the
+ * partially-populated reservation queue.
+ *
+ * The page "mpred" must immediately precede the offset "pindex" within the
+ * specified object.
+ *
+ * The object must be locked.
+ */
+vm_page_t
+vm_reserv_extend(vm_object_t object, vm_pindex_t pindex, vm_page_t mpred)
+{
+	vm_page_t m, msucc;
+	vm_reserv_t rv;
+	int index;
+
+	VM_OBJECT_ASSERT_WLOCKED(object);
+
+	/*
+	 * Look for an existing reservation.  Only a thread holding the object
+	 * lock can make it belong to the object, but it may be broken
+	 * concurrently, so check again with the reservation locked.
+	 */
+	if (mpred != NULL) {
+		KASSERT(mpred->object == object,
+		    ("vm_reserv_extend: object doesn't contain mpred"));
+		KASSERT(mpred->pindex < pindex,
+		    ("vm_reserv_extend: mpred doesn't precede pindex"));
+		rv = vm_reserv_from_page(mpred);
+		if (rv->object == object && vm_reserv_has_pindex(rv, pindex))
+			goto found;
+		msucc = TAILQ_NEXT(mpred, listq);
+	} else
+		msucc = TAILQ_FIRST(&object->memq);
+	if (msucc != NULL) {
+		KASSERT(msucc->pindex > pindex,
+		    ("vm_reserv_extend: msucc doesn't succeed pindex"));
+		rv = vm_reserv_from_page(msucc);
+		if (rv->object == object && vm_reserv_has_pindex(rv, pindex))
+			goto found;
+	}
+	return (NULL);
+
+found:
+	index = VM_RESERV_INDEX(object, pindex);
+	m = &rv->pages[index];
+	vm_reserv_lock(rv);
+	/*
+	 * Cached pages must be removed from their object's cache and zeroed
+	 * pages are counted, both under the free page queue lock.
+	 */
+	if (rv->object != object || !vm_reserv_has_pindex(rv, pindex) ||
+	    popmap_is_set(rv->popmap, index) ||
+	    rv->popcnt + 1 >= VM_LEVEL_0_NPAGES ||
+	    (m->flags & (PG_CACHED | PG_ZERO)) != 0) {
+		vm_reserv_unlock(rv);
+		return (NULL);
+	}
+	popmap_set(rv->popmap, index);
+	rv->popcnt++;
+	vm_reserv_unlock(rv);
+	return (m);
+}
+
+#if VM_NRESERVLEVEL > 1
+/*
+ * Returns the first page of an unused level 0 reservation for the given
+ * (object, pindex) from an existing or newly-created level 1 reservation, or
+ * NULL if level 1 reservations are not applicable.  The caller activates the
+ * returned level 0 reservation.
+ *
+ * Level 1 reservations are only created for anonymous objects whose size
+ * already covers the entire reservation, and only when the machine-dependent
+ * layer supports a third page size.
+ *
+ * The pages "mpred" and "msucc" must immediately precede and succeed the
+ * offset "pindex" within the specified object.
+ *
+ * The object and free page queue must be locked.
+ */
+static vm_page_t
+vm_reserv1_alloc(vm_object_t object, vm_pindex_t pindex, vm_page_t mpred,
+    vm_page_t msucc)
+{
+	vm_page_t m;
+	vm_pindex_t first;
+	vm_reserv_t rv;
+	vm_reserv1_t rv1;
+	int i;
+
+	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+	VM_OBJECT_ASSERT_WLOCKED(object);
+
+	/*
+	 * Look for an existing level 1 reservation.
+	 */
+	if (mpred != NULL) {
+		rv1 = vm_reserv1_from_page(mpred);
+		if (rv1->object == object && vm_reserv1_has_pindex(rv1, pindex))
+			goto found;
+	}
+	if (msucc != NULL) {
+		rv1 = vm_reserv1_from_page(msucc);
+		if (rv1->object == object && vm_reserv1_has_pindex(rv1, pindex))
+			goto found;
+	}
+
+	/*
+	 * Is a level 1 reservation fundamentally impossible or undesirable?
+	 */
+	if (!vm_reserv_level1_enabled || pagesizes[2] == 0 ||
+	    (object->type != OBJT_DEFAULT && object->type != OBJT_SWAP))
+		return (NULL);
+	if (pindex < VM_RESERV1_INDEX(object, pindex))
+		return (NULL);
+	first = pindex - VM_RESERV1_INDEX(object, pindex);
+	if (first + VM_LEVEL_1_NPAGES > object->size)
+		return (NULL);
+
+	/*
+	 * Is any page within the range already allocated?
+	 */
+	if ((mpred != NULL && mpred->pindex >= first) ||
+	    (msucc != NULL && msucc->pindex < first + VM_LEVEL_1_NPAGES))
+		return (NULL);
+
+	/*
+	 * Allocate the new level 1 reservation.  Rather than searching the
+	 * free lists for a suitably aligned run, probe a bounded number of
+	 * the huge pages themselves.
+	 */
+	if (time_uptime < vm_reserv_level1_retry)
+		return (NULL);
+	for (i = 0; i < VM_RESERV1_NPROBES; i++) {
+		rv1 = &vm_reserv1_array[vm_reserv1_cursor];
+		if (++vm_reserv1_cursor == vm_reserv1_count)
+			vm_reserv1_cursor = 0;
+		if (rv1->pages != NULL && rv1->object == NULL &&
+		    vm_phys_alloc_run(rv1->pages, VM_LEVEL_1_NPAGES))
+			break;
+	}
+	if (i == VM_RESERV1_NPROBES) {
+		vm_reserv_level1_failed++;
+		vm_reserv_level1_retry = time_uptime + 1;
+		return (NULL);
+	}
+	m = rv1->pages;
+	KASSERT(rv1->pages == m,
+	    ("vm_reserv1_alloc: reserv1 %p's pages is corrupted", rv1));
+	KASSERT(rv1->object == NULL,
+	    ("vm_reserv1_alloc: reserv1 %p isn't free", rv1));
+	KASSERT(rv1->popcnt == 0 && rv1->fullcnt == 0,
+	    ("vm_reserv1_alloc: reserv1 %p's popcnt is corrupted", rv1));
+	KASSERT(!rv1->inpartpopq,
+	    ("vm_reserv1_alloc: reserv1 %p's inpartpopq is TRUE", rv1));
+	rv1->object = object;
+	rv1->pindex = first;
+
+	/*
+	 * Found a matching level 1 reservation.
+	 */
+found:
+	m = &rv1->pages[VM_RESERV1_INDEX(object, pindex) &
+	    ~(VM_LEVEL_0_NPAGES - 1)];
+	rv = vm_reserv_from_page(m);
+	/* Handle vm_page_rename(m, new_object, ...). */
+	if (rv->object != NULL)
+		return (NULL);
+	vm_reserv1_populate(rv1, rv);
+	return (m);
+}
+
+/*
+ * Breaks the given level 1 reservation.  Its active level 0 reservations
+ * become ordinary, independent reservations, and its unused level 0
+ * reservations are returned to the physical memory allocator.
+ *
+ * The free page queue lock must be held.
+ */
+static void
+vm_reserv1_break(vm_reserv1_t rv1)
+{
+	vm_reserv_t rv;
+	int begin, i;
+
+	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+	KASSERT(rv1->object != NULL,
+	    ("vm_reserv1_break: reserv1 %p is free", rv1));
+	if (rv1->inpartpopq) {
+		TAILQ_REMOVE(&vm_rvq1_partpop, rv1, partpopq);
+		rv1->inpartpopq = FALSE;
+	}
+	if (rv1->fullcnt == VM_LEVEL_1_NRESERV) {
+		KASSERT(rv1->pages->psind == 2,
+		    ("vm_reserv1_break: reserv1 %p's psind is corrupted", rv1));
+		rv1->pages->psind = 1;
+	}
+	rv1->fullcnt = 0;
+	rv1->object = NULL;
+	begin = -1;
+	for (i = 0; i < VM_LEVEL_1_NRESERV; i++) {
+		rv = vm_reserv_from_page(&rv1->pages[i * VM_LEVEL_0_NPAGES]);
+		if (rv->object != NULL) {
+			KASSERT(rv->inlevel1,
+			    ("vm_reserv1_break: reserv %p is corrupted", rv));
+			rv->inlevel1 = FALSE;
+			rv1->popcnt--;
+			if (begin >= 0) {
+				vm_phys_free_contig(&rv1->pages[begin *
+				    VM_LEVEL_0_NPAGES], (i - begin) *
+				    VM_LEVEL_0_NPAGES);
+				begin = -1;
+			}
+		} else if (begin < 0)
+			begin = i;
+	}
+	if (begin >= 0)
+		vm_phys_free_contig(&rv1->pages[begin * VM_LEVEL_0_NPAGES],
+		    (VM_LEVEL_1_NRESERV - begin) * VM_LEVEL_0_NPAGES);
+	KASSERT(rv1->popcnt == 0,
+	    ("vm_reserv1_break: reserv1 %p's popcnt is corrupted", rv1));
+	vm_reserv_broken++;
+}
+#endif
+
 /*
  * Breaks the given reservation.  Except for the specified cached or free
  * page, all cached and free pages in the reservation are returned to the
@@ -739,7 +1270,12 @@ vm_reserv_break(vm_reserv_t rv, vm_page_t m)
 	    ("vm_reserv_break: reserv %p is free", rv));
 	KASSERT(!rv->inpartpopq,
 	    ("vm_reserv_break: reserv %p's inpartpopq is TRUE", rv));
+#if VM_NRESERVLEVEL > 1
+	if (rv->inlevel1)
+		vm_reserv1_break(vm_reserv1_from_page(rv->pages));
+#endif
 	LIST_REMOVE(rv, objq);
+	vm_reserv_lock(rv);
 	rv->object = NULL;
 	if (m != NULL) {
 		/*
@@ -794,6 +1330,7 @@ vm_reserv_break(vm_reserv_t rv, vm_page_t m)
 	} while (i < NPOPMAP);
 	KASSERT(rv->popcnt == 0,
 	    ("vm_reserv_break: reserv %p's popcnt is corrupted", rv));
+	vm_reserv_unlock(rv);
 	vm_reserv_broken++;
 }
 
@@ -839,7 +1376,7 @@ vm_reserv_free_page(vm_page_t m)
 
 /*
  * Initializes the reservation management system.  Specifically, initializes
- * the reservation array.
+ * the reservation locks and array.
  *
  * Requires that vm_page_array and first_page are initialized!
  */
@@ -848,7 +1385,10 @@ vm_reserv_init(void)
 {
 	vm_paddr_t paddr;
 	struct vm_phys_seg *seg;
-	int segind;
+	int i, segind;
+
+	for (i = 0; i < VM_RESERV_NLOCKS; i++)
+		mtx_init(&vm_reserv_locks[i], "vm reserv", NULL, MTX_DEF);
 
 	/*
 	 * Initialize the reservation array.  Specifically, initialize the
@@ -862,6 +1402,14 @@ vm_reserv_init(void)
 			    PHYS_TO_VM_PAGE(paddr);
 			paddr += VM_LEVEL_0_SIZE;
 		}
+#if VM_NRESERVLEVEL > 1
+		paddr = roundup2(seg->start, VM_LEVEL_1_SIZE);
+		while (paddr + VM_LEVEL_1_SIZE <= seg->end) {
+			vm_reserv1_array[paddr >> VM_LEVEL_1_SHIFT].pages =
+			    PHYS_TO_VM_PAGE(paddr);
+			paddr += VM_LEVEL_1_SIZE;
+		}
+#endif
 	}
 }
 
@@ -873,12 +1421,22 @@ bool
 vm_reserv_is_page_free(vm_page_t m)
 {
 	vm_reserv_t rv;
+	bool free;
 
 	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
 	rv = vm_reserv_from_page(m);
-	if (rv->object == NULL)
+	if (rv->object == NULL) {
+#if VM_NRESERVLEVEL > 1
+		/* Unused level 0 reservations within a level 1 are free. */
+		return (vm_reserv1_from_page(m)->object != NULL);
+#else
 		return (false);
-	return (popmap_is_clear(rv->popmap, m - rv->pages));
+#endif
+	}
+	vm_reserv_lock(rv);
+	free = popmap_is_clear(rv->popmap, m - rv->pages);
+	vm_reserv_unlock(rv);
+	return (free);
 }
 
 /*
@@ -890,6 +1448,10 @@ vm_reserv_level(vm_page_t m)
 {
 	vm_reserv_t rv;
 
+#if VM_NRESERVLEVEL > 1
+	if (vm_reserv1_from_page(m)->object != NULL)
+		return (1);
+#endif
 	rv = vm_reserv_from_page(m);
 	return (rv->object != NULL ? 0 : -1);
 }
@@ -903,6 +1465,10 @@ vm_reserv_level_iffullpop(vm_page_t m)
 {
 	vm_reserv_t rv;
 
+#if VM_NRESERVLEVEL > 1
+	if (vm_reserv1_from_page(m)->fullcnt == VM_LEVEL_1_NRESERV)
+		return (1);
+#endif
 	rv = vm_reserv_from_page(m);
 	return (rv->popcnt == VM_LEVEL_0_NPAGES ? 0 : -1);
 }
@@ -968,7 +1534,8 @@ vm_reserv_reclaim(vm_reserv_t rv)
 /*
  * Breaks the reservation at the head of the partially-populated reservation
  * queue, releasing its cached and free pages to the physical memory
- * allocator.  Returns TRUE if a reservation is broken and FALSE otherwise.
+ * allocator.  Level 1 reservations with unused level 0 reservations are
+ * broken first.  Returns TRUE if a reservation is broken and FALSE otherwise.
  *
  * The free page queue lock must be held.
  */
@@ -976,8 +1543,18 @@ boolean_t
 vm_reserv_reclaim_inactive(void)
 {
 	vm_reserv_t rv;
+#if VM_NRESERVLEVEL > 1
+	vm_reserv1_t rv1;
+#endif
 
 	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+#if VM_NRESERVLEVEL > 1
+	if ((rv1 = TAILQ_FIRST(&vm_rvq1_partpop)) != NULL) {
+		vm_reserv1_break(rv1);
+		vm_reserv_reclaimed++;
+		return (TRUE);
+	}
+#endif
 	if ((rv = TAILQ_FIRST(&vm_rvq_partpop)) != NULL) {
 		vm_reserv_reclaim(rv);
 		return (TRUE);
@@ -1000,9 +1577,27 @@ vm_reserv_reclaim_contig(u_long npages, vm_paddr_t low, vm_paddr_t high,
 {
 	vm_paddr_t pa, size;
 	vm_reserv_t rv;
+#if VM_NRESERVLEVEL > 1
+	vm_reserv1_t rv1;
+#endif
 	int hi, i, lo, low_index, next_free;
 
 	mtx_assert(&vm_page_queue_free_mtx, MA_OWNED);
+#if VM_NRESERVLEVEL > 1
+	/*
+	 * The unused level 0 reservations within a level 1 reservation are
+	 * not in any free list.  Break the least recently active level 1
+	 * reservation that overlaps the requested range.
+	 */
+	TAILQ_FOREACH(rv1, &vm_rvq1_partpop, partpopq) {
+		pa = VM_PAGE_TO_PHYS(rv1->pages);
+		if (pa + VM_LEVEL_1_SIZE > low && pa < high) {
+			vm_reserv1_break(rv1);
+			vm_reserv_reclaimed++;
+			return (TRUE);
+		}
+	}
+#endif
 	if (npages > VM_LEVEL_0_NPAGES - 1)
 		return (FALSE);
 	size = npages << PAGE_SHIFT;
@@ -1095,10 +1690,16 @@ vm_reserv_rename(vm_page_t m, vm_object_t new_object, vm_object_t old_object,
 	if (rv->object == old_object) {
 		mtx_lock(&vm_page_queue_free_mtx);
 		if (rv->object == old_object) {
+#if VM_NRESERVLEVEL > 1
+			if (rv->inlevel1)
+				vm_reserv1_break(vm_reserv1_from_page(m));
+#endif
 			LIST_REMOVE(rv, objq);
 			LIST_INSERT_HEAD(&new_object->rvq, rv, objq);
+			vm_reserv_lock(rv);
 			rv->object = new_object;
 			rv->pindex -= old_object_offset;
+			vm_reserv_unlock(rv);
 		}
 		mtx_unlock(&vm_page_queue_free_mtx);
 	}
@@ -1112,6 +1713,10 @@ vm_reserv_size(int level)
 {
 
 	switch (level) {
+#if VM_NRESERVLEVEL > 1
+	case 1:
+		return ((int)VM_LEVEL_1_SIZE);
+#endif
 	case 0:
 		return (VM_LEVEL_0_SIZE);
 	case -1:
@@ -1129,7 +1734,7 @@ vm_paddr_t
 vm_reserv_startup(vm_offset_t *vaddr, vm_paddr_t end, vm_paddr_t high_water)
 {
 	vm_paddr_t new_end;
-	size_t size;
+	size_t size, size1;
 
 	/*
 	 * Calculate the size (in bytes) of the reservation array.  Round up
@@ -1140,14 +1745,28 @@ vm_reserv_startup(vm_offset_t *vaddr, vm_paddr_t end, vm_paddr_t high_water)
 	 */
 	size = howmany(high_water, VM_LEVEL_0_SIZE) * sizeof(struct vm_reserv);
 
+	/*
+	 * The level 1 reservation array, if any, immediately follows the
+	 * level 0 reservation array.
+	 */
+#if VM_NRESERVLEVEL > 1
+	vm_reserv1_count = howmany(high_water, VM_LEVEL_1_SIZE);
+	size1 = vm_reserv1_count * sizeof(struct vm_reserv1);
+#else
+	size1 = 0;
+#endif
+
 	/*
 	 * Allocate and map the physical memory for the reservation array.  The
 	 * next available virtual address is returned by reference.
 	 */
-	new_end = end - round_page(size);
+	new_end = end - round_page(size + size1);
 	vm_reserv_array = (void *)(uintptr_t)pmap_map(vaddr, new_end, end,
 	    VM_PROT_READ | VM_PROT_WRITE);
-	bzero(vm_reserv_array, size);
+	bzero(vm_reserv_array, size + size1);
+#if VM_NRESERVLEVEL > 1
+	vm_reserv1_array = (void *)((char *)vm_reserv_array + size);
+#endif
 
 	/*
 	 * Return the next available physical address.